@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sqls.h"
+#include "active.h"
+#include "checkpoint.h"
+
+/*
+   report3 asks how many trips were active at t, meaning they began at or
+   before t and had not ended before t. On tripsummary that is a range
+   scan of every trip that began before t, so it gets slower the longer
+   we run.
+
+   Instead add_tripdata() tells us about every BEGIN and END. "now" is
+   just the live counter. For the past we keep, per second since the
+   first event, the running totals of BEGINs and ENDs, and the answer is
+   begins[t] - ends[t - 1]: two array reads however old the data is.
+
+   Events are stamped with time() as they are stored, so they nearly
+   always land on the last second and the totals are extended by copying
+   the last one forward. If the clock steps back, the seconds after the
+   event are all bumped (active.backfills in stats counts how often).
+
+   When retention drops a segment the seconds before the oldest one left
+   are cut off, and report3 says 0 for them like it does for the time
+   before we started.
+*/
+
+#define INITIAL_SECS 4096
+
+struct active *
+active_create()
+{
+    struct active *a = (struct active *)malloc(sizeof(*a));
+    memset(a, 0, sizeof(*a));
+    return a;
+}
+
+void
+active_destroy(struct active *a)
+{
+    ckpt_free(a->begins);
+    ckpt_free(a->ends);
+    free(a);
+}
+
+/* Make sure second base + i is filled in */
+static int
+extend_to(struct active *a, unsigned long i)
+{
+    unsigned long s;
+
+    if (i >= a->cap) {
+        unsigned long cap = a->cap ? a->cap : INITIAL_SECS;
+        while (cap <= i)
+            cap *= 2;
+        unsigned long *b = (unsigned long *)
+                           ckpt_realloc(a->begins, a->cap * sizeof(*b),
+                                        cap * sizeof(*b));
+        if (b)
+            a->begins = b;
+        unsigned long *e = (unsigned long *)
+                           ckpt_realloc(a->ends, a->cap * sizeof(*e),
+                                        cap * sizeof(*e));
+        if (e)
+            a->ends = e;
+        if (!b || !e)
+            return -1;
+        a->cap = cap;
+    }
+    for (s = a->secs; s <= i; s++) {
+        a->begins[s] = s ? a->begins[s - 1] : 0;
+        a->ends[s] = s ? a->ends[s - 1] : 0;
+    }
+    if (i >= a->secs)
+        a->secs = i + 1;
+    return 0;
+}
+
+/* Count a trip that began or ended at t. Only once for each: the caller
+   passes on a BEGIN or END the trip already had. */
+int
+active_add(struct active *a, int type, time_t t)
+{
+    unsigned long *totals;
+    unsigned long i;
+
+    if (type == BEGIN)
+        a->live++;
+    else if (type == END)
+        a->live--;
+    else
+        return 0;
+
+    if (!a->secs)
+        a->base = t;
+    /* older than anything we have, so rather count it at the start */
+    if (t < a->base)
+        t = a->base;
+    if (extend_to(a, t - a->base) < 0) {
+        fprintf(stderr, "active: out of memory at %lu seconds\n", a->secs);
+        return -1;
+    }
+
+    totals = type == BEGIN ? a->begins : a->ends;
+    i = t - a->base;
+    if (i + 1 < a->secs)
+        a->backfills++;
+    for (; i < a->secs; i++)
+        totals[i]++;
+    return 0;
+}
+
+/* report3: trips active at t */
+long
+active_at(struct active *a, time_t t)
+{
+    unsigned long i;
+
+    if (!a->secs || t < a->base)
+        return 0;
+    i = t - a->base;
+    if (i >= a->secs)
+        return a->live;
+    return a->begins[i] - (i ? a->ends[i - 1] : a->ends_before);
+}
+
+/* Forget the seconds before t */
+void
+active_trim(struct active *a, time_t t)
+{
+    unsigned long i;
+
+    if (!a->secs || t <= a->base)
+        return;
+    i = t - a->base;
+    /* always keep the last second, where new events go */
+    if (i >= a->secs)
+        i = a->secs - 1;
+    if (!i)
+        return;
+    a->ends_before = a->ends[i - 1];
+    a->secs -= i;
+    memmove(a->begins, a->begins + i, a->secs * sizeof(*a->begins));
+    memmove(a->ends, a->ends + i, a->secs * sizeof(*a->ends));
+    a->base += i;
+}
+
+unsigned long
+active_bytes(struct active *a)
+{
+    return a->cap * (sizeof(*a->begins) + sizeof(*a->ends));
+}
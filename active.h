@@ -0,0 +1,29 @@
+/* Active trip counts for report3: a live counter and, per second, how
+   many trips had begun and ended by then. See active.c. */
+
+#include <time.h>
+
+struct active
+{
+    long live;                  /* trips begun and not yet ended */
+
+    /* begins[i] and ends[i] count what happened up to and including
+       second base + i */
+    time_t base;
+    unsigned long *begins;
+    unsigned long *ends;
+    unsigned long ends_before;  /* ENDs before base, once trimmed */
+    unsigned long secs;         /* seconds filled in */
+    unsigned long cap;
+    unsigned long backfills;    /* events older than the last second */
+};
+
+struct active *active_create();
+void active_destroy(struct active *a);
+
+int active_add(struct active *a, int type, time_t t);
+
+long active_at(struct active *a, time_t t);
+void active_trim(struct active *a, time_t t);
+
+unsigned long active_bytes(struct active *a);
@@ -0,0 +1,47 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bufpool.h"
+
+void
+bufpool_init(struct bufpool *pool, int size)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->size = size;
+}
+
+void
+bufpool_destroy(struct bufpool *pool)
+{
+    int i;
+    for (i = 0; i < pool->nfree; i++)
+        free(pool->free[i]);
+    free(pool->free);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/* Take a buffer off the free list, or make a new one */
+char *
+bufpool_get(struct bufpool *pool)
+{
+    if (pool->nfree)
+        return pool->free[--pool->nfree];
+    pool->allocated++;
+    return (char *)malloc(pool->size);
+}
+
+/* Give a buffer back for the next connection */
+void
+bufpool_put(struct bufpool *pool, char *buf)
+{
+    if (pool->nfree == pool->cap) {
+        int cap = pool->cap ? pool->cap * 2 : 64;
+        char **p = (char **)realloc(pool->free, cap * sizeof(*p));
+        if (!p) {
+            free(buf);
+            return;
+        }
+        pool->free = p;
+        pool->cap = cap;
+    }
+    pool->free[pool->nfree++] = buf;
+}
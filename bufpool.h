@@ -0,0 +1,16 @@
+/* Free list of fixed size buffers. Each reactor has its own, so there is
+   no locking. Used for the per connection receive buffers. */
+
+struct bufpool
+{
+    int size;               /* bytes per buffer */
+    int nfree;
+    int cap;
+    char **free;
+    unsigned long allocated;    /* buffers malloc'd over the pool's life */
+};
+
+void bufpool_init(struct bufpool *pool, int size);
+void bufpool_destroy(struct bufpool *pool);
+char *bufpool_get(struct bufpool *pool);
+void bufpool_put(struct bufpool *pool, char *buf);
@@ -0,0 +1,43 @@
+/* Cell arithmetic shared by the fixed grid indexes over the area (grid.c,
+   sat.c, hll.c). Row and column are worked out the same way, from the low edge
+   of the area and the size of a cell. */
+
+#include <math.h>
+
+/* The low edge of row (or column) i */
+static inline double
+cell_edge(double min, double step, int i)
+{
+    return min + i * step;
+}
+
+/* Which row (or column) v falls in. Nudged so that it always agrees with
+   cell_edge(), which is what decides whether a rect covers the whole
+   cell. *out is set if v is outside of the area, in which case it goes
+   to the nearest border row. v can be any float a client sent, NaN or
+   huge, so it is clamped before the conversion to int. NaN goes to row
+   0. */
+static inline int
+cell_of(double min, double step, int n, double v, int *out)
+{
+    double x = floor((v - min) / step);
+    int i;
+
+    if (!(x >= -1))
+        x = -1;
+    else if (x > n)
+        x = n;
+    i = (int)x;
+    if (i >= 0 && i < n) {
+        if (v < cell_edge(min, step, i))
+            i--;
+        else if (v >= cell_edge(min, step, i + 1))
+            i++;
+    }
+    *out = i < 0 || i >= n;
+    if (i < 0)
+        return 0;
+    if (i >= n)
+        return n - 1;
+    return i;
+}
@@ -0,0 +1,975 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sqlite3.h"
+#include "sqls.h"
+#include "stats.h"
+#include "colstore.h"
+#include "grid.h"
+#include "hll.h"
+#include "sat.h"
+#include "active.h"
+#include "segment.h"
+#include "trips.h"
+#include "quant.h"
+#include "checkpoint.h"
+#include "bufpool.h"
+#include "ctx.h"
+
+/*
+   Replaying the write-ahead log at startup goes through add_tripdata()
+   for every event ever stored, so it takes as long as ingesting it all
+   did. A checkpoint is instead the store itself, written out the way it
+   is laid out in memory: the columns of each segment, its grid, sketches
+   and summed-area tables, the trip records with their points and the
+   report3 totals. A restart mmap()s the file and points the structures
+   at it, so it only touches the few pages it needs to fix up, and the
+   rest is read in by the page faults of the queries that need it. The
+   log (if any) is then replayed from where the checkpoint left off.
+
+   Every array is written as it is, 8 byte aligned, and the structs that
+   point to arrays are written with the pointers changed to the offsets
+   of the arrays in the file (0 for NULL). Loading changes them back,
+   which is a pass over the cells of each grid and not over the data.
+   Trip records are fixed up one at a time instead, the first time they
+   are looked at (trip_slot() in trips.c), since there is one for every
+   trip. The file is a private mapping, so whatever is written to it
+   after loading stays in memory and the file doesn't change. Arrays
+   are written with their capacity cut to their length, so that the
+   first append to one copies it out of the mapping (ckpt_realloc()),
+   and freeing one that is still in it does nothing (ckpt_free()).
+
+   The sqlite engine's tables can't be mapped, since they are in-memory
+   databases, so each segment's is written next to the checkpoint as a
+   sqlite file (<path>.<gen>.seg<seq>) and copied in with the backup API
+   on restart, at page copy speed.
+
+   The layout is that of the structs in memory, so a checkpoint is only
+   for the build and the options that wrote it, which the header checks.
+   The sqlite snapshot (snapshot.c) is the portable copy. Checkpoints are
+   written the same way snapshots are, from a forked child, to <path>.tmp
+   and then renamed over path.
+*/
+
+#define CKPT_MAGIC "TRIPCKP1"
+#define CKPT_VERSION 1
+
+struct ckpt_header
+{
+    char magic[8];
+    uint32_t version;
+    uint16_t sizes[16];         /* of the structs in it, see layout() */
+
+    /* the options it was written with */
+    int32_t engine;
+    int32_t rtree;
+    int32_t coord_bits;
+    int32_t keep_points;
+    int32_t grid_cells, hll_cells, sat_cells;
+    double min_lat, max_lat, min_lng, max_lng;
+
+    int64_t taken;
+    uint64_t wal_records;
+    uint64_t rows;
+    char gen[24];               /* names its sqlite files */
+    uint64_t first_seq;
+    uint64_t nsegs;
+    uint64_t next_seq;
+
+    /* offsets */
+    uint64_t segs;              /* nsegs offsets of segment images */
+    uint64_t trips;
+    uint64_t active;
+};
+
+static void
+layout(uint16_t *sizes)
+{
+    memset(sizes, 0, 16 * sizeof(*sizes));
+    sizes[0] = sizeof(struct segment);
+    sizes[1] = sizeof(struct colstore);
+    sizes[2] = sizeof(struct grid);
+    sizes[3] = sizeof(struct grid_cell);
+    sizes[4] = sizeof(struct grid_block);
+    sizes[5] = sizeof(struct hll_grid);
+    sizes[6] = sizeof(struct hll_cell);
+    sizes[7] = sizeof(struct sat_grid);
+    sizes[8] = sizeof(struct sat_cell);
+    sizes[9] = sizeof(struct sat_begin);
+    sizes[10] = sizeof(struct sat_end);
+    sizes[11] = sizeof(struct trips);
+    sizes[12] = sizeof(struct trip);
+    sizes[13] = sizeof(struct traj_chunk);
+    sizes[14] = sizeof(struct traj_point);
+    sizes[15] = sizeof(struct active);
+}
+
+static void
+fill_options(struct tripstore_context *ctx, struct ckpt_header *h)
+{
+    struct segments *s = ctx->segments;
+
+    memcpy(h->magic, CKPT_MAGIC, sizeof(h->magic));
+    h->version = CKPT_VERSION;
+    layout(h->sizes);
+    h->engine = ctx->engine;
+    h->rtree = ctx->rtree;
+    h->coord_bits = ctx->quant ? ctx->quant->bits : 0;
+    h->keep_points = ctx->trips->keep_points;
+    h->grid_cells = s->grid_cells;
+    h->hll_cells = s->hll_cells;
+    h->sat_cells = s->sat_cells;
+    h->min_lat = s->min_lat;
+    h->max_lat = s->max_lat;
+    h->min_lng = s->min_lng;
+    h->max_lng = s->max_lng;
+}
+
+static unsigned long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void
+sql_file(char *buf, size_t len, const char *path, const char *gen,
+         unsigned long seq)
+{
+    snprintf(buf, len, "%s.%s.seg%lu", path, gen, seq);
+}
+
+/* The mapping of the checkpoint we loaded, if any */
+
+static char *map_base;
+static size_t map_len;
+
+static int
+mapped(const void *p)
+{
+    return map_base && (const char *)p >= map_base &&
+           (const char *)p < map_base + map_len;
+}
+
+/* The pointer for an offset in the checkpoint */
+void *
+ckpt_at(const void *off)
+{
+    return off ? map_base + (uintptr_t)off : NULL;
+}
+
+/* Whether n things of size bytes at offset off are all in the checkpoint.
+   Everything in it was put() past the header, 8 byte aligned. */
+int
+ckpt_in(const void *off, uint64_t n, size_t size)
+{
+    uint64_t at = (uintptr_t)off;
+
+    return at >= sizeof(struct ckpt_header) && !(at & 7) && at <= map_len &&
+           (!size || n <= (map_len - at) / size);
+}
+
+/* realloc(), except that an array in the checkpoint is copied out of it.
+   old is how many bytes p has. */
+void *
+ckpt_realloc(void *p, size_t old, size_t size)
+{
+    void *n;
+
+    if (!mapped(p))
+        return realloc(p, size);
+    n = malloc(size);
+    if (n)
+        memcpy(n, p, old < size ? old : size);
+    return n;
+}
+
+void
+ckpt_free(void *p)
+{
+    if (!mapped(p))
+        free(p);
+}
+
+/* Writing, in the forked child (snapshot.c) */
+
+#define OFF(x) ((void *)(uintptr_t)(x))
+
+struct ckpt_out
+{
+    FILE *f;
+    uint64_t off;
+    int err;
+};
+
+/* Append len bytes at the next 8 byte boundary, and say where they went */
+static uint64_t
+put(struct ckpt_out *o, const void *p, size_t len)
+{
+    static const char zeros[8];
+    uint64_t at;
+
+    if (o->off & 7) {
+        size_t pad = 8 - (o->off & 7);
+        if (fwrite(zeros, 1, pad, o->f) != pad)
+            o->err = 1;
+        o->off += pad;
+    }
+    at = o->off;
+    if (len && fwrite(p, 1, len, o->f) != len)
+        o->err = 1;
+    o->off += len;
+    return at;
+}
+
+/* An array, as the offset it will have in place of its pointer */
+static void *
+put_array(struct ckpt_out *o, const void *p, size_t len)
+{
+    return p && len ? OFF(put(o, p, len)) : NULL;
+}
+
+static uint64_t
+put_colstore(struct ckpt_out *o, struct colstore *cs)
+{
+    struct colstore img = *cs;
+    unsigned long n = cs->n;
+
+    img.cap = n;
+    img.id = put_array(o, cs->id, n * sizeof(*cs->id));
+    img.lng = put_array(o, cs->lng, n * sizeof(*cs->lng));
+    img.lat = put_array(o, cs->lat, n * sizeof(*cs->lat));
+    img.type = put_array(o, cs->type, n * sizeof(*cs->type));
+    img.fare = put_array(o, cs->fare, n * sizeof(*cs->fare));
+    img.time = put_array(o, cs->time, n * sizeof(*cs->time));
+    return put(o, &img, sizeof(img));
+}
+
+/* The cells are ours to change: this is the child's copy */
+static uint64_t
+put_grid(struct ckpt_out *o, struct grid *g)
+{
+    struct grid img = *g;
+    int i;
+
+    for (i = 0; i < g->n * g->n; i++) {
+        struct grid_cell *c = &g->cells[i];
+        c->blocks = put_array(o, c->blocks, c->nblocks * sizeof(*c->blocks));
+        c->lat = put_array(o, c->lat, c->npts * sizeof(*c->lat));
+        c->lng = put_array(o, c->lng, c->npts * sizeof(*c->lng));
+        c->id = put_array(o, c->id, c->npts * sizeof(*c->id));
+        c->capblocks = c->nblocks;
+        c->cappts = c->npts;
+    }
+    img.cells = put_array(o, g->cells, g->n * g->n * sizeof(*g->cells));
+    return put(o, &img, sizeof(img));
+}
+
+static uint64_t
+put_hll(struct ckpt_out *o, struct hll_grid *h)
+{
+    struct hll_grid img = *h;
+    int i;
+
+    for (i = 0; i < h->n * h->n; i++) {
+        struct hll_cell *c = &h->cells[i];
+        c->trips = put_array(o, c->trips, HLL_M);
+        c->ends = put_array(o, c->ends, HLL_M);
+    }
+    img.cells = put_array(o, h->cells, h->n * h->n * sizeof(*h->cells));
+    return put(o, &img, sizeof(img));
+}
+
+static uint64_t
+put_sat(struct ckpt_out *o, struct sat_grid *s)
+{
+    struct sat_grid img = *s;
+    int nc = s->n * s->n, sn = (s->n + 1) * (s->n + 1);
+    int i;
+
+    for (i = 0; i < nc; i++) {
+        struct sat_cell *c = &s->cells[i];
+        c->begins = put_array(o, c->begins, c->nbegins * sizeof(*c->begins));
+        c->near = put_array(o, c->near, c->nnear * sizeof(*c->near));
+        c->far = put_array(o, c->far, c->nfar * sizeof(*c->far));
+        c->capbegins = c->nbegins;
+        c->capnear = c->nnear;
+        c->capfar = c->nfar;
+    }
+    img.cells = put_array(o, s->cells, nc * sizeof(*s->cells));
+    img.starts = put_array(o, s->starts, nc * sizeof(*s->starts));
+    img.stops = put_array(o, s->stops, nc * sizeof(*s->stops));
+    img.nears = put_array(o, s->nears, nc * sizeof(*s->nears));
+    img.fares = put_array(o, s->fares, nc * sizeof(*s->fares));
+    img.sum_starts = put_array(o, s->sum_starts, sn * sizeof(*s->sum_starts));
+    img.sum_stops = put_array(o, s->sum_stops, sn * sizeof(*s->sum_stops));
+    img.sum_nears = put_array(o, s->sum_nears, sn * sizeof(*s->sum_nears));
+    img.sum_fares = put_array(o, s->sum_fares, sn * sizeof(*s->sum_fares));
+    img.spill_row = put_array(o, s->spill_row, s->n);
+    img.spill_col = put_array(o, s->spill_col, s->n);
+    return put(o, &img, sizeof(img));
+}
+
+static uint64_t
+put_active(struct ckpt_out *o, struct active *a)
+{
+    struct active img = *a;
+
+    img.cap = a->secs;
+    img.begins = put_array(o, a->begins, a->secs * sizeof(*a->begins));
+    img.ends = put_array(o, a->ends, a->secs * sizeof(*a->ends));
+    return put(o, &img, sizeof(img));
+}
+
+/* A trip's chunks go out last first, so that each one knows where the
+   next one went */
+static int
+put_points(struct ckpt_out *o, struct trip *r, struct traj_chunk ***chain,
+           unsigned long *cap)
+{
+    struct traj_chunk *c;
+    unsigned long n = 0, j;
+    void *next = NULL;
+
+    for (c = r->head; c; c = c->next) {
+        if (n == *cap) {
+            unsigned long nc = *cap ? *cap * 2 : 64;
+            struct traj_chunk **p = (struct traj_chunk **)
+                                    realloc(*chain, nc * sizeof(*p));
+            if (!p)
+                return -1;
+            *chain = p;
+            *cap = nc;
+        }
+        (*chain)[n++] = c;
+    }
+    for (j = n; j-- > 0;) {
+        c = (*chain)[j];
+        c->next = next;
+        next = OFF(put(o, c, sizeof(*c) + c->cap * sizeof(c->pts[0])));
+        if (j == n - 1)
+            r->tail = next;
+    }
+    r->head = next;
+    r->unfixed = 1;
+    return 0;
+}
+
+static uint64_t
+put_trips(struct ckpt_out *o, struct trips *t)
+{
+    struct trips img = *t;
+    struct traj_chunk **chain = NULL;
+    unsigned long cap = 0, p;
+    uint64_t *pages = (uint64_t *)calloc(t->npages + 1, sizeof(*pages));
+    int i;
+
+    if (!pages) {
+        o->err = 1;
+        return 0;
+    }
+    for (p = 0; p < t->npages; p++) {
+        struct trip *page = t->pages[p];
+        if (!page)
+            continue;
+        for (i = 0; i < TRIPS_PAGE; i++) {
+            /* still as it came from the checkpoint we started from */
+            if (page[i].unfixed)
+                trips_get(t, ((t->first_page + (int64_t)p) <<
+                              TRIPS_PAGE_BITS) + i);
+            if (page[i].head && put_points(o, &page[i], &chain, &cap) < 0)
+                o->err = 1;
+        }
+        pages[p] = put(o, page, TRIPS_PAGE * sizeof(*page));
+    }
+    img.pages = put_array(o, pages, t->npages * sizeof(*pages));
+    free(pages);
+    free(chain);
+    return put(o, &img, sizeof(img));
+}
+
+/* A segment's sqlite tables, to a file of their own */
+static int
+put_segment_sql(struct tripstore_context *ctx, struct segment *seg,
+                const char *file)
+{
+    sqlite3 *out;
+    sqlite3_backup *b;
+    int rc;
+
+    unlink(file);
+    if (sqlite3_open(file, &out) != SQLITE_OK) {
+        sqlite3_close(out);
+        return -1;
+    }
+    b = sqlite3_backup_init(out, "main", ctx->db, seg->name);
+    if (b) {
+        sqlite3_backup_step(b, -1);
+        sqlite3_backup_finish(b);
+    }
+    rc = sqlite3_errcode(out);
+    if (rc != SQLITE_OK)
+        fprintf(stderr, "checkpoint: can't write %s: %s\n", file,
+                sqlite3_errmsg(out));
+    sqlite3_close(out);
+    return rc == SQLITE_OK ? 0 : -1;
+}
+
+/* checkpoint_write
+
+   Runs in the forked child (take_snapshot() in snapshot.c), which has
+   the store to itself and can scribble on its copy. wal_records is how
+   many records the log had at the fork.
+*/
+int
+checkpoint_write(struct tripstore_context *ctx, const char *tmp,
+                 const char *path, unsigned long wal_records)
+{
+    struct segments *s = ctx->segments;
+    struct ckpt_header h, old;
+    struct ckpt_out o;
+    uint64_t *segs;
+    char file[PATH_MAX];
+    int fd, i, have_old = 0;
+
+    memset(&h, 0, sizeof(h));
+    fill_options(ctx, &h);
+    h.taken = time(NULL);
+    h.wal_records = wal_records;
+    snprintf(h.gen, sizeof(h.gen), "%lx%05x", (unsigned long)h.taken,
+             getpid() & 0xfffff);
+    h.first_seq = s->n ? s->segs[0]->seq : 0;
+    h.nsegs = s->n;
+    h.next_seq = s->next_seq;
+
+    memset(&o, 0, sizeof(o));
+    segs = (uint64_t *)calloc(s->n + 1, sizeof(*segs));
+    o.f = fopen(tmp, "w");
+    if (!o.f || !segs) {
+        fprintf(stderr, "checkpoint: can't open %s: %s\n", tmp,
+                strerror(errno));
+        return -1;
+    }
+    setvbuf(o.f, NULL, _IOFBF, 1 << 20);
+    /* the header goes in last, once we know where everything is */
+    put(&o, &h, sizeof(h));
+
+    for (i = 0; i < s->n; i++) {
+        struct segment *seg = s->segs[i];
+        struct segment img = *seg;
+
+        img.insert = img.insert_rtree = img.insert_ends_rtree = NULL;
+        img.reports[0] = img.reports[1] = NULL;
+        img.report1_rtree = img.report2_rtree = NULL;
+        img.page_count = img.page_size = NULL;
+        img.bytes = img.measured_rows = 0;
+        img.cs = seg->cs ? OFF(put_colstore(&o, seg->cs)) : NULL;
+        img.grid = seg->grid ? OFF(put_grid(&o, seg->grid)) : NULL;
+        img.hll = seg->hll ? OFF(put_hll(&o, seg->hll)) : NULL;
+        img.sat = seg->sat ? OFF(put_sat(&o, seg->sat)) : NULL;
+        segs[i] = put(&o, &img, sizeof(img));
+        h.rows += seg->rows;
+
+        if (ctx->engine == ENGINE_SQLITE) {
+            sql_file(file, sizeof(file), path, h.gen, seg->seq);
+            if (put_segment_sql(ctx, seg, file) < 0)
+                o.err = 1;
+        }
+    }
+    h.segs = put(&o, segs, s->n * sizeof(*segs));
+    h.trips = put_trips(&o, ctx->trips);
+    h.active = put_active(&o, ctx->active);
+    free(segs);
+
+    if (fseek(o.f, 0, SEEK_SET) < 0 || fwrite(&h, sizeof(h), 1, o.f) != 1 ||
+        fflush(o.f) != 0 || fsync(fileno(o.f)) < 0)
+        o.err = 1;
+    fclose(o.f);
+    if (o.err) {
+        fprintf(stderr, "checkpoint: can't write %s\n", tmp);
+        return -1;
+    }
+
+    /* The sqlite files of the one this replaces go once it is replaced */
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        have_old = pread(fd, &old, sizeof(old), 0) == sizeof(old) &&
+                   !memcmp(old.magic, CKPT_MAGIC, sizeof(old.magic)) &&
+                   old.gen[sizeof(old.gen) - 1] == 0 &&
+                   strcmp(old.gen, h.gen) != 0;
+        close(fd);
+    }
+    if (rename(tmp, path) < 0) {
+        fprintf(stderr, "checkpoint: can't put %s in place: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    if (have_old && old.engine == ENGINE_SQLITE) {
+        unsigned long seq;
+        /* they are consecutive, which bounds a header gone bad */
+        for (seq = old.first_seq; seq < old.first_seq + old.nsegs; seq++) {
+            sql_file(file, sizeof(file), path, old.gen, seq);
+            if (unlink(file) < 0 && errno == ENOENT)
+                break;
+        }
+    }
+    return 0;
+}
+
+/* Checking, before loading: a checkpoint that was cut short or scribbled
+   on has offsets and counts that point past its end, and would take the
+   server down instead of being passed over for the log. Each struct is
+   looked at before we go by what it says, and the arrays it points to
+   must be in the file, as long as their capacity. Only the ones that
+   are allocated when needed can be missing. */
+
+/* An array of n things, which is only missing if n is 0 */
+static int
+array_in(const void *off, uint64_t n, size_t size)
+{
+    return off ? ckpt_in(off, n, size) : !n;
+}
+
+static int
+check_colstore(const void *off)
+{
+    struct colstore *cs = (struct colstore *)ckpt_at(off);
+
+    if (!ckpt_in(off, 1, sizeof(*cs)))
+        return -1;
+    return cs->n <= cs->cap &&
+           array_in(cs->id, cs->cap, sizeof(*cs->id)) &&
+           array_in(cs->lng, cs->cap, sizeof(*cs->lng)) &&
+           array_in(cs->lat, cs->cap, sizeof(*cs->lat)) &&
+           array_in(cs->type, cs->cap, sizeof(*cs->type)) &&
+           array_in(cs->fare, cs->cap, sizeof(*cs->fare)) &&
+           array_in(cs->time, cs->cap, sizeof(*cs->time)) ? 0 : -1;
+}
+
+/* n is the cells per side we were started with */
+static int
+check_grid(const void *off, int n)
+{
+    struct grid *g = (struct grid *)ckpt_at(off);
+    struct grid_cell *cells;
+    int i;
+
+    if (!ckpt_in(off, 1, sizeof(*g)) || g->n != n ||
+        !array_in(g->cells, (uint64_t)n * n, sizeof(*cells)))
+        return -1;
+    cells = (struct grid_cell *)ckpt_at(g->cells);
+    for (i = 0; i < n * n; i++) {
+        struct grid_cell *c = &cells[i];
+        if (c->nblocks > c->capblocks || c->npts > c->cappts ||
+            !array_in(c->blocks, c->capblocks, sizeof(*c->blocks)) ||
+            !array_in(c->lat, c->cappts, sizeof(*c->lat)) ||
+            !array_in(c->lng, c->cappts, sizeof(*c->lng)) ||
+            !array_in(c->id, c->cappts, sizeof(*c->id)))
+            return -1;
+    }
+    return 0;
+}
+
+/* A cell's sketches are allocated with its first point */
+static int
+check_hll(const void *off, int n)
+{
+    struct hll_grid *h = (struct hll_grid *)ckpt_at(off);
+    struct hll_cell *cells;
+    int i;
+
+    if (!ckpt_in(off, 1, sizeof(*h)) || h->n != n ||
+        !array_in(h->cells, (uint64_t)n * n, sizeof(*cells)))
+        return -1;
+    cells = (struct hll_cell *)ckpt_at(h->cells);
+    for (i = 0; i < n * n; i++) {
+        if ((cells[i].trips && !ckpt_in(cells[i].trips, HLL_M, 1)) ||
+            (cells[i].ends && !ckpt_in(cells[i].ends, HLL_M, 1)))
+            return -1;
+    }
+    return 0;
+}
+
+static int
+check_sat(const void *off, int n)
+{
+    struct sat_grid *s = (struct sat_grid *)ckpt_at(off);
+    struct sat_cell *cells;
+    uint64_t nc = (uint64_t)n * n, sn = (uint64_t)(n + 1) * (n + 1);
+    unsigned long i;
+
+    if (!ckpt_in(off, 1, sizeof(*s)) || s->n != n ||
+        !array_in(s->cells, nc, sizeof(*cells)) ||
+        !array_in(s->starts, nc, sizeof(*s->starts)) ||
+        !array_in(s->stops, nc, sizeof(*s->stops)) ||
+        !array_in(s->nears, nc, sizeof(*s->nears)) ||
+        !array_in(s->fares, nc, sizeof(*s->fares)) ||
+        !array_in(s->sum_starts, sn, sizeof(*s->sum_starts)) ||
+        !array_in(s->sum_stops, sn, sizeof(*s->sum_stops)) ||
+        !array_in(s->sum_nears, sn, sizeof(*s->sum_nears)) ||
+        !array_in(s->sum_fares, sn, sizeof(*s->sum_fares)) ||
+        !array_in(s->spill_row, n, 1) || !array_in(s->spill_col, n, 1))
+        return -1;
+    cells = (struct sat_cell *)ckpt_at(s->cells);
+    for (i = 0; i < nc; i++) {
+        struct sat_cell *c = &cells[i];
+        if (c->nbegins > c->capbegins || c->nnear > c->capnear ||
+            c->nfar > c->capfar ||
+            !array_in(c->begins, c->capbegins, sizeof(*c->begins)) ||
+            !array_in(c->near, c->capnear, sizeof(*c->near)) ||
+            !array_in(c->far, c->capfar, sizeof(*c->far)))
+            return -1;
+    }
+    return 0;
+}
+
+/* The segment image at off, for the engine and indexes of h */
+static int
+check_segment(struct ckpt_header *h, const void *off)
+{
+    struct segment *seg = (struct segment *)ckpt_at(off);
+
+    if (!ckpt_in(off, 1, sizeof(*seg)))
+        return -1;
+    if ((h->engine == ENGINE_COLUMNAR) != !!seg->cs ||
+        (h->grid_cells > 0) != !!seg->grid ||
+        (h->hll_cells > 0) != !!seg->hll ||
+        (h->sat_cells > 0) != !!seg->sat)
+        return -1;
+    if ((seg->cs && check_colstore(seg->cs) < 0) ||
+        (seg->grid && check_grid(seg->grid, h->grid_cells) < 0) ||
+        (seg->hll && check_hll(seg->hll, h->hll_cells) < 0) ||
+        (seg->sat && check_sat(seg->sat, h->sat_cells) < 0))
+        return -1;
+    return 0;
+}
+
+/* Everything but the trips' points, which are only looked at as each
+   trip is (see fix_points() in trips.c) */
+static int
+check_image(struct ckpt_header *h)
+{
+    struct active *a = (struct active *)ckpt_at(OFF(h->active));
+    struct trips *t = (struct trips *)ckpt_at(OFF(h->trips));
+    uint64_t *pages, *segs;
+    unsigned long i;
+
+    if (!ckpt_in(OFF(h->active), 1, sizeof(*a)) || a->secs > a->cap ||
+        !array_in(a->begins, a->cap, sizeof(*a->begins)) ||
+        !array_in(a->ends, a->cap, sizeof(*a->ends)))
+        return -1;
+    if (!ckpt_in(OFF(h->trips), 1, sizeof(*t)) ||
+        !array_in(t->pages, t->npages, sizeof(*pages)))
+        return -1;
+    pages = (uint64_t *)ckpt_at(t->pages);
+    for (i = 0; i < t->npages; i++) {
+        if (pages[i] && !ckpt_in(OFF(pages[i]), TRIPS_PAGE,
+                                 sizeof(struct trip)))
+            return -1;
+    }
+    if (!array_in(OFF(h->segs), h->nsegs, sizeof(*segs)))
+        return -1;
+    segs = (uint64_t *)ckpt_at(OFF(h->segs));
+    for (i = 0; i < h->nsegs; i++) {
+        if (check_segment(h, OFF(segs[i])) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Loading */
+
+static struct colstore *
+load_colstore(struct colstore *img)
+{
+    struct colstore *cs = (struct colstore *)malloc(sizeof(*cs));
+
+    if (!cs)
+        return NULL;
+    *cs = *img;
+    cs->id = (int64_t *)ckpt_at(img->id);
+    cs->lng = (float *)ckpt_at(img->lng);
+    cs->lat = (float *)ckpt_at(img->lat);
+    cs->type = (unsigned char *)ckpt_at(img->type);
+    cs->fare = (int *)ckpt_at(img->fare);
+    cs->time = (unsigned int *)ckpt_at(img->time);
+    return cs;
+}
+
+static struct grid *
+load_grid(struct grid *img)
+{
+    struct grid *g = (struct grid *)malloc(sizeof(*g));
+    int i;
+
+    if (!g)
+        return NULL;
+    *g = *img;
+    g->cells = (struct grid_cell *)ckpt_at(img->cells);
+    for (i = 0; i < g->n * g->n; i++) {
+        struct grid_cell *c = &g->cells[i];
+        c->blocks = (struct grid_block *)ckpt_at(c->blocks);
+        c->lat = (float *)ckpt_at(c->lat);
+        c->lng = (float *)ckpt_at(c->lng);
+        c->id = (int64_t *)ckpt_at(c->id);
+    }
+    return g;
+}
+
+/* hll_create() also sets up the tables the estimates use */
+static struct hll_grid *
+load_hll(struct hll_grid *img)
+{
+    struct hll_grid *h = hll_create(img->n, img->min_lat, img->max_lat,
+                                    img->min_lng, img->max_lng);
+    int i;
+
+    if (!h)
+        return NULL;
+    free(h->cells);
+    h->cells = (struct hll_cell *)ckpt_at(img->cells);
+    h->sketches = img->sketches;
+    for (i = 0; i < h->n * h->n; i++) {
+        h->cells[i].trips = (uint8_t *)ckpt_at(h->cells[i].trips);
+        h->cells[i].ends = (uint8_t *)ckpt_at(h->cells[i].ends);
+    }
+    return h;
+}
+
+static struct sat_grid *
+load_sat(struct sat_grid *img)
+{
+    struct sat_grid *s = (struct sat_grid *)malloc(sizeof(*s));
+    int i;
+
+    if (!s)
+        return NULL;
+    *s = *img;
+    s->cells = (struct sat_cell *)ckpt_at(img->cells);
+    s->starts = (unsigned long *)ckpt_at(img->starts);
+    s->stops = (unsigned long *)ckpt_at(img->stops);
+    s->nears = (unsigned long *)ckpt_at(img->nears);
+    s->fares = (long long *)ckpt_at(img->fares);
+    s->sum_starts = (unsigned long *)ckpt_at(img->sum_starts);
+    s->sum_stops = (unsigned long *)ckpt_at(img->sum_stops);
+    s->sum_nears = (unsigned long *)ckpt_at(img->sum_nears);
+    s->sum_fares = (long long *)ckpt_at(img->sum_fares);
+    s->spill_row = (unsigned char *)ckpt_at(img->spill_row);
+    s->spill_col = (unsigned char *)ckpt_at(img->spill_col);
+    for (i = 0; i < s->n * s->n; i++) {
+        struct sat_cell *c = &s->cells[i];
+        c->begins = (struct sat_begin *)ckpt_at(c->begins);
+        c->near = (struct sat_end *)ckpt_at(c->near);
+        c->far = (struct sat_end *)ckpt_at(c->far);
+    }
+    return s;
+}
+
+static struct segment *
+load_segment(struct segment *img)
+{
+    struct segment *seg = (struct segment *)malloc(sizeof(*seg));
+
+    if (!seg)
+        return NULL;
+    *seg = *img;
+    seg->cs = NULL;
+    seg->grid = NULL;
+    seg->hll = NULL;
+    seg->sat = NULL;
+    if ((img->cs &&
+         !(seg->cs = load_colstore((struct colstore *)ckpt_at(img->cs)))) ||
+        (img->grid &&
+         !(seg->grid = load_grid((struct grid *)ckpt_at(img->grid)))) ||
+        (img->hll &&
+         !(seg->hll = load_hll((struct hll_grid *)ckpt_at(img->hll)))) ||
+        (img->sat &&
+         !(seg->sat = load_sat((struct sat_grid *)ckpt_at(img->sat))))) {
+        fprintf(stderr, "checkpoint: out of memory loading segment %lu\n",
+                img->seq);
+        return NULL;
+    }
+    return seg;
+}
+
+/* Into the segment's attached database, which segments_adopt() opened */
+static int
+load_segment_sql(struct tripstore_context *ctx, struct segment *seg,
+                 const char *file)
+{
+    sqlite3 *in;
+    sqlite3_backup *b;
+    int rc;
+
+    if (sqlite3_open_v2(file, &in, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "checkpoint: can't open %s\n", file);
+        sqlite3_close(in);
+        return -1;
+    }
+    b = sqlite3_backup_init(ctx->db, seg->name, in, "main");
+    if (b) {
+        sqlite3_backup_step(b, -1);
+        sqlite3_backup_finish(b);
+    }
+    rc = sqlite3_errcode(ctx->db);
+    if (rc != SQLITE_OK)
+        fprintf(stderr, "checkpoint: can't copy in %s: %s\n", file,
+                sqlite3_errmsg(ctx->db));
+    sqlite3_close(in);
+    return rc == SQLITE_OK ? 0 : -1;
+}
+
+/* A checkpoint we won't use after all */
+static int
+unmap()
+{
+    munmap(map_base, map_len);
+    map_base = NULL;
+    map_len = 0;
+    return -1;
+}
+
+/* checkpoint_load
+
+   Map the checkpoint at path and make it the store. Call it on a fresh
+   store, after prepare_statements() and before segments_start(). Returns
+   -1 if the checkpoint can't be used, with the store as it was, so the
+   log can be replayed from the start instead, and -2 if loading failed
+   partway.
+*/
+int
+checkpoint_load(struct tripstore_context *ctx, const char *path,
+                struct checkpoint_loaded *ld)
+{
+    struct ckpt_header *h, want;
+    struct trips *timg;
+    struct active *aimg;
+    struct stat st;
+    uint64_t *segs;
+    uint64_t *pages;
+    unsigned long start = now_us(), t;
+    char file[PATH_MAX];
+    unsigned long i, p;
+    int fd, shared;
+
+    memset(ld, 0, sizeof(*ld));
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "checkpoint: can't open %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    if (st.st_size < (off_t)sizeof(*h)) {
+        fprintf(stderr, "checkpoint: %s is cut short\n", path);
+        close(fd);
+        return -1;
+    }
+    map_base = (char *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map_base == MAP_FAILED) {
+        map_base = NULL;
+        fprintf(stderr, "checkpoint: can't map %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    map_len = st.st_size;
+    h = (struct ckpt_header *)map_base;
+
+    memset(&want, 0, sizeof(want));
+    fill_options(ctx, &want);
+    if (memcmp(h->magic, want.magic, sizeof(want.magic)) ||
+        h->version != want.version ||
+        memcmp(h->sizes, want.sizes, sizeof(want.sizes))) {
+        fprintf(stderr, "checkpoint: %s isn't a checkpoint this build "
+                "can read\n", path);
+        return unmap();
+    }
+    if (h->engine != want.engine || h->rtree != want.rtree ||
+        h->coord_bits != want.coord_bits ||
+        h->keep_points != want.keep_points ||
+        h->grid_cells != want.grid_cells || h->hll_cells != want.hll_cells ||
+        h->sat_cells != want.sat_cells || h->min_lat != want.min_lat ||
+        h->max_lat != want.max_lat || h->min_lng != want.min_lng ||
+        h->max_lng != want.max_lng) {
+        fprintf(stderr, "checkpoint: %s was taken with other storage "
+                "options\n", path);
+        return unmap();
+    }
+    if (check_image(h) < 0) {
+        fprintf(stderr, "checkpoint: %s is corrupt\n", path);
+        return unmap();
+    }
+    ld->bytes = map_len;
+    ld->wal_records = h->wal_records;
+    t = now_us();
+    ld->map_us = t - start;
+
+    /* report3 totals, and the trip records, which were made empty */
+    aimg = (struct active *)ckpt_at(OFF(h->active));
+    free(ctx->active->begins);
+    free(ctx->active->ends);
+    *ctx->active = *aimg;
+    ctx->active->begins = (unsigned long *)ckpt_at(aimg->begins);
+    ctx->active->ends = (unsigned long *)ckpt_at(aimg->ends);
+
+    timg = (struct trips *)ckpt_at(OFF(h->trips));
+    pages = (uint64_t *)ckpt_at(timg->pages);
+    free(ctx->trips->pages);
+    free(ctx->trips->spans);
+    shared = ctx->trips->shared;
+    *ctx->trips = *timg;
+    ctx->trips->shared = shared;
+    pthread_mutex_init(&ctx->trips->lock, NULL);
+    ctx->trips->pages = NULL;
+    ctx->trips->spans = NULL;
+    if (timg->npages) {
+        ctx->trips->pages = (struct trip **)calloc(timg->npages,
+                                                    sizeof(struct trip *));
+        ctx->trips->spans = (struct trips_span *)
+                            malloc(timg->npages * sizeof(struct trips_span));
+        if (!ctx->trips->pages || !ctx->trips->spans) {
+            fprintf(stderr, "checkpoint: out of memory\n");
+            return -2;
+        }
+    }
+    /* the spans aren't in the checkpoint: the pages it has are never
+       passed over */
+    for (p = 0; p < timg->npages; p++) {
+        ctx->trips->pages[p] = (struct trip *)ckpt_at(OFF(pages[p]));
+        ctx->trips->spans[p].lo = 0;
+        ctx->trips->spans[p].hi = UINT32_MAX;
+    }
+    ld->trips_us = now_us() - t;
+
+    t = now_us();
+    segs = (uint64_t *)ckpt_at(OFF(h->segs));
+    for (i = 0; i < h->nsegs; i++) {
+        struct segment *seg = load_segment((struct segment *)
+                                           ckpt_at(OFF(segs[i])));
+        if (!seg || segments_adopt(ctx, seg) < 0)
+            return -2;
+        if (ctx->engine == ENGINE_SQLITE) {
+            unsigned long ts = now_us();
+            sql_file(file, sizeof(file), path, h->gen, seg->seq);
+            if (load_segment_sql(ctx, seg, file) < 0)
+                return -2;
+            ld->sql_us += now_us() - ts;
+        }
+        ld->rows += seg->rows;
+        if (seg->max_id > ld->max_id)
+            ld->max_id = seg->max_id;
+    }
+    ctx->segments->next_seq = h->next_seq;
+    ld->segments = h->nsegs;
+    ld->segments_us = now_us() - t - ld->sql_us;
+    return 0;
+}
@@ -0,0 +1,33 @@
+/* Checkpoints: the whole store in one file (tripstore --checkpoint) that
+   a restart maps back in instead of replaying the log. See checkpoint.c. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct tripstore_context;
+
+/* What loading a checkpoint found and took, for the startup log */
+struct checkpoint_loaded
+{
+    unsigned long bytes;            /* of the file, mapped */
+    unsigned long segments;
+    unsigned long rows;
+    unsigned long wal_records;      /* log records it covers */
+    int64_t max_id;                 /* highest trip id in it */
+    unsigned long map_us;
+    unsigned long trips_us;         /* trip records and report3 totals */
+    unsigned long segments_us;      /* segment indexes and columns */
+    unsigned long sql_us;           /* copying in the sqlite tables */
+};
+
+int checkpoint_write(struct tripstore_context *ctx, const char *tmp,
+                     const char *path, unsigned long wal_records);
+int checkpoint_load(struct tripstore_context *ctx, const char *path,
+                    struct checkpoint_loaded *ld);
+
+/* Arrays of a loaded checkpoint stay in its mapping until they grow.
+   Whatever can hold one reallocs and frees it through these. */
+void *ckpt_realloc(void *p, size_t old, size_t size);
+void ckpt_free(void *p);
+void *ckpt_at(const void *off);
+int ckpt_in(const void *off, uint64_t n, size_t size);
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sqls.h"
+#include "colstore.h"
+#include "checkpoint.h"
+#include "scan.h"
+
+/*
+   Every event is fixed width, so instead of a sqlite row plus two covering
+   index entries we keep one array per field:
+
+     id int64 | lng float | lat float | type uint8 | fare int | time uint32
+
+   That is 25 bytes per event with no per row or per index overhead, and
+   an insert is six stores at the end of the arrays. The columns double in
+   size when they fill up.
+
+   There are no indexes. The reports scan just the columns they need,
+   which is sequential and cheap, and trip ids are handed out densely from
+   1 so DISTINCT is a bitmap indexed by id rather than a temp b-tree. The
+   bitmap only spans the ids in this store, which for a time segment is
+   the trips that began in it. If those are spread so thin that the
+   bitmap would be bigger than the columns, the matching ids are sorted
+   instead (struct distinct).
+*/
+
+#define INITIAL_EVENTS (1 << 16)
+
+struct colstore *
+colstore_create()
+{
+    struct colstore *cs = (struct colstore *)malloc(sizeof(*cs));
+    memset(cs, 0, sizeof(*cs));
+    return cs;
+}
+
+void
+colstore_destroy(struct colstore *cs)
+{
+    ckpt_free(cs->id);
+    ckpt_free(cs->lng);
+    ckpt_free(cs->lat);
+    ckpt_free(cs->type);
+    ckpt_free(cs->fare);
+    ckpt_free(cs->time);
+    free(cs);
+}
+
+/* grow one column from old to cap elements of size bytes */
+static int
+grow_column(void **col, unsigned long old, unsigned long cap, int size)
+{
+    void *p = ckpt_realloc(*col, old * size, cap * size);
+    if (!p)
+        return -1;
+    *col = p;
+    return 0;
+}
+
+static int
+grow(struct colstore *cs)
+{
+    unsigned long cap = cs->cap ? cs->cap * 2 : INITIAL_EVENTS;
+
+    if (grow_column((void **)&cs->id, cs->cap, cap, sizeof(*cs->id)) < 0 ||
+        grow_column((void **)&cs->lng, cs->cap, cap, sizeof(*cs->lng)) < 0 ||
+        grow_column((void **)&cs->lat, cs->cap, cap, sizeof(*cs->lat)) < 0 ||
+        grow_column((void **)&cs->type, cs->cap, cap,
+                    sizeof(*cs->type)) < 0 ||
+        grow_column((void **)&cs->fare, cs->cap, cap,
+                    sizeof(*cs->fare)) < 0 ||
+        grow_column((void **)&cs->time, cs->cap, cap,
+                    sizeof(*cs->time)) < 0) {
+        fprintf(stderr, "colstore: out of memory at %lu events\n", cs->n);
+        return -1;
+    }
+    cs->cap = cap;
+    return 0;
+}
+
+/* Append one event */
+int
+colstore_add(struct colstore *cs, int64_t id, float lng, float lat,
+             int type, int cents, time_t t)
+{
+    unsigned long i = cs->n;
+
+    if (i == cs->cap && grow(cs) < 0)
+        return -1;
+
+    cs->id[i] = id;
+    cs->lng[i] = lng;
+    cs->lat[i] = lat;
+    cs->type[i] = type;
+    cs->fare[i] = cents;
+    cs->time[i] = t;
+    if (id > cs->max_id)
+        cs->max_id = id;
+    if (id < cs->min_id || !i)
+        cs->min_id = id;
+    cs->n = i + 1;
+    return 0;
+}
+
+/* bytes allocated for the columns */
+unsigned long
+colstore_bytes(struct colstore *cs)
+{
+    return cs->cap * (sizeof(*cs->id) + sizeof(*cs->lng) +
+                      sizeof(*cs->lat) + sizeof(*cs->type) +
+                      sizeof(*cs->fare) + sizeof(*cs->time));
+}
+
+/* COUNT(DISTINCT id): one bit per trip id from min_id, or the ids
+   themselves to be sorted at the end */
+struct distinct
+{
+    unsigned char *bm;
+    int64_t *ids;
+    unsigned long n, cap;       /* bm: the count so far */
+};
+
+static int
+distinct_start(struct colstore *cs, struct distinct *d)
+{
+    unsigned long bytes = (cs->max_id - cs->min_id) / 8 + 1;
+
+    memset(d, 0, sizeof(*d));
+    if (cs->max_id < cs->min_id)
+        return 0;
+    if (bytes <= colstore_bytes(cs)) {
+        d->bm = (unsigned char *)calloc(bytes, 1);
+        return d->bm ? 0 : -1;
+    }
+    d->cap = 1024;
+    d->ids = (int64_t *)malloc(d->cap * sizeof(*d->ids));
+    return d->ids ? 0 : -1;
+}
+
+/* Count id, which is from min_id to max_id */
+static inline int
+distinct_add(struct colstore *cs, struct distinct *d, int64_t id)
+{
+    if (d->bm) {
+        id -= cs->min_id;
+        unsigned char bit = 1 << (id & 7);
+        if (!(d->bm[id >> 3] & bit)) {
+            d->bm[id >> 3] |= bit;
+            d->n++;
+        }
+        return 0;
+    }
+    if (d->n == d->cap) {
+        int64_t *ids = (int64_t *)realloc(d->ids, 2 * d->cap * sizeof(*ids));
+        if (!ids)
+            return -1;
+        d->ids = ids;
+        d->cap *= 2;
+    }
+    d->ids[d->n++] = id;
+    return 0;
+}
+
+static int
+cmp_id(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* The count, and d freed */
+static unsigned long
+distinct_end(struct distinct *d)
+{
+    unsigned long i, count = d->n;
+
+    if (d->ids && d->n) {
+        qsort(d->ids, d->n, sizeof(*d->ids), cmp_id);
+        for (count = 1, i = 1; i < d->n; i++)
+            count += d->ids[i] != d->ids[i - 1];
+    }
+    free(d->bm);
+    free(d->ids);
+    return count;
+}
+
+static inline int
+in_rect(struct colstore *cs, unsigned long i,
+        double lat1, double lat2, double lng1, double lng2)
+{
+    return cs->lat[i] >= lat1 && cs->lat[i] <= lat2 &&
+           cs->lng[i] >= lng1 && cs->lng[i] <= lng2;
+}
+
+/* report1: distinct trips with any event in the rect, -1 if we ran out
+   of memory */
+long
+colstore_report1(struct colstore *cs,
+                 double lat1, double lat2, double lng1, double lng2)
+{
+    struct distinct d;
+    unsigned long i;
+
+    if (distinct_start(cs, &d) < 0)
+        goto oom;
+    for (i = 0; i < cs->n; i++) {
+        if (in_rect(cs, i, lat1, lat2, lng1, lng2) &&
+            distinct_add(cs, &d, cs->id[i]) < 0)
+            goto oom;
+    }
+    return distinct_end(&d);
+oom:
+    distinct_end(&d);
+    return -1;
+}
+
+/* report2: distinct trips with a BEGIN or END in the rect, and the sum of
+   the fares on those events. rows is how many events matched, so the
+   caller can tell an empty SUM apart from a zero one. -1 if we ran out
+   of memory. */
+long
+colstore_report2(struct colstore *cs,
+                 double lat1, double lat2, double lng1, double lng2,
+                 long long *fare_sum, unsigned long *rows)
+{
+    struct distinct d;
+    unsigned long i;
+
+    *fare_sum = 0;
+    *rows = 0;
+    if (distinct_start(cs, &d) < 0)
+        goto oom;
+    for (i = 0; i < cs->n; i++) {
+        if (cs->type[i] == TRANSIT)
+            continue;
+        if (in_rect(cs, i, lat1, lat2, lng1, lng2)) {
+            if (distinct_add(cs, &d, cs->id[i]) < 0)
+                goto oom;
+            *fare_sum += cs->fare[i];
+            (*rows)++;
+        }
+    }
+    return distinct_end(&d);
+oom:
+    distinct_end(&d);
+    return -1;
+}
+
+/* report1 and report2 for each rect that s has selected, in one pass
+   over the columns. Each event is looked up in the bins of the rects
+   (scan_bin()) and checked against the ones in its bin, marking its
+   trip in the ids of those it is in (and adding the fare for report2s if
+   it is a BEGIN or END). */
+void
+colstore_reports_scan(struct colstore *cs, struct scan *s)
+{
+    unsigned long i;
+    int j, n = 0;
+
+    for (j = 0; j < s->nsel; j++) {
+        if (scan_ids_reset(&s->sel[j].ids, cs->min_id, cs->max_id) == 0)
+            s->live[n++] = j;
+        else if (cs->max_id >= cs->min_id)
+            s->sel[j].rect->failed = 1;
+    }
+    if (!n)
+        return;
+    scan_bin(s, n);
+    for (i = 0; i < cs->n; i++) {
+        int b = scan_bin_of(s, cs->lat[i], cs->lng[i]);
+        if (b < 0)
+            continue;
+        for (j = s->bin_start[b]; j < s->bin_start[b + 1]; j++) {
+            struct scan_sel *sel = &s->sel[s->bin_sels[j]];
+            if (sel->rect->report == 2 && cs->type[i] == TRANSIT)
+                continue;
+            if (!in_rect(cs, i, sel->lat1, sel->lat2, sel->lng1, sel->lng2))
+                continue;
+            scan_ids_set(&sel->ids, cs->id[i]);
+            if (sel->rect->report == 2) {
+                sel->rect->fares += cs->fare[i];
+                sel->rect->rows++;
+            }
+        }
+    }
+}
@@ -0,0 +1,38 @@
+/* Append only columnar store for the trip log. This is the alternative to
+   the sqlite triplog / tripsummary tables (tripstore --engine columnar).
+   See colstore.c for the layout. */
+
+#include <stdint.h>
+
+struct colstore
+{
+    unsigned long n;        /* events stored */
+    unsigned long cap;      /* events the columns have room for */
+    int64_t min_id;         /* lowest trip id seen */
+    int64_t max_id;         /* highest trip id seen */
+
+    int64_t *id;
+    float *lng;
+    float *lat;
+    unsigned char *type;
+    int *fare;
+    unsigned int *time;
+};
+
+struct colstore *colstore_create();
+void colstore_destroy(struct colstore *cs);
+
+int colstore_add(struct colstore *cs, int64_t id, float lng, float lat,
+                 int type, int cents, time_t t);
+
+unsigned long colstore_bytes(struct colstore *cs);
+
+/* -1 if out of memory */
+long colstore_report1(struct colstore *cs, double lat1, double lat2,
+                      double lng1, double lng2);
+long colstore_report2(struct colstore *cs, double lat1, double lat2,
+                      double lng1, double lng2, long long *fare_sum,
+                      unsigned long *rows);
+
+struct scan;
+void colstore_reports_scan(struct colstore *cs, struct scan *s);
@@ -1,13 +1,98 @@
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct reactor;
+struct evq;
+struct uring;
+struct active;
+struct segments;
+struct trips;
+struct quant;
+struct wal;
+struct snapshot;
+struct query_pool;
+struct query_conn;
+struct outbuf;
+struct reply;
+struct scan;
+struct tick_report;
 
 struct tripstore_context
 {
+    /* Storage is shared by all of the reactors. Whoever touches db or the
+       batch state below must hold store_lock. */
+    pthread_mutex_t store_lock;
+    int engine;                 /* enum STORE_ENGINE */
     sqlite3 *db;
-    sqlite3_stmt *insert;
-    sqlite3_stmt *insert_summary;
-    sqlite3_stmt *update_summary;
-    sqlite3_stmt *reports[3];
+    sqlite3_stmt *begin;
+    sqlite3_stmt *commit;
+    sqlite3_stmt *rollback;
+
+    /* The trip log, in time segments that each have their tables (or
+       columns) and their indexes. See segment.c. */
+    struct segments *segments;
+
+    /* The segments' databases are shared-cache, for the query workers'
+       connections to attach too. See query.c. */
+    int shared_segments;
+
+    /* R-tree side indexes over triplog, keyed by its rowid. rtree says
+       which of them add_tripdata() keeps up to date in each segment.
+       tripends_rtree is only kept (ends_rtree) without the summed-area
+       tables, which answer report2 whenever there are any. */
+    int rtree;                  /* enum RTREE_MODE */
+    int ends_rtree;
+
+    /* Fixed point long and lat in the sqlite tables, NULL for REAL. See
+       quant.h. */
+    struct quant *quant;
+
+    /* A record per trip: the tripsummary row, its segment and (with
+       --trajectories) its points. See trips.c. */
+    struct trips *trips;
+
+    /* BEGIN and END counts that report3 is answered from */
+    struct active *active;
+
+    /* Group commit: add_tripdata() opens a transaction and the event loop
+       commits it once the batch is full or due. batch_max_rows <= 1
+       turns this off and every row is its own implicit transaction. */
+    int batch_max_rows;
+    int batch_max_ms;
+    int in_batch;
+    int batch_rows;
+    int batch_fails;            /* commits of the open batch that failed */
+    struct timespec batch_start;
+    struct batch_stats batch_stats;
+
+    /* add_tripdata() logs every event here with --wal. See wal.c. */
+    struct wal *wal;
+
+    /* Takes snapshots for the "snapshot" query and --snapshot-secs. See
+       snapshot.c. */
+    struct snapshot *snapshot;
+
+    /* Runs the queries from the query port, NULL to run them on the
+       event loop. See query.c. */
+    struct query_pool *queries;
+
+    /* report1s and report2s that come in together are answered in one
+       scan. See scan.c. */
+    struct scan_stats scan_stats;
+
+    /* Query connections buffer their answers. See outbuf.c. */
+    unsigned long out_cap;      /* --out-kb, in bytes */
+    struct outbuf_stats out_stats;
+
+    /* The reactors push decoded events here for the storage writer */
+    struct evq *evq;
+
+    /* The event loops, for the "stats" query */
+    struct reactor *reactors;
+    int nreactors;
 };
 
 static inline struct tripstore_context *
@@ -16,19 +101,39 @@ make_ctx()
     struct tripstore_context * ctx = (struct tripstore_context *)
                                              malloc(sizeof(*ctx));
     memset(ctx, 0, sizeof(*ctx));
+    pthread_mutex_init(&ctx->store_lock, NULL);
     return ctx;
 }
 
-/* The trip messages are tiny, so we'll just make them part of the
-   structure */
-#define MAX_MSG_SIZE 32
+/* Generator connections read into msg_buf, a buffer from the reactor's
+   pool that is big enough to take everything the kernel has queued for
+   us in one read(). Frames are parsed in place from msg_start up to
+   bytes. */
 struct epoll_context
 {
     int fd;
     int (*cb)(struct epoll_context *, struct tripstore_context *, int);
-    char msg_buf[MAX_MSG_SIZE];
+    struct reactor *reactor;
+    char *msg_buf;
+    int msg_start;
     char *query_buf;
+    struct query_conn *qc;      /* with query workers */
+    struct outbuf *out;         /* query connections' answers */
+    struct reply *reply;        /* made once the first bytes say which
+                                   protocol the client speaks */
     int bytes;
+    int closing;                /* --backend uring: shut down, not freed.
+                                   Query connections: the client is done
+                                   sending, and it goes once answered. */
+    int reports;                /* query connections without workers: the
+                                   reports waiting for the end of the tick */
+    int ticked;                 /* in the reactor's tick_conns */
+    /* trip id blocks leased to this generator, the latest and the one
+       before it, as [lo, hi) */
+    int64_t lease_lo[2];
+    int64_t lease_hi[2];
+    int64_t lease_next;         /* ids below it were begun or passed over */
+    unsigned long bad_ids;      /* events dropped for ids never handed out */
 };
 
 static inline struct epoll_context *
@@ -39,7 +144,46 @@ make_epoll_ctx(int fd,
     struct epoll_context *ctx = (struct epoll_context *)malloc(sizeof(*ctx));
     ctx->fd = fd;
     ctx->cb = cb;
+    ctx->reactor = NULL;
+    ctx->msg_buf = NULL;
+    ctx->msg_start = 0;
     ctx->bytes = 0;
+    ctx->closing = 0;
+    ctx->reports = 0;
+    ctx->ticked = 0;
+    memset(ctx->lease_lo, 0, sizeof(ctx->lease_lo));
+    memset(ctx->lease_hi, 0, sizeof(ctx->lease_hi));
+    ctx->lease_next = 0;
+    ctx->bad_ids = 0;
     ctx->query_buf = NULL;
+    ctx->qc = NULL;
+    ctx->out = NULL;
+    ctx->reply = NULL;
     return ctx;
 }
+
+/* A reactor is one event loop thread. Each has its own SO_REUSEPORT
+   listening socket and epoll set, so the kernel spreads the generator
+   connections across them. Decoded events go to the storage writer
+   through ctx->evq. */
+struct reactor
+{
+    int id;
+    int efd;
+    int listen_fd;
+    pthread_t thread;
+    struct tripstore_context *ctx;
+    struct bufpool recv_bufs;
+    struct uring *uring;        /* only with --backend uring */
+    struct reactor_stats stats;
+
+    /* query connections, see end_tick(). With query workers: whether
+       this tick gave them queries. Without: its reports, answered from
+       one scan at the end of it, and the connections they came on. */
+    int submitted;
+    struct tick_report *reports;        /* SCAN_MAX_RECTS */
+    int nreports;
+    struct epoll_context **tick_conns;  /* EPOLL_EVENTS */
+    int nconns;
+    struct scan *scan;
+};
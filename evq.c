@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "sqls.h"
+#include "stats.h"
+#include "evq.h"
+
+/*
+   This is the usual bounded ring with a sequence number per slot. A slot
+   whose seq equals the producer position is free for that position, one
+   whose seq is position + 1 holds an event for the consumer.
+
+   Producers (the reactors) claim a position with a CAS on head, fill the
+   slot and then publish it by storing seq. The single consumer (the
+   storage writer) owns tail outright, so popping needs no atomic
+   read-modify-write at all.
+
+   When the ring is empty the writer parks on an eventfd. Producers only
+   pay for the write() when they see it parked, so a busy writer costs
+   the network side nothing but the CAS.
+*/
+
+static unsigned long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* size is rounded up to a power of two */
+int
+evq_init(struct evq *q, int size)
+{
+    unsigned long n = 1;
+    unsigned long i;
+
+    memset(q, 0, sizeof(*q));
+    while (n < (unsigned long)size)
+        n <<= 1;
+
+    q->slots = (struct evq_slot *)malloc(n * sizeof(*q->slots));
+    if (!q->slots)
+        return -1;
+    for (i = 0; i < n; i++)
+        q->slots[i].seq = i;
+    q->mask = n - 1;
+
+    q->efd = eventfd(0, EFD_NONBLOCK);
+    if (q->efd < 0) {
+        free(q->slots);
+        q->slots = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void
+evq_destroy(struct evq *q)
+{
+    close(q->efd);
+    free(q->slots);
+    q->slots = NULL;
+}
+
+/* Push one event. Returns -1 if the ring is full. */
+int
+evq_push(struct evq *q, const struct trip_event *e)
+{
+    struct evq_slot *slot;
+    unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    unsigned long seq;
+    long dif;
+
+    while (1) {
+        slot = &q->slots[pos & q->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        dif = (long)seq - (long)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->ev = *e;
+    slot->enq_ns = now_ns();
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST)) {
+        unsigned long long one = 1;
+        __atomic_store_n(&q->sleeping, 0, __ATOMIC_SEQ_CST);
+        write(q->efd, &one, sizeof(one));
+    }
+    return 0;
+}
+
+/* Push one event, yielding until the writer makes room. We would rather
+   stall a reactor than drop trip data. Each stall is counted. */
+void
+evq_push_wait(struct evq *q, const struct trip_event *e)
+{
+    while (-1 == evq_push(q, e)) {
+        __sync_fetch_and_add(&q->stats.full, 1);
+        sched_yield();
+    }
+}
+
+/* Pop up to max events into out. Only the writer thread may call this. */
+int
+evq_pop(struct evq *q, struct trip_event *out, int max)
+{
+    unsigned long now = 0;
+    unsigned long depth;
+    int n;
+
+    depth = __atomic_load_n(&q->head, __ATOMIC_RELAXED) - q->tail;
+    if (depth > q->stats.max_depth)
+        q->stats.max_depth = depth;
+
+    for (n = 0; n < max; n++) {
+        struct evq_slot *slot = &q->slots[q->tail & q->mask];
+        unsigned long lat;
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->tail + 1)
+            break;
+
+        out[n] = slot->ev;
+        if (!now)
+            now = now_ns();
+        lat = now > slot->enq_ns ? now - slot->enq_ns : 0;
+        q->stats.latency_ns_total += lat;
+        if (lat > q->stats.latency_ns_max)
+            q->stats.latency_ns_max = lat;
+
+        __atomic_store_n(&slot->seq, q->tail + q->mask + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELAXED);
+    }
+
+    if (n) {
+        q->stats.drains++;
+        q->stats.drained += n;
+    }
+    return n;
+}
+
+/* Park the writer until something is pushed or timeout_ms passes */
+void
+evq_wait(struct evq *q, int timeout_ms)
+{
+    struct pollfd pfd;
+    unsigned long long v;
+
+    __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+    /* recheck, in case a producer published before it saw the flag */
+    if (evq_depth(q) == 0) {
+        pfd.fd = q->efd;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, timeout_ms);
+    }
+    __atomic_store_n(&q->sleeping, 0, __ATOMIC_SEQ_CST);
+    read(q->efd, &v, sizeof(v));
+}
+
+/* events pushed but not yet popped */
+unsigned long
+evq_depth(struct evq *q)
+{
+    return __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) -
+           __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+}
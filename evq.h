@@ -0,0 +1,31 @@
+/* Bounded lock-free multi-producer / single-consumer queue of trip events.
+   The reactors push decoded events, the storage writer thread drains them.
+   See evq.c for the details. Needs sqls.h (struct trip_event) and stats.h
+   (struct evq_stats) included first. */
+
+struct evq_slot
+{
+    unsigned long seq;
+    unsigned long enq_ns;
+    struct trip_event ev;
+};
+
+struct evq
+{
+    struct evq_slot *slots;
+    unsigned long mask;
+    int efd;
+    int sleeping;
+    /* producers and the consumer each get their own cache line */
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+    struct evq_stats stats;
+};
+
+int evq_init(struct evq *q, int size);
+void evq_destroy(struct evq *q);
+int evq_push(struct evq *q, const struct trip_event *e);
+void evq_push_wait(struct evq *q, const struct trip_event *e);
+int evq_pop(struct evq *q, struct trip_event *out, int max);
+void evq_wait(struct evq *q, int timeout_ms);
+unsigned long evq_depth(struct evq *q);
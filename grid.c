@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "grid.h"
+#include "cells.h"
+#include "checkpoint.h"
+#include "scan.h"
+
+/*
+   The area (tripstore --area) is cut into n x n cells. Points outside of
+   it go to the nearest edge cell, and that cell is then marked as spilled
+   so that no rect ever counts as covering all of it.
+
+   Each cell keeps the trip ids that have a point in it as a compressed
+   bitmap: only the 64 bit words that have a bit set, with the word's
+   position (id / 64). Trip ids are handed out in increasing order and a
+   trip only lives for minutes, so a new point's word is nearly always the
+   last one or close to it, and the words stay sorted by just appending.
+
+   report1 is then the union of the bitmaps of the cells that lie wholly
+   inside the rect, plus an exact check of the points of the cells that
+   the rect only partly covers. The cost follows the area asked about
+   (how many cells, and how many trips went through each) instead of how
+   many points were ever stored there.
+*/
+
+#define INITIAL_BLOCKS 16
+#define INITIAL_POINTS 64
+
+struct grid *
+grid_create(int n, double min_lat, double max_lat,
+            double min_lng, double max_lng)
+{
+    struct grid *g = (struct grid *)malloc(sizeof(*g));
+    memset(g, 0, sizeof(*g));
+    g->n = n;
+    g->min_lat = min_lat;
+    g->max_lat = max_lat;
+    g->min_lng = min_lng;
+    g->max_lng = max_lng;
+    g->cell_lat = (max_lat - min_lat) / n;
+    g->cell_lng = (max_lng - min_lng) / n;
+    g->cells = (struct grid_cell *)calloc(n * n, sizeof(*g->cells));
+    if (!g->cells) {
+        free(g);
+        return NULL;
+    }
+    return g;
+}
+
+void
+grid_destroy(struct grid *g)
+{
+    int i;
+    for (i = 0; i < g->n * g->n; i++) {
+        ckpt_free(g->cells[i].blocks);
+        ckpt_free(g->cells[i].lat);
+        ckpt_free(g->cells[i].lng);
+        ckpt_free(g->cells[i].id);
+    }
+    ckpt_free(g->cells);
+    free(g);
+}
+
+/* Set id in the cell's bitmap. Returns 1 if a block was added. */
+static int
+cell_mark(struct grid_cell *c, int64_t id)
+{
+    int64_t blk = id >> 6;
+    uint64_t bit = 1ULL << (id & 63);
+    unsigned long i = c->nblocks;
+
+    while (i > 0 && c->blocks[i - 1].blk > blk)
+        i--;
+    if (i > 0 && c->blocks[i - 1].blk == blk) {
+        c->blocks[i - 1].bits |= bit;
+        return 0;
+    }
+
+    if (c->nblocks == c->capblocks) {
+        unsigned long cap = c->capblocks ? c->capblocks * 2 : INITIAL_BLOCKS;
+        struct grid_block *p = (struct grid_block *)
+                               ckpt_realloc(c->blocks,
+                                            c->capblocks * sizeof(*p),
+                                            cap * sizeof(*p));
+        if (!p)
+            return -1;
+        c->blocks = p;
+        c->capblocks = cap;
+    }
+    memmove(&c->blocks[i + 1], &c->blocks[i],
+            (c->nblocks - i) * sizeof(*c->blocks));
+    c->blocks[i].blk = blk;
+    c->blocks[i].bits = bit;
+    c->nblocks++;
+    return 1;
+}
+
+static int
+cell_add_point(struct grid_cell *c, int64_t id, float lng, float lat)
+{
+    if (c->npts == c->cappts) {
+        unsigned long cap = c->cappts ? c->cappts * 2 : INITIAL_POINTS;
+        float *la = (float *)ckpt_realloc(c->lat, c->cappts * sizeof(*la),
+                                          cap * sizeof(*la));
+        if (la)
+            c->lat = la;
+        float *ln = (float *)ckpt_realloc(c->lng, c->cappts * sizeof(*ln),
+                                          cap * sizeof(*ln));
+        if (ln)
+            c->lng = ln;
+        int64_t *ids = (int64_t *)ckpt_realloc(c->id,
+                                               c->cappts * sizeof(*ids),
+                                               cap * sizeof(*ids));
+        if (ids)
+            c->id = ids;
+        if (!la || !ln || !ids)
+            return -1;
+        c->cappts = cap;
+    }
+    c->lat[c->npts] = lat;
+    c->lng[c->npts] = lng;
+    c->id[c->npts] = id;
+    c->npts++;
+    return 0;
+}
+
+/* Add one trip point */
+int
+grid_add(struct grid *g, int64_t id, float lng, float lat)
+{
+    int out_lat, out_lng;
+    int row = cell_of(g->min_lat, g->cell_lat, g->n, lat, &out_lat);
+    int col = cell_of(g->min_lng, g->cell_lng, g->n, lng, &out_lng);
+    struct grid_cell *c = &g->cells[row * g->n + col];
+    int added;
+
+    if (cell_add_point(c, id, lng, lat) < 0 ||
+        (added = cell_mark(c, id)) < 0) {
+        fprintf(stderr, "grid: out of memory at %lu points\n", g->points);
+        return -1;
+    }
+    if (out_lat || out_lng)
+        c->spilled = 1;
+    g->blocks += added;
+    g->points++;
+    if (id > g->max_id)
+        g->max_id = id;
+    if (id < g->min_id || g->points == 1)
+        g->min_id = id;
+    return 0;
+}
+
+/* bytes allocated for the cells */
+unsigned long
+grid_bytes(struct grid *g)
+{
+    unsigned long bytes = g->n * g->n * sizeof(*g->cells);
+    int i;
+    for (i = 0; i < g->n * g->n; i++) {
+        bytes += g->cells[i].capblocks * sizeof(struct grid_block);
+        bytes += g->cells[i].cappts * (2 * sizeof(float) + sizeof(int64_t));
+    }
+    return bytes;
+}
+
+/* report1: distinct trips with a point in the rect, -1 if there is no
+   memory for their bitmap. lat1 <= lat2 and lng1 <= lng2. */
+long
+grid_report1(struct grid *g, double lat1, double lat2,
+             double lng1, double lng2)
+{
+    /* only the words that the ids in this grid can be in */
+    int64_t lo = g->min_id >> 6;
+    unsigned long words = (g->max_id >> 6) - lo + 1;
+    uint64_t *bm = (uint64_t *)calloc(words, sizeof(*bm));
+    int out;
+    int r0 = cell_of(g->min_lat, g->cell_lat, g->n, lat1, &out);
+    int r1 = cell_of(g->min_lat, g->cell_lat, g->n, lat2, &out);
+    int c0 = cell_of(g->min_lng, g->cell_lng, g->n, lng1, &out);
+    int c1 = cell_of(g->min_lng, g->cell_lng, g->n, lng2, &out);
+    unsigned long count = 0;
+    unsigned long i;
+    int row, col;
+
+    if (!bm)
+        return -1;
+    for (row = r0; row <= r1; row++) {
+        int rows_in = lat1 <= cell_edge(g->min_lat, g->cell_lat, row) &&
+                      cell_edge(g->min_lat, g->cell_lat, row + 1) <= lat2;
+        for (col = c0; col <= c1; col++) {
+            struct grid_cell *c = &g->cells[row * g->n + col];
+            if (rows_in && !c->spilled &&
+                lng1 <= cell_edge(g->min_lng, g->cell_lng, col) &&
+                cell_edge(g->min_lng, g->cell_lng, col + 1) <= lng2) {
+                /* wholly inside, take the whole bitmap */
+                for (i = 0; i < c->nblocks; i++)
+                    bm[c->blocks[i].blk - lo] |= c->blocks[i].bits;
+                continue;
+            }
+            /* on the edge of the rect, check each point */
+            for (i = 0; i < c->npts; i++) {
+                if (c->lat[i] >= lat1 && c->lat[i] <= lat2 &&
+                    c->lng[i] >= lng1 && c->lng[i] <= lng2)
+                    bm[(c->id[i] >> 6) - lo] |= 1ULL << (c->id[i] & 63);
+            }
+        }
+    }
+
+    for (i = 0; i < words; i++)
+        count += __builtin_popcountll(bm[i]);
+    free(bm);
+    return count;
+}
+
+/* report1 for each rect that s has selected, marking its trips in its
+   ids. The cells are walked once, a row at a time over the rects that
+   touch that row, and each cell is taken whole by the rects that cover
+   it while its points are checked once against all of the others. */
+void
+grid_report1_scan(struct grid *g, struct scan *s)
+{
+    int rmin = g->n, rmax = -1;
+    int i, out, row, col;
+    unsigned long p;
+
+    for (i = 0; i < s->nsel; i++) {
+        struct scan_sel *sel = &s->sel[i];
+        if (scan_ids_reset(&sel->ids, g->min_id, g->max_id) < 0) {
+            /* out of memory: it is answered with an error */
+            sel->rect->failed = 1;
+            sel->r0 = sel->c0 = g->n;
+            sel->r1 = sel->c1 = -1;
+            continue;
+        }
+        sel->r0 = cell_of(g->min_lat, g->cell_lat, g->n, sel->lat1, &out);
+        sel->r1 = cell_of(g->min_lat, g->cell_lat, g->n, sel->lat2, &out);
+        sel->c0 = cell_of(g->min_lng, g->cell_lng, g->n, sel->lng1, &out);
+        sel->c1 = cell_of(g->min_lng, g->cell_lng, g->n, sel->lng2, &out);
+        if (sel->r0 < rmin)
+            rmin = sel->r0;
+        if (sel->r1 > rmax)
+            rmax = sel->r1;
+    }
+
+    for (row = rmin; row <= rmax; row++) {
+        double lo = cell_edge(g->min_lat, g->cell_lat, row);
+        double hi = cell_edge(g->min_lat, g->cell_lat, row + 1);
+        int cmin = g->n, cmax = -1, nlive = 0;
+
+        /* the rects in this row, each with whether it spans the row */
+        for (i = 0; i < s->nsel; i++) {
+            struct scan_sel *sel = &s->sel[i];
+            if (row < sel->r0 || row > sel->r1)
+                continue;
+            s->live[nlive++] = i;
+            if (sel->c0 < cmin)
+                cmin = sel->c0;
+            if (sel->c1 > cmax)
+                cmax = sel->c1;
+        }
+        for (col = cmin; col <= cmax; col++) {
+            struct grid_cell *c = &g->cells[row * g->n + col];
+            double left = cell_edge(g->min_lng, g->cell_lng, col);
+            double right = cell_edge(g->min_lng, g->cell_lng, col + 1);
+            int npart = 0, j;
+
+            for (j = 0; j < nlive; j++) {
+                struct scan_sel *sel = &s->sel[s->live[j]];
+                if (col < sel->c0 || col > sel->c1)
+                    continue;
+                if (!c->spilled && sel->lat1 <= lo && hi <= sel->lat2 &&
+                    sel->lng1 <= left && right <= sel->lng2) {
+                    /* wholly inside, take the whole bitmap */
+                    for (p = 0; p < c->nblocks; p++)
+                        sel->ids.words[c->blocks[p].blk - sel->ids.lo] |=
+                            c->blocks[p].bits;
+                } else {
+                    s->part[npart++] = s->live[j];
+                }
+            }
+            if (!npart)
+                continue;
+            /* on the edge of these rects, check each point against them */
+            for (p = 0; p < c->npts; p++) {
+                float lat = c->lat[p], lng = c->lng[p];
+                for (j = 0; j < npart; j++) {
+                    struct scan_sel *sel = &s->sel[s->part[j]];
+                    if (lat >= sel->lat1 && lat <= sel->lat2 &&
+                        lng >= sel->lng1 && lng <= sel->lng2)
+                        scan_ids_set(&sel->ids, c->id[p]);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,56 @@
+/* Fixed grid spatial index over the trip points, for report1. Each cell
+   has a bitmap of the trip ids that passed through it and the points
+   themselves for the cells a rect only partly covers. See grid.c. */
+
+#include <stdint.h>
+
+/* 64 trip ids starting at blk * 64 */
+struct grid_block
+{
+    int64_t blk;
+    uint64_t bits;
+};
+
+struct grid_cell
+{
+    /* trip id bitmap, only the non empty blocks, sorted by blk */
+    struct grid_block *blocks;
+    unsigned long nblocks;
+    unsigned long capblocks;
+
+    /* every point in the cell */
+    float *lat;
+    float *lng;
+    int64_t *id;
+    unsigned long npts;
+    unsigned long cappts;
+
+    int spilled;                /* has points from outside of the area */
+};
+
+struct grid
+{
+    int n;                      /* cells per side */
+    double min_lat, max_lat, min_lng, max_lng;
+    double cell_lat, cell_lng;
+    int64_t min_id, max_id;
+    struct grid_cell *cells;    /* n * n, row (lat) major */
+
+    unsigned long points;
+    unsigned long blocks;
+};
+
+struct grid *grid_create(int n, double min_lat, double max_lat,
+                         double min_lng, double max_lng);
+void grid_destroy(struct grid *g);
+
+int grid_add(struct grid *g, int64_t id, float lng, float lat);
+
+unsigned long grid_bytes(struct grid *g);
+
+/* -1 if out of memory */
+long grid_report1(struct grid *g, double lat1, double lat2, double lng1,
+                  double lng2);
+
+struct scan;
+void grid_report1_scan(struct grid *g, struct scan *s);
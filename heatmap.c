@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sqlite3.h"
+#include "trips.h"
+#include "heatmap.h"
+
+/*
+   The ops UI painted its density map with a report1 per cell, hundreds
+   of queries that each went over the same points again. "heatmap" does
+   the whole map in one request:
+
+     heatmap lat1 lat2 long1 long2 rows cols [from [to]]
+
+   and answers with the points in each of the rows x cols cells of the
+   bbox and the distinct trips that have a point in each (from and to
+   are times like report3 takes, and bound the points that count).
+
+   It goes over the trips' points (trips.c, --trajectories) rather than
+   triplog or the grid. A trip's points are together there, so a cell
+   counts a trip the first time one of its points lands in it, which
+   takes the last trip counted in each cell rather than a bitmap of the
+   ids per cell. A page of trips whose points' times are all outside of
+   the window is passed over whole (see trips_heatmap()), then so is a
+   trip that ended before from or began after to, and a chunk of its
+   points whose times are all outside of it. store_lock is let go between
+   the pages, so the map isn't of one instant: a point that comes in
+   meanwhile counts if its trip's page is still ahead.
+
+   heatmap_add() bins a chunk's points HEATMAP_BATCH at a time. They are
+   copied out into an array of lats and one of longs, NAN for the points
+   outside of the window and for the rest of the batch. The loop that
+   works out each point's cell (or -1 outside of the bbox) then goes over
+   a whole batch of plain floats with no branches, which the compiler
+   vectorizes at -O2 where it wouldn't over the points themselves. A
+   last loop adds up the cells. A point on lat2 or long2 goes in the last
+   row or column.
+*/
+
+/* points binned at a time */
+#define HEATMAP_BATCH 16
+
+struct heatmap *
+heatmap_create(int rows, int cols, double lat1, double lat2,
+               double lng1, double lng2, uint32_t from, uint32_t to)
+{
+    struct heatmap *h = (struct heatmap *)calloc(1, sizeof(*h));
+    unsigned long cells = (unsigned long)rows * cols;
+
+    if (!h)
+        return NULL;
+    h->rows = rows;
+    h->cols = cols;
+    h->lat1 = lat1;
+    h->lat2 = lat2;
+    h->lng1 = lng1;
+    h->lng2 = lng2;
+    h->lat_scale = lat2 > lat1 ? rows / (lat2 - lat1) : 0;
+    h->lng_scale = lng2 > lng1 ? cols / (lng2 - lng1) : 0;
+    h->from = from;
+    h->to = to;
+    h->points = (uint32_t *)calloc(cells, sizeof(*h->points));
+    h->trips = (uint32_t *)calloc(cells, sizeof(*h->trips));
+    h->last = (int64_t *)calloc(cells, sizeof(*h->last));
+    if (!h->points || !h->trips || !h->last) {
+        heatmap_destroy(h);
+        return NULL;
+    }
+    return h;
+}
+
+void
+heatmap_destroy(struct heatmap *h)
+{
+    free(h->points);
+    free(h->trips);
+    free(h->last);
+    free(h);
+}
+
+/* Add run points in cell b (if it is one) for trip id */
+static inline void
+add_run(struct heatmap *h, int64_t id, int b, uint32_t run)
+{
+    if (b < 0)
+        return;
+    h->points[b] += run;
+    if (h->last[b] != id) {
+        h->last[b] = id;
+        h->trips[b]++;
+    }
+}
+
+/* Count n of trip id's points */
+void
+heatmap_add(struct heatmap *h, int64_t id, const struct traj_point *pts,
+            uint32_t n)
+{
+    float lat[HEATMAP_BATCH], lng[HEATMAP_BATCH];
+    int bins[HEATMAP_BATCH];
+    float lat1 = h->lat1, lat2 = h->lat2, lng1 = h->lng1, lng2 = h->lng2;
+    float lat_scale = h->lat_scale, lng_scale = h->lng_scale;
+    float last_row = h->rows - 1, last_col = h->cols - 1;
+    int cols = h->cols;
+    int whole, prev = -1;
+    uint32_t start, i, m, run = 0;
+
+    if (!n || pts[n - 1].t < h->from || pts[0].t > h->to)
+        return;
+    whole = pts[0].t >= h->from && pts[n - 1].t <= h->to;
+    for (start = 0; start < n; start += m) {
+        const struct traj_point *p = pts + start;
+        m = n - start < HEATMAP_BATCH ? n - start : HEATMAP_BATCH;
+
+        /* a point outside of the window, and the rest of the batch, is
+           NAN, which is outside of the bbox */
+        for (i = 0; i < m; i++) {
+            lat[i] = p[i].lat;
+            lng[i] = p[i].lng;
+            if (!whole && (p[i].t < h->from || p[i].t > h->to))
+                lat[i] = NAN;
+        }
+        for (; i < HEATMAP_BATCH; i++) {
+            lat[i] = NAN;
+            lng[i] = 0;
+        }
+
+        for (i = 0; i < HEATMAP_BATCH; i++) {
+            float row = (lat[i] - lat1) * lat_scale;
+            float col = (lng[i] - lng1) * lng_scale;
+            int in = (lat[i] >= lat1) & (lat[i] <= lat2) &
+                     (lng[i] >= lng1) & (lng[i] <= lng2);
+            /* clamped before the conversion, for the points outside */
+            row = row > 0 ? row : 0;
+            row = row < last_row ? row : last_row;
+            col = col > 0 ? col : 0;
+            col = col < last_col ? col : last_col;
+            bins[i] = in ? (int)row * cols + (int)col : -1;
+        }
+
+        /* a trip's next point is mostly in the same cell as the one
+           before it */
+        for (i = 0; i < m; i++) {
+            if (bins[i] == prev) {
+                run++;
+                continue;
+            }
+            add_run(h, id, prev, run);
+            prev = bins[i];
+            run = 1;
+        }
+    }
+    add_run(h, id, prev, run);
+}
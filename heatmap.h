@@ -0,0 +1,29 @@
+/* "heatmap": the points and the distinct trips in each cell of a grid
+   over a bbox, in one pass over the trips' points. See heatmap.c. Needs
+   trips.h (struct traj_point) included first. */
+
+#include <stdint.h>
+
+/* most cells per side */
+#define HEATMAP_MAX_SIDE 1024
+
+struct heatmap
+{
+    int rows, cols;             /* rows over lat, cols over long */
+    float lat1, lat2, lng1, lng2;
+    float lat_scale, lng_scale; /* cells per degree */
+    uint32_t from, to;          /* the time window, inclusive */
+
+    /* rows * cols, row (lat) major from lat1 */
+    uint32_t *points;
+    uint32_t *trips;
+    int64_t *last;              /* the last trip counted in each cell */
+};
+
+struct heatmap *heatmap_create(int rows, int cols, double lat1, double lat2,
+                               double lng1, double lng2, uint32_t from,
+                               uint32_t to);
+void heatmap_destroy(struct heatmap *h);
+
+void heatmap_add(struct heatmap *h, int64_t id, const struct traj_point *pts,
+                 uint32_t n);
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "sqls.h"
+#include "hll.h"
+#include "checkpoint.h"
+#include "cells.h"
+
+/*
+   report1 and report2 have to count distinct trip ids, and doing that
+   exactly costs at least one bit per trip touched by the rect. Our
+   dashboards can live with about 1% error, so these answer them from
+   HyperLogLog sketches instead.
+
+   The area is cut into a coarse n x n grid (tripstore --hll, 16 by
+   default) and every cell gets two sketches, one of all the trips with a
+   point in the cell and one of the trips that began or ended there, plus
+   the sum of the fares that ended there. Sketches are unions of register
+   maxima, so a rect is answered by taking the byte wise max of the cells
+   it covers and estimating from that. That is at most n * n * 16KB of
+   work no matter how many rows the rect covers.
+
+   The rect is rounded to whole cells: a cell is taken if its centre is
+   inside the rect. The rounded rect is returned with the answer, since
+   the sketch can't say anything about part of a cell. Points outside of
+   the area are counted in the nearest border cell, so a rounded rect
+   that takes in a border cell is open (inf) on that side.
+
+   The error bound returned is two standard errors (1.04 / sqrt(m) each),
+   so the true count for the rounded rect is inside it about 95% of the
+   time.
+*/
+
+/* 2^-rank for every rank a register can hold, filled in once by the
+   first hll_create() */
+static double pow2[64 - HLL_P + 2];
+static pthread_once_t pow2_once = PTHREAD_ONCE_INIT;
+
+static void
+fill_pow2()
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(pow2) / sizeof(*pow2)); i++)
+        pow2[i] = ldexp(1.0, -i);
+}
+
+struct hll_grid *
+hll_create(int n, double min_lat, double max_lat,
+           double min_lng, double max_lng)
+{
+    struct hll_grid *h = (struct hll_grid *)malloc(sizeof(*h));
+
+    pthread_once(&pow2_once, fill_pow2);
+    memset(h, 0, sizeof(*h));
+    h->n = n;
+    h->min_lat = min_lat;
+    h->max_lat = max_lat;
+    h->min_lng = min_lng;
+    h->max_lng = max_lng;
+    h->cell_lat = (max_lat - min_lat) / n;
+    h->cell_lng = (max_lng - min_lng) / n;
+    h->cells = (struct hll_cell *)calloc(n * n, sizeof(*h->cells));
+    if (!h->cells) {
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+void
+hll_destroy(struct hll_grid *h)
+{
+    int i;
+    for (i = 0; i < h->n * h->n; i++) {
+        ckpt_free(h->cells[i].trips);
+        ckpt_free(h->cells[i].ends);
+    }
+    ckpt_free(h->cells);
+    free(h);
+}
+
+/* splitmix64, so that the dense trip ids spread over the registers */
+static inline uint64_t
+hash_id(int64_t id)
+{
+    uint64_t z = (uint64_t)id + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Add id to the sketch at *regs, making it on first use */
+static int
+sketch_add(struct hll_grid *h, uint8_t **regs, int64_t id)
+{
+    uint64_t x = hash_id(id);
+    unsigned idx = x >> (64 - HLL_P);
+    /* the guard bit keeps the rank in range when the rest is all 0 */
+    uint8_t rank = __builtin_clzll((x << HLL_P) | (1ULL << (HLL_P - 1))) + 1;
+
+    if (!*regs) {
+        *regs = (uint8_t *)calloc(HLL_M, 1);
+        if (!*regs)
+            return -1;
+        h->sketches++;
+    }
+    if (rank > (*regs)[idx])
+        (*regs)[idx] = rank;
+    return 0;
+}
+
+/* Add one trip point */
+int
+hll_add(struct hll_grid *h, int64_t id, float lng, float lat, int type,
+        int cents)
+{
+    int out;
+    int row = cell_of(h->min_lat, h->cell_lat, h->n, lat, &out);
+    int col = cell_of(h->min_lng, h->cell_lng, h->n, lng, &out);
+    struct hll_cell *c = &h->cells[row * h->n + col];
+
+    if (sketch_add(h, &c->trips, id) < 0)
+        goto fail;
+    if (type == TRANSIT)
+        return 0;
+    if (sketch_add(h, &c->ends, id) < 0)
+        goto fail;
+    if (type == END) {
+        c->fares += cents;
+        c->nends++;
+    }
+    return 0;
+fail:
+    fprintf(stderr, "hll: out of memory at %lu sketches\n", h->sketches);
+    return -1;
+}
+
+unsigned long
+hll_bytes(struct hll_grid *h)
+{
+    return h->n * h->n * sizeof(*h->cells) + h->sketches * HLL_M;
+}
+
+/* The rows (or columns) whose centres are inside [v1, v2]. If there are
+   none, the one v1 and v2 are centred on. The bounds are clamped before
+   the conversion to int, like cell_of() does. */
+static void
+round_to_cells(double min, double step, int n, double v1, double v2,
+               int *i0, int *i1)
+{
+    double x0 = ceil((v1 - min) / step - 0.5);
+    double x1 = floor((v2 - min) / step - 0.5);
+    int out;
+
+    *i0 = x0 > 0 ? (x0 < n ? (int)x0 : n) : 0;
+    *i1 = x1 < n - 1 ? (x1 > -1 ? (int)x1 : -1) : n - 1;
+    if (*i0 > *i1)
+        *i0 = *i1 = cell_of(min, step, n, (v1 + v2) / 2, &out);
+}
+
+static double
+estimate(const uint8_t *regs)
+{
+    double alpha = 0.7213 / (1 + 1.079 / HLL_M);
+    double sum = 0;
+    double e;
+    int zeros = 0;
+    int i;
+
+    for (i = 0; i < HLL_M; i++) {
+        sum += pow2[regs[i]];
+        zeros += regs[i] == 0;
+    }
+    e = alpha * HLL_M * HLL_M / sum;
+    /* linear counting does better while many registers are still empty */
+    if (e <= 2.5 * HLL_M && zeros)
+        e = HLL_M * log((double)HLL_M / zeros);
+    return e;
+}
+
+/* report1 or report2, approximately. lat1 <= lat2 and lng1 <= lng2. */
+void
+hll_report(struct hll_grid *h, int report, double lat1, double lat2,
+           double lng1, double lng2, struct hll_answer *ans)
+{
+    uint8_t regs[HLL_M];
+    int r0, r1, c0, c1, row, col, i;
+
+    memset(regs, 0, sizeof(regs));
+    memset(ans, 0, sizeof(*ans));
+    round_to_cells(h->min_lat, h->cell_lat, h->n, lat1, lat2, &r0, &r1);
+    round_to_cells(h->min_lng, h->cell_lng, h->n, lng1, lng2, &c0, &c1);
+
+    for (row = r0; row <= r1; row++) {
+        for (col = c0; col <= c1; col++) {
+            struct hll_cell *c = &h->cells[row * h->n + col];
+            const uint8_t *s = report == 1 ? c->trips : c->ends;
+            if (!s)
+                continue;
+            for (i = 0; i < HLL_M; i++)
+                regs[i] = s[i] > regs[i] ? s[i] : regs[i];
+            ans->fares += c->fares;
+            ans->nends += c->nends;
+        }
+    }
+
+    ans->estimate = estimate(regs);
+    ans->bound = 2 * 1.04 / sqrt(HLL_M) * ans->estimate;
+    ans->lat1 = r0 == 0 ? -INFINITY : h->min_lat + r0 * h->cell_lat;
+    ans->lat2 = r1 == h->n - 1 ? INFINITY : h->min_lat + (r1 + 1) * h->cell_lat;
+    ans->lng1 = c0 == 0 ? -INFINITY : h->min_lng + c0 * h->cell_lng;
+    ans->lng2 = c1 == h->n - 1 ? INFINITY : h->min_lng + (c1 + 1) * h->cell_lng;
+}
@@ -0,0 +1,49 @@
+/* HyperLogLog sketches of the trip ids per cell of a coarse grid over the
+   area, for the approximate "report1~" and "report2~" queries. See hll.c. */
+
+#include <stdint.h>
+
+/* 2^HLL_P one byte registers per sketch, about 0.8% standard error */
+#define HLL_P 14
+#define HLL_M (1 << HLL_P)
+
+struct hll_cell
+{
+    uint8_t *trips;             /* every trip with a point in the cell */
+    uint8_t *ends;              /* trips with a BEGIN or END in the cell */
+    long long fares;            /* fares of the ENDs in the cell */
+    unsigned long nends;
+};
+
+struct hll_grid
+{
+    int n;                      /* cells per side */
+    double min_lat, max_lat, min_lng, max_lng;
+    double cell_lat, cell_lng;
+    struct hll_cell *cells;     /* n * n, row (lat) major */
+    unsigned long sketches;
+};
+
+/* What an approximate report answered: the estimate, its error bound and
+   the rect it actually covers, which is the asked for rect rounded to
+   the cells. */
+struct hll_answer
+{
+    double estimate;
+    double bound;
+    long long fares;
+    unsigned long nends;
+    double lat1, lat2, lng1, lng2;
+};
+
+struct hll_grid *hll_create(int n, double min_lat, double max_lat,
+                            double min_lng, double max_lng);
+void hll_destroy(struct hll_grid *h);
+
+int hll_add(struct hll_grid *h, int64_t id, float lng, float lat, int type,
+            int cents);
+
+unsigned long hll_bytes(struct hll_grid *h);
+
+void hll_report(struct hll_grid *h, int report, double lat1, double lat2,
+                double lng1, double lng2, struct hll_answer *ans);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include "msgs.h"
 
 #define MSG_HDR_SIZE (sizeof(int) * 2)
@@ -8,6 +9,17 @@
    The message format:
 
    message size (int), messag type (int), <optional fields>
+
+   Trip ids are 64 bit on the wire.
+
+   MSG_UPDATE_BATCH is count (int) followed by count (id, long, lat)
+   tuples, so a generator running many trips sends one frame per tick.
+
+   Instead of a MSG_BEGIN / MSG_ID round trip per trip, a generator can
+   lease a block of ids with MSG_LEASE_REQ (count). The server answers with
+   MSG_LEASE (first id, count) and the generator then starts trips on its
+   own with MSG_BEGIN_ID (id, long, lat), taking the ids in increasing
+   order.
 */
 
 /* Helper functions */
@@ -54,7 +66,7 @@ add_lng_lat(char *p, float lng, float lat)
 
 /* messages commonly have id,  lat, long - use this helper */
 char *
-add_id_lng_lat(char *p, int id, float lng, float lat)
+add_id_lng_lat(char *p, int64_t id, float lng, float lat)
 {
     memcpy(p, &id, sizeof(id));
     p += sizeof(id);
@@ -89,38 +101,43 @@ send_begin_msg(int s, float lng, float lat)
     return 0;
 }
 
-/* after sending the begin, generator waits for the trip id to be assigned */
+/* Read all data - handles short reads */
 int
-recv_trip_id(int s)
+full_recv(int s, char *buf, int size)
 {
-    char buf[MSG_HDR_SIZE + sizeof(int)];
-    int got;
     int x = 0;
-    int size = MSG_HDR_SIZE + sizeof(int);
-
+    int got;
     got = read(s, buf, size);
     while (got > 0) {
         x += got;
         if (x == size)
-            break;
+            return 0;
         got = read(s, buf + x, size - x);
     }
+    return -1;
+}
 
-    if (x == size) {
-        char * p = buf + MSG_HDR_SIZE;
-        return *(int *)p;
-    }
-    return 0;
+/* after sending the begin, generator waits for the trip id to be assigned */
+int64_t
+recv_trip_id(int s)
+{
+    char buf[MSG_HDR_SIZE + sizeof(int64_t)];
+    int64_t id;
+
+    if (-1 == full_recv(s, buf, sizeof(buf)))
+        return 0;
+    memcpy(&id, buf + MSG_HDR_SIZE, sizeof(id));
+    return id;
 }
 
 /* the server replies with the allocated trip id */
 int
-send_trip_id(int s, int id)
+send_trip_id(int s, int64_t id)
 {
     char buf[MSG_HDR_SIZE + sizeof(id)];
     char * p = buf;
     
-    p = msg_hdr(p, sizeof(int), MSG_ID);
+    p = msg_hdr(p, sizeof(id), MSG_ID);
     memcpy(p, &id, sizeof(id));
     p += sizeof(id);
 
@@ -129,9 +146,69 @@ send_trip_id(int s, int id)
     return 0;
 }
 
+/* generator asks for a block of count trip ids */
+int
+send_lease_req(int s, int count)
+{
+    char buf[MSG_HDR_SIZE + sizeof(count)];
+    char *p = buf;
+
+    p = msg_hdr(p, sizeof(count), MSG_LEASE_REQ);
+    p = add_cents(p, count);
+
+    if (-1 == full_send(s, buf, p - buf))
+        return -1;
+    return 0;
+}
+
+/* the server replies with the block: first id and how many */
+int
+send_lease(int s, int64_t first, int count)
+{
+    char buf[MSG_HDR_SIZE + sizeof(first) + sizeof(count)];
+    char *p = buf;
+
+    p = msg_hdr(p, sizeof(first) + sizeof(count), MSG_LEASE);
+    memcpy(p, &first, sizeof(first));
+    p += sizeof(first);
+    p = add_cents(p, count);
+
+    if (-1 == full_send(s, buf, p - buf))
+        return -1;
+    return 0;
+}
+
+/* generator reads the reply to its send_lease_req() */
+int
+recv_lease(int s, int64_t *first, int *count)
+{
+    char buf[MSG_HDR_SIZE + sizeof(*first) + sizeof(*count)];
+
+    if (-1 == full_recv(s, buf, sizeof(buf)))
+        return -1;
+    memcpy(first, buf + MSG_HDR_SIZE, sizeof(*first));
+    memcpy(count, buf + MSG_HDR_SIZE + sizeof(*first), sizeof(*count));
+    return 0;
+}
+
+/* begin message for a trip id the generator holds a lease on */
+int
+send_begin_id_msg(int s, int64_t id, float lng, float lat)
+{
+    char buf[MSG_HDR_SIZE + sizeof(id) + 2 * sizeof(float)];
+    char *p = buf;
+
+    p = msg_hdr(p, sizeof(id) + sizeof(float) * 2, MSG_BEGIN_ID);
+    p = add_id_lng_lat(p, id, lng, lat);
+
+    if (-1 == full_send(s, buf, p - buf))
+        return -1;
+    return 0;
+}
+
 /* generator sends these for each 1 second update */
 int
-send_update_msg(int s, int id, float lng, float lat)
+send_update_msg(int s, int64_t id, float lng, float lat)
 {
     char buf[MSG_HDR_SIZE + sizeof(id) + sizeof(float) * 2];
     char *p = buf;
@@ -146,12 +223,12 @@ send_update_msg(int s, int id, float lng, float lat)
 
 /* generator sends this when the trip is complete */
 int
-send_end_msg(int s, int id, float lng, float lat, int cents)
+send_end_msg(int s, int64_t id, float lng, float lat, int cents)
 {
-    char buf[MSG_HDR_SIZE * sizeof(int) * 2 + sizeof(float) * 2];
+    char buf[MSG_HDR_SIZE + sizeof(id) + sizeof(int) + sizeof(float) * 2];
     char *p = buf;
 
-    p = msg_hdr(p, sizeof(int) * 2 + sizeof(float) * 2, MSG_END);
+    p = msg_hdr(p, sizeof(id) + sizeof(int) + sizeof(float) * 2, MSG_END);
     p = add_id_lng_lat(p, id, lng, lat);
     p = add_cents(p, cents);
 
@@ -160,31 +237,83 @@ send_end_msg(int s, int id, float lng, float lat, int cents)
     return 0;
 }
 
-/* server (stripsore) utility function to parse out the message fields */
+/* generator sends this for each 1 second tick when it multiplexes trips */
+int
+send_update_batch_msg(int s, int count, const int64_t *ids,
+                      const float *lngs, const float *lats)
+{
+    char buf[MAX_FRAME_SIZE];
+    char *p = buf;
+    int i;
+
+    if (count > MAX_BATCH_UPDATES)
+        return -1;
+
+    p = msg_hdr(p, sizeof(count) + count * MSG_BATCH_TUPLE_SIZE,
+                MSG_UPDATE_BATCH);
+    p = add_cents(p, count);
+    for (i = 0; i < count; i++)
+        p = add_id_lng_lat(p, ids[i], lngs[i], lats[i]);
+
+    if (-1 == full_send(s, buf, p - buf))
+        return -1;
+    return 0;
+}
+
+/* The size of a message of type, with its fields, or 0 for one the
+   server isn't sent. A batch's tuples come on top of this. */
+static int
+msg_size(int type)
+{
+    switch (type) {
+        case MSG_BEGIN:
+            return MSG_HDR_SIZE + 2 * sizeof(float);
+        case MSG_UPDATE:
+        case MSG_BEGIN_ID:
+            return MSG_HDR_SIZE + sizeof(int64_t) + 2 * sizeof(float);
+        case MSG_END:
+            return MSG_HDR_SIZE + sizeof(int64_t) + 2 * sizeof(float) +
+                   sizeof(int);
+        case MSG_UPDATE_BATCH:
+        case MSG_LEASE_REQ:
+            return MSG_HDR_SIZE + sizeof(int);
+    }
+    return 0;
+}
+
+/* server (stripsore) utility function to parse out the message fields.
+   A frame too short for its type's fields is an error. */
 int
 parse_msg(char *buf, int size,
-          enum MSG_TYPE *t, int *id, float *lng, float *lat, int *cents)
+          enum MSG_TYPE *t, int64_t *id, float *lng, float *lat, int *cents)
 {
     char *oldp;
     char *p = buf;
+    int count;
+    int type;
+
+    if (size < (int)MSG_HDR_SIZE)
+        return -1;
     /* Skip the size marker */
     p += sizeof(int);
 
-    int type;
     memcpy(&type, p, sizeof(type));
     p += sizeof(type);
     *t = type;
+    if (!msg_size(type) || size < msg_size(type))
+        return -1;
 
     switch (type) {
         case MSG_END:
             oldp = p;
-            p += sizeof(int) + 2 * sizeof(float);
+            p += sizeof(int64_t) + 2 * sizeof(float);
             memcpy(cents, p, sizeof(int));
             p = oldp;
             /* fall through */
         case MSG_UPDATE:
-            memcpy(id, p, sizeof(int));
-            p += sizeof(int);
+        case MSG_BEGIN_ID:
+            memcpy(id, p, sizeof(int64_t));
+            p += sizeof(int64_t);
             /* fall through */
         case MSG_BEGIN:
             memcpy(lng, p, sizeof(float));
@@ -193,6 +322,25 @@ parse_msg(char *buf, int size,
             p += sizeof(float);
             break;
 
+        /* For a batch we only hand back the count in id. The tuples are
+           read straight out of buf with batch_update_at(). */
+        case MSG_UPDATE_BATCH:
+            memcpy(&count, p, sizeof(int));
+            if (count < 0 || count > MAX_BATCH_UPDATES ||
+                MSG_HDR_SIZE + sizeof(int) + count * MSG_BATCH_TUPLE_SIZE >
+                    (size_t)size)
+                return -1;
+            *id = count;
+            break;
+
+        /* the count asked for also comes back in id */
+        case MSG_LEASE_REQ:
+            memcpy(&count, p, sizeof(int));
+            if (count <= 0 || count > MAX_LEASE_IDS)
+                return -1;
+            *id = count;
+            break;
+
         default:
             return -1;
     }
@@ -200,3 +348,16 @@ parse_msg(char *buf, int size,
     return 0;
 }
 
+/* Read the i'th tuple of a MSG_UPDATE_BATCH frame in place */
+void
+batch_update_at(const char *buf, int i, int64_t *id, float *lng, float *lat)
+{
+    const char *p = buf + MSG_HDR_SIZE + sizeof(int) +
+                    i * MSG_BATCH_TUPLE_SIZE;
+    memcpy(id, p, sizeof(int64_t));
+    p += sizeof(int64_t);
+    memcpy(lng, p, sizeof(float));
+    p += sizeof(float);
+    memcpy(lat, p, sizeof(float));
+}
+
@@ -1,12 +1,34 @@
 /* This is the general messaging interface. Both tripgen and tripstore utilize
    these. See the .c files for more description */
-enum MSG_TYPE {MSG_BEGIN, MSG_ID, MSG_UPDATE, MSG_END};
+#include <stdint.h>
+
+enum MSG_TYPE {MSG_BEGIN, MSG_ID, MSG_UPDATE, MSG_END, MSG_UPDATE_BATCH,
+               MSG_LEASE_REQ, MSG_LEASE, MSG_BEGIN_ID};
+
+/* MSG_UPDATE_BATCH carries up to this many (id, long, lat) updates */
+#define MAX_BATCH_UPDATES 256
+#define MSG_BATCH_TUPLE_SIZE (sizeof(int64_t) + 2 * sizeof(float))
+#define MAX_FRAME_SIZE (sizeof(int) * 3 + \
+                        MAX_BATCH_UPDATES * MSG_BATCH_TUPLE_SIZE)
+
+/* MSG_LEASE_REQ asks for at most this many trip ids at once */
+#define MAX_LEASE_IDS 65536
 
 int send_begin_msg(int s, float lng, float lat);
-int send_update_msg(int s, int id, float lng, float lat);
-int send_end_msg(int s, int id, float lng, float lat, int cents);
+int send_begin_id_msg(int s, int64_t id, float lng, float lat);
+int send_update_msg(int s, int64_t id, float lng, float lat);
+int send_end_msg(int s, int64_t id, float lng, float lat, int cents);
+int send_update_batch_msg(int s, int count, const int64_t *ids,
+                          const float *lngs, const float *lats);
 int parse_msg(char *buf, int size,
-              enum MSG_TYPE *t, int *id, float *lng, float *lat, int *cents);
+              enum MSG_TYPE *t, int64_t *id, float *lng, float *lat,
+              int *cents);
+void batch_update_at(const char *buf, int i,
+                     int64_t *id, float *lng, float *lat);
+
+int send_trip_id(int s, int64_t id);
+int64_t recv_trip_id(int s);
 
-int send_trip_id(int s, int id);
-int recv_trip_id(int s);
+int send_lease_req(int s, int count);
+int send_lease(int s, int64_t first, int count);
+int recv_lease(int s, int64_t *first, int *count);
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include "stats.h"
+#include "outbuf.h"
+
+/*
+   Answers used to be written to the query socket as they were made, a
+   write() for each column, each space between them and each newline, on
+   a blocking socket. An export of a million rows was tens of millions of
+   syscalls, and a client that read slowly held up whoever was writing to
+   it: the event loop, or a worker with store_lock.
+
+   Now query sockets are non-blocking and everything an answer writes is
+   copied into the connection's outbuf, a list of OUTBUF_CHUNK chunks.
+   Once a chunk's worth is buffered, and at the end of each query, the
+   producer writes what it has with one writev(). What the socket doesn't
+   take stays buffered and the event loop writes it when the socket says
+   EPOLLOUT (outbuf_drain()). Query sockets are edge triggered, so EPOLLOUT
+   only comes when a full socket gets room.
+
+   A producer that is --out-kb ahead of the client waits: query workers
+   in outbuf_wait(), at a point where they hold nothing the rest of the
+   server needs, and the event loop itself (with no workers) in poll() in
+   outbuf_write(), which is how it always waited for slow clients. Once
+   a write fails the client is gone, and the rest of the answer is
+   dropped as it comes.
+
+   The event loop waits with store_lock held and nothing else running,
+   so a client that stops reading would hang the whole server. It only
+   gets OUTBUF_INLINE_MS of waiting over an answer; after that it is
+   treated as gone. Big answers for slow clients need query workers.
+   A worker holds nothing else, but it is one of -W, so a few clients
+   that stop reading would still take the whole query port. It waits for
+   as long as the client keeps taking some of the answer, and once it has
+   taken none of it for OUTBUF_WORKER_MS the client is gone too.
+*/
+
+#define OUTBUF_CHUNK 65536
+
+/* chunks per writev() */
+#define OUTBUF_IOV 64
+
+/* ms the event loop waits on a client over one answer, all told */
+#define OUTBUF_INLINE_MS 1000
+
+/* ms a query worker waits on a client that takes none of its answer */
+#define OUTBUF_WORKER_MS 5000
+
+static unsigned long
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+struct outbuf *
+outbuf_create(int fd, int efd, void *data, unsigned long cap,
+              int inline_wait, struct outbuf_stats *stats)
+{
+    struct outbuf *out = (struct outbuf *)calloc(1, sizeof(*out));
+
+    if (!out)
+        return NULL;
+    out->fd = fd;
+    out->efd = efd;
+    out->data = data;
+    out->cap = cap;
+    out->inline_wait = inline_wait;
+    out->stats = stats;
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_cond_init(&out->room, NULL);
+    return out;
+}
+
+/* Throw away what is buffered. Under out->lock. */
+static void
+drop(struct outbuf *out)
+{
+    while (out->head) {
+        struct outbuf_chunk *c = out->head;
+        out->head = c->next;
+        free(c);
+    }
+    out->tail = NULL;
+    __sync_fetch_and_sub(&out->stats->buffered, out->bytes);
+    out->bytes = 0;
+}
+
+void
+outbuf_destroy(struct outbuf *out)
+{
+    drop(out);
+    free(out->spare);
+    pthread_mutex_destroy(&out->lock);
+    pthread_cond_destroy(&out->room);
+    free(out);
+}
+
+/* The client is gone. Under out->lock. */
+static void
+fail(struct outbuf *out)
+{
+    if (out->bytes)
+        __sync_fetch_and_add(&out->stats->failed, 1);
+    out->failed = 1;
+    drop(out);
+    pthread_cond_broadcast(&out->room);
+}
+
+/* n bytes from the front were written */
+static void
+consume(struct outbuf *out, unsigned long n)
+{
+    out->bytes -= n;
+    __sync_fetch_and_sub(&out->stats->buffered, n);
+    while (n) {
+        struct outbuf_chunk *c = out->head;
+        int left = c->len - c->start;
+        if (n < (unsigned long)left) {
+            c->start += n;
+            return;
+        }
+        n -= left;
+        out->head = c->next;
+        if (!out->head)
+            out->tail = NULL;
+        if (!out->spare)
+            out->spare = c;
+        else
+            free(c);
+    }
+}
+
+/* Write what the socket will take. Under out->lock. */
+static void
+write_out(struct outbuf *out)
+{
+    while (out->head && !out->failed) {
+        struct iovec iov[OUTBUF_IOV];
+        struct outbuf_chunk *c;
+        ssize_t x;
+        int n = 0;
+
+        for (c = out->head; c && n < OUTBUF_IOV; c = c->next, n++) {
+            iov[n].iov_base = c->data + c->start;
+            iov[n].iov_len = c->len - c->start;
+        }
+        x = writev(out->fd, iov, n);
+        __sync_fetch_and_add(&out->stats->writes, 1);
+        if (x < 0 && errno == EINTR)
+            continue;
+        if (x < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* the event loop takes it from here */
+            out->blocked = 1;
+            __sync_fetch_and_add(&out->stats->blocked, 1);
+            return;
+        }
+        if (x < 0) {
+            fail(out);
+            return;
+        }
+        __sync_fetch_and_add(&out->stats->bytes, x);
+        consume(out, x);
+    }
+}
+
+/* Add len bytes of buf to the answer. Returns 1 if out is at the cap and
+   the producer should outbuf_wait(), and -1 if the client is gone. */
+int
+outbuf_write(struct outbuf *out, const void *buf, int len)
+{
+    const char *p = (const char *)buf;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    if (out->failed) {
+        pthread_mutex_unlock(&out->lock);
+        return -1;
+    }
+    out->bytes += len;
+    __sync_fetch_and_add(&out->stats->buffered, len);
+    if (out->bytes > out->stats->max_buffered)
+        out->stats->max_buffered = out->bytes;
+    while (len) {
+        struct outbuf_chunk *c = out->tail;
+        int n;
+        if (!c || c->len == OUTBUF_CHUNK) {
+            c = out->spare;
+            out->spare = NULL;
+            if (!c)
+                c = (struct outbuf_chunk *)malloc(sizeof(*c) + OUTBUF_CHUNK);
+            if (!c) {
+                fprintf(stderr, "outbuf: out of memory\n");
+                fail(out);
+                pthread_mutex_unlock(&out->lock);
+                return -1;
+            }
+            c->next = NULL;
+            c->start = c->len = 0;
+            if (out->tail)
+                out->tail->next = c;
+            else
+                out->head = c;
+            out->tail = c;
+        }
+        n = OUTBUF_CHUNK - c->len;
+        if (n > len)
+            n = len;
+        memcpy(c->data + c->len, p, n);
+        c->len += n;
+        p += n;
+        len -= n;
+    }
+
+    if (out->bytes >= OUTBUF_CHUNK && !out->blocked)
+        write_out(out);
+    if (out->inline_wait && out->bytes >= out->cap) {
+        __sync_fetch_and_add(&out->stats->waits, 1);
+        while (out->bytes >= out->cap && !out->failed) {
+            struct pollfd pfd = {out->fd, POLLOUT, 0};
+            unsigned long t;
+            if (out->waited_ms >= OUTBUF_INLINE_MS) {
+                __sync_fetch_and_add(&out->stats->timeouts, 1);
+                fail(out);
+                break;
+            }
+            pthread_mutex_unlock(&out->lock);
+            t = now_ms();
+            poll(&pfd, 1, OUTBUF_INLINE_MS - out->waited_ms);
+            out->waited_ms += now_ms() - t;
+            pthread_mutex_lock(&out->lock);
+            out->blocked = 0;
+            write_out(out);
+        }
+    }
+    ret = out->failed ? -1 : out->bytes >= out->cap;
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+/* The end of an answer: write what the socket takes now. Returns -1 if
+   the client is gone. */
+int
+outbuf_flush(struct outbuf *out)
+{
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    if (!out->blocked)
+        write_out(out);
+    out->waited_ms = 0;
+    ret = out->failed ? -1 : 0;
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+/* OUTBUF_WORKER_MS from now, for pthread_cond_timedwait() */
+static void
+worker_due(struct timespec *due)
+{
+    clock_gettime(CLOCK_REALTIME, due);
+    due->tv_nsec += OUTBUF_WORKER_MS % 1000 * 1000000L;
+    due->tv_sec += OUTBUF_WORKER_MS / 1000 + due->tv_nsec / 1000000000L;
+    due->tv_nsec %= 1000000000L;
+}
+
+/* Bytes of the answer the client hasn't got yet: ours, and what the
+   socket holds that it hasn't acked. Under out->lock. */
+static unsigned long
+unread(struct outbuf *out)
+{
+    int queued = 0;
+
+    if (ioctl(out->fd, SIOCOUTQ, &queued) < 0)
+        queued = 0;
+    return out->bytes + queued;
+}
+
+/* For query workers: wait until out is under the cap. Returns -1 if the
+   client is gone, or stopped reading. */
+int
+outbuf_wait(struct outbuf *out)
+{
+    struct timespec due;
+    unsigned long left;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    if (out->bytes >= out->cap && !out->blocked)
+        write_out(out);
+    if (out->bytes >= out->cap && !out->failed) {
+        __sync_fetch_and_add(&out->stats->waits, 1);
+        left = unread(out);
+        worker_due(&due);
+        while (out->bytes >= out->cap && !out->failed) {
+            if (pthread_cond_timedwait(&out->room, &out->lock, &due) !=
+                ETIMEDOUT)
+                continue;
+            /* The socket only says it has room once a good part of its
+               buffer is free, which can take a slow reader a while, so
+               look at what the client itself got. */
+            if (unread(out) < left) {
+                write_out(out);
+                left = unread(out);
+                worker_due(&due);
+                continue;
+            }
+            __sync_fetch_and_add(&out->stats->timeouts, 1);
+            fail(out);
+        }
+    }
+    ret = out->failed ? -1 : 0;
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+/* For the event loop, on any event for the socket: write what it will
+   take. Returns 1 when nothing is left to write, also when the client is
+   gone. */
+int
+outbuf_drain(struct outbuf *out)
+{
+    int done;
+
+    pthread_mutex_lock(&out->lock);
+    out->blocked = 0;
+    write_out(out);
+    if (out->bytes < out->cap)
+        pthread_cond_broadcast(&out->room);
+    done = !out->head;
+    pthread_mutex_unlock(&out->lock);
+    return done;
+}
+
+/* Have the event loop look at the socket again, from another thread */
+void
+outbuf_kick(struct outbuf *out)
+{
+    struct epoll_event evt;
+
+    evt.events = OUTBUF_EVENTS;
+    evt.data.ptr = out->data;
+    epoll_ctl(out->efd, EPOLL_CTL_MOD, out->fd, &evt);
+}
@@ -0,0 +1,50 @@
+/* Output buffers for query connections: answers are put together here and
+   go out with writev() as the socket takes them, the rest when the event
+   loop gets EPOLLOUT. See outbuf.c. Needs stats.h (struct outbuf_stats)
+   included first. */
+
+#include <pthread.h>
+#include <sys/epoll.h>
+
+/* what query sockets are registered for. Edge triggered, so that a
+   worker can ring the event loop with EPOLL_CTL_MOD (outbuf_kick()). */
+#define OUTBUF_EVENTS (EPOLLIN | EPOLLOUT | EPOLLET)
+
+struct outbuf_chunk
+{
+    struct outbuf_chunk *next;
+    int start;                  /* written up to here */
+    int len;
+    char data[];
+};
+
+struct outbuf
+{
+    int fd;
+    int efd;                    /* the event loop's epoll, and the */
+    void *data;                 /* fd's epoll_event data there */
+    unsigned long cap;          /* --out-kb */
+    int inline_wait;            /* filled by the event loop itself, which
+                                   waits in poll() at the cap */
+    unsigned long waited_ms;    /* by it, over this answer */
+    struct outbuf_stats *stats;
+
+    /* lock covers the rest. Producers wait on room at the cap. */
+    pthread_mutex_t lock;
+    pthread_cond_t room;
+    struct outbuf_chunk *head, *tail, *spare;
+    unsigned long bytes;        /* not written yet */
+    int blocked;                /* the socket is full, until EPOLLOUT */
+    int failed;                 /* the client is gone; what comes is dropped */
+};
+
+struct outbuf *outbuf_create(int fd, int efd, void *data, unsigned long cap,
+                             int inline_wait, struct outbuf_stats *stats);
+void outbuf_destroy(struct outbuf *out);
+
+int outbuf_write(struct outbuf *out, const void *buf, int len);
+int outbuf_flush(struct outbuf *out);
+int outbuf_wait(struct outbuf *out);
+
+int outbuf_drain(struct outbuf *out);
+void outbuf_kick(struct outbuf *out);
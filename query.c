@@ -0,0 +1,668 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "sqlite3.h"
+#include "sqls.h"
+#include "stats.h"
+#include "scan.h"
+#include "segment.h"
+#include "trips.h"
+#include "query.h"
+#include "outbuf.h"
+#include "reply.h"
+#include "bufpool.h"
+#include "ctx.h"
+
+/*
+   Queries used to run on the first reactor, under store_lock, so one
+   big ad-hoc SELECT stopped that reactor's generator sockets and, once
+   the event queue filled up behind the writer, everybody's. Now the
+   reactor only cuts the query port's input into lines and queues them
+   here, and a pool of worker threads (--query-workers) runs them.
+
+   The reports, trip, stats and the like are answered from the store's
+   own structures, which the writer changes under store_lock, so the
+   workers still take it for those. They are short.
+
+   Ad-hoc sql is what can run for seconds, and each worker runs it on
+   its own sqlite connection without store_lock. With workers the
+   segments are shared-cache in-memory databases (see attach_segment()
+   in sqls.c), which the workers attach too, with read_uncommitted so
+   that the writer's open batch doesn't lock them out. Before each query
+   a worker attaches the segments that are new since its last one,
+   detaches the ones retention dropped (their memory goes once the last
+   connection lets go) and remakes its triplog view. tripsummary reads
+   the trip records under their own lock (see trips.c).
+
+   The workers' connections are only for reading: they have query_only
+   set, and run_sql() turns away a statement that sqlite says writes.
+   sqlite counts a PRAGMA that turns query_only back off, ATTACH, DETACH
+   and BEGIN as reading, so the authorizer turns those away in clients'
+   sql too. They would let a client write, pull segments out from under
+   sync_segments(), or hold the segments' tables open across queries.
+
+   sqlite serializes the connections of a shared cache a step at a time:
+   a worker's step holds the mutex of each segment database its
+   statement reads, and the writer waits for it to insert into one of
+   them. A query that hands back rows takes short steps. An aggregate
+   over the segment the writer is in (say COUNT(*) over triplog) is one
+   long step, and ingest still waits that long.
+
+   A snapshot fork()s, and the child reads the segments through the
+   same mutexes (and allocates through sqlite's), so none may be held by
+   a worker at that instant. Workers go into sqlite a step at a time,
+   with the row put into the reply before they come back out and wait
+   for the client, and query_pool_pause() waits for them to be out and
+   keeps them out until query_pool_resume(). So a snapshot waits for one step
+   of a long query, not all of it.
+
+   A connection's queries are answered in order: it is on the run queue
+   while it has any, and goes back on the end after each one so that
+   one client's pile of queries can't keep out everybody else's. A
+   worker only flushes the outbuf when the connection has no more queries
+   waiting, so a client that pipelines gets its answers in few writes.
+
+   Answers go to the connection's outbuf, and the event loop writes what
+   the socket doesn't take at once. A worker only waits for a slow
+   client once it is --out-kb ahead of it, between rows or after a
+   query, and never with store_lock or inside of sqlite. The event loop
+   frees the connection once the client is done sending and has its
+   answers; a worker that still has its queries then kicks the socket
+   when it is done with them (outbuf_kick()), for the event loop to
+   look again.
+*/
+
+/* how often an idle worker lets go of dropped segments */
+#define IDLE_SECS 1
+
+static unsigned long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* Workers */
+
+/* The authorizer of a worker's connection. In a client's sql it turns
+   away what would get around query_only (see the top of this file). */
+static int
+authorize(void *arg, int action, const char *a1, const char *a2,
+          const char *db, const char *trigger)
+{
+    struct query_worker *w = (struct query_worker *)arg;
+
+    (void)db;
+    (void)trigger;
+    if (!w->client_sql)
+        return SQLITE_OK;
+    switch (action) {
+    case SQLITE_ATTACH:
+    case SQLITE_DETACH:
+    case SQLITE_TRANSACTION:
+    case SQLITE_SAVEPOINT:
+        return SQLITE_DENY;
+    case SQLITE_PRAGMA:
+        if (a2 && (strcasecmp(a1, "query_only") == 0 ||
+                   strcasecmp(a1, "read_uncommitted") == 0))
+            return SQLITE_DENY;
+        return SQLITE_OK;
+    default:
+        return SQLITE_OK;
+    }
+}
+
+static int
+open_worker_db(struct query_worker *w)
+{
+    struct tripstore_context *ctx = w->pool->ctx;
+
+    if (sqlite3_open_v2(":memory:", &w->db, SQLITE_OPEN_READWRITE |
+                        SQLITE_OPEN_CREATE | SQLITE_OPEN_URI,
+                        NULL) != SQLITE_OK ||
+        sqlite3_exec(w->db, "PRAGMA read_uncommitted = 1;", NULL, NULL,
+                     NULL) != SQLITE_OK) {
+        fprintf(stderr, "query: can't open worker %d's database: %s\n",
+                w->id, sqlite3_errmsg(w->db));
+        return -1;
+    }
+    w->first_seq = 1;
+    w->last_seq = 0;
+    if (trips_create_module(w->db, ctx->trips) < 0)
+        return -1;
+    if (sqlite3_exec(w->db, "PRAGMA query_only = 1;", NULL, NULL,
+                     NULL) != SQLITE_OK ||
+        sqlite3_set_authorizer(w->db, authorize, w) != SQLITE_OK) {
+        fprintf(stderr, "query: can't make worker %d's database read "
+                "only: %s\n", w->id, sqlite3_errmsg(w->db));
+        return -1;
+    }
+    return 0;
+}
+
+/* Make w's attached segments the ones ctx has now. Under store_lock, so
+   the writer isn't changing them. */
+static void
+sync_segments(struct query_worker *w, unsigned long *attached,
+              unsigned long *detached)
+{
+    struct tripstore_context *ctx = w->pool->ctx;
+    struct segments *s = ctx->segments;
+    unsigned long first = s->segs[0]->seq;
+    unsigned long last = s->segs[s->n - 1]->seq;
+    unsigned long seq;
+    char sql[64];
+
+    if (first == w->first_seq && last == w->last_seq)
+        return;
+    for (seq = w->first_seq; seq <= w->last_seq; seq++) {
+        if (seq >= first && seq <= last)
+            continue;
+        snprintf(sql, sizeof(sql), "DETACH seg%lu;", seq);
+        sqlite3_exec(w->db, sql, NULL, NULL, NULL);
+        (*detached)++;
+    }
+    for (seq = first; seq <= last; seq++) {
+        if (seq >= w->first_seq && seq <= w->last_seq)
+            continue;
+        /* what we have stays [first, seq), and the next query retries */
+        if (attach_segment(ctx, w->db, seq) < 0)
+            break;
+        (*attached)++;
+    }
+    w->first_seq = first;
+    w->last_seq = seq - 1;
+    /* the view is in temp, which query_only covers too */
+    sqlite3_exec(w->db, "PRAGMA query_only = 0;", NULL, NULL, NULL);
+    update_segment_views(ctx, w->db);
+    sqlite3_exec(w->db, "PRAGMA query_only = 1;", NULL, NULL, NULL);
+}
+
+/* Into sqlite, unless a snapshot is about to fork */
+static void
+enter_sql(struct query_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->paused)
+        pthread_cond_wait(&p->resumed, &p->lock);
+    p->sql_running++;
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void
+leave_sql(struct query_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    if (--p->sql_running == 0 && p->paused)
+        pthread_cond_signal(&p->idle);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Bring w's segments up to date, for ad-hoc sql or to let go of dropped
+   ones when idle */
+static void
+refresh(struct query_worker *w)
+{
+    struct query_pool *p = w->pool;
+    struct tripstore_context *ctx = p->ctx;
+    unsigned long attached = 0, detached = 0;
+
+    enter_sql(p);
+    pthread_mutex_lock(&ctx->store_lock);
+    sync_segments(w, &attached, &detached);
+    pthread_mutex_unlock(&ctx->store_lock);
+    leave_sql(p);
+
+    if (attached || detached) {
+        pthread_mutex_lock(&p->lock);
+        p->stats.attached += attached;
+        p->stats.detached += detached;
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/* Ad-hoc sql on w's connection, a statement and a step at a time. It
+   stops once the client is gone, or at a statement that would write. */
+static void
+run_sql(struct query_worker *w, const char *q, struct reply *r)
+{
+    struct query_pool *p = w->pool;
+    const char *tail = q;
+    char *err = NULL;
+    int rc = SQLITE_OK, gone = 0;
+
+    while (*tail && rc == SQLITE_OK && !gone) {
+        sqlite3_stmt *stmt = NULL;
+        int full = 0;
+
+        enter_sql(p);
+        w->client_sql = 1;
+        rc = sqlite3_prepare_v2(w->db, tail, -1, &stmt, &tail);
+        w->client_sql = 0;
+        leave_sql(p);
+        if (rc != SQLITE_OK || !stmt)
+            break;
+        if (!sqlite3_stmt_readonly(stmt)) {
+            enter_sql(p);
+            sqlite3_finalize(stmt);
+            leave_sql(p);
+            reply_error(r, "ad-hoc sql can only read");
+            return;
+        }
+        do {
+            enter_sql(p);
+            rc = sqlite3_step(stmt);
+            if (rc == SQLITE_ROW)
+                full = reply_sql_row(r, stmt);
+            leave_sql(p);
+            if (full > 0)
+                full = outbuf_wait(r->out);
+            gone = full < 0;
+        } while (rc == SQLITE_ROW && !gone);
+        enter_sql(p);
+        rc = sqlite3_finalize(stmt);
+        leave_sql(p);
+    }
+    if (rc != SQLITE_OK) {
+        enter_sql(p);
+        err = strdup(sqlite3_errmsg(w->db));
+        leave_sql(p);
+        reply_error(r, err ? err : "out of memory");
+    }
+    free(err);
+}
+
+static void
+run_query(struct query_worker *w, struct query_conn *c, struct query_job *job)
+{
+    struct query_pool *p = w->pool;
+    struct tripstore_context *ctx = p->ctx;
+
+    reply_begin(c->reply, job->id);
+    if (w->db && query_is_sql(ctx, job->q)) {
+        refresh(w);
+        run_sql(w, job->q, c->reply);
+        pthread_mutex_lock(&p->lock);
+        p->stats.sql++;
+        pthread_mutex_unlock(&p->lock);
+    } else {
+        pthread_mutex_lock(&ctx->store_lock);
+        exec_query_tofd(job->q, ctx, c->reply);
+        pthread_mutex_unlock(&ctx->store_lock);
+    }
+    reply_end(c->reply);
+}
+
+static void
+free_jobs(struct query_conn *c)
+{
+    while (c->head) {
+        struct query_job *job = c->head;
+        c->head = job->next;
+        free(job->q);
+        free(job);
+    }
+    c->tail = NULL;
+}
+
+/* Put c on the end of the run queue. Under p->lock. */
+static void
+enqueue(struct query_pool *p, struct query_conn *c)
+{
+    c->next = NULL;
+    if (p->tail)
+        p->tail->next = c;
+    else
+        p->head = c;
+    p->tail = c;
+}
+
+/* Take c's next job for w and, if it is a report, the reports right
+   behind it. Under the pool's lock. */
+static void
+take_jobs(struct query_worker *w, struct query_conn *c)
+{
+    struct query_job *job;
+
+    do {
+        job = c->head;
+        c->head = job->next;
+        if (!c->head)
+            c->tail = NULL;
+        w->jobs[w->njobs] = job;
+        w->conns[w->njobs++] = c;
+    } while (job->rect.report && c->head && c->head->rect.report &&
+             w->njobs < SCAN_MAX_RECTS);
+}
+
+/* w has taken the first of c's jobs. If it is a report, also take the
+   reports at the front of the other connections on the run queue, for
+   them all to share a scan. Under p->lock. */
+static void
+take_reports(struct query_pool *p, struct query_worker *w)
+{
+    struct query_conn *c = p->head;
+
+    if (!w->jobs[0]->rect.report)
+        return;
+    p->head = p->tail = NULL;
+    while (c) {
+        struct query_conn *next = c->next;
+        if (c->head->rect.report && w->njobs < SCAN_MAX_RECTS)
+            take_jobs(w, c);
+        else
+            enqueue(p, c);
+        c = next;
+    }
+}
+
+/* w's jobs are reports: answer them from one scan */
+static void
+run_reports(struct query_worker *w)
+{
+    struct tripstore_context *ctx = w->pool->ctx;
+    int i;
+
+    scan_reset(w->scan);
+    for (i = 0; i < w->njobs; i++)
+        scan_add(w->scan, &w->jobs[i]->rect);
+    pthread_mutex_lock(&ctx->store_lock);
+    run_scan(ctx, w->scan);
+    pthread_mutex_unlock(&ctx->store_lock);
+    for (i = 0; i < w->njobs; i++) {
+        struct reply *r = w->conns[i]->reply;
+        reply_begin(r, w->jobs[i]->id);
+        scan_rect_reply(&w->jobs[i]->rect, r);
+        reply_end(r);
+    }
+}
+
+static void *
+run_worker(void *arg)
+{
+    struct query_worker *w = (struct query_worker *)arg;
+    struct query_pool *p = w->pool;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        struct query_conn *c = p->head;
+        unsigned long start, took;
+        int i;
+
+        if (!c) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += IDLE_SECS;
+            if (pthread_cond_timedwait(&p->wake, &p->lock,
+                                       &ts) == ETIMEDOUT && w->db) {
+                pthread_mutex_unlock(&p->lock);
+                refresh(w);
+                pthread_mutex_lock(&p->lock);
+            }
+            continue;
+        }
+        p->head = c->next;
+        if (!p->head)
+            p->tail = NULL;
+        w->njobs = 0;
+        take_jobs(w, c);
+        take_reports(p, w);
+
+        start = now_us();
+        for (i = 0; i < w->njobs; i++) {
+            took = start - w->jobs[i]->queued_us;
+            p->stats.waiting--;
+            p->stats.wait_us_total += took;
+            if (took > p->stats.wait_us_max)
+                p->stats.wait_us_max = took;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        if (w->jobs[0]->rect.report)
+            run_reports(w);
+        else
+            run_query(w, c, w->jobs[0]);
+        for (i = 0; i < w->njobs; i++) {
+            free(w->jobs[i]->q);
+            free(w->jobs[i]);
+        }
+
+        /* the answers are all out, or at most --out-kb of them are left
+           for the event loop. With more queries waiting they go out with
+           the next ones'. A connection's jobs are next to each other in
+           conns. */
+        for (i = 0; i < w->njobs; i++) {
+            int more;
+            c = w->conns[i];
+            if (i && c == w->conns[i - 1])
+                continue;
+            pthread_mutex_lock(&p->lock);
+            more = c->head != NULL;
+            pthread_mutex_unlock(&p->lock);
+            if (more || outbuf_flush(c->reply->out) == 0)
+                outbuf_wait(c->reply->out);
+        }
+
+        took = now_us() - start;
+        pthread_mutex_lock(&p->lock);
+        p->stats.queries += w->njobs;
+        p->stats.run_us_total += took * w->njobs;
+        if (took > p->stats.run_us_max)
+            p->stats.run_us_max = took;
+        for (i = 0; i < w->njobs; i++) {
+            c = w->conns[i];
+            if (i && c == w->conns[i - 1])
+                continue;
+            if (c->head) {
+                enqueue(p, c);
+                pthread_cond_signal(&p->wake);
+            } else {
+                c->queued = 0;
+                if (c->closed)
+                    outbuf_kick(c->reply->out);
+            }
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* The pool */
+
+struct query_pool *
+query_pool_create(struct tripstore_context *ctx, int nworkers)
+{
+    struct query_pool *p = (struct query_pool *)calloc(1, sizeof(*p));
+    int i;
+
+    if (!p)
+        return NULL;
+    p->ctx = ctx;
+    p->nworkers = nworkers;
+    p->workers = (struct query_worker *)calloc(nworkers, sizeof(*p->workers));
+    if (!p->workers) {
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->resumed, NULL);
+    pthread_cond_init(&p->idle, NULL);
+
+    /* The connections are opened here, before the snapshot thread could
+       fork while one is half made */
+    for (i = 0; i < nworkers; i++) {
+        struct query_worker *w = &p->workers[i];
+        w->pool = p;
+        w->id = i;
+        if (!(w->scan = scan_create())) {
+            query_pool_destroy(p);
+            return NULL;
+        }
+        if (ctx->engine == ENGINE_SQLITE && open_worker_db(w) < 0) {
+            query_pool_destroy(p);
+            return NULL;
+        }
+    }
+    return p;
+}
+
+int
+query_pool_start(struct query_pool *p)
+{
+    int i;
+
+    for (i = 0; i < p->nworkers; i++) {
+        if (pthread_create(&p->workers[i].thread, NULL, run_worker,
+                           &p->workers[i]) != 0) {
+            fprintf(stderr, "query: can't start worker %d\n", i);
+            p->nworkers = i;
+            return -1;
+        }
+    }
+    p->started = 1;
+    return 0;
+}
+
+/* Waits for the queries that are running, and drops the rest. The
+   connections are the event loop's. */
+void
+query_pool_destroy(struct query_pool *p)
+{
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    p->paused = 0;
+    pthread_cond_broadcast(&p->wake);
+    pthread_cond_broadcast(&p->resumed);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; p->started && i < p->nworkers; i++)
+        pthread_join(p->workers[i].thread, NULL);
+    for (i = 0; i < p->nworkers; i++) {
+        if (p->workers[i].db)
+            sqlite3_close(p->workers[i].db);
+        if (p->workers[i].scan)
+            scan_destroy(p->workers[i].scan);
+    }
+    while (p->head) {
+        struct query_conn *c = p->head;
+        p->head = c->next;
+        free_jobs(c);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    pthread_cond_destroy(&p->resumed);
+    pthread_cond_destroy(&p->idle);
+    free(p->workers);
+    free(p);
+}
+
+/* Connections */
+
+struct query_conn *
+query_conn_create(struct reply *r)
+{
+    struct query_conn *c = (struct query_conn *)calloc(1, sizeof(*c));
+
+    if (c)
+        c->reply = r;
+    return c;
+}
+
+/* Queue query q (which the pool frees) on c, to be answered as request
+   id */
+void
+query_submit(struct query_pool *p, struct query_conn *c, char *q,
+             uint32_t id)
+{
+    struct query_job *job = (struct query_job *)malloc(sizeof(*job));
+
+    if (!job) {
+        free(q);
+        return;
+    }
+    job->next = NULL;
+    job->q = q;
+    job->id = id;
+    job->queued_us = now_us();
+    report_rect(q, &job->rect);
+
+    pthread_mutex_lock(&p->lock);
+    if (c->tail)
+        c->tail->next = job;
+    else
+        c->head = job;
+    c->tail = job;
+    if (++p->stats.waiting > p->stats.max_waiting)
+        p->stats.max_waiting = p->stats.waiting;
+    if (!c->queued) {
+        c->queued = 1;
+        enqueue(p, c);
+        p->unwoken++;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Wake the workers for the queries submitted since the last time. The
+   event loop calls this once it has submitted a tick's worth, so that
+   the reports among them are there together for a worker to take. */
+void
+query_pool_wake(struct query_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    if (p->unwoken) {
+        if (p->unwoken == 1)
+            pthread_cond_signal(&p->wake);
+        else
+            pthread_cond_broadcast(&p->wake);
+        p->unwoken = 0;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* The event loop wants to free c. Frees it and returns 0 unless a worker
+   still has queries of c's to answer. Then returns -1, and the worker
+   kicks c's socket once it has answered them, for the event loop to try
+   again. */
+int
+query_conn_close(struct query_pool *p, struct query_conn *c)
+{
+    int busy;
+
+    pthread_mutex_lock(&p->lock);
+    busy = c->queued;
+    if (busy)
+        c->closed = 1;
+    else
+        free(c);
+    pthread_mutex_unlock(&p->lock);
+    return busy ? -1 : 0;
+}
+
+/* Snapshots */
+
+/* Wait for the workers to be out of sqlite, and keep them out */
+void
+query_pool_pause(struct query_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->paused = 1;
+    p->stats.pauses++;
+    while (p->sql_running)
+        pthread_cond_wait(&p->idle, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void
+query_pool_resume(struct query_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->paused = 0;
+    pthread_cond_broadcast(&p->resumed);
+    pthread_mutex_unlock(&p->lock);
+}
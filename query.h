@@ -0,0 +1,88 @@
+/* The query workers (tripstore --query-workers): queries from the query
+   port run on these threads rather than on the event loop, ad-hoc sql on
+   each worker's own sqlite connection. See query.c. Needs stats.h
+   (struct query_stats) and scan.h included first. */
+
+#include <pthread.h>
+#include <stdint.h>
+
+struct tripstore_context;
+struct sqlite3;
+struct reply;
+
+/* A query waiting for a worker */
+struct query_job
+{
+    struct query_job *next;
+    char *q;
+    uint32_t id;                /* the request's, with the binary protocol */
+    unsigned long queued_us;
+    struct scan_rect rect;      /* report1s and report2s, for a scan */
+};
+
+/* A query port connection. Its queries are answered in the order they
+   came in, one at a time, so it is on the run queue (or with a worker)
+   while it has any. The event loop owns it, and its socket, reply and
+   outbuf. */
+struct query_conn
+{
+    struct reply *reply;
+    struct query_job *head, *tail;
+    int queued;                 /* on the run queue, or being run */
+    int closed;                 /* the event loop wants to free it */
+    struct query_conn *next;    /* on the run queue */
+};
+
+struct query_worker
+{
+    struct query_pool *pool;
+    int id;
+    pthread_t thread;
+    struct sqlite3 *db;         /* NULL with --engine columnar */
+    unsigned long first_seq;    /* the segments it has attached, */
+    unsigned long last_seq;     /* none while first_seq > last_seq */
+    int client_sql;             /* preparing a client's sql, for the
+                                   authorizer */
+
+    /* the jobs it is running, more than one when they are reports that
+       share a scan, and their connections */
+    struct query_job *jobs[SCAN_MAX_RECTS];
+    struct query_conn *conns[SCAN_MAX_RECTS];
+    int njobs;
+    struct scan *scan;
+};
+
+struct query_pool
+{
+    struct tripstore_context *ctx;
+    int nworkers;
+    struct query_worker *workers;
+
+    /* lock covers the run queue, sql_running, paused, stop and stats */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        /* for the workers: queries came in */
+    pthread_cond_t resumed;     /* for the workers: not paused any more */
+    pthread_cond_t idle;        /* for query_pool_pause() */
+    struct query_conn *head, *tail;
+    int sql_running;            /* workers inside of sqlite */
+    int unwoken;                /* connections queued since query_pool_wake() */
+    int paused;
+    int stop;
+    int started;
+
+    struct query_stats stats;
+};
+
+struct query_pool *query_pool_create(struct tripstore_context *ctx,
+                                     int nworkers);
+int query_pool_start(struct query_pool *p);
+void query_pool_destroy(struct query_pool *p);
+
+struct query_conn *query_conn_create(struct reply *r);
+void query_submit(struct query_pool *p, struct query_conn *c, char *q,
+                  uint32_t id);
+int query_conn_close(struct query_pool *p, struct query_conn *c);
+void query_pool_wake(struct query_pool *p);
+
+void query_pool_pause(struct query_pool *p);
+void query_pool_resume(struct query_pool *p);
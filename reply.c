@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sqlite3.h"
+#include "stats.h"
+#include "outbuf.h"
+#include "reply.h"
+
+/*
+   The query port only spoke text: a query a line, and its answer as rows
+   of space separated values, numbers printed by us or by sqlite and read
+   back by the client. Answers could only be matched up to queries by
+   order.
+
+   A connection that starts with REPLY_MAGIC speaks the binary protocol
+   instead. Integers are little-endian, as on the hosts we run on. A
+   request is
+
+       size (uint32, of what follows), id (uint32), query text
+
+   with the same queries as the text protocol, and as many of them may be
+   sent at once as the client likes. The answers come back in the order
+   the requests were sent, each as one or more frames
+
+       size (uint32, of what follows), id (uint32), status (uint8),
+       last (uint8), ncols (uint16), nrows (uint32), the columns
+
+   status 0 has the rows, nrows of them, in ncols columns of
+
+       type (uint8: 0 all NULL, 1 int64, 2 double, 3 text),
+       has_nulls (uint8), then a bit a row, set for NULL, if has_nulls,
+       then nrows int64s or doubles, or nrows uint32 lengths and the text
+
+   and status 1 is an error, ncols and nrows 0 and then the message. The
+   last frame of an answer has last set. A column keeps its type within a
+   frame; a value of another type, like an integer in a column of REAL,
+   starts a new frame. Big answers go out REPLY_BLOCK_ROWS rows (or
+   REPLY_BLOCK_BYTES) a frame.
+
+   The answers are built the same way for both: a value at a time
+   (reply_int(), reply_text(), ...) and then reply_row(). As text each row
+   is one line, formatted as it always was; numbers from sqlite are in
+   sqlite's text.
+*/
+
+#define REPLY_BLOCK_ROWS 4096
+#define REPLY_BLOCK_BYTES (256 * 1024)
+
+/* the fixed part of a response frame, after its size */
+#define REPLY_HDR_SIZE (4 + 1 + 1 + 2 + 4)
+
+static int
+buf_add(struct reply_buf *b, const void *p, int n)
+{
+    if (b->len + n > b->cap) {
+        int cap = b->cap ? b->cap : 256;
+        char *q;
+        while (cap < b->len + n)
+            cap *= 2;
+        q = (char *)realloc(b->p, cap);
+        if (!q)
+            return -1;
+        b->p = q;
+        b->cap = cap;
+    }
+    memcpy(b->p + b->len, p, n);
+    b->len += n;
+    return 0;
+}
+
+static int
+buf_zero(struct reply_buf *b, int n)
+{
+    static const char zeros[64];
+
+    while (n > 0) {
+        int k = n < (int)sizeof(zeros) ? n : (int)sizeof(zeros);
+        if (buf_add(b, zeros, k) < 0)
+            return -1;
+        n -= k;
+    }
+    return 0;
+}
+
+struct reply *
+reply_create(struct outbuf *out, int proto)
+{
+    struct reply *r = (struct reply *)calloc(1, sizeof(*r));
+
+    if (r) {
+        r->out = out;
+        r->proto = proto;
+    }
+    return r;
+}
+
+void
+reply_destroy(struct reply *r)
+{
+    int i;
+
+    for (i = 0; i < r->cols_cap; i++) {
+        free(r->cols[i].nulls.p);
+        free(r->cols[i].data.p);
+        free(r->cols[i].text.p);
+    }
+    free(r->cols);
+    free(r->row);
+    free(r->row_text.p);
+    free(r->line.p);
+    free(r);
+}
+
+static void
+clear_block(struct reply *r)
+{
+    int i;
+
+    for (i = 0; i < r->ncols; i++) {
+        struct reply_col *c = &r->cols[i];
+        c->type = REPLY_NULL;
+        c->has_nulls = 0;
+        c->nulls.len = c->data.len = c->text.len = 0;
+    }
+    r->ncols = 0;
+    r->nrows = 0;
+    r->bytes = 0;
+}
+
+static void
+clear_row(struct reply *r)
+{
+    r->ncol = 0;
+    r->line.len = 0;
+    r->row_text.len = 0;
+}
+
+void
+reply_begin(struct reply *r, uint32_t id)
+{
+    r->id = id;
+    r->failed = 0;
+    r->errored = 0;
+    clear_row(r);
+    clear_block(r);
+}
+
+/* Write a frame header. Returns what outbuf_write() does. */
+static int
+write_hdr(struct reply *r, uint32_t size, int status, int last, int ncols,
+          uint32_t nrows)
+{
+    char hdr[4 + REPLY_HDR_SIZE];
+    uint16_t nc = ncols;
+    char *p = hdr;
+
+    memcpy(p, &size, 4);
+    memcpy(p + 4, &r->id, 4);
+    p[8] = status;
+    p[9] = last;
+    memcpy(p + 10, &nc, 2);
+    memcpy(p + 12, &nrows, 4);
+    return outbuf_write(r->out, hdr, sizeof(hdr));
+}
+
+/* outbuf_write(), keeping in *ret the worst of what it says */
+static void
+put(struct reply *r, const void *p, int n, int *ret)
+{
+    int x;
+
+    if (*ret < 0 || !n)
+        return;
+    x = outbuf_write(r->out, p, n);
+    if (x < 0 || x > *ret)
+        *ret = x;
+}
+
+/* Send the block as a frame. Returns 1 if the outbuf is at its cap, -1
+   if the client is gone. */
+static int
+send_block(struct reply *r, int last)
+{
+    uint32_t size = REPLY_HDR_SIZE;
+    int nullbytes = (r->nrows + 7) / 8;
+    int i, ret;
+
+    for (i = 0; i < r->ncols; i++) {
+        struct reply_col *c = &r->cols[i];
+        size += 2 + (c->has_nulls ? nullbytes : 0) + c->data.len +
+                c->text.len;
+    }
+    ret = write_hdr(r, size, 0, last, r->ncols, r->nrows);
+    for (i = 0; i < r->ncols; i++) {
+        struct reply_col *c = &r->cols[i];
+        char ch[2] = {c->type, c->has_nulls};
+        put(r, ch, 2, &ret);
+        if (c->has_nulls)
+            put(r, c->nulls.p, nullbytes, &ret);
+        put(r, c->data.p, c->data.len, &ret);
+        put(r, c->text.p, c->text.len, &ret);
+    }
+    clear_block(r);
+    return ret;
+}
+
+/* The answer is done */
+int
+reply_end(struct reply *r)
+{
+    int ret = 0;
+
+    if (r->proto == REPLY_BINARY && !r->errored && !r->failed)
+        ret = send_block(r, 1);
+    return r->failed ? -1 : ret;
+}
+
+/* Values of the row being built */
+
+static struct reply_val *
+next_val(struct reply *r)
+{
+    if (r->ncol == r->row_cap) {
+        int cap = r->row_cap ? r->row_cap * 2 : 16;
+        struct reply_val *v = (struct reply_val *)
+                              realloc(r->row, cap * sizeof(*v));
+        if (!v) {
+            r->failed = 1;
+            return NULL;
+        }
+        r->row = v;
+        r->row_cap = cap;
+    }
+    return &r->row[r->ncol++];
+}
+
+/* As text, the space before every value but the first */
+static void
+add_text(struct reply *r, const char *s, int len)
+{
+    if ((r->ncol++ && buf_add(&r->line, " ", 1) < 0) ||
+        buf_add(&r->line, s, len) < 0)
+        r->failed = 1;
+}
+
+void
+reply_int(struct reply *r, int64_t v)
+{
+    struct reply_val *val;
+
+    if (r->proto == REPLY_TEXT) {
+        char s[32];
+        add_text(r, s, snprintf(s, sizeof(s), "%lld", (long long)v));
+    } else if ((val = next_val(r))) {
+        val->type = REPLY_INT64;
+        val->i = v;
+    }
+}
+
+/* prec is the digits after the point as text */
+void
+reply_double(struct reply *r, double v, int prec)
+{
+    struct reply_val *val;
+
+    if (r->proto == REPLY_TEXT) {
+        char s[64];
+        int n = snprintf(s, sizeof(s), "%.*f", prec, v);
+        add_text(r, s, n < (int)sizeof(s) ? n : (int)sizeof(s) - 1);
+    } else if ((val = next_val(r))) {
+        val->type = REPLY_DOUBLE;
+        val->d = v;
+    }
+}
+
+void
+reply_text(struct reply *r, const char *s, int len)
+{
+    struct reply_val *val;
+
+    if (r->proto == REPLY_TEXT) {
+        add_text(r, s, len);
+    } else if ((val = next_val(r))) {
+        val->type = REPLY_TEXT_COL;
+        val->off = r->row_text.len;
+        val->len = len;
+        if (buf_add(&r->row_text, s, len) < 0)
+            r->failed = 1;
+    }
+}
+
+void
+reply_str(struct reply *r, const char *s)
+{
+    reply_text(r, s, strlen(s));
+}
+
+void
+reply_null(struct reply *r)
+{
+    struct reply_val *val;
+
+    if (r->proto == REPLY_TEXT)
+        add_text(r, "NULL", 4);
+    else if ((val = next_val(r)))
+        val->type = REPLY_NULL;
+}
+
+/* Would the row go in the block as it is? */
+static int
+row_fits(struct reply *r)
+{
+    int i;
+
+    if (!r->nrows)
+        return 1;
+    if (r->ncol != r->ncols || r->nrows == REPLY_BLOCK_ROWS ||
+        r->bytes >= REPLY_BLOCK_BYTES)
+        return 0;
+    for (i = 0; i < r->ncol; i++) {
+        int t = r->row[i].type, ct = r->cols[i].type;
+        if (t != REPLY_NULL && ct != REPLY_NULL && t != ct)
+            return 0;
+    }
+    return 1;
+}
+
+/* Add the row's values to the columns of the block */
+static int
+add_row(struct reply *r)
+{
+    int i, row = r->nrows;
+
+    if (!r->nrows) {
+        if (r->ncol > r->cols_cap) {
+            struct reply_col *c = (struct reply_col *)
+                                  realloc(r->cols, r->ncol * sizeof(*c));
+            if (!c)
+                return -1;
+            memset(c + r->cols_cap, 0,
+                   (r->ncol - r->cols_cap) * sizeof(*c));
+            r->cols = c;
+            r->cols_cap = r->ncol;
+        }
+        r->ncols = r->ncol;
+    }
+    for (i = 0; i < r->ncol; i++) {
+        struct reply_val *v = &r->row[i];
+        struct reply_col *c = &r->cols[i];
+        int was = c->data.len + c->text.len;
+        uint32_t len;
+
+        if (row % 8 == 0 && buf_zero(&c->nulls, 1) < 0)
+            return -1;
+        if (c->type == REPLY_NULL && v->type != REPLY_NULL) {
+            /* the rows before were all NULL */
+            c->type = v->type;
+            if (buf_zero(&c->data, row * (c->type == REPLY_TEXT_COL ?
+                                          sizeof(len) : 8)) < 0)
+                return -1;
+        }
+        if (v->type == REPLY_NULL) {
+            c->has_nulls = 1;
+            c->nulls.p[row / 8] |= 1 << (row % 8);
+        }
+        switch (c->type) {
+            case REPLY_INT64:
+                if (buf_add(&c->data, &v->i, 8) < 0)
+                    return -1;
+                break;
+            case REPLY_DOUBLE:
+                if (buf_add(&c->data, &v->d, 8) < 0)
+                    return -1;
+                break;
+            case REPLY_TEXT_COL:
+                len = v->type == REPLY_NULL ? 0 : v->len;
+                if (buf_add(&c->data, &len, sizeof(len)) < 0 ||
+                    buf_add(&c->text, r->row_text.p + v->off, len) < 0)
+                    return -1;
+                break;
+        }
+        r->bytes += c->data.len + c->text.len - was;
+    }
+    r->nrows++;
+    return 0;
+}
+
+/* The row is done. Returns 1 if the outbuf is at its cap and the caller
+   should outbuf_wait(), and -1 if the client is gone. */
+int
+reply_row(struct reply *r)
+{
+    int ret = 0;
+
+    if (r->failed || r->errored) {
+        clear_row(r);
+        return r->failed ? -1 : 0;
+    }
+    if (r->proto == REPLY_TEXT) {
+        if (buf_add(&r->line, "\n", 1) < 0)
+            r->failed = 1;
+        else
+            ret = outbuf_write(r->out, r->line.p, r->line.len);
+    } else {
+        if (!row_fits(r))
+            ret = send_block(r, 0);
+        if (ret >= 0 && add_row(r) < 0)
+            r->failed = 1;
+    }
+    clear_row(r);
+    if (ret < 0 || r->failed) {
+        r->failed = 1;
+        return -1;
+    }
+    return ret;
+}
+
+/* The row stmt is on. As text, the columns in sqlite's own text. */
+int
+reply_sql_row(struct reply *r, sqlite3_stmt *stmt)
+{
+    int cols = sqlite3_column_count(stmt);
+    int i;
+
+    for (i = 0; i < cols; i++) {
+        int type = sqlite3_column_type(stmt, i);
+        if (type == SQLITE_NULL)
+            reply_null(r);
+        else if (r->proto == REPLY_TEXT || type == SQLITE_TEXT)
+            reply_text(r, (const char *)sqlite3_column_text(stmt, i),
+                       sqlite3_column_bytes(stmt, i));
+        else if (type == SQLITE_INTEGER)
+            reply_int(r, sqlite3_column_int64(stmt, i));
+        else if (type == SQLITE_FLOAT)
+            reply_double(r, sqlite3_column_double(stmt, i), 6);
+        else
+            reply_text(r, (const char *)sqlite3_column_blob(stmt, i),
+                       sqlite3_column_bytes(stmt, i));
+    }
+    return reply_row(r);
+}
+
+/* The answer is an error. The rows already sent stay sent. */
+void
+reply_error(struct reply *r, const char *msg)
+{
+    int len = strlen(msg);
+
+    clear_row(r);
+    if (r->failed || r->errored)
+        return;
+    r->errored = 1;
+    if (r->proto == REPLY_TEXT) {
+        outbuf_write(r->out, "error: ", strlen("error: "));
+        outbuf_write(r->out, msg, len);
+        outbuf_write(r->out, "\n", 1);
+        return;
+    }
+    if (r->nrows)
+        send_block(r, 0);
+    clear_block(r);
+    if (write_hdr(r, REPLY_HDR_SIZE + len, 1, 1, 0, 0) >= 0)
+        outbuf_write(r->out, msg, len);
+}
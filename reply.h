@@ -0,0 +1,83 @@
+/* The answer to a query, as text lines or as typed column blocks for the
+   binary protocol. Everything a query answers goes through here to the
+   connection's outbuf. See reply.c. */
+
+#include <stdint.h>
+
+struct outbuf;
+struct sqlite3_stmt;
+
+/* a binary connection starts with these bytes. No text query starts
+   with a NUL. */
+#define REPLY_MAGIC "\0TQ1"
+#define REPLY_MAGIC_SIZE 4
+
+/* request frames: size (uint32, of what follows), id (uint32), query */
+#define REPLY_REQ_HDR_SIZE 8
+
+enum REPLY_PROTO {REPLY_TEXT, REPLY_BINARY};
+
+/* column types in a block */
+enum REPLY_TYPE {REPLY_NULL, REPLY_INT64, REPLY_DOUBLE, REPLY_TEXT_COL};
+
+struct reply_buf
+{
+    char *p;
+    int len, cap;
+};
+
+/* one column of the block being built */
+struct reply_col
+{
+    int type;                   /* enum REPLY_TYPE, REPLY_NULL while all
+                                   of its values are */
+    int has_nulls;
+    struct reply_buf nulls;     /* bitmap, a bit a row */
+    struct reply_buf data;      /* int64s, doubles, or uint32 lengths */
+    struct reply_buf text;
+};
+
+/* a value of the row being built */
+struct reply_val
+{
+    int type;
+    int64_t i;
+    double d;
+    int off, len;               /* text, in row_text */
+};
+
+struct reply
+{
+    struct outbuf *out;
+    int proto;                  /* enum REPLY_PROTO */
+    uint32_t id;                /* the request being answered */
+    int failed;                 /* the client is gone, or out of memory */
+    int errored;                /* the answer was an error */
+
+    /* the row so far: its text, or its values */
+    struct reply_buf line;
+    struct reply_val *row;
+    int ncol, row_cap;
+    struct reply_buf row_text;
+
+    /* binary: the block so far */
+    struct reply_col *cols;
+    int ncols, cols_cap;
+    int nrows;
+    int bytes;
+};
+
+struct reply *reply_create(struct outbuf *out, int proto);
+void reply_destroy(struct reply *r);
+
+void reply_begin(struct reply *r, uint32_t id);
+int reply_end(struct reply *r);
+
+void reply_int(struct reply *r, int64_t v);
+void reply_double(struct reply *r, double v, int prec);
+void reply_text(struct reply *r, const char *s, int len);
+void reply_str(struct reply *r, const char *s);
+void reply_null(struct reply *r);
+int reply_row(struct reply *r);
+int reply_sql_row(struct reply *r, struct sqlite3_stmt *stmt);
+void reply_error(struct reply *r, const char *msg);
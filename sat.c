@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sqls.h"
+#include "sat.h"
+#include "cells.h"
+#include "checkpoint.h"
+
+/*
+   report2 only cares about trip endpoints, so rather than walking every
+   event in the rect we keep, per cell of a fixed grid over the area
+   (tripstore --sat), how many trips started and stopped there and the
+   fares of the ones that stopped there. Summed-area tables of those
+   answer any cell aligned rect with four lookups each. The tables are
+   rebuilt from the per cell totals (n * n adds) by the first query after
+   new BEGINs or ENDs, so ingest only ever bumps one cell.
+
+   The cells on the edge of the rect are only partly covered, so for
+   those we keep the BEGINs and ENDs themselves and check them exactly.
+
+   That gives starts, stops and fares. report2 counts distinct trips
+   though, and a trip that both started and stopped in the rect must only
+   count once: distinct = starts + stops - both. Each END remembers where
+   its trip began (from the trip's record in trips.c), and whether that
+   was within SAT_BAND cells of where it ended (near) or not (far). A
+   near END in a cell more than SAT_BAND cells inside the covered part of
+   the rect must have begun inside it too, so those come from a
+   summed-area table as well. Only the near ENDs in the band along the
+   edge of the rect, and the far ENDs, are checked one by one. For trips
+   that stay in a neighbourhood that is a strip along the edge. tripgen's
+   trips jump all over the area, so with it nearly every END is far and
+   "both" costs a pass over the ENDs in the rect (still a small part of
+   the events).
+
+   Points outside of the area go to the nearest border cell, and that
+   border row or column is then never counted as covered.
+*/
+
+#define SAT_BAND 2
+#define INITIAL_RECS 16
+
+struct sat_grid *
+sat_create(int n, double min_lat, double max_lat,
+           double min_lng, double max_lng)
+{
+    struct sat_grid *s = (struct sat_grid *)malloc(sizeof(*s));
+    int sn = (n + 1) * (n + 1);
+
+    memset(s, 0, sizeof(*s));
+    s->n = n;
+    s->min_lat = min_lat;
+    s->max_lat = max_lat;
+    s->min_lng = min_lng;
+    s->max_lng = max_lng;
+    s->cell_lat = (max_lat - min_lat) / n;
+    s->cell_lng = (max_lng - min_lng) / n;
+    s->cells = (struct sat_cell *)calloc(n * n, sizeof(*s->cells));
+    s->starts = (unsigned long *)calloc(n * n, sizeof(*s->starts));
+    s->stops = (unsigned long *)calloc(n * n, sizeof(*s->stops));
+    s->nears = (unsigned long *)calloc(n * n, sizeof(*s->nears));
+    s->fares = (long long *)calloc(n * n, sizeof(*s->fares));
+    s->sum_starts = (unsigned long *)calloc(sn, sizeof(*s->sum_starts));
+    s->sum_stops = (unsigned long *)calloc(sn, sizeof(*s->sum_stops));
+    s->sum_nears = (unsigned long *)calloc(sn, sizeof(*s->sum_nears));
+    s->sum_fares = (long long *)calloc(sn, sizeof(*s->sum_fares));
+    s->spill_row = (unsigned char *)calloc(n, 1);
+    s->spill_col = (unsigned char *)calloc(n, 1);
+    if (!s->cells || !s->starts || !s->stops || !s->nears || !s->fares ||
+        !s->sum_starts || !s->sum_stops || !s->sum_nears || !s->sum_fares ||
+        !s->spill_row || !s->spill_col) {
+        sat_destroy(s);
+        return NULL;
+    }
+    return s;
+}
+
+void
+sat_destroy(struct sat_grid *s)
+{
+    int i;
+    for (i = 0; s->cells && i < s->n * s->n; i++) {
+        ckpt_free(s->cells[i].begins);
+        ckpt_free(s->cells[i].near);
+        ckpt_free(s->cells[i].far);
+    }
+    ckpt_free(s->cells);
+    ckpt_free(s->starts);
+    ckpt_free(s->stops);
+    ckpt_free(s->nears);
+    ckpt_free(s->fares);
+    ckpt_free(s->sum_starts);
+    ckpt_free(s->sum_stops);
+    ckpt_free(s->sum_nears);
+    ckpt_free(s->sum_fares);
+    ckpt_free(s->spill_row);
+    ckpt_free(s->spill_col);
+    free(s);
+}
+
+/* Append the size byte record rec to *arr */
+static int
+append(void **arr, unsigned long *n, unsigned long *cap, const void *rec,
+       int size)
+{
+    if (*n == *cap) {
+        unsigned long c = *cap ? *cap * 2 : INITIAL_RECS;
+        void *p = ckpt_realloc(*arr, *cap * size, c * size);
+        if (!p)
+            return -1;
+        *arr = p;
+        *cap = c;
+    }
+    memcpy((char *)*arr + *n * size, rec, size);
+    (*n)++;
+    return 0;
+}
+
+/* Add one trip point. Only BEGINs and ENDs matter here. For an END,
+   begin_lat and begin_lng are where its trip began, NAN if we never saw
+   that. */
+int
+sat_add(struct sat_grid *s, float lng, float lat, int type, int cents,
+        float begin_lat, float begin_lng)
+{
+    int out_lat, out_lng;
+    int row, col, brow, bcol, c;
+    struct sat_cell *cell;
+    struct sat_begin b;
+    struct sat_end e;
+
+    if (type == TRANSIT)
+        return 0;
+
+    row = cell_of(s->min_lat, s->cell_lat, s->n, lat, &out_lat);
+    col = cell_of(s->min_lng, s->cell_lng, s->n, lng, &out_lng);
+    c = row * s->n + col;
+    cell = &s->cells[c];
+    if (out_lat)
+        s->spill_row[row] = 1;
+    if (out_lng)
+        s->spill_col[col] = 1;
+    s->stale = 1;
+
+    if (type == BEGIN) {
+        b.lat = lat;
+        b.lng = lng;
+        if (append((void **)&cell->begins, &cell->nbegins, &cell->capbegins,
+                   &b, sizeof(b)) < 0)
+            goto fail;
+        s->starts[c]++;
+        return 0;
+    }
+
+    e.lat = lat;
+    e.lng = lng;
+    e.fare = cents;
+    e.begin_lat = begin_lat;
+    e.begin_lng = begin_lng;
+    if (!isnan(begin_lat)) {
+        brow = cell_of(s->min_lat, s->cell_lat, s->n, e.begin_lat, &out_lat);
+        bcol = cell_of(s->min_lng, s->cell_lng, s->n, e.begin_lng, &out_lng);
+        if (abs(brow - row) <= SAT_BAND && abs(bcol - col) <= SAT_BAND) {
+            if (append((void **)&cell->near, &cell->nnear, &cell->capnear,
+                       &e, sizeof(e)) < 0)
+                goto fail;
+            s->nears[c]++;
+            s->stops[c]++;
+            s->fares[c] += cents;
+            return 0;
+        }
+    }
+    if (append((void **)&cell->far, &cell->nfar, &cell->capfar,
+               &e, sizeof(e)) < 0)
+        goto fail;
+    s->stops[c]++;
+    s->fares[c] += cents;
+    return 0;
+fail:
+    fprintf(stderr, "sat: out of memory\n");
+    return -1;
+}
+
+unsigned long
+sat_bytes(struct sat_grid *s)
+{
+    int n2 = s->n * s->n;
+    int sn = (s->n + 1) * (s->n + 1);
+    unsigned long bytes = n2 * (sizeof(*s->cells) + 3 * sizeof(long) +
+                                sizeof(long long)) +
+                          sn * (3 * sizeof(long) + sizeof(long long));
+    int i;
+    for (i = 0; i < n2; i++) {
+        bytes += s->cells[i].capbegins * sizeof(struct sat_begin);
+        bytes += (s->cells[i].capnear + s->cells[i].capfar) *
+                 sizeof(struct sat_end);
+    }
+    return bytes;
+}
+
+/* Bring the summed-area tables up to date with the per cell totals */
+static void
+rebuild(struct sat_grid *s)
+{
+    int n = s->n, w = n + 1;
+    int r, c;
+
+    for (r = 0; r < n; r++) {
+        for (c = 0; c < n; c++) {
+            int i = (r + 1) * w + c + 1, up = r * w + c + 1;
+            int left = (r + 1) * w + c, diag = r * w + c;
+            s->sum_starts[i] = s->starts[r * n + c] + s->sum_starts[up] +
+                               s->sum_starts[left] - s->sum_starts[diag];
+            s->sum_stops[i] = s->stops[r * n + c] + s->sum_stops[up] +
+                              s->sum_stops[left] - s->sum_stops[diag];
+            s->sum_nears[i] = s->nears[r * n + c] + s->sum_nears[up] +
+                              s->sum_nears[left] - s->sum_nears[diag];
+            s->sum_fares[i] = s->fares[r * n + c] + s->sum_fares[up] +
+                              s->sum_fares[left] - s->sum_fares[diag];
+        }
+    }
+    s->stale = 0;
+    s->rebuilds++;
+}
+
+/* The sum of cells [r0, r1] x [c0, c1] of a summed-area table */
+#define AREA(s, t, r0, r1, c0, c1) \
+    ((t)[((r1) + 1) * ((s)->n + 1) + (c1) + 1] - \
+     (t)[(r0) * ((s)->n + 1) + (c1) + 1] - \
+     (t)[((r1) + 1) * ((s)->n + 1) + (c0)] + \
+     (t)[(r0) * ((s)->n + 1) + (c0)])
+
+static inline int
+in_rect(float lat, float lng, double lat1, double lat2,
+        double lng1, double lng2)
+{
+    return lat >= lat1 && lat <= lat2 && lng >= lng1 && lng <= lng2;
+}
+
+/* The rows (or columns) in [i0, i1] the rect covers all of, as [*c0, *c1].
+   Spilled border rows are never covered. */
+static void
+covered(double min, double step, const unsigned char *spill,
+        double v1, double v2, int i0, int i1, int *c0, int *c1)
+{
+    *c0 = i0;
+    *c1 = i1;
+    while (*c0 <= *c1 && (v1 > cell_edge(min, step, *c0) || spill[*c0] ||
+                          cell_edge(min, step, *c0 + 1) > v2))
+        (*c0)++;
+    while (*c1 >= *c0 && (v2 < cell_edge(min, step, *c1 + 1) || spill[*c1] ||
+                          cell_edge(min, step, *c1) < v1))
+        (*c1)--;
+}
+
+/* Check one list of ENDs against the rect. If check_end is not set they
+   are known to be inside it, and only "both" is counted. */
+static void
+scan_ends(const struct sat_end *e, unsigned long n, int check_end,
+          double lat1, double lat2, double lng1, double lng2,
+          unsigned long *stops, long long *fares, unsigned long *both)
+{
+    unsigned long i;
+    for (i = 0; i < n; i++) {
+        if (check_end) {
+            if (!in_rect(e[i].lat, e[i].lng, lat1, lat2, lng1, lng2))
+                continue;
+            (*stops)++;
+            *fares += e[i].fare;
+        }
+        if (in_rect(e[i].begin_lat, e[i].begin_lng, lat1, lat2, lng1, lng2))
+            (*both)++;
+    }
+}
+
+/* report2: distinct trips with a BEGIN or END in the rect, and the sum of
+   their fares. rows is how many BEGINs and ENDs that was, so the caller
+   can tell an empty SUM apart from a zero one. lat1 <= lat2 and
+   lng1 <= lng2. */
+unsigned long
+sat_report2(struct sat_grid *s, double lat1, double lat2,
+            double lng1, double lng2, long long *fare_sum,
+            unsigned long *rows)
+{
+    unsigned long starts = 0, stops = 0, both = 0;
+    long long fares = 0;
+    int out, ra, rb, ca, cb, ri0, ri1, ci0, ci1, row, col;
+    unsigned long i;
+
+    ra = cell_of(s->min_lat, s->cell_lat, s->n, lat1, &out);
+    rb = cell_of(s->min_lat, s->cell_lat, s->n, lat2, &out);
+    ca = cell_of(s->min_lng, s->cell_lng, s->n, lng1, &out);
+    cb = cell_of(s->min_lng, s->cell_lng, s->n, lng2, &out);
+    covered(s->min_lat, s->cell_lat, s->spill_row, lat1, lat2, ra, rb,
+            &ri0, &ri1);
+    covered(s->min_lng, s->cell_lng, s->spill_col, lng1, lng2, ca, cb,
+            &ci0, &ci1);
+
+    if (ri0 <= ri1 && ci0 <= ci1) {
+        if (s->stale)
+            rebuild(s);
+        starts += AREA(s, s->sum_starts, ri0, ri1, ci0, ci1);
+        stops += AREA(s, s->sum_stops, ri0, ri1, ci0, ci1);
+        fares += AREA(s, s->sum_fares, ri0, ri1, ci0, ci1);
+        if (ri0 + SAT_BAND <= ri1 - SAT_BAND &&
+            ci0 + SAT_BAND <= ci1 - SAT_BAND)
+            both += AREA(s, s->sum_nears, ri0 + SAT_BAND, ri1 - SAT_BAND,
+                         ci0 + SAT_BAND, ci1 - SAT_BAND);
+    }
+
+    for (row = ra; row <= rb; row++) {
+        for (col = ca; col <= cb; col++) {
+            struct sat_cell *c = &s->cells[row * s->n + col];
+            int in = row >= ri0 && row <= ri1 && col >= ci0 && col <= ci1;
+            int deep = row >= ri0 + SAT_BAND && row <= ri1 - SAT_BAND &&
+                       col >= ci0 + SAT_BAND && col <= ci1 - SAT_BAND;
+
+            if (!in) {
+                for (i = 0; i < c->nbegins; i++)
+                    starts += in_rect(c->begins[i].lat, c->begins[i].lng,
+                                      lat1, lat2, lng1, lng2);
+            }
+            if (!deep)
+                scan_ends(c->near, c->nnear, !in, lat1, lat2, lng1, lng2,
+                          &stops, &fares, &both);
+            scan_ends(c->far, c->nfar, !in, lat1, lat2, lng1, lng2,
+                      &stops, &fares, &both);
+        }
+    }
+
+    *fare_sum = fares;
+    *rows = starts + stops;
+    return starts + stops - both;
+}
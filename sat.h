@@ -0,0 +1,63 @@
+/* Summed-area tables of trip starts, stops and fares over a fixed grid,
+   for report2. See sat.c. */
+
+#include <stdint.h>
+
+struct sat_begin
+{
+    float lat, lng;
+};
+
+/* An END, with where its trip began (NAN if we never saw the BEGIN) */
+struct sat_end
+{
+    float lat, lng;
+    float begin_lat, begin_lng;
+    int fare;
+};
+
+struct sat_cell
+{
+    struct sat_begin *begins;
+    unsigned long nbegins, capbegins;
+    /* ENDs of trips that began within SAT_BAND cells of this one, and of
+       the ones that began further away */
+    struct sat_end *near;
+    unsigned long nnear, capnear;
+    struct sat_end *far;
+    unsigned long nfar, capfar;
+};
+
+struct sat_grid
+{
+    int n;                      /* cells per side */
+    double min_lat, max_lat, min_lng, max_lng;
+    double cell_lat, cell_lng;
+    struct sat_cell *cells;     /* n * n, row (lat) major */
+
+    /* per cell totals, and their summed-area tables ((n + 1) * (n + 1))
+       which are brought up to date when a query finds them stale */
+    unsigned long *starts, *stops, *nears;
+    long long *fares;
+    unsigned long *sum_starts, *sum_stops, *sum_nears;
+    long long *sum_fares;
+    int stale;
+
+    /* border rows and columns with points from outside of the area */
+    unsigned char *spill_row, *spill_col;
+
+    unsigned long rebuilds;
+};
+
+struct sat_grid *sat_create(int n, double min_lat, double max_lat,
+                            double min_lng, double max_lng);
+void sat_destroy(struct sat_grid *s);
+
+int sat_add(struct sat_grid *s, float lng, float lat, int type, int cents,
+            float begin_lat, float begin_lng);
+
+unsigned long sat_bytes(struct sat_grid *s);
+
+unsigned long sat_report2(struct sat_grid *s, double lat1, double lat2,
+                          double lng1, double lng2,
+                          long long *fare_sum, unsigned long *rows);
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+#include "scan.h"
+
+/*
+   Each report1 and report2 used to go over the data on its own: its
+   cells of the grid, or its band of lat_long_idx, or all of the columns
+   with --engine columnar. A dashboard asks for dozens of rects at once,
+   mostly over the same busy part of the city, so the same cells and rows
+   were gone over once for every rect.
+
+   Now the reports that come in together are answered together. The event
+   loop wakes the query workers once per tick, after it has queued all of
+   that tick's queries, and the worker that picks up a report takes with
+   it the reports right behind it on that connection and at the front of
+   every other connection on the run queue (query.c). With -W 0 the event
+   loop answers the reports of a tick at the end of it (tripstore.c).
+   Either way the rects go through run_scan() (sqls.c) as one scan, under
+   store_lock, and each segment is gone over once for all of them:
+
+     - the grid (report1): the cells the rects touch are visited once, row
+       by row, and each cell is taken whole or its points checked for
+       every rect that touches it (grid_report1_scan())
+     - the columns: one pass over the events, each checked against the
+       rects in its bin of a 16 x 16 grid over them (scan_bin(),
+       colstore_reports_scan())
+     - sqlite: one walk of lat_long_idx over each band of lat that the
+       rects cover, each row checked against the rects whose band it is in
+       (scan_rows() in sqls.c)
+
+   What isn't a scan stays per rect: report2 from the summed-area tables
+   is a few lookups, and the R-tree paths walk only their own rect.
+
+   A rect's distinct trips in a segment are a bitmap of its trip ids
+   (struct scan_ids), sized to the ids of the grid or the columns, and
+   grown as ids turn up for sqlite. A trip is in one segment, so the
+   counts add up over them as before, and the answers are the same as
+   the rects would get on their own.
+*/
+
+struct scan *
+scan_create()
+{
+    return (struct scan *)calloc(1, sizeof(struct scan));
+}
+
+void
+scan_destroy(struct scan *s)
+{
+    int i;
+
+    for (i = 0; i < SCAN_MAX_RECTS; i++)
+        free(s->sel[i].ids.words);
+    free(s);
+}
+
+void
+scan_reset(struct scan *s)
+{
+    s->n = 0;
+    s->nsel = 0;
+}
+
+/* Returns -1 if s is full */
+int
+scan_add(struct scan *s, struct scan_rect *rect)
+{
+    if (s->n == SCAN_MAX_RECTS)
+        return -1;
+    rect->count = 0;
+    rect->fares = 0;
+    rect->rows = 0;
+    rect->failed = 0;
+    s->rects[s->n++] = rect;
+    return 0;
+}
+
+/* Add rect to the ones scanning the segment at hand, with its ids
+   empty. The caller sets the bounds it compares with. */
+struct scan_sel *
+scan_select(struct scan *s, struct scan_rect *rect)
+{
+    struct scan_sel *sel = &s->sel[s->nsel++];
+
+    sel->rect = rect;
+    sel->ids.nwords = 0;
+    sel->lat1 = rect->lat1;
+    sel->lat2 = rect->lat2;
+    sel->lng1 = rect->lng1;
+    sel->lng2 = rect->lng2;
+    return sel;
+}
+
+/* The segment at hand is done: add each selected rect's trips to its
+   count */
+void
+scan_collect(struct scan *s)
+{
+    int i;
+    unsigned long w;
+
+    for (i = 0; i < s->nsel; i++) {
+        struct scan_ids *ids = &s->sel[i].ids;
+        for (w = 0; w < ids->nwords; w++)
+            s->sel[i].rect->count += __builtin_popcountll(ids->words[w]);
+    }
+    s->nsel = 0;
+}
+
+/* Make room for at least words words */
+static int
+ids_room(struct scan_ids *ids, unsigned long words)
+{
+    if (words > ids->cap) {
+        uint64_t *p = (uint64_t *)realloc(ids->words, words * sizeof(*p));
+        if (!p)
+            return -1;
+        ids->words = p;
+        ids->cap = words;
+    }
+    return 0;
+}
+
+/* Empty, for the ids from min_id to max_id */
+int
+scan_ids_reset(struct scan_ids *ids, int64_t min_id, int64_t max_id)
+{
+    unsigned long words = (max_id >> 6) - (min_id >> 6) + 1;
+
+    ids->nwords = 0;
+    if (max_id < min_id || ids_room(ids, words) < 0)
+        return -1;
+    ids->lo = min_id >> 6;
+    ids->nwords = words;
+    memset(ids->words, 0, words * sizeof(*ids->words));
+    return 0;
+}
+
+/* Make room for id, which is outside of the range so far, and mark it.
+   The range at least doubles on the side that grows. */
+int
+scan_ids_grow(struct scan_ids *ids, int64_t id)
+{
+    int64_t w = id >> 6;
+    int64_t lo = ids->lo, hi = ids->lo + (int64_t)ids->nwords - 1;
+    unsigned long words;
+
+    if (!ids->nwords) {
+        lo = hi = w;
+    } else if (w < lo) {
+        lo = w < lo - (int64_t)ids->nwords ? w : lo - (int64_t)ids->nwords;
+    } else {
+        hi = w > hi + (int64_t)ids->nwords ? w : hi + (int64_t)ids->nwords;
+    }
+    words = hi - lo + 1;
+    if (ids_room(ids, words) < 0)
+        return -1;
+    if (ids->nwords) {
+        /* the old words move up by however much lo came down */
+        memmove(ids->words + (ids->lo - lo), ids->words,
+                ids->nwords * sizeof(*ids->words));
+        memset(ids->words, 0, (ids->lo - lo) * sizeof(*ids->words));
+        memset(ids->words + (ids->lo - lo) + ids->nwords, 0,
+               (words - (ids->lo - lo) - ids->nwords) *
+               sizeof(*ids->words));
+    } else {
+        memset(ids->words, 0, words * sizeof(*ids->words));
+    }
+    ids->lo = lo;
+    ids->nwords = words;
+    scan_ids_set(ids, id);
+    return 0;
+}
+
+/* Bin the first n of s->live, by where their bounds are, for
+   scan_bin_of(). A point's bin is in the bins of every sel it is in. */
+void
+scan_bin(struct scan *s, int n)
+{
+    int count[SCAN_BINS * SCAN_BINS];
+    int i, r, c;
+
+    s->bin_lat1 = s->bin_lng1 = 1;
+    s->bin_lat2 = s->bin_lng2 = 0;
+    for (i = 0; i < n; i++) {
+        struct scan_sel *sel = &s->sel[s->live[i]];
+        if (!i || sel->lat1 < s->bin_lat1)
+            s->bin_lat1 = sel->lat1;
+        if (!i || sel->lat2 > s->bin_lat2)
+            s->bin_lat2 = sel->lat2;
+        if (!i || sel->lng1 < s->bin_lng1)
+            s->bin_lng1 = sel->lng1;
+        if (!i || sel->lng2 > s->bin_lng2)
+            s->bin_lng2 = sel->lng2;
+    }
+    s->bin_lat_scale = s->bin_lat2 > s->bin_lat1 ?
+                       SCAN_BINS / (s->bin_lat2 - s->bin_lat1) : 0;
+    s->bin_lng_scale = s->bin_lng2 > s->bin_lng1 ?
+                       SCAN_BINS / (s->bin_lng2 - s->bin_lng1) : 0;
+
+    /* count each bin's sels, then lay them out after each other */
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++) {
+        struct scan_sel *sel = &s->sel[s->live[i]];
+        sel->r0 = scan_bin_index(sel->lat1, s->bin_lat1, s->bin_lat_scale);
+        sel->r1 = scan_bin_index(sel->lat2, s->bin_lat1, s->bin_lat_scale);
+        sel->c0 = scan_bin_index(sel->lng1, s->bin_lng1, s->bin_lng_scale);
+        sel->c1 = scan_bin_index(sel->lng2, s->bin_lng1, s->bin_lng_scale);
+        for (r = sel->r0; r <= sel->r1; r++) {
+            for (c = sel->c0; c <= sel->c1; c++)
+                count[r * SCAN_BINS + c]++;
+        }
+    }
+    s->bin_start[0] = 0;
+    for (i = 0; i < SCAN_BINS * SCAN_BINS; i++) {
+        s->bin_start[i + 1] = s->bin_start[i] + count[i];
+        count[i] = s->bin_start[i];
+    }
+    for (i = 0; i < n; i++) {
+        struct scan_sel *sel = &s->sel[s->live[i]];
+        for (r = sel->r0; r <= sel->r1; r++) {
+            for (c = sel->c0; c <= sel->c1; c++)
+                s->bin_sels[count[r * SCAN_BINS + c]++] = s->live[i];
+        }
+    }
+}
+
+/* A scan of n reports is done. Under store_lock. */
+void
+scan_record(struct scan_stats *stats, int n)
+{
+    stats->scans++;
+    stats->reports += n;
+    if ((unsigned long)n > stats->max_reports)
+        stats->max_reports = n;
+    if (n == 1)
+        stats->served[0]++;
+    else if (n < 8)
+        stats->served[1]++;
+    else if (n < 64)
+        stats->served[2]++;
+    else
+        stats->served[3]++;
+}
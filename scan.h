@@ -0,0 +1,122 @@
+/* Shared scans: report1s and report2s that come in together are answered
+   in one pass over each segment's cells or rows, every rect checked per
+   cell or row. See scan.c. */
+
+#include <stdint.h>
+
+struct scan_stats;
+
+/* most rects in one scan */
+#define SCAN_MAX_RECTS 256
+
+/* bins per side of the grid over the rects that a point looks up the
+   ones it could be in with (scan_bin()) */
+#define SCAN_BINS 16
+
+/* A report1 or report2 waiting for a scan, and then its answer */
+struct scan_rect
+{
+    int report;                 /* 1 or 2, 0 for not a report */
+    double lat1, lat2;          /* lat1 <= lat2 */
+    double lng1, lng2;          /* lng1 <= lng2 */
+
+    /* over all of the segments */
+    unsigned long count;
+    long long fares;
+    unsigned long rows;         /* report2: the events whose fares are summed */
+    int failed;                 /* ran out of memory in some segment */
+};
+
+/* The distinct trip ids a rect has met in a segment: a bit each, in the
+   64 bit words from word lo on */
+struct scan_ids
+{
+    int64_t lo;
+    unsigned long nwords, cap;
+    uint64_t *words;
+};
+
+/* A rect being scanned in the segment at hand */
+struct scan_sel
+{
+    struct scan_rect *rect;
+    struct scan_ids ids;
+    double lat1, lat2;          /* the rect in the units that the */
+    double lng1, lng2;          /* segment's data is compared in */
+    int r0, r1, c0, c1;         /* the grid cells or bins it touches */
+};
+
+struct scan
+{
+    struct scan_rect *rects[SCAN_MAX_RECTS];
+    int n;
+
+    /* the ones that scan the segment at hand together, by grid cells or
+       by rows */
+    struct scan_sel sel[SCAN_MAX_RECTS];
+    int nsel;
+
+    /* scratch for the backends: lists of indexes into sel */
+    int live[SCAN_MAX_RECTS];
+    int part[SCAN_MAX_RECTS];
+
+    /* the live sels by bin over their bbox: bin b's are bin_sels from
+       bin_start[b] up to bin_start[b + 1] */
+    double bin_lat1, bin_lat2, bin_lng1, bin_lng2;
+    double bin_lat_scale, bin_lng_scale;
+    int bin_start[SCAN_BINS * SCAN_BINS + 1];
+    int bin_sels[SCAN_BINS * SCAN_BINS * SCAN_MAX_RECTS];
+};
+
+struct scan *scan_create();
+void scan_destroy(struct scan *s);
+
+void scan_reset(struct scan *s);
+int scan_add(struct scan *s, struct scan_rect *rect);
+
+struct scan_sel *scan_select(struct scan *s, struct scan_rect *rect);
+void scan_collect(struct scan *s);
+
+int scan_ids_reset(struct scan_ids *ids, int64_t min_id, int64_t max_id);
+int scan_ids_grow(struct scan_ids *ids, int64_t id);
+
+/* Mark id, which is in the range the ids were reset to or grown to */
+static inline void
+scan_ids_set(struct scan_ids *ids, int64_t id)
+{
+    ids->words[(id >> 6) - ids->lo] |= 1ULL << (id & 63);
+}
+
+/* Mark id, making room for it first if it is out of the range so far */
+static inline int
+scan_ids_add(struct scan_ids *ids, int64_t id)
+{
+    int64_t w = (id >> 6) - ids->lo;
+
+    if (w < 0 || w >= (int64_t)ids->nwords)
+        return scan_ids_grow(ids, id);
+    ids->words[w] |= 1ULL << (id & 63);
+    return 0;
+}
+
+void scan_bin(struct scan *s, int n);
+
+static inline int
+scan_bin_index(double v, double lo, double scale)
+{
+    int b = (int)((v - lo) * scale);
+    return b < SCAN_BINS ? b : SCAN_BINS - 1;
+}
+
+/* The bin of the point, -1 if it is outside of all of the live sels */
+static inline int
+scan_bin_of(struct scan *s, double lat, double lng)
+{
+    if (!(lat >= s->bin_lat1 && lat <= s->bin_lat2 &&
+          lng >= s->bin_lng1 && lng <= s->bin_lng2))
+        return -1;
+    return scan_bin_index(lat, s->bin_lat1, s->bin_lat_scale) * SCAN_BINS +
+           scan_bin_index(lng, s->bin_lng1, s->bin_lng_scale);
+}
+
+void scan_record(struct scan_stats *stats, int n);
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sqlite3.h"
+#include "sqls.h"
+#include "stats.h"
+#include "colstore.h"
+#include "grid.h"
+#include "hll.h"
+#include "sat.h"
+#include "active.h"
+#include "trips.h"
+#include "segment.h"
+#include "bufpool.h"
+#include "ctx.h"
+
+/*
+   The trip log only ever grew, and taking old rows out one by one would
+   mean deleting from the table and from every index under store_lock,
+   while ingest waits. Instead the log is cut into time segments. The
+   newest one takes the new trips until it is seal_secs old (--segment),
+   or, with --retain-mb, until it holds 1/SEAL_SHARE of that. Then it is
+   sealed and a new one is opened. Retention (--retain, --retain-mb)
+   drops the oldest sealed segment whole.
+
+   With the sqlite engine a segment is its own in-memory database,
+   ATTACHed as seg<seq>, with the same tables and indexes that triplog
+   and tripsummary always had. DETACH hands all of its pages back at once
+   (about 10ms for 80MB), where DROP TABLE walks the b-trees and then
+   keeps the pages around on the freelist. triplog and tripsummary are
+   TEMP views of the UNION ALL of the segments, for ad-hoc sql. sqlite
+   can attach at most SQLITE_MAX_ATTACHED databases (we build it with
+   125), and once we are at that the newest segment just stays open.
+
+   Every event of a trip goes to the segment that the trip began in, so
+   segments never share a trip. Counting distinct trips over the whole
+   log is then the sum of the counts of the segments, and each segment
+   has its own grid, sketches and summed-area tables to count with.
+   Reports skip the segments whose bounding box misses the rect, and the
+   report3 totals in active.c are trimmed to the oldest segment left, as
+   are the trajectories in trips.c.
+*/
+
+#define SEAL_SHARE 8
+
+/* how often, in events, to look at the sizes */
+#define CHECK_ROWS 4096
+
+struct segments *
+segments_create()
+{
+    struct segments *s = (struct segments *)malloc(sizeof(*s));
+    memset(s, 0, sizeof(*s));
+    s->next_seq = 1;
+    return s;
+}
+
+/* Segments */
+
+static void
+free_segment(struct segment *seg)
+{
+    if (seg->cs)
+        colstore_destroy(seg->cs);
+    if (seg->grid)
+        grid_destroy(seg->grid);
+    if (seg->hll)
+        hll_destroy(seg->hll);
+    if (seg->sat)
+        sat_destroy(seg->sat);
+    free(seg);
+}
+
+/* Make seg the newest segment, with its tables opened */
+static int
+add_segment(struct tripstore_context *ctx, struct segment *seg)
+{
+    struct segments *s = ctx->segments;
+
+    if (s->n == s->cap) {
+        int cap = s->cap ? s->cap * 2 : 16;
+        struct segment **p = (struct segment **)
+                             realloc(s->segs, cap * sizeof(*p));
+        if (!p)
+            return -1;
+        s->segs = p;
+        s->cap = cap;
+    }
+
+    if (ctx->engine == ENGINE_SQLITE) {
+        /* ATTACH can't happen inside of a transaction */
+        end_batch(ctx);
+        if (open_segment_sql(ctx, seg) < 0)
+            return -1;
+    }
+
+    s->segs[s->n++] = seg;
+    s->next_seq = seg->seq + 1;
+    if (ctx->engine == ENGINE_SQLITE)
+        update_segment_views(ctx, ctx->db);
+    return 0;
+}
+
+static struct segment *
+open_segment(struct tripstore_context *ctx, time_t now)
+{
+    struct segments *s = ctx->segments;
+    struct segment *seg;
+
+    seg = (struct segment *)calloc(1, sizeof(*seg));
+    if (!seg)
+        goto oom;
+    seg->seq = s->next_seq;
+    snprintf(seg->name, sizeof(seg->name), "seg%lu", seg->seq);
+    seg->opened = now;
+    if (ctx->engine == ENGINE_COLUMNAR && !(seg->cs = colstore_create()))
+        goto fail;
+    if (s->grid_cells > 0 &&
+        !(seg->grid = grid_create(s->grid_cells, s->min_lat, s->max_lat,
+                                  s->min_lng, s->max_lng)))
+        goto fail;
+    if (s->hll_cells > 0 &&
+        !(seg->hll = hll_create(s->hll_cells, s->min_lat, s->max_lat,
+                                s->min_lng, s->max_lng)))
+        goto fail;
+    if (s->sat_cells > 0 &&
+        !(seg->sat = sat_create(s->sat_cells, s->min_lat, s->max_lat,
+                                s->min_lng, s->max_lng)))
+        goto fail;
+    if (add_segment(ctx, seg) < 0)
+        goto fail;
+    return seg;
+
+fail:
+    free_segment(seg);
+oom:
+    fprintf(stderr, "segments: can't open segment %lu\n", s->next_seq);
+    return NULL;
+}
+
+/* Drop the oldest segment, and everything in it */
+static void
+drop_oldest(struct tripstore_context *ctx)
+{
+    struct segments *s = ctx->segments;
+    struct segment *seg = s->segs[0];
+
+    if (ctx->engine == ENGINE_SQLITE) {
+        end_batch(ctx);
+        close_segment_sql(ctx, seg);
+    }
+    s->dropped++;
+    s->dropped_rows += seg->rows;
+    s->n--;
+    memmove(s->segs, s->segs + 1, s->n * sizeof(*s->segs));
+    trips_drop_segment(ctx->trips, seg->seq, seg->max_id);
+    free_segment(seg);
+
+    if (s->segs[0]->rows)
+        active_trim(ctx->active, s->segs[0]->first);
+    if (ctx->engine == ENGINE_SQLITE)
+        update_segment_views(ctx, ctx->db);
+}
+
+unsigned long
+segment_bytes(struct tripstore_context *ctx, struct segment *seg)
+{
+    unsigned long bytes = sizeof(*seg);
+
+    if (seg->measured_rows == seg->rows && seg->bytes)
+        return seg->bytes;
+    if (seg->cs)
+        bytes += colstore_bytes(seg->cs);
+    if (seg->grid)
+        bytes += grid_bytes(seg->grid);
+    if (seg->hll)
+        bytes += hll_bytes(seg->hll);
+    if (seg->sat)
+        bytes += sat_bytes(seg->sat);
+    if (ctx->engine == ENGINE_SQLITE)
+        bytes += segment_sql_bytes(seg);
+    seg->bytes = bytes;
+    seg->measured_rows = seg->rows;
+    return bytes;
+}
+
+/* Everything the segments hold, and the records of their trips.
+   Sealed segments stop changing once their last trips end, so this is
+   mostly cached sizes. */
+unsigned long
+segments_bytes(struct tripstore_context *ctx)
+{
+    struct segments *s = ctx->segments;
+    unsigned long bytes = trips_bytes(ctx->trips);
+    int i;
+
+    for (i = 0; i < s->n; i++)
+        bytes += segment_bytes(ctx, s->segs[i]);
+    return bytes;
+}
+
+/* Open the first segment, unless a checkpoint brought some back. The
+   engine and the database must be set up. */
+int
+segments_start(struct tripstore_context *ctx)
+{
+    if (ctx->engine == ENGINE_SQLITE)
+        ctx->segments->max = sqlite3_limit(ctx->db, SQLITE_LIMIT_ATTACHED, -1);
+    if (ctx->segments->n)
+        return 0;
+    return open_segment(ctx, time(NULL)) ? 0 : -1;
+}
+
+/* Take seg, loaded from a checkpoint (checkpoint.c), as the newest
+   segment. With the sqlite engine its tables are opened empty, for the
+   caller to copy into. */
+int
+segments_adopt(struct tripstore_context *ctx, struct segment *seg)
+{
+    if (add_segment(ctx, seg) < 0) {
+        fprintf(stderr, "segments: can't open segment %lu\n", seg->seq);
+        free_segment(seg);
+        return -1;
+    }
+    return 0;
+}
+
+/* Should the newest segment be sealed? */
+static int
+newest_full(struct tripstore_context *ctx, time_t now)
+{
+    struct segments *s = ctx->segments;
+    struct segment *seg = s->segs[s->n - 1];
+
+    if (!seg->rows)
+        return 0;
+    if (s->seal_secs > 0 && now - seg->opened >= s->seal_secs)
+        return 1;
+    return s->retain_bytes &&
+           segment_bytes(ctx, seg) >= s->retain_bytes / SEAL_SHARE;
+}
+
+/* Drop what retention says to, then seal the newest segment if it is
+   full */
+static int
+check_segments(struct tripstore_context *ctx, time_t now)
+{
+    struct segments *s = ctx->segments;
+
+    s->since_check = 0;
+    while (s->n > 1) {
+        struct segment *oldest = s->segs[0];
+        if (s->retain_secs > 0 && now - oldest->last > s->retain_secs)
+            drop_oldest(ctx);
+        else if (s->retain_bytes && segments_bytes(ctx) > s->retain_bytes)
+            drop_oldest(ctx);
+        else
+            break;
+    }
+
+    if (!newest_full(ctx, now))
+        return 0;
+    if (s->max && s->n >= s->max) {
+        s->full++;
+        return 0;
+    }
+    s->segs[s->n - 1]->sealed = 1;
+    s->sealed++;
+    return open_segment(ctx, now) ? 0 : -1;
+}
+
+/* segments_route
+
+   Which segment the event for trip id goes to. A trip we have a record
+   for (trips.c) is in the segment its first event went to, and new trips
+   go to the newest one, so BEGINs go there and the rest of the trip
+   follows. This is also where segments are opened, sealed and dropped.
+*/
+struct segment *
+segments_route(struct tripstore_context *ctx, int64_t id, int type,
+               time_t now)
+{
+    struct segments *s = ctx->segments;
+    struct segment *newest;
+    struct trip *r;
+
+    newest = s->segs[s->n - 1];
+    if (++s->since_check >= CHECK_ROWS ||
+        (type == BEGIN && s->seal_secs > 0 &&
+         now - newest->opened >= s->seal_secs &&
+         (!s->max || s->n < s->max))) {
+        if (check_segments(ctx, now) < 0)
+            return NULL;
+        newest = s->segs[s->n - 1];
+    }
+
+    r = trips_get(ctx->trips, id);
+    if (!r || r->seq < s->segs[0]->seq)
+        return newest;
+    return s->segs[r->seq - s->segs[0]->seq];
+}
+
+/* Account for an event that was stored in seg */
+void
+segment_added(struct segment *seg, int64_t id, float lng, float lat,
+              int type, time_t now)
+{
+    if (!seg->rows) {
+        seg->first = now;
+        /* events replayed from the log (wal.c) are older than we are */
+        if (now < seg->opened)
+            seg->opened = now;
+    }
+    seg->last = now;
+    seg->rows++;
+    if (type == BEGIN)
+        seg->trips++;
+    if (id > seg->max_id)
+        seg->max_id = id;
+
+    if (!seg->have_bbox) {
+        seg->min_lat = seg->max_lat = lat;
+        seg->min_lng = seg->max_lng = lng;
+        seg->have_bbox = 1;
+        return;
+    }
+    if (lat < seg->min_lat)
+        seg->min_lat = lat;
+    if (lat > seg->max_lat)
+        seg->max_lat = lat;
+    if (lng < seg->min_lng)
+        seg->min_lng = lng;
+    if (lng > seg->max_lng)
+        seg->max_lng = lng;
+}
+
+/* Could seg have points in the rect? lat1 <= lat2 and lng1 <= lng2. */
+int
+segment_overlaps(struct segment *seg, double lat1, double lat2,
+                 double lng1, double lng2)
+{
+    return seg->have_bbox &&
+           lat1 <= seg->max_lat && lat2 >= seg->min_lat &&
+           lng1 <= seg->max_lng && lng2 >= seg->min_lng;
+}
+
+void
+segments_destroy(struct tripstore_context *ctx)
+{
+    struct segments *s = ctx->segments;
+    int i;
+
+    if (ctx->engine == ENGINE_SQLITE)
+        end_batch(ctx);
+    for (i = 0; i < s->n; i++) {
+        if (ctx->engine == ENGINE_SQLITE)
+            close_segment_sql(ctx, s->segs[i]);
+        free_segment(s->segs[i]);
+    }
+    free(s->segs);
+    free(s);
+    ctx->segments = NULL;
+}
@@ -0,0 +1,89 @@
+/* Time segments of the trip log. Each one has its own tables (its own
+   attached in-memory database with the sqlite engine) and its own grid,
+   sketches and summed-area tables, so that retention can drop it whole.
+   See segment.c. */
+
+#include <stdint.h>
+#include <time.h>
+
+struct tripstore_context;
+
+struct segment
+{
+    unsigned long seq;
+    char name[24];              /* schema of its sqlite tables, "seg<seq>" */
+    time_t opened;
+    time_t first, last;         /* times of the first and last event */
+    int sealed;                 /* takes no new trips */
+    unsigned long rows;
+    unsigned long trips;        /* BEGINs */
+    int64_t max_id;             /* highest trip id with events here */
+
+    /* bounding box of the points, so reports can skip the segment */
+    int have_bbox;
+    float min_lat, max_lat, min_lng, max_lng;
+
+    /* bytes as of the last time we measured, at rows */
+    unsigned long bytes;
+    unsigned long measured_rows;
+
+    /* ENGINE_SQLITE: statements on the tables in name */
+    sqlite3_stmt *insert;
+    sqlite3_stmt *reports[2];
+    sqlite3_stmt *insert_rtree;
+    sqlite3_stmt *insert_ends_rtree;
+    sqlite3_stmt *report1_rtree;
+    sqlite3_stmt *report2_rtree;
+    sqlite3_stmt *scan;         /* for shared scans, see scan.c */
+    sqlite3_stmt *page_count;
+    sqlite3_stmt *page_size;
+
+    /* ENGINE_COLUMNAR */
+    struct colstore *cs;
+
+    /* NULL if turned off */
+    struct grid *grid;
+    struct hll_grid *hll;
+    struct sat_grid *sat;
+};
+
+struct segments
+{
+    struct segment **segs;      /* oldest first, seqs are consecutive */
+    int n, cap;
+    int max;                    /* most we can have at once, 0 for no limit */
+    unsigned long next_seq;
+
+    /* what a new segment gets: cells per side of each index (0 for
+       none) over the area */
+    int grid_cells, hll_cells, sat_cells;
+    double min_lat, max_lat, min_lng, max_lng;
+
+    /* seal the newest after seal_secs, and drop the oldest once older
+       than retain_secs or while we are over retain_bytes (0 for never) */
+    int seal_secs;
+    int retain_secs;
+    unsigned long retain_bytes;
+    unsigned long since_check;
+
+    unsigned long sealed;
+    unsigned long dropped;
+    unsigned long dropped_rows;
+    unsigned long full;         /* times we wanted to seal but were at max */
+};
+
+struct segments *segments_create();
+int segments_start(struct tripstore_context *ctx);
+int segments_adopt(struct tripstore_context *ctx, struct segment *seg);
+void segments_destroy(struct tripstore_context *ctx);
+
+struct segment *segments_route(struct tripstore_context *ctx, int64_t id,
+                               int type, time_t now);
+void segment_added(struct segment *seg, int64_t id, float lng, float lat,
+                   int type, time_t now);
+
+int segment_overlaps(struct segment *seg, double lat1, double lat2,
+                     double lng1, double lng2);
+unsigned long segment_bytes(struct tripstore_context *ctx,
+                            struct segment *seg);
+unsigned long segments_bytes(struct tripstore_context *ctx);
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include "sqlite3.h"
+#include "sqls.h"
+#include "stats.h"
+#include "colstore.h"
+#include "segment.h"
+#include "trips.h"
+#include "wal.h"
+#include "checkpoint.h"
+#include "snapshot.h"
+#include "scan.h"
+#include "query.h"
+#include "bufpool.h"
+#include "ctx.h"
+
+/*
+   A snapshot is a sqlite file with the trip log and the trip summaries
+   as of one instant, for looking at with the sqlite3 shell or for
+   loading elsewhere:
+
+       triplog(id, long, lat, type, fare_cents)
+       tripsummary(id, begin, end, start_long, start_lat, end_long,
+                   end_lat, fare_cents)
+       snapshot(taken, events, trips, wal_records)
+
+   wal_records is how many events the write-ahead log had when it was
+   taken (0 without --wal), so the log from there on is what came after.
+
+   Copying the store takes seconds once it is big, and the store can't
+   change while it is copied. Instead of holding store_lock all that
+   time, the snapshot thread takes it just long enough to commit the
+   open batch and fork(). The child has a copy-on-write image of the
+   whole store as it was at that instant and writes it out at its own
+   pace, while the parent goes straight back to ingest. What ingest pays
+   is the fork() itself, which copies the page tables (about 50ms a GB
+   here), and then a page copy the first time it writes to each page
+   the child still shares, which can take the memory up to twice the
+   store's while the child runs. Reading the in-memory store from the child
+   is safe because nothing else in it is running: the other threads
+   aren't forked, sqlite is only used under store_lock, which the forking
+   thread holds, or by the query workers, which are kept out of it for
+   the fork (query_pool_pause()).
+
+   The child writes to <path>.tmp and renames it over path once it is
+   synced, so path is always the last whole snapshot. Checkpoints
+   (checkpoint.c) are taken the same way, and snapshot.* in stats counts
+   both. They don't overlap: a request while one is running is turned
+   down.
+*/
+
+static unsigned long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static char snapshot_ddl[] =
+"PRAGMA journal_mode = OFF;"
+"PRAGMA synchronous = OFF;"
+"BEGIN;"
+"CREATE TABLE triplog(id INTEGER, long REAL, lat REAL, type INTEGER,"
+"                     fare_cents INTEGER);"
+"CREATE TABLE tripsummary(id INTEGER PRIMARY KEY, begin INTEGER,"
+"                         end INTEGER, start_long REAL, start_lat REAL,"
+"                         end_long REAL, end_lat REAL, fare_cents INTEGER);"
+"CREATE TABLE snapshot(taken INTEGER, events INTEGER, trips INTEGER,"
+"                      wal_records INTEGER);";
+
+/* Copy the rows of select on from through insert on to */
+static int
+copy_rows(sqlite3 *from, const char *select, sqlite3 *to,
+          const char *insert)
+{
+    sqlite3_stmt *sel = NULL, *ins = NULL;
+    int i, n, rc = -1;
+
+    if (sqlite3_prepare_v2(from, select, -1, &sel, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(to, insert, -1, &ins, NULL) != SQLITE_OK)
+        goto out;
+    n = sqlite3_column_count(sel);
+    while ((rc = sqlite3_step(sel)) == SQLITE_ROW) {
+        for (i = 0; i < n; i++)
+            sqlite3_bind_value(ins, i + 1, sqlite3_column_value(sel, i));
+        if (sqlite3_step(ins) != SQLITE_DONE)
+            break;
+        sqlite3_reset(ins);
+    }
+    rc = rc == SQLITE_DONE ? 0 : -1;
+out:
+    sqlite3_finalize(sel);
+    sqlite3_finalize(ins);
+    return rc;
+}
+
+/* The columnar engine has no triplog in sqlite, so copy the columns */
+static int
+copy_columns(struct tripstore_context *ctx, sqlite3 *to)
+{
+    struct segments *s = ctx->segments;
+    sqlite3_stmt *ins;
+    unsigned long j;
+    int i;
+
+    if (sqlite3_prepare_v2(to, "INSERT INTO triplog VALUES (?, ?, ?, ?, ?);",
+                           -1, &ins, NULL) != SQLITE_OK)
+        return -1;
+    for (i = 0; i < s->n; i++) {
+        struct colstore *cs = s->segs[i]->cs;
+        for (j = 0; j < cs->n; j++) {
+            sqlite3_bind_int64(ins, 1, cs->id[j]);
+            sqlite3_bind_double(ins, 2, cs->lng[j]);
+            sqlite3_bind_double(ins, 3, cs->lat[j]);
+            sqlite3_bind_int(ins, 4, cs->type[j]);
+            sqlite3_bind_int(ins, 5, cs->fare[j]);
+            if (sqlite3_step(ins) != SQLITE_DONE) {
+                sqlite3_finalize(ins);
+                return -1;
+            }
+            sqlite3_reset(ins);
+        }
+    }
+    sqlite3_finalize(ins);
+    return 0;
+}
+
+/* write_snapshot
+
+   Runs in the child. Everything it reads is its own copy, and it only
+   returns through _exit(), so nothing of the parent's is flushed or
+   freed twice.
+*/
+static int
+write_snapshot(struct tripstore_context *ctx, const char *tmp,
+               const char *path, unsigned long rows, time_t taken,
+               unsigned long wal_records)
+{
+    sqlite3 *out = NULL;
+    char *meta;
+    int fd, rc = -1;
+
+    unlink(tmp);
+    if (sqlite3_open(tmp, &out) != SQLITE_OK ||
+        sqlite3_exec(out, snapshot_ddl, NULL, NULL, NULL) != SQLITE_OK)
+        goto out;
+    if (ctx->engine == ENGINE_COLUMNAR ?
+            copy_columns(ctx, out) < 0 :
+            copy_rows(ctx->db, "SELECT * FROM triplog;", out,
+                      "INSERT INTO triplog VALUES (?, ?, ?, ?, ?);") < 0)
+        goto out;
+    if (copy_rows(ctx->db, "SELECT * FROM tripsummary;", out,
+                  "INSERT INTO tripsummary VALUES "
+                  "(?, ?, ?, ?, ?, ?, ?, ?);") < 0)
+        goto out;
+    meta = sqlite3_mprintf("INSERT INTO snapshot VALUES (%lld, %lu, %lu, %lu);"
+                           "COMMIT;", (long long)taken, rows,
+                           ctx->trips->trips, wal_records);
+    if (!meta || sqlite3_exec(out, meta, NULL, NULL, NULL) != SQLITE_OK) {
+        sqlite3_free(meta);
+        goto out;
+    }
+    sqlite3_free(meta);
+    rc = 0;
+out:
+    if (rc < 0)
+        fprintf(stderr, "snapshot: can't write %s: %s\n", tmp,
+                out ? sqlite3_errmsg(out) : "out of memory");
+    sqlite3_close(out);
+    if (rc < 0)
+        return -1;
+
+    /* synchronous is off, so make it durable before it takes the name */
+    fd = open(tmp, O_RDONLY);
+    if (fd < 0 || fsync(fd) < 0 || rename(tmp, path) < 0) {
+        fprintf(stderr, "snapshot: can't put %s in place: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* take_snapshot
+
+   Fork the child that writes path (as a checkpoint, or a sqlite
+   snapshot) and wait for it. ctx only stops for the commit and the
+   fork().
+*/
+static void
+take_snapshot(struct snapshot *s, const char *path, int checkpoint)
+{
+    struct tripstore_context *ctx = s->ctx;
+    struct snapshot_stats *st = &s->stats;
+    char *tmp = sqlite3_mprintf("%s.tmp", path);
+    unsigned long start, stall, rows = 0, wal_records;
+    time_t taken = time(NULL);
+    struct stat sb;
+    pid_t pid;
+    int i, status;
+
+    if (!tmp) {
+        fprintf(stderr, "snapshot: out of memory\n");
+        st->failed++;
+        return;
+    }
+
+    /* a worker's sqlite mutexes would stay locked in the child */
+    if (ctx->queries)
+        query_pool_pause(ctx->queries);
+    pthread_mutex_lock(&ctx->store_lock);
+    start = now_us();
+    end_batch(ctx);
+    for (i = 0; i < ctx->segments->n; i++)
+        rows += ctx->segments->segs[i]->rows;
+    wal_records = ctx->wal ? ctx->wal->logged : 0;
+    pid = fork();
+    if (pid == 0) {
+        /* don't hold the parent's sockets and log open */
+        if (syscall(__NR_close_range, 3, ~0U, 0) < 0) {
+            long fd, max = sysconf(_SC_OPEN_MAX);
+            for (fd = 3; fd < max; fd++)
+                close(fd);
+        }
+        if (checkpoint)
+            _exit(checkpoint_write(ctx, tmp, path, wal_records) < 0);
+        _exit(write_snapshot(ctx, tmp, path, rows, taken, wal_records) < 0);
+    }
+    stall = now_us() - start;
+    pthread_mutex_unlock(&ctx->store_lock);
+    if (ctx->queries)
+        query_pool_resume(ctx->queries);
+
+    st->stall_us_total += stall;
+    if (stall > st->stall_us_max)
+        st->stall_us_max = stall;
+    st->last_stall_us = stall;
+    if (pid < 0) {
+        fprintf(stderr, "snapshot: can't fork: %s\n", strerror(errno));
+        st->failed++;
+        sqlite3_free(tmp);
+        return;
+    }
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    st->last_ms = (now_us() - start) / 1000;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        st->taken++;
+        st->last_at = taken;
+        st->last_rows = rows;
+        st->last_bytes = stat(path, &sb) == 0 ? sb.st_size : 0;
+    } else {
+        st->failed++;
+    }
+    sqlite3_free(tmp);
+}
+
+/* The snapshot thread: takes one when asked to, or every every_secs */
+static void *
+run_snapshots(void *arg)
+{
+    struct snapshot *s = (struct snapshot *)arg;
+    time_t due = time(NULL) + s->every_secs;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->stop) {
+        char *path = NULL;
+        int checkpoint = 0;
+        if (s->want) {
+            path = s->want;
+            checkpoint = s->want_checkpoint;
+            s->want = NULL;
+        } else if (s->every_secs > 0 && time(NULL) >= due) {
+            checkpoint = s->checkpoint != NULL;
+            path = strdup(checkpoint ? s->checkpoint : s->path);
+        }
+        if (!path) {
+            if (s->every_secs > 0) {
+                struct timespec ts = {due, 0};
+                pthread_cond_timedwait(&s->wake, &s->lock, &ts);
+            } else {
+                pthread_cond_wait(&s->wake, &s->lock);
+            }
+            continue;
+        }
+
+        s->running = 1;
+        pthread_mutex_unlock(&s->lock);
+        take_snapshot(s, path, checkpoint);
+        free(path);
+        pthread_mutex_lock(&s->lock);
+        s->running = 0;
+        due = time(NULL) + s->every_secs;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+struct snapshot *
+snapshot_create(struct tripstore_context *ctx, const char *path,
+                const char *checkpoint, int every_secs)
+{
+    struct snapshot *s = (struct snapshot *)calloc(1, sizeof(*s));
+
+    if (!s)
+        return NULL;
+    s->ctx = ctx;
+    s->path = strdup(path);
+    s->checkpoint = checkpoint ? strdup(checkpoint) : NULL;
+    s->every_secs = every_secs;
+    if (!s->path || (checkpoint && !s->checkpoint)) {
+        free(s->path);
+        free(s);
+        return NULL;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    return s;
+}
+
+int
+snapshot_start(struct snapshot *s)
+{
+    if (pthread_create(&s->thread, NULL, run_snapshots, s) != 0)
+        return -1;
+    s->started = 1;
+    return 0;
+}
+
+/* Ask for a snapshot (or a checkpoint) to path now. -1 if one is already
+   on its way. */
+int
+snapshot_request(struct snapshot *s, const char *path, int checkpoint)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&s->lock);
+    if (!s->running && !s->want) {
+        s->want = strdup(path);
+        s->want_checkpoint = checkpoint;
+        if (s->want) {
+            pthread_cond_signal(&s->wake);
+            rc = 0;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return rc;
+}
+
+/* Waits for a snapshot that is being written */
+void
+snapshot_destroy(struct snapshot *s)
+{
+    if (s->started) {
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+    }
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->wake);
+    free(s->want);
+    free(s->path);
+    free(s->checkpoint);
+    free(s);
+}
@@ -0,0 +1,37 @@
+/* Point-in-time copies of the store, written by a forked child while
+   ingest goes on: sqlite snapshots ("snapshot") and checkpoints for
+   restarts ("checkpoint", see checkpoint.c), also every --snapshot-secs.
+   See snapshot.c. Needs stats.h (struct snapshot_stats) included first. */
+
+#include <pthread.h>
+
+struct tripstore_context;
+
+struct snapshot
+{
+    struct tripstore_context *ctx;
+    char *path;                 /* --snapshot, where they go by default */
+    char *checkpoint;           /* --checkpoint, NULL for none */
+    int every_secs;             /* --snapshot-secs, 0 for only on request.
+                                   Checkpoints if there is --checkpoint. */
+
+    /* lock covers want, running and stop. The thread sleeps on wake. */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char *want;                 /* path asked for by a query, not yet begun */
+    int want_checkpoint;
+    int running;
+    int stop;
+    pthread_t thread;
+    int started;
+
+    struct snapshot_stats stats;
+};
+
+struct snapshot *snapshot_create(struct tripstore_context *ctx,
+                                 const char *path, const char *checkpoint,
+                                 int every_secs);
+int snapshot_start(struct snapshot *s);
+void snapshot_destroy(struct snapshot *s);
+
+int snapshot_request(struct snapshot *s, const char *path, int checkpoint);
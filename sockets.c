@@ -3,6 +3,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <unistd.h>
 
 #include "sockets.h"
 
@@ -15,7 +16,7 @@ sock_connect(const char *hostname, int port)
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
     addr.sin_addr.s_addr = inet_addr(hostname);
-    if (addr.sin_addr.s_addr == -1) {
+    if (addr.sin_addr.s_addr == INADDR_NONE) {
         struct hostent *phe;
         phe = gethostbyname(hostname);
         if (!phe)
@@ -34,8 +35,8 @@ sock_connect(const char *hostname, int port)
     return s;
 }
 
-int
-listen_on_port(int port)
+static int
+make_listener(int port, int reuseport)
 {
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
@@ -45,6 +46,11 @@ listen_on_port(int port)
     int s = socket(AF_INET, SOCK_STREAM, 0);
     int one = 1;
     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport &&
+            -1 == setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+        close(s);
+        return -1;
+    }
     if (-1 == bind(s, (struct sockaddr *)&addr, sizeof(addr))) {
         close(s);
         return -1;
@@ -55,3 +61,17 @@ listen_on_port(int port)
     }
     return s;
 }
+
+int
+listen_on_port(int port)
+{
+    return make_listener(port, 0);
+}
+
+/* Several sockets may listen on the same port this way and the kernel
+   spreads incoming connections across them. */
+int
+listen_on_port_reuse(int port)
+{
+    return make_listener(port, 1);
+}
@@ -1,4 +1,5 @@
 /* These are network utility functions. */
 
 int sock_connect(const char *host, int port);
-int list_on_port(int port);
+int listen_on_port(int port);
+int listen_on_port_reuse(int port);
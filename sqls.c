@@ -1,8 +1,26 @@
+#define _GNU_SOURCE             /* strptime() */
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
 #include "sqlite3.h"
 #include "sqls.h"
+#include "stats.h"
+#include "colstore.h"
+#include "grid.h"
+#include "hll.h"
+#include "active.h"
+#include "sat.h"
+#include "segment.h"
+#include "trips.h"
+#include "heatmap.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "reply.h"
+#include "scan.h"
+#include "quant.h"
+#include "bufpool.h"
 #include "ctx.h"
 
 /*
@@ -24,21 +42,55 @@
 
     tripsummary: 
 
-    id INTEGER | begin INTEGER | end INTEGER
+    id INTEGER | begin INTEGER | end INTEGER | start_long REAL |
+    start_lat REAL | end_long REAL | end_lat REAL | fare_cents INTEGER
     
              Contains the begin and end time for each trip (or NULL while
-             trip is active. This table is there to provide fast access
-             to questions about which trips where active when. The begin
-             and end times are stored as unix timestamps (time_t values
-             for example from the time() function). They are stored
-             in GMT.
+             trip is active), where it started and ended and its fare.
+             The begin and end times are stored as unix timestamps
+             (time_t values for example from the time() function). They
+             are stored in GMT. This is not a table any more but a
+             virtual table over the trip records in trips.c, which are an
+             array indexed by id.
+
+    tripends_rtree / triplog_rtree:
+
+    rowid INTEGER | min_lat | max_lat | min_long | max_long
+
+             R-tree virtual tables over the triplog points, keyed by the
+             triplog rowid (so min and max are the same point).
+             tripends_rtree has only the BEGIN and END rows and
+             triplog_rtree has all of them. Which ones exist depends on
+             --rtree, and tripends_rtree also on there being no
+             summed-area tables (--sat 0), which otherwise answer every
+             report2.
+
+    Each time segment of the log (see segment.c) has its own copy of
+    triplog and the R-trees, in an in-memory database attached as
+    seg<seq>. triplog itself is a TEMP view of the UNION ALL of the
+    segments, for ad-hoc sql. A trip is always in one segment, so the
+    reports run on each segment whose bounding box meets the rect and add
+    up the counts.
 
     There's a description of expected running times for each of the reporting
     queries below.
 
+    With --engine columnar the trip log goes to colstore.c instead and the
+    reports are answered from there. There are no sqlite tables in that
+    case.
+
+    With --grid (the default) report1 is answered from the grid index in
+    grid.c with either engine, and with --sat (also the default) report2
+    from the summed-area tables in sat.c.
+
+    "report1~" and "report2~" are approximate versions answered from the
+    sketches in hll.c (--hll). They return the estimate, its error bound
+    and the rect that was actually counted.
+
 */
 
-/* Here are the queries for each of the reports: */
+/* Here are the queries for each of the reports. The sql on the tables of
+   a segment has %s where the segment's schema name goes (see seg_sql()). */
 
 /* "- How many trips passed through a given geo-rect (defined by four 
        at/long pairs)."
@@ -46,7 +98,7 @@
    lat and long are the front of the index, and id is contained in that
    index. This should always be at worse O(log(n)).
 */
-static char report1_sql[] = "SELECT COUNT(DISTINCT id) FROM triplog WHERE "
+static char report1_sql[] = "SELECT COUNT(DISTINCT id) FROM %s.triplog WHERE "
     "lat >= ? AND lat <= ? AND long >= ? AND long <= ?;";
 
 /* "- How many trips started or stopped within a given geo-rect, and the
@@ -56,46 +108,123 @@ static char report1_sql[] = "SELECT COUNT(DISTINCT id) FROM triplog WHERE "
     therin. This should always be at worst O(log(n)).
 */
 static char report2_sql[] = "SELECT COUNT(DISTINCT id), SUM(fare_cents) FROM "
-    "triplog WHERE lat >= ? AND lat <= ? AND long >= ? AND long <= ? AND "
+    "%s.triplog WHERE lat >= ? AND lat <= ? AND long >= ? AND long <= ? AND "
     "(type = 0 OR type = 2);";
 
 
+/* The R-tree versions of the geo-rect reports.
+
+   tripends_rtree is a few percent of triplog, so report2 walks only the
+   BEGIN/END points inside the rect and looks each one up by rowid, instead
+   of range scanning every point with a matching lat and filtering the
+   long and type.
+
+   triplog_rtree has every point, and at millions of points it only beats
+   lat_long_idx for narrow rects: each hit costs a rowid lookup into
+   triplog, where the covering index already has the id in hand. So
+   report1 only uses it for rects that cover little of the data (see
+   RTREE_REPORT1_FRACTION).
+*/
+static char report1_rtree_sql[] = "SELECT COUNT(DISTINCT t.id) FROM "
+    "%s.triplog_rtree r, %s.triplog t WHERE t.rowid = r.rowid AND "
+    "r.min_lat >= ? AND r.max_lat <= ? AND "
+    "r.min_long >= ? AND r.max_long <= ?;";
+
+static char report2_rtree_sql[] = "SELECT COUNT(DISTINCT t.id), "
+    "SUM(t.fare_cents) FROM %s.tripends_rtree r, %s.triplog t WHERE "
+    "t.rowid = r.rowid AND r.min_lat >= ? AND r.max_lat <= ? AND "
+    "r.min_long >= ? AND r.max_long <= ?;";
+
+/* The shared scan of lat_long_idx (see scan.c): the rows of a band of
+   lat, in lat order, for the rects of a scan to be checked against */
+static char scan_sql[] = "SELECT lat, long, type, id, fare_cents FROM "
+    "%s.triplog WHERE lat >= ? AND lat <= ?;";
+
+/* report1 goes to triplog_rtree when the rect covers at most this much
+   of the bounding box of the segment */
+#define RTREE_REPORT1_FRACTION 0.005
+
+
 /* "- How many trips were occurring at a given point in time."
 
-   begin and end are at the front of the index and id is contained therin. This
-   should always be at worse O (log(n))
+   This used to be a query on tripsummary, but its (begin, end, id) index
+   only bounds the begin side, so it walked every trip that started
+   before the time asked about. It is now answered from the running
+   totals in active.c with either engine, in O(1).
 */
-static char report3_sql[] = "SELECT COUNT(DISTINCT id) FROM tripsummary WHERE "
-                            "begin <= ? AND (end ISNULL OR end >= ?);";
 
 
-/* DDL follows ... */
+/* DDL follows, for each segment ... */
+
+static char attach_sql[] = "ATTACH ':memory:' AS seg%lu;";
+
+/* With query workers (query.c) a segment is a shared-cache database, that
+   their connections attach too. The name has ctx in it, for more than one
+   store in a process. */
+static char attach_shared_sql[] =
+    "ATTACH 'file:tripstore-%p-seg%lu?mode=memory&cache=shared' AS seg%lu;";
+
+/* triplog and the R-trees come in two flavours: [0] with REAL long and
+   lat, and [1] with the fixed point integers of --coord-bits (quant.h) */
+static char *triplog_ddl[] = {
+"CREATE TABLE %s.triplog(id INTEGER,"
+"                        long REAL,"
+"                        lat REAL,"
+"                        type INTEGER,"
+"                        fare_cents INTEGER DEFAULT 0);",
+"CREATE TABLE %s.triplog(id INTEGER,"
+"                        long INTEGER,"
+"                        lat INTEGER,"
+"                        type INTEGER,"
+"                        fare_cents INTEGER DEFAULT 0);"};
 
 static char ddl_sql[] =
-"CREATE TABLE triplog(id INTEGER,"
-"                     long REAL,"
-"                     lat REAL,"
-"                     type INTEGER,"
-"                     fare_cents INTEGER DEFAULT 0);"
-"CREATE INDEX lat_long_idx ON triplog(lat, long, type, id, fare_cents);"
-"CREATE INDEX type_idx ON triplog(id, type);"
-"CREATE TABLE tripsummary(id INTEGER,"
-"                         begin INTEGER,"
-"                         end INTEGER);"
-"CREATE INDEX summary_id_index ON tripsummary(id);"
-"CREATE INDEX summary_time_index ON tripsummary(begin, end, id);";
+"CREATE INDEX %s.lat_long_idx ON triplog(lat, long, type, id, fare_cents);"
+"CREATE INDEX %s.type_idx ON triplog(id, type);";
+
+static char *ends_rtree_ddl[] = {
+"CREATE VIRTUAL TABLE %s.tripends_rtree USING rtree(rowid, min_lat, max_lat,"
+"                                                  min_long, max_long);",
+"CREATE VIRTUAL TABLE %s.tripends_rtree USING rtree_i32(rowid,"
+"                                  min_lat, max_lat, min_long, max_long);"};
+
+static char *all_rtree_ddl[] = {
+"CREATE VIRTUAL TABLE %s.triplog_rtree USING rtree(rowid, min_lat, max_lat,"
+"                                                 min_long, max_long);",
+"CREATE VIRTUAL TABLE %s.triplog_rtree USING rtree_i32(rowid,"
+"                                 min_lat, max_lat, min_long, max_long);"};
+
+static char detach_sql[] = "DETACH %s;";
 
-static char insert_sql[] = "INSERT INTO triplog VALUES(?, ?, ?, ?, ?);";
+static char insert_sql[] = "INSERT INTO %s.triplog VALUES(?, ?, ?, ?, ?);";
 
-static char insert_summary[] = "INSERT INTO tripsummary VALUES(?, ?, NULL);";
+static char insert_ends_rtree_sql[] =
+    "INSERT INTO %s.tripends_rtree VALUES(?, ?, ?, ?, ?);";
 
-static char update_summary[] = "UPDATE tripsummary SET end = ? WHERE id = ?;";
+static char insert_rtree_sql[] =
+    "INSERT INTO %s.triplog_rtree VALUES(?, ?, ?, ?, ?);";
+
+/* plain PRAGMAs: the pragma_page_count() table-valued function is newer
+   than our sqlite */
+static char page_count_sql[] = "PRAGMA %s.page_count;";
+
+static char page_size_sql[] = "PRAGMA %s.page_size;";
+
+static char begin_sql[] = "BEGIN;";
+
+static char commit_sql[] = "COMMIT;";
+
+static char rollback_sql[] = "ROLLBACK;";
+
+/* times end_batch() tries to commit a batch before rolling it back */
+#define BATCH_COMMIT_TRIES 3
 
 
 /* open_create_db
 
-   This opens our sqlite in memory database and runs the ddl to create
-   our catalog.
+   This opens our sqlite in memory database and makes tripsummary over
+   ctx->trips. The catalog is made one segment at a time by
+   open_segment_sql().
 */
 
 int
@@ -103,10 +232,11 @@ open_create_db(struct tripstore_context *ctx)
 {
     ctx->db = NULL;
     int rc;
-    char *errmsg = NULL;
 
-    /* Create the in memory data store */
-    rc = sqlite3_open(":memory:", &ctx->db);
+    /* Create the in memory data store. URI names are for the segments
+       that query workers share, see attach_segment(). */
+    rc = sqlite3_open_v2(":memory:", &ctx->db, SQLITE_OPEN_READWRITE |
+                         SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "Failed to open sqlite memory db: %s\n",
                 sqlite3_errmsg(ctx->db));
@@ -114,17 +244,7 @@ open_create_db(struct tripstore_context *ctx)
         ctx->db = NULL;
         return -1;
     }
-
-    /* Run our ddl to create the catalog */
-    rc = sqlite3_exec(ctx->db, ddl_sql, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to make ddl: %s\n", errmsg);
-        sqlite3_free(errmsg);
-        sqlite3_close(ctx->db);
-        ctx->db = NULL;
-        return -1;
-    }
-    return 0;
+    return trips_create_module(ctx->db, ctx->trips);
 }
 
 /* cleanup prepared statements */
@@ -137,17 +257,15 @@ finalize_one(sqlite3_stmt **s)
     }
 }
 
-/* shutdown the database and clean things up */
+/* shutdown the database and clean things up. The segments must have
+   been closed already. */
 void
 close_db(struct tripstore_context *ctx)
 {
-    int i;
-    finalize_one(&ctx->insert);
-    finalize_one(&ctx->insert_summary);
-    finalize_one(&ctx->update_summary);
-    for (i = 0; i < 3; i++) {
-        finalize_one(&ctx->reports[i]);
-    }
+    end_batch(ctx);
+    finalize_one(&ctx->begin);
+    finalize_one(&ctx->commit);
+    finalize_one(&ctx->rollback);
 
     sqlite3_close(ctx->db);
     ctx->db = NULL;
@@ -163,129 +281,479 @@ prepare_one(struct tripstore_context *ctx, const char *sql, sqlite3_stmt **stmt)
         fprintf(stderr, "prepare: \"%s\": %s\n", sql, sqlite3_errstr(rc));
         return -1;
     }
+    return 0;
 }
 
-/* prepare each of our reporting queries */
+/* prepare the statements that aren't on any one segment */
 int
 prepare_statements(struct tripstore_context *ctx)
 {
-    prepare_one(ctx, insert_sql, &ctx->insert);
-    prepare_one(ctx, insert_summary, &ctx->insert_summary);
-    prepare_one(ctx, update_summary, &ctx->update_summary);
-    prepare_one(ctx, report1_sql, &ctx->reports[0]);
-    prepare_one(ctx, report2_sql, &ctx->reports[1]);
-    prepare_one(ctx, report3_sql, &ctx->reports[2]);
+    prepare_one(ctx, begin_sql, &ctx->begin);
+    prepare_one(ctx, commit_sql, &ctx->commit);
+    prepare_one(ctx, rollback_sql, &ctx->rollback);
     return 0;
 }
 
-/* this is the entrypoint for all rows in the database */
+/* fmt with each %s (there are at most 8) made the schema name of seg.
+   Free it with sqlite3_free(). */
+static char *
+seg_sql(struct segment *seg, const char *fmt)
+{
+    const char *n = seg->name;
+    return sqlite3_mprintf(fmt, n, n, n, n, n, n, n, n);
+}
+
+static int
+exec_seg(struct tripstore_context *ctx, struct segment *seg, const char *fmt)
+{
+    char *sql = seg_sql(seg, fmt);
+    char *errmsg = NULL;
+    int rc;
+
+    if (!sql)
+        return -1;
+    rc = sqlite3_exec(ctx->db, sql, NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", sql, errmsg);
+        sqlite3_free(errmsg);
+    }
+    sqlite3_free(sql);
+    return rc == SQLITE_OK ? 0 : -1;
+}
+
+static int
+prepare_seg(struct tripstore_context *ctx, struct segment *seg,
+            const char *fmt, sqlite3_stmt **stmt)
+{
+    char *sql = seg_sql(seg, fmt);
+    int rc;
+
+    if (!sql)
+        return -1;
+    rc = prepare_one(ctx, sql, stmt);
+    sqlite3_free(sql);
+    return rc;
+}
+
+static void
+finalize_seg(struct segment *seg)
+{
+    int i;
+    finalize_one(&seg->insert);
+    for (i = 0; i < 2; i++) {
+        finalize_one(&seg->reports[i]);
+    }
+    finalize_one(&seg->insert_rtree);
+    finalize_one(&seg->insert_ends_rtree);
+    finalize_one(&seg->report1_rtree);
+    finalize_one(&seg->report2_rtree);
+    finalize_one(&seg->scan);
+    finalize_one(&seg->page_count);
+    finalize_one(&seg->page_size);
+}
+
+/* Attach the database of segment seq to db, ctx->db or the connection
+   of a query worker, as seg<seq> */
 int
-add_tripdata(struct tripstore_context *ctx,
-             int id, float lng, float lat, enum TRIP_EVENT_TYPE t, int cents)
+attach_segment(struct tripstore_context *ctx, sqlite3 *db, unsigned long seq)
 {
+    char *errmsg = NULL;
+    char *sql;
     int rc;
-    if (sqlite3_bind_int(ctx->insert, 1, id) != SQLITE_OK)
+
+    if (ctx->shared_segments)
+        sql = sqlite3_mprintf(attach_shared_sql, (void *)ctx, seq, seq);
+    else
+        sql = sqlite3_mprintf(attach_sql, seq);
+    if (!sql)
+        return -1;
+    rc = sqlite3_exec(db, sql, NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", sql, errmsg);
+        sqlite3_free(errmsg);
+    }
+    sqlite3_free(sql);
+    return rc == SQLITE_OK ? 0 : -1;
+}
+
+/* open_segment_sql
+
+   Attach the database for a new segment, make its catalog (and the
+   R-trees that --rtree asked for) and prepare its statements. Not inside
+   of a transaction.
+*/
+int
+open_segment_sql(struct tripstore_context *ctx, struct segment *seg)
+{
+    int fixed = ctx->quant != NULL;
+
+    if (attach_segment(ctx, ctx->db, seg->seq) < 0)
+        return -1;
+    if (exec_seg(ctx, seg, triplog_ddl[fixed]) < 0 ||
+        exec_seg(ctx, seg, ddl_sql) < 0)
         goto fail;
-    if (sqlite3_bind_double(ctx->insert, 2, lng) != SQLITE_OK)
+    if (ctx->ends_rtree &&
+        exec_seg(ctx, seg, ends_rtree_ddl[fixed]) < 0)
         goto fail;
-    if (sqlite3_bind_double(ctx->insert, 3, lat) != SQLITE_OK)
+    if (ctx->rtree >= RTREE_ALL &&
+        exec_seg(ctx, seg, all_rtree_ddl[fixed]) < 0)
         goto fail;
-    if (sqlite3_bind_int(ctx->insert, 4, t) != SQLITE_OK)
+
+    if (prepare_seg(ctx, seg, insert_sql, &seg->insert) < 0 ||
+        prepare_seg(ctx, seg, report1_sql, &seg->reports[0]) < 0 ||
+        prepare_seg(ctx, seg, report2_sql, &seg->reports[1]) < 0 ||
+        prepare_seg(ctx, seg, scan_sql, &seg->scan) < 0 ||
+        prepare_seg(ctx, seg, page_count_sql, &seg->page_count) < 0 ||
+        prepare_seg(ctx, seg, page_size_sql, &seg->page_size) < 0)
         goto fail;
-    if (sqlite3_bind_int(ctx->insert, 5, cents) != SQLITE_OK)
+    if (ctx->ends_rtree &&
+        (prepare_seg(ctx, seg, insert_ends_rtree_sql,
+                     &seg->insert_ends_rtree) < 0 ||
+         prepare_seg(ctx, seg, report2_rtree_sql, &seg->report2_rtree) < 0))
         goto fail;
-
-    /* When we add a BEGIN message, insert a new row into the tripsummary */
-    if (t == BEGIN) {
-        if (sqlite3_bind_int(ctx->insert_summary, 1, id) != SQLITE_OK)
-            goto fail;
-        if (sqlite3_bind_int(ctx->insert_summary, 2, time(NULL)) !=
-                SQLITE_OK)
-            goto fail;
-        if (sqlite3_step(ctx->insert_summary) != SQLITE_DONE)
-            goto fail;
-        sqlite3_reset(ctx->insert_summary);
-    /* When we add an END message, update the tripsummary row for the id */
-    } else if (t == END) {
-        if (sqlite3_bind_int(ctx->update_summary, 1, time(NULL)) !=
-                SQLITE_OK)
-            goto fail;
-        if (sqlite3_bind_int(ctx->update_summary, 2, id) != SQLITE_OK)
-            return -1;
-        if (sqlite3_step(ctx->update_summary) != SQLITE_DONE)
-            goto fail;
-        sqlite3_reset(ctx->update_summary);
-    }
-
-    rc = sqlite3_step(ctx->insert);
-    if (rc != SQLITE_DONE)
+    if (ctx->rtree >= RTREE_ALL &&
+        (prepare_seg(ctx, seg, insert_rtree_sql, &seg->insert_rtree) < 0 ||
+         prepare_seg(ctx, seg, report1_rtree_sql, &seg->report1_rtree) < 0))
         goto fail;
-
-    sqlite3_reset(ctx->insert);
     return 0;
+
 fail:
-    fprintf(stderr, "Failed to update tripdata!\n");
+    close_segment_sql(ctx, seg);
     return -1;
 }
 
-struct rowout_ctx
+/* Finalize the statements of seg and detach its database, which frees
+   all of it. Not inside of a transaction. */
+void
+close_segment_sql(struct tripstore_context *ctx, struct segment *seg)
 {
-    struct tripstore_context *ctx;
-    int fd;
-};
+    finalize_seg(seg);
+    exec_seg(ctx, seg, detach_sql);
+}
 
-/* Output this row data to the file descriptor provided. This is the handler
-   for the sqlite3_exec() callback interface */
+/* Make the triplog view of db (ctx->db, or a query worker's) cover the
+   segments we have now. With --coord-bits it turns long and lat back
+   into degrees. */
 int
-row_to_fd(void *pd, int cols, char **data, char **names)
+update_segment_views(struct tripstore_context *ctx, sqlite3 *db)
 {
-    struct rowout_ctx *ctx = (struct rowout_ctx *)pd;
-    int i;
-    for (i = 0; i < cols; i++) {
-        if (i != 0)
-            write(ctx->fd, " ", 1);
-        if (!data[i])
-            write(ctx->fd, "NULL", strlen("NULL"));
-        else
-            write(ctx->fd, data[i], strlen(data[i]));
+    struct segments *s = ctx->segments;
+    struct quant *q = ctx->quant;
+    char *errmsg = NULL;
+    char *cols;
+    char *sql;
+    int j;
+    int rc;
+
+    if (q)
+        cols = sqlite3_mprintf("id, %.17g + long * %.17g AS long, "
+                               "%.17g + lat * %.17g AS lat, type, "
+                               "fare_cents", q->mid_lng, q->step_lng,
+                               q->mid_lat, q->step_lat);
+    else
+        cols = sqlite3_mprintf("*");
+    sql = sqlite3_mprintf("DROP VIEW IF EXISTS temp.triplog;"
+                          "CREATE TEMP VIEW triplog AS");
+    for (j = 0; sql && cols && j < s->n; j++)
+        sql = sqlite3_mprintf("%z%s SELECT %s FROM %s.triplog", sql,
+                              j ? " UNION ALL" : "", cols,
+                              s->segs[j]->name);
+    sqlite3_free(cols);
+    if (!sql)
+        return -1;
+    rc = sqlite3_exec(db, sql, NULL, NULL, &errmsg);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to make triplog view: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        return -1;
     }
-    write(ctx->fd, "\n", 1);
     return 0;
 }
 
-/* Output this row data to the file descriptor provided. This is the handler
-   for the sqlite3_step() iteration interface */
+/* bytes of sqlite pages the tables of seg take */
+unsigned long
+segment_sql_bytes(struct segment *seg)
+{
+    sqlite3_int64 pages = 0, size = 0;
+    if (sqlite3_step(seg->page_count) == SQLITE_ROW)
+        pages = sqlite3_column_int64(seg->page_count, 0);
+    sqlite3_reset(seg->page_count);
+    if (sqlite3_step(seg->page_size) == SQLITE_ROW)
+        size = sqlite3_column_int64(seg->page_size, 0);
+    sqlite3_reset(seg->page_size);
+    return pages * size;
+}
+
+/* milliseconds since the open batch was started */
+static long
+batch_age_ms(struct tripstore_context *ctx)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - ctx->batch_start.tv_sec) * 1000 +
+           (now.tv_nsec - ctx->batch_start.tv_nsec) / 1000000;
+}
+
+/* begin_batch
+
+   Group commit. In autocommit mode each add_tripdata() is its own
+   transaction and pays the whole commit cost for a single row. Instead
+   add_tripdata() opens a transaction on the first row, and the event loop
+   commits it after it has handled an epoll_wait() wakeup (or after
+   batch_max_ms if that is set). A batch that reaches batch_max_rows is
+   committed right away.
+*/
 int
-step_to_fd(sqlite3_stmt *stmt, int fd)
+begin_batch(struct tripstore_context *ctx)
 {
-    int cols;
-    const char *col;
-    int collen;
-    int i;
-    while (SQLITE_ROW == sqlite3_step(stmt)) {
-        cols = sqlite3_column_count(stmt);
-        for (i = 0; i < cols; i++) {
-            col = sqlite3_column_text(stmt, i);
-            collen = sqlite3_column_bytes(stmt, i);
-            if (i != 0)
-                write(fd, " ", 1);
-            if (!col)
-                write(fd, "NULL", strlen("NULL"));
-            else
-                write(fd, col, collen);
+    if (ctx->in_batch)
+        return 0;
 
-        }
-        write(fd, "\n", 1);
+    if (sqlite3_step(ctx->begin) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to begin batch: %s\n",
+                sqlite3_errmsg(ctx->db));
+        sqlite3_reset(ctx->begin);
+        return -1;
+    }
+    sqlite3_reset(ctx->begin);
+    ctx->in_batch = 1;
+    ctx->batch_rows = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ctx->batch_start);
+    return 0;
+}
+
+/* Give up on the open batch: roll it back if sqlite hasn't already */
+static void
+abandon_batch(struct tripstore_context *ctx)
+{
+    if (!sqlite3_get_autocommit(ctx->db)) {
+        if (sqlite3_step(ctx->rollback) != SQLITE_DONE)
+            fprintf(stderr, "Failed to roll back batch: %s\n",
+                    sqlite3_errmsg(ctx->db));
+        sqlite3_reset(ctx->rollback);
+    }
+    ctx->batch_stats.lost += ctx->batch_rows;
+    ctx->in_batch = 0;
+    ctx->batch_fails = 0;
+}
+
+/* commit the open batch, if there is one */
+int
+end_batch(struct tripstore_context *ctx)
+{
+    struct batch_stats *stats = &ctx->batch_stats;
+
+    if (!ctx->in_batch)
+        return 0;
+
+    if (sqlite3_step(ctx->commit) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to commit batch: %s\n",
+                sqlite3_errmsg(ctx->db));
+        sqlite3_reset(ctx->commit);
+        stats->failed++;
+        /* A commit that fails (SQLITE_LOCKED by a reader of a shared
+           segment, say) leaves the transaction open, and every BEGIN
+           after it would fail. Keep the batch and commit it again next
+           time, and roll it back after BATCH_COMMIT_TRIES. */
+        if (!sqlite3_get_autocommit(ctx->db) &&
+            ++ctx->batch_fails < BATCH_COMMIT_TRIES)
+            return -1;
+        abandon_batch(ctx);
+        return -1;
     }
+    sqlite3_reset(ctx->commit);
+    ctx->in_batch = 0;
+    ctx->batch_fails = 0;
+
+    stats->batches++;
+    stats->rows += ctx->batch_rows;
+    if ((unsigned long)ctx->batch_rows > stats->max_rows)
+        stats->max_rows = ctx->batch_rows;
+    return 0;
+}
+
+/* Should the event loop commit the open batch now? */
+int
+batch_due(struct tripstore_context *ctx)
+{
+    if (!ctx->in_batch)
+        return 0;
+    return ctx->batch_max_ms <= 0 || batch_age_ms(ctx) >= ctx->batch_max_ms;
+}
+
+/* How long the event loop may block before the open batch is due. This
+   is suitable for passing as the epoll_wait() timeout. */
+int
+batch_timeout_ms(struct tripstore_context *ctx)
+{
+    long left;
+    if (!ctx->in_batch)
+        return -1;
+    left = ctx->batch_max_ms - batch_age_ms(ctx);
+    return left > 0 ? left : 0;
+}
+
+/* Bind a lat or long, as the fixed point integer with --coord-bits */
+static int
+bind_lat(struct tripstore_context *ctx, sqlite3_stmt *stmt, int i, double lat)
+{
+    if (ctx->quant)
+        return sqlite3_bind_int64(stmt, i, quant_lat(ctx->quant, lat));
+    return sqlite3_bind_double(stmt, i, lat);
+}
+
+static int
+bind_lng(struct tripstore_context *ctx, sqlite3_stmt *stmt, int i, double lng)
+{
+    if (ctx->quant)
+        return sqlite3_bind_int64(stmt, i, quant_lng(ctx->quant, lng));
+    return sqlite3_bind_double(stmt, i, lng);
+}
+
+/* Put the triplog row at rowid into one of the R-trees, as a point */
+static int
+insert_rtree(struct tripstore_context *ctx, sqlite3_stmt *stmt,
+             sqlite3_int64 rowid, float lng, float lat)
+{
+    int rc;
+    sqlite3_bind_int64(stmt, 1, rowid);
+    bind_lat(ctx, stmt, 2, lat);
+    bind_lat(ctx, stmt, 3, lat);
+    bind_lng(ctx, stmt, 4, lng);
+    bind_lng(ctx, stmt, 5, lng);
+    rc = sqlite3_step(stmt);
     sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
 }
 
-void
-send_err_msg(int fd, const char *msg)
+/* this is the entrypoint for all rows in the database */
+int
+add_tripdata(struct tripstore_context *ctx,
+             int64_t id, float lng, float lat, enum TRIP_EVENT_TYPE t,
+             int cents)
+{
+    return add_tripdata_at(ctx, id, lng, lat, t, cents, time(NULL));
+}
+
+/* add_tripdata() for an event that came in at now. Replaying the log
+   (wal.c) brings the events back with their times. */
+int
+add_tripdata_at(struct tripstore_context *ctx,
+                int64_t id, float lng, float lat, enum TRIP_EVENT_TYPE t,
+                int cents, time_t now)
+{
+    int rc;
+    struct segment *seg;
+    struct trip *r;
+    int changed;
+
+    /* A trip on a page of records that retention dropped went with its
+       segment. Its late events would only land in the newest segment, a
+       trip with no BEGIN at a time that isn't its own. */
+    if (id >> TRIPS_PAGE_BITS < ctx->trips->first_page) {
+        ctx->trips->ignored++;
+        return 0;
+    }
+    /* An update or an end of a trip with no record never began: it is a
+       stray or made up id, and everything below is sized by trip id. A
+       trip's BEGIN is always ahead of its other events on the queue. */
+    if (t != BEGIN && !trips_get(ctx->trips, id)) {
+        /* logged at the first and then at each power of 2 */
+        if (!(ctx->trips->unknown & (ctx->trips->unknown - 1)))
+            fprintf(stderr, "dropping events of trip %lld, which never "
+                    "began (%lu so far)\n", (long long)id,
+                    ctx->trips->unknown + 1);
+        ctx->trips->unknown++;
+        return 0;
+    }
+    if (ctx->wal)
+        wal_append(ctx->wal, id, lng, lat, t, cents, now);
+    seg = segments_route(ctx, id, t, now);
+    if (!seg)
+        return -1;
+    /* The trip's record is the tripsummary row: a BEGIN or an END fills
+       in its half */
+    changed = trips_add(ctx->trips, id, seg->seq, lng, lat, t, cents, now,
+                        &r);
+    if (changed < 0)
+        return -1;
+    if (seg->grid && grid_add(seg->grid, id, lng, lat) < 0)
+        return -1;
+    if (seg->hll && hll_add(seg->hll, id, lng, lat, t, cents) < 0)
+        return -1;
+    if (seg->sat &&
+        sat_add(seg->sat, lng, lat, t, cents,
+                r && r->begun ? r->start_lat : NAN,
+                r && r->begun ? r->start_lng : NAN) < 0)
+        return -1;
+    /* only a trip that really began or ended moves report3's counts; a
+       repeated BEGIN or END would shift them for good */
+    if (changed && active_add(ctx->active, t, now) < 0)
+        return -1;
+    if (ctx->engine == ENGINE_COLUMNAR) {
+        if (colstore_add(seg->cs, id, lng, lat, t, cents, now) < 0)
+            return -1;
+        segment_added(seg, id, lng, lat, t, now);
+        return 0;
+    }
+
+    if (ctx->batch_max_rows > 1 && begin_batch(ctx) < 0)
+        goto fail;
+
+    if (sqlite3_bind_int64(seg->insert, 1, id) != SQLITE_OK)
+        goto fail;
+    if (bind_lng(ctx, seg->insert, 2, lng) != SQLITE_OK)
+        goto fail;
+    if (bind_lat(ctx, seg->insert, 3, lat) != SQLITE_OK)
+        goto fail;
+    if (sqlite3_bind_int(seg->insert, 4, t) != SQLITE_OK)
+        goto fail;
+    if (sqlite3_bind_int(seg->insert, 5, cents) != SQLITE_OK)
+        goto fail;
+
+    rc = sqlite3_step(seg->insert);
+    if (rc != SQLITE_DONE)
+        goto fail;
+
+    sqlite3_reset(seg->insert);
+
+    if (ctx->ends_rtree && t != TRANSIT &&
+            insert_rtree(ctx, seg->insert_ends_rtree,
+                         sqlite3_last_insert_rowid(ctx->db), lng, lat) < 0)
+        goto fail;
+    if (ctx->rtree >= RTREE_ALL &&
+            insert_rtree(ctx, seg->insert_rtree,
+                         sqlite3_last_insert_rowid(ctx->db), lng, lat) < 0)
+        goto fail;
+    segment_added(seg, id, lng, lat, t, now);
+
+    if (ctx->in_batch && ++ctx->batch_rows >= ctx->batch_max_rows)
+        end_batch(ctx);
+    return 0;
+fail:
+    fprintf(stderr, "Failed to update tripdata!\n");
+    return -1;
+}
+
+/* Send one formatted line as a row of one text column, for the
+   messages we answer with ourselves */
+static void
+send_line(struct reply *r, const char *fmt, ...)
 {
-    write(fd, "error: ", strlen("error: "));
-    write(fd, msg, strlen(msg));
-    write(fd, "\n", 1);
+    char buf[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        len = 0;
+    else if (len >= (int)sizeof(buf))
+        len = sizeof(buf) - 1;
+    reply_text(r, buf, len);
+    reply_row(r);
 }
 
 /* Make sure that the one that should be lower is lower. If it isn't, swap
@@ -302,14 +770,15 @@ ensure_order(double *d1, double *d2)
 }
 
 void
-bind4(sqlite3_stmt *stmt, double d1, double d2, double d3, double d4)
+bind4(struct tripstore_context *ctx, sqlite3_stmt *stmt,
+      double d1, double d2, double d3, double d4)
 {
     ensure_order(&d1, &d2);
     ensure_order(&d3, &d4); 
-    sqlite3_bind_double(stmt, 1, d1);
-    sqlite3_bind_double(stmt, 2, d2);
-    sqlite3_bind_double(stmt, 3, d3);
-    sqlite3_bind_double(stmt, 4, d4);
+    bind_lat(ctx, stmt, 1, d1);
+    bind_lat(ctx, stmt, 2, d2);
+    bind_lng(ctx, stmt, 3, d3);
+    bind_lng(ctx, stmt, 4, d4);
 }
 
 /* Data is stored in the database in gmt. This converts a local time
@@ -327,54 +796,618 @@ localtime_to_gmt(const char *tstr)
     return mktime(&tm);
 }
 
+/* A local time like TIME_FORMAT at the start of tstr (after any blanks),
+   as its gmt unixtime in t. Returns where it ends, or NULL if there
+   wasn't one. */
+static const char *
+parse_local_time(const char *tstr, time_t *t)
+{
+    struct tm tm = {0, 0, 0, 0, 0, 0, 0, 0, -1, 0, NULL};
+    int end = 0;
+
+    if (6 != sscanf(tstr, " %d-%d-%d %d:%d:%d%n", &tm.tm_year, &tm.tm_mon,
+                    &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &end))
+        return NULL;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *t = mktime(&tm);
+    return tstr + end;
+}
+
+/* Is the rect small enough, against the data in seg, that report1
+   should walk triplog_rtree rather than range scan lat_long_idx?
+   lat1 <= lat2 and lng1 <= lng2. */
+static int
+report1_use_rtree(struct tripstore_context *ctx, struct segment *seg,
+                  double lat1, double lat2, double lng1, double lng2)
+{
+    double data_area, dlat, dlng;
+
+    if (ctx->rtree < RTREE_ALL || !seg->have_bbox)
+        return 0;
+    data_area = ((double)seg->max_lat - seg->min_lat) *
+                ((double)seg->max_lng - seg->min_lng);
+    if (data_area <= 0)
+        return 0;
+
+    /* only the part of the rect that overlaps the data counts */
+    dlat = (lat2 < seg->max_lat ? lat2 : seg->max_lat) -
+           (lat1 > seg->min_lat ? lat1 : seg->min_lat);
+    dlng = (lng2 < seg->max_lng ? lng2 : seg->max_lng) -
+           (lng1 > seg->min_lng ? lng1 : seg->min_lng);
+    if (dlat < 0 || dlng < 0)
+        return 1;
+    return dlat * dlng <= data_area * RTREE_REPORT1_FRACTION;
+}
+
+/* Run one of the sql reports on a segment. The trip count comes back,
+   and for report2 the fares and whether there were any rows to sum. */
+static unsigned long
+step_report(struct tripstore_context *ctx, sqlite3_stmt *stmt,
+            double lat1, double lat2, double lng1, double lng2,
+            long long *fares, unsigned long *rows)
+{
+    unsigned long count = 0;
+
+    bind4(ctx, stmt, lat1, lat2, lng1, lng2);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        count = sqlite3_column_int64(stmt, 0);
+        if (fares && sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
+            *fares = sqlite3_column_int64(stmt, 1);
+            *rows = 1;
+        }
+    }
+    sqlite3_reset(stmt);
+    return count;
+}
+
+/* report1 on one segment, from the grid index, the columns or sqlite.
+   -1 if we ran out of memory. */
+static long
+segment_report1(struct tripstore_context *ctx, struct segment *seg,
+                double lat1, double lat2, double lng1, double lng2)
+{
+    if (seg->grid)
+        return grid_report1(seg->grid, lat1, lat2, lng1, lng2);
+    if (seg->cs)
+        return colstore_report1(seg->cs, lat1, lat2, lng1, lng2);
+    if (report1_use_rtree(ctx, seg, lat1, lat2, lng1, lng2))
+        return step_report(ctx, seg->report1_rtree, lat1, lat2, lng1, lng2,
+                           NULL, NULL);
+    return step_report(ctx, seg->reports[0], lat1, lat2, lng1, lng2,
+                       NULL, NULL);
+}
+
+/* report2 on one segment, from the summed-area tables, the columns or
+   sqlite. -1 if we ran out of memory. */
+static long
+segment_report2(struct tripstore_context *ctx, struct segment *seg,
+                double lat1, double lat2, double lng1, double lng2,
+                long long *fares, unsigned long *rows)
+{
+    *fares = 0;
+    *rows = 0;
+    if (seg->sat)
+        return sat_report2(seg->sat, lat1, lat2, lng1, lng2, fares, rows);
+    if (seg->cs)
+        return colstore_report2(seg->cs, lat1, lat2, lng1, lng2, fares,
+                                rows);
+    if (ctx->ends_rtree)
+        return step_report(ctx, seg->report2_rtree, lat1, lat2, lng1, lng2,
+                           fares, rows);
+    return step_report(ctx, seg->reports[1], lat1, lat2, lng1, lng2,
+                       fares, rows);
+}
+
+/* The answer to a report1 or report2, as the sql versions' row would be */
+static void
+report_answer(struct reply *r, int report, unsigned long count,
+              long long fares, unsigned long rows)
+{
+    reply_int(r, count);
+    if (report == 2 && rows)
+        reply_int(r, fares);
+    else if (report == 2)
+        reply_null(r);
+    reply_row(r);
+}
+
+/* report1 and report2: the sum over the segments that the rect can
+   touch, answered the way the sql versions' rows would be */
+void
+report_tofd(struct tripstore_context *ctx, int report,
+            double lat1, double lat2, double lng1, double lng2,
+            struct reply *r)
+{
+    struct segments *s = ctx->segments;
+    unsigned long count = 0, rows = 0, seg_rows;
+    long long fares = 0, seg_fares;
+    long seg_count;
+    int i;
+
+    ensure_order(&lat1, &lat2);
+    ensure_order(&lng1, &lng2);
+    for (i = 0; i < s->n; i++) {
+        struct segment *seg = s->segs[i];
+        if (!segment_overlaps(seg, lat1, lat2, lng1, lng2))
+            continue;
+        if (report == 1) {
+            seg_count = segment_report1(ctx, seg, lat1, lat2, lng1, lng2);
+        } else {
+            seg_count = segment_report2(ctx, seg, lat1, lat2, lng1, lng2,
+                                        &seg_fares, &seg_rows);
+            fares += seg_fares;
+            rows += seg_rows;
+        }
+        if (seg_count < 0) {
+            reply_error(r, "out of memory for the report");
+            return;
+        }
+        count += seg_count;
+    }
+
+    report_answer(r, report, count, fares, rows);
+}
+
+/* Bind a bound that is already in the units stored (see scan_rows()) */
+static int
+bind_stored(struct tripstore_context *ctx, sqlite3_stmt *stmt, int i,
+            double v)
+{
+    if (ctx->quant)
+        return sqlite3_bind_int64(stmt, i, (int64_t)v);
+    return sqlite3_bind_double(stmt, i, v);
+}
+
+static int
+sel_by_lat(const void *a, const void *b)
+{
+    const struct scan_sel *x = (const struct scan_sel *)a;
+    const struct scan_sel *y = (const struct scan_sel *)b;
+
+    return x->lat1 < y->lat1 ? -1 : x->lat1 > y->lat1;
+}
+
+/* The rects that s has selected, over seg's triplog: lat_long_idx is
+   walked once over each band of lat that they cover. The rows come in
+   lat order, so with the rects sorted by lat1 a row is only checked
+   against the ones whose band has begun. */
+static void
+scan_rows(struct tripstore_context *ctx, struct segment *seg, struct scan *s)
+{
+    sqlite3_stmt *stmt = seg->scan;
+    int first, i, j;
+
+    /* with --coord-bits compare in the stored integers, rounded as the
+       report's own bind would */
+    for (i = 0; ctx->quant && i < s->nsel; i++) {
+        struct scan_sel *sel = &s->sel[i];
+        sel->lat1 = quant_lat(ctx->quant, sel->lat1);
+        sel->lat2 = quant_lat(ctx->quant, sel->lat2);
+        sel->lng1 = quant_lng(ctx->quant, sel->lng1);
+        sel->lng2 = quant_lng(ctx->quant, sel->lng2);
+    }
+    qsort(s->sel, s->nsel, sizeof(s->sel[0]), sel_by_lat);
+
+    for (first = 0; first < s->nsel; first = j) {
+        double hi = s->sel[first].lat2;
+        for (j = first + 1; j < s->nsel && s->sel[j].lat1 <= hi; j++) {
+            if (s->sel[j].lat2 > hi)
+                hi = s->sel[j].lat2;
+        }
+        bind_stored(ctx, stmt, 1, s->sel[first].lat1);
+        bind_stored(ctx, stmt, 2, hi);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            double lat = sqlite3_column_double(stmt, 0);
+            double lng = sqlite3_column_double(stmt, 1);
+            int type = sqlite3_column_int(stmt, 2);
+            int64_t id = sqlite3_column_int64(stmt, 3);
+            for (i = first; i < j && s->sel[i].lat1 <= lat; i++) {
+                struct scan_sel *sel = &s->sel[i];
+                if (lat > sel->lat2 || lng < sel->lng1 || lng > sel->lng2)
+                    continue;
+                if (sel->rect->report == 2) {
+                    if (type != BEGIN && type != END)
+                        continue;
+                    sel->rect->fares += sqlite3_column_int64(stmt, 4);
+                    sel->rect->rows++;
+                }
+                if (scan_ids_add(&sel->ids, id) < 0)
+                    sel->rect->failed = 1;
+            }
+        }
+        sqlite3_reset(stmt);
+        ctx->scan_stats.passes++;
+    }
+}
+
+/* Does rect go over seg's rows in a shared scan, rather than being
+   answered on its own by a faster path? */
+static int
+scans_rows(struct tripstore_context *ctx, struct segment *seg,
+           struct scan_rect *rect)
+{
+    if (rect->report == 1)
+        return seg->cs || !report1_use_rtree(ctx, seg, rect->lat1, rect->lat2,
+                                              rect->lng1, rect->lng2);
+    return !seg->sat && (seg->cs || !ctx->ends_rtree);
+}
+
+/* The report1s and report2s of s together, under store_lock. In each
+   segment the grid and then the rows are gone over once for all of the
+   rects that scan them (see scan.c); the rest, and a scan of one rect,
+   are answered the way report_tofd() answers them. */
+void
+run_scan(struct tripstore_context *ctx, struct scan *s)
+{
+    struct segments *segs = ctx->segments;
+    int i, k;
+
+    for (i = 0; i < segs->n; i++) {
+        struct segment *seg = segs->segs[i];
+
+        for (k = 0; s->n > 1 && seg->grid && k < s->n; k++) {
+            struct scan_rect *rect = s->rects[k];
+            if (rect->report == 1 &&
+                segment_overlaps(seg, rect->lat1, rect->lat2, rect->lng1,
+                                 rect->lng2))
+                scan_select(s, rect);
+        }
+        if (s->nsel) {
+            grid_report1_scan(seg->grid, s);
+            scan_collect(s);
+            ctx->scan_stats.passes++;
+        }
+
+        for (k = 0; k < s->n; k++) {
+            struct scan_rect *rect = s->rects[k];
+            long long fares;
+            unsigned long rows;
+            long count;
+            if (!segment_overlaps(seg, rect->lat1, rect->lat2, rect->lng1,
+                                  rect->lng2))
+                continue;
+            if (s->n > 1 && rect->report == 1 && seg->grid)
+                continue;
+            if (s->n > 1 && scans_rows(ctx, seg, rect)) {
+                scan_select(s, rect);
+                continue;
+            }
+            if (rect->report == 1) {
+                count = segment_report1(ctx, seg, rect->lat1, rect->lat2,
+                                        rect->lng1, rect->lng2);
+            } else {
+                count = segment_report2(ctx, seg, rect->lat1, rect->lat2,
+                                        rect->lng1, rect->lng2, &fares,
+                                        &rows);
+                rect->fares += fares;
+                rect->rows += rows;
+            }
+            if (count < 0)
+                rect->failed = 1;
+            else
+                rect->count += count;
+            if (s->n > 1)
+                ctx->scan_stats.alone++;
+        }
+        if (s->nsel) {
+            if (seg->cs) {
+                colstore_reports_scan(seg->cs, s);
+                ctx->scan_stats.passes++;
+            } else {
+                scan_rows(ctx, seg, s);
+            }
+            scan_collect(s);
+        }
+    }
+    scan_record(&ctx->scan_stats, s->n);
+}
+
+/* Answer a rect of a scan that run_scan() has been through */
+void
+scan_rect_reply(struct scan_rect *rect, struct reply *r)
+{
+    if (rect->failed) {
+        reply_error(r, "out of memory for the report");
+        return;
+    }
+    report_answer(r, rect->report, rect->count, rect->fares, rect->rows);
+}
+
+/* "report1~" and "report2~": the sketch estimate, its error bound (and
+   the fares for report2) and then the rect it was counted over. The
+   segments don't share trips, so their estimates and bounds add up. */
+void
+hll_report_tofd(struct tripstore_context *ctx, int report,
+                double lat1, double lat2, double lng1, double lng2,
+                struct reply *r)
+{
+    struct segments *s = ctx->segments;
+    struct hll_answer ans, seg_ans;
+    int i;
+
+    ensure_order(&lat1, &lat2);
+    ensure_order(&lng1, &lng2);
+    memset(&ans, 0, sizeof(ans));
+    for (i = 0; i < s->n; i++) {
+        hll_report(s->segs[i]->hll, report, lat1, lat2, lng1, lng2,
+                   &seg_ans);
+        ans.estimate += seg_ans.estimate;
+        ans.bound += seg_ans.bound;
+        ans.fares += seg_ans.fares;
+        ans.nends += seg_ans.nends;
+        ans.lat1 = seg_ans.lat1;
+        ans.lat2 = seg_ans.lat2;
+        ans.lng1 = seg_ans.lng1;
+        ans.lng2 = seg_ans.lng2;
+    }
+    reply_double(r, ans.estimate, 0);
+    reply_double(r, ans.bound, 0);
+    if (report == 2 && ans.estimate > 0)
+        reply_int(r, ans.fares);
+    else if (report == 2)
+        reply_null(r);
+    reply_double(r, ans.lat1, 6);
+    reply_double(r, ans.lat2, 6);
+    reply_double(r, ans.lng1, 6);
+    reply_double(r, ans.lng2, 6);
+    reply_row(r);
+}
+
+/* "trip <id>": the trip's points in the order they came in, one row
+   each as "long lat type fare_cents time", like its rows in triplog */
+void
+trip_tofd(struct tripstore_context *ctx, int64_t id, struct reply *r)
+{
+    struct trip *t = trips_get(ctx->trips, id);
+    struct traj_chunk *c;
+    uint32_t i, n = 0;
+
+    if (!t) {
+        reply_error(r, "no such trip");
+        return;
+    }
+    for (c = t->head; c; c = c->next) {
+        for (i = 0; i < c->n; i++, n++) {
+            int type = TRANSIT, cents = 0;
+            if (n == 0 && t->begun)
+                type = BEGIN;
+            else if (n == t->npoints - 1 && t->ended) {
+                type = END;
+                cents = t->fare;
+            }
+            reply_double(r, c->pts[i].lng, 6);
+            reply_double(r, c->pts[i].lat, 6);
+            reply_int(r, type);
+            reply_int(r, cents);
+            reply_int(r, c->pts[i].t);
+            reply_row(r);
+        }
+    }
+}
+
+/* "heatmap": the points and then the distinct trips in each of the rows x
+   cols cells over the rect, with times from from to to. A row of the
+   answer for each row of cells, from lat1, with a column for each column
+   of cells, from long1. See heatmap.c. */
+static void
+heatmap_tofd(struct tripstore_context *ctx, double lat1, double lat2,
+             double lng1, double lng2, int rows, int cols, uint32_t from,
+             uint32_t to, struct reply *r)
+{
+    struct heatmap *h;
+    int i, j;
+
+    ensure_order(&lat1, &lat2);
+    ensure_order(&lng1, &lng2);
+    h = heatmap_create(rows, cols, lat1, lat2, lng1, lng2, from, to);
+    if (!h) {
+        reply_error(r, "out of memory for the heatmap");
+        return;
+    }
+    trips_heatmap(ctx->trips, h, &ctx->store_lock);
+    for (i = 0; i < rows; i++) {
+        for (j = 0; j < cols; j++)
+            reply_int(r, h->points[i * cols + j]);
+        reply_row(r);
+    }
+    for (i = 0; i < rows; i++) {
+        for (j = 0; j < cols; j++)
+            reply_int(r, h->trips[i * cols + j]);
+        reply_row(r);
+    }
+    heatmap_destroy(h);
+}
+
+/* "heatmap lat1 lat2 long1 long2 rows cols [from [to]]" */
+static void
+heatmap_query(struct tripstore_context *ctx, const char *q, struct reply *r)
+{
+    float lat1, lat2, lng1, lng2;
+    int rows, cols, end = 0;
+    time_t from = 0, to = UINT32_MAX;
+    const char *rest;
+
+    if (6 != sscanf(q + strlen("HEATMAP"), " %f %f %f %f %d %d%n",
+                    &lat1, &lat2, &lng1, &lng2, &rows, &cols, &end)) {
+        reply_error(r, "HEATMAP takes lat1, lat2, long1, long2, rows, cols"
+                       " and optionally from and to times");
+        return;
+    }
+    rest = q + strlen("HEATMAP") + end;
+    while (*rest == ' ')
+        rest++;
+    if (*rest && (!(rest = parse_local_time(rest, &from)) ||
+                  (*rest && !parse_local_time(rest, &to)))) {
+        reply_error(r, "HEATMAP times are like 2013-12-25 09:32:00");
+        return;
+    }
+    if (rows < 1 || rows > HEATMAP_MAX_SIDE ||
+        cols < 1 || cols > HEATMAP_MAX_SIDE) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "HEATMAP takes 1 to %d rows and cols",
+                 HEATMAP_MAX_SIDE);
+        reply_error(r, msg);
+        return;
+    }
+    if (!ctx->trips->keep_points) {
+        reply_error(r, "heatmaps need --trajectories");
+        return;
+    }
+    heatmap_tofd(ctx, lat1, lat2, lng1, lng2, rows, cols,
+                 from < 0 ? 0 : from, to > UINT32_MAX ? UINT32_MAX : to, r);
+}
+
+/* Is q a report1 or report2 with its rect? Then it can go in a scan
+   (see scan.c): fill in rect and return 1. */
+int
+report_rect(const char *q, struct scan_rect *rect)
+{
+    float lat1, lat2, lng1, lng2;
+    int replen = strlen("REPORTX");
+
+    rect->report = 0;
+    if ((strncasecmp(q, "REPORT1", replen) != 0 &&
+         strncasecmp(q, "REPORT2", replen) != 0) || q[replen] == '~' ||
+        4 != sscanf(q + replen, " %f %f %f %f", &lat1, &lat2, &lng1, &lng2))
+        return 0;
+    rect->report = q[replen - 1] - '0';
+    rect->lat1 = lat1;
+    rect->lat2 = lat2;
+    rect->lng1 = lng1;
+    rect->lng2 = lng2;
+    ensure_order(&rect->lat1, &rect->lat2);
+    ensure_order(&rect->lng1, &rect->lng2);
+    return 1;
+}
+
 /* This is the main handler for the query interface. We decide if they
    are running one of the reports, and if not then evaluate it as 
    freeform sql */
 void
-exec_query_tofd(const char *q, struct tripstore_context *ctx, int fd)
+exec_query_tofd(const char *q, struct tripstore_context *ctx,
+                struct reply *r)
 {
     float lat1, lat2, lng1, lng2;
     int replen = strlen("REPORTX");
 
-    if (strncasecmp(q, "REPORT1", replen) == 0) {
-        if (4 != sscanf(q + replen, " %f %f %f %f",
+    if (strncasecmp(q, "REPORT1~", replen + 1) == 0 ||
+        strncasecmp(q, "REPORT2~", replen + 1) == 0) {
+        if (4 != sscanf(q + replen + 1, " %f %f %f %f",
                         &lat1, &lat2, &lng1, &lng2)) {
-            send_err_msg(fd, "REPORT1 takes lat1, lat2, long1, long2");
+            reply_error(r, "REPORTn~ takes lat1, lat2, long1, long2");
+        } else if (ctx->segments->hll_cells <= 0) {
+            reply_error(r, "approximate reports need --hll");
         } else {
-            bind4(ctx->reports[0], lat1, lat2, lng1, lng2);
-            step_to_fd(ctx->reports[0], fd);
+            hll_report_tofd(ctx, q[replen - 1] - '0', lat1, lat2, lng1, lng2,
+                            r);
         }
-    } else if (strncasecmp(q, "REPORT2", replen) == 0) {
+    } else if (strncasecmp(q, "REPORT1", replen) == 0 ||
+               strncasecmp(q, "REPORT2", replen) == 0) {
         if (4 != sscanf(q + replen, " %f %f %f %f",
                         &lat1, &lat2, &lng1, &lng2)) {
-            send_err_msg(fd, "REPORT2 takes lat1, lat2, long1, long2");
+            reply_error(r, q[replen - 1] == '1' ?
+                             "REPORT1 takes lat1, lat2, long1, long2" :
+                             "REPORT2 takes lat1, lat2, long1, long2");
         } else {
-            bind4(ctx->reports[1], lat1, lat2, lng1, lng2);
-            step_to_fd(ctx->reports[1], fd);
+            report_tofd(ctx, q[replen - 1] - '0', lat1, lat2, lng1, lng2, r);
         }
     } else if (strncasecmp(q, "REPORT3", replen) == 0) {
         /* If they didn't give a date, then use now as the comparison */
         time_t t;
-        if (strlen(q) <= replen + 1)
+        if (strlen(q) <= (size_t)replen + 1)
             t = time(NULL);
         else
             t = localtime_to_gmt(q + replen + 1);
 
-        sqlite3_bind_int(ctx->reports[2], 1, t);
-        sqlite3_bind_int(ctx->reports[2], 2, t);
-        step_to_fd(ctx->reports[2], fd);
+        reply_int(r, active_at(ctx->active, t));
+        reply_row(r);
+    } else if (strncasecmp(q, "HEATMAP", strlen("HEATMAP")) == 0) {
+        heatmap_query(ctx, q, r);
+    } else if (strncasecmp(q, "TRIP ", strlen("TRIP ")) == 0) {
+        long long id;
+        if (1 != sscanf(q + strlen("TRIP "), "%lld", &id))
+            reply_error(r, "TRIP takes a trip id");
+        else if (!ctx->trips->keep_points)
+            reply_error(r, "trip queries need --trajectories");
+        else
+            trip_tofd(ctx, id, r);
+    } else if (strncasecmp(q, "SNAPSHOT", strlen("SNAPSHOT")) == 0) {
+        /* "snapshot [path]", to --snapshot's path if they didn't give one.
+           It is written in the background: see snapshot.* in stats. */
+        const char *path = q + strlen("SNAPSHOT");
+        while (*path == ' ')
+            path++;
+        if (!*path)
+            path = ctx->snapshot->path;
+        if (snapshot_request(ctx->snapshot, path, 0) < 0)
+            reply_error(r, "a snapshot is already being taken");
+        else
+            send_line(r, "taking a snapshot to %s", path);
+    } else if (strncasecmp(q, "CHECKPOINT", strlen("CHECKPOINT")) == 0) {
+        /* to --checkpoint, which is what a restart loads */
+        if (!ctx->snapshot->checkpoint)
+            reply_error(r, "checkpoints need --checkpoint");
+        else if (snapshot_request(ctx->snapshot, ctx->snapshot->checkpoint,
+                                  1) < 0)
+            reply_error(r, "a snapshot is already being taken");
+        else
+            send_line(r, "taking a checkpoint to %s",
+                      ctx->snapshot->checkpoint);
+    } else if (strncasecmp(q, "STATS", strlen("STATS")) == 0) {
+        stats_to_fd(ctx, r);
+    } else if (ctx->engine == ENGINE_COLUMNAR) {
+        reply_error(r, "ad-hoc sql needs --engine sqlite");
     } else {
         /* They aren't requesting a specific report so just treat the
            reset as plain SQL */
-        char *errmsg;
-        struct rowout_ctx *out = (struct rowout_ctx *)malloc(sizeof(*out));
-        out->fd = fd;
-        out->ctx = ctx;
-        if (sqlite3_exec(ctx->db, q, row_to_fd, (void *)out,
-                         &errmsg) != SQLITE_OK) {
-            send_err_msg(out->fd, errmsg);
-        }
-        free(out);
+        exec_sql_tofd(ctx->db, q, r);
+    }
+}
+
+/* Would exec_query_tofd() run q as ad-hoc sql? Query workers (query.c)
+   run those on their own connection instead. */
+int
+query_is_sql(struct tripstore_context *ctx, const char *q)
+{
+    static const char *ours[] = {"REPORT1", "REPORT2", "REPORT3", "TRIP ",
+                                 "HEATMAP", "SNAPSHOT", "CHECKPOINT",
+                                 "STATS"};
+    size_t i;
+
+    if (ctx->engine == ENGINE_COLUMNAR)
+        return 0;
+    for (i = 0; i < sizeof(ours) / sizeof(ours[0]); i++) {
+        if (strncasecmp(q, ours[i], strlen(ours[i])) == 0)
+            return 0;
     }
+    return 1;
 }
 
+/* Run ad-hoc sql on db, each statement of it in turn, and answer with
+   the rows. Stops once the client is gone. */
+void
+exec_sql_tofd(sqlite3 *db, const char *q, struct reply *r)
+{
+    sqlite3_stmt *stmt;
+    int rc = SQLITE_OK;
+
+    while (*q && rc == SQLITE_OK) {
+        if (sqlite3_prepare_v2(db, q, -1, &stmt, &q) != SQLITE_OK) {
+            reply_error(r, sqlite3_errmsg(db));
+            return;
+        }
+        if (!stmt)
+            continue;           /* a comment, or only whitespace left */
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+            if (reply_sql_row(r, stmt) < 0) {
+                sqlite3_finalize(stmt);
+                return;
+            }
+        if (rc == SQLITE_DONE)
+            rc = SQLITE_OK;
+        else
+            reply_error(r, sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+    }
+}
@@ -1,13 +1,60 @@
+#include <stdint.h>
+#include <time.h>
+
 struct tripstore_context;
+struct segment;
+struct sqlite3;
+struct reply;
+struct scan;
+struct scan_rect;
 enum TRIP_EVENT_TYPE {BEGIN, TRANSIT, END};
 
+/* Where the trip log lives. Chosen at startup with --engine. */
+enum STORE_ENGINE {ENGINE_SQLITE, ENGINE_COLUMNAR};
+
+/* Which triplog points the sqlite engine also keeps in an R-tree.
+   Chosen at startup with --rtree. */
+enum RTREE_MODE {RTREE_NONE, RTREE_ENDS, RTREE_ALL};
+
+/* A decoded trip event on its way from the network to add_tripdata() */
+struct trip_event
+{
+    int64_t id;
+    float lng;
+    float lat;
+    int type;
+    int cents;
+};
+
 int open_create_db(struct tripstore_context *);
 void close_db(struct tripstore_context *);
 
 int prepare_statements(struct tripstore_context *);
 
+int attach_segment(struct tripstore_context *, struct sqlite3 *db,
+                   unsigned long seq);
+int open_segment_sql(struct tripstore_context *, struct segment *);
+void close_segment_sql(struct tripstore_context *, struct segment *);
+int update_segment_views(struct tripstore_context *, struct sqlite3 *db);
+unsigned long segment_sql_bytes(struct segment *);
+
 int add_tripdata(struct tripstore_context *ctx,
-                 int id, float lat, float lng, enum TRIP_EVENT_TYPE t,
+                 int64_t id, float lng, float lat, enum TRIP_EVENT_TYPE t,
                  int cents);
+int add_tripdata_at(struct tripstore_context *ctx,
+                    int64_t id, float lng, float lat, enum TRIP_EVENT_TYPE t,
+                    int cents, time_t now);
+
+int begin_batch(struct tripstore_context *);
+int end_batch(struct tripstore_context *);
+int batch_due(struct tripstore_context *);
+int batch_timeout_ms(struct tripstore_context *);
+
+void exec_query_tofd(const char *q, struct tripstore_context *,
+                     struct reply *r);
+int query_is_sql(struct tripstore_context *, const char *q);
+void exec_sql_tofd(struct sqlite3 *db, const char *q, struct reply *r);
 
-void exec_query_tofd(const char *q, struct tripstore_context *, int fd);
+int report_rect(const char *q, struct scan_rect *rect);
+void run_scan(struct tripstore_context *ctx, struct scan *s);
+void scan_rect_reply(struct scan_rect *rect, struct reply *r);
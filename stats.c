@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sqlite3.h"
+#include "sqls.h"
+#include "stats.h"
+#include "evq.h"
+#include "colstore.h"
+#include "grid.h"
+#include "hll.h"
+#include "active.h"
+#include "sat.h"
+#include "segment.h"
+#include "trips.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "scan.h"
+#include "query.h"
+#include "reply.h"
+#include "bufpool.h"
+#include "ctx.h"
+
+/* Answer one "name value" row */
+static void
+stat_line(struct reply *out, const char *name, unsigned long v)
+{
+    reply_str(out, name);
+    reply_int(out, v);
+    reply_row(out);
+}
+
+/* Answer one "prefix.N.name value" row for a per-thread counter */
+static void
+stat_line_n(struct reply *out, const char *prefix, int n, const char *name,
+            unsigned long v)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s.%d.%s", prefix, n, name);
+    stat_line(out, buf, v);
+}
+
+/* CPU time used so far by another thread */
+static unsigned long
+thread_cpu_us(pthread_t thread)
+{
+    clockid_t cid;
+    struct timespec ts;
+
+    if (pthread_getcpuclockid(thread, &cid) != 0 ||
+        clock_gettime(cid, &ts) != 0)
+        return 0;
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* stats_to_fd
+
+   Entrypoint for the "stats" query. Each group of counters is written
+   with a common prefix so they are easy to grep for.
+*/
+void
+stats_to_fd(struct tripstore_context *ctx, struct reply *out)
+{
+    struct batch_stats *b = &ctx->batch_stats;
+
+    stat_line(out, "batch.max_rows_config", ctx->batch_max_rows);
+    stat_line(out, "batch.max_ms_config", ctx->batch_max_ms);
+    stat_line(out, "batch.batches", b->batches);
+    stat_line(out, "batch.rows", b->rows);
+    stat_line(out, "batch.max_rows", b->max_rows);
+    stat_line(out, "batch.avg_rows", b->batches ? b->rows / b->batches : 0);
+    stat_line(out, "batch.failed", b->failed);
+    stat_line(out, "batch.lost_rows", b->lost);
+
+    /* the grid, sketch and summed-area table counters are summed over
+       the segments */
+    struct segments *segs = ctx->segments;
+    unsigned long cs_events = 0, cs_mem = 0;
+    unsigned long grid_points = 0, grid_blocks = 0, grid_mem = 0;
+    unsigned long hll_sketches = 0, hll_mem = 0;
+    unsigned long sat_rebuilds = 0, sat_mem = 0;
+    int i;
+
+    stat_line(out, "segments.count", segs->n);
+    stat_line(out, "segments.sealed", segs->sealed);
+    stat_line(out, "segments.dropped", segs->dropped);
+    stat_line(out, "segments.dropped_rows", segs->dropped_rows);
+    stat_line(out, "segments.full", segs->full);
+    stat_line(out, "segments.bytes", segments_bytes(ctx));
+    for (i = 0; i < segs->n; i++) {
+        struct segment *seg = segs->segs[i];
+        stat_line_n(out, "segment", seg->seq, "rows", seg->rows);
+        stat_line_n(out, "segment", seg->seq, "trips", seg->trips);
+        stat_line_n(out, "segment", seg->seq, "first", seg->first);
+        stat_line_n(out, "segment", seg->seq, "last", seg->last);
+        stat_line_n(out, "segment", seg->seq, "bytes",
+                    segment_bytes(ctx, seg));
+
+        if (seg->cs) {
+            cs_events += seg->cs->n;
+            cs_mem += colstore_bytes(seg->cs);
+        }
+        if (seg->grid) {
+            grid_points += seg->grid->points;
+            grid_blocks += seg->grid->blocks;
+            grid_mem += grid_bytes(seg->grid);
+        }
+        if (seg->hll) {
+            hll_sketches += seg->hll->sketches;
+            hll_mem += hll_bytes(seg->hll);
+        }
+        if (seg->sat) {
+            sat_rebuilds += seg->sat->rebuilds;
+            sat_mem += sat_bytes(seg->sat);
+        }
+    }
+
+    if (ctx->engine == ENGINE_COLUMNAR) {
+        stat_line(out, "colstore.events", cs_events);
+        stat_line(out, "colstore.bytes", cs_mem);
+    }
+
+    if (segs->grid_cells > 0) {
+        stat_line(out, "grid.cells", segs->grid_cells * segs->grid_cells);
+        stat_line(out, "grid.points", grid_points);
+        stat_line(out, "grid.blocks", grid_blocks);
+        stat_line(out, "grid.bytes", grid_mem);
+    }
+
+    if (segs->hll_cells > 0) {
+        stat_line(out, "hll.cells", segs->hll_cells * segs->hll_cells);
+        stat_line(out, "hll.sketches", hll_sketches);
+        stat_line(out, "hll.bytes", hll_mem);
+    }
+
+    if (segs->sat_cells > 0) {
+        stat_line(out, "sat.cells", segs->sat_cells * segs->sat_cells);
+        stat_line(out, "sat.rebuilds", sat_rebuilds);
+        stat_line(out, "sat.bytes", sat_mem);
+    }
+
+    stat_line(out, "trips.trips", ctx->trips->trips);
+    stat_line(out, "trips.open", ctx->trips->open);
+    stat_line(out, "trips.points", ctx->trips->points);
+    stat_line(out, "trips.chunks", ctx->trips->chunks);
+    stat_line(out, "trips.ignored", ctx->trips->ignored);
+    stat_line(out, "trips.unknown", ctx->trips->unknown);
+    stat_line(out, "trips.bytes", trips_bytes(ctx->trips));
+
+    if (ctx->wal) {
+        struct wal_stats *w = &ctx->wal->stats;
+        stat_line(out, "wal.records", w->records);
+        stat_line(out, "wal.bytes", w->bytes);
+        stat_line(out, "wal.syncs", w->syncs);
+        stat_line(out, "wal.sync_us_avg",
+                  w->syncs ? w->sync_us_total / w->syncs : 0);
+        stat_line(out, "wal.sync_us_max", w->sync_us_max);
+        stat_line(out, "wal.max_sync_records", w->max_sync_records);
+        stat_line(out, "wal.pending", ctx->wal->fill);
+        stat_line(out, "wal.stalls", w->stalls);
+        stat_line(out, "wal.failed", w->failed);
+        stat_line(out, "wal.replayed", w->replayed);
+        stat_line(out, "wal.replay_ms", w->replay_ms);
+        stat_line(out, "wal.replay_per_sec",
+                  w->replay_ms ? w->replayed * 1000 / w->replay_ms : 0);
+        stat_line(out, "wal.torn_bytes", w->torn_bytes);
+    }
+
+    if (ctx->snapshot) {
+        struct snapshot_stats *sn = &ctx->snapshot->stats;
+        unsigned long tries = sn->taken + sn->failed;
+        stat_line(out, "snapshot.taken", sn->taken);
+        stat_line(out, "snapshot.failed", sn->failed);
+        stat_line(out, "snapshot.running", ctx->snapshot->running);
+        stat_line(out, "snapshot.last_at", sn->last_at);
+        stat_line(out, "snapshot.last_rows", sn->last_rows);
+        stat_line(out, "snapshot.last_bytes", sn->last_bytes);
+        stat_line(out, "snapshot.last_ms", sn->last_ms);
+        stat_line(out, "snapshot.last_stall_us", sn->last_stall_us);
+        stat_line(out, "snapshot.stall_us_avg",
+                  tries ? sn->stall_us_total / tries : 0);
+        stat_line(out, "snapshot.stall_us_max", sn->stall_us_max);
+    }
+
+    if (ctx->active) {
+        stat_line(out, "active.live", ctx->active->live);
+        stat_line(out, "active.seconds", ctx->active->secs);
+        stat_line(out, "active.backfills", ctx->active->backfills);
+        stat_line(out, "active.bytes", active_bytes(ctx->active));
+    }
+
+    if (ctx->evq) {
+        struct evq_stats *q = &ctx->evq->stats;
+        stat_line(out, "evq.size", ctx->evq->mask + 1);
+        stat_line(out, "evq.depth", evq_depth(ctx->evq));
+        stat_line(out, "evq.max_depth", q->max_depth);
+        stat_line(out, "evq.full", q->full);
+        stat_line(out, "evq.drains", q->drains);
+        stat_line(out, "evq.drained", q->drained);
+        stat_line(out, "evq.drain_latency_avg_us",
+                  q->drained ? q->latency_ns_total / q->drained / 1000 : 0);
+        stat_line(out, "evq.drain_latency_max_us", q->latency_ns_max / 1000);
+    }
+
+    if (ctx->queries) {
+        struct query_stats *q = &ctx->queries->stats;
+        stat_line(out, "query.workers", ctx->queries->nworkers);
+        stat_line(out, "query.queries", q->queries);
+        stat_line(out, "query.sql", q->sql);
+        stat_line(out, "query.waiting", q->waiting);
+        stat_line(out, "query.max_waiting", q->max_waiting);
+        stat_line(out, "query.wait_us_avg",
+                  q->queries ? q->wait_us_total / q->queries : 0);
+        stat_line(out, "query.wait_us_max", q->wait_us_max);
+        stat_line(out, "query.run_us_avg",
+                  q->queries ? q->run_us_total / q->queries : 0);
+        stat_line(out, "query.run_us_max", q->run_us_max);
+        stat_line(out, "query.attached", q->attached);
+        stat_line(out, "query.detached", q->detached);
+        stat_line(out, "query.pauses", q->pauses);
+    }
+
+    struct scan_stats *sc = &ctx->scan_stats;
+    stat_line(out, "scan.scans", sc->scans);
+    stat_line(out, "scan.reports", sc->reports);
+    stat_line(out, "scan.avg_reports",
+              sc->scans ? sc->reports / sc->scans : 0);
+    stat_line(out, "scan.max_reports", sc->max_reports);
+    stat_line(out, "scan.served_1", sc->served[0]);
+    stat_line(out, "scan.served_2_7", sc->served[1]);
+    stat_line(out, "scan.served_8_63", sc->served[2]);
+    stat_line(out, "scan.served_64_up", sc->served[3]);
+    stat_line(out, "scan.passes", sc->passes);
+    stat_line(out, "scan.alone", sc->alone);
+
+    struct outbuf_stats *o = &ctx->out_stats;
+    stat_line(out, "out.cap", ctx->out_cap);
+    stat_line(out, "out.writes", o->writes);
+    stat_line(out, "out.bytes", o->bytes);
+    stat_line(out, "out.blocked", o->blocked);
+    stat_line(out, "out.waits", o->waits);
+    stat_line(out, "out.failed", o->failed);
+    stat_line(out, "out.timeouts", o->timeouts);
+    stat_line(out, "out.buffered", o->buffered);
+    stat_line(out, "out.max_buffered", o->max_buffered);
+
+    stat_line(out, "reactor.count", ctx->nreactors);
+    for (i = 0; i < ctx->nreactors; i++) {
+        struct reactor_stats *r = &ctx->reactors[i].stats;
+        stat_line_n(out, "reactor", i, "connections", r->connections);
+        stat_line_n(out, "reactor", i, "accepted", r->accepted);
+        stat_line_n(out, "reactor", i, "msgs", r->msgs);
+        stat_line_n(out, "reactor", i, "events", r->events);
+        stat_line_n(out, "reactor", i, "reads", r->reads);
+        stat_line_n(out, "reactor", i, "syscalls", r->syscalls);
+        stat_line_n(out, "reactor", i, "nobufs", r->nobufs);
+        stat_line_n(out, "reactor", i, "leases", r->leases);
+        stat_line_n(out, "reactor", i, "bad_ids", r->bad_ids);
+        stat_line_n(out, "reactor", i, "cpu_us",
+                    thread_cpu_us(ctx->reactors[i].thread));
+        stat_line_n(out, "reactor", i, "recv_bufs",
+                    ctx->reactors[i].recv_bufs.allocated);
+        stat_line_n(out, "reactor", i, "wakeups", r->wakeups);
+    }
+}
@@ -0,0 +1,121 @@
+/* Counters that tripstore exports on the query port. Send "stats" to the
+   query port to get them as "name value" lines. */
+
+struct tripstore_context;
+
+/* group commit of the ingest path (see begin_batch() in sqls.c) */
+struct batch_stats
+{
+    unsigned long batches;      /* transactions committed */
+    unsigned long rows;         /* rows covered by those transactions */
+    unsigned long max_rows;     /* largest single transaction */
+    unsigned long failed;       /* commits which failed */
+    unsigned long lost;         /* rows of batches rolled back */
+};
+
+/* per event loop thread (see struct reactor in ctx.h). These are only
+   written by the owning reactor, so reads from "stats" may be a little
+   stale but never torn on the platforms we run on. */
+struct reactor_stats
+{
+    unsigned long connections;  /* currently open generator connections */
+    unsigned long accepted;     /* generator connections accepted */
+    unsigned long msgs;         /* frames decoded */
+    unsigned long events;       /* trip events in those frames */
+    unsigned long reads;        /* read()s, or recv completions with uring */
+    unsigned long syscalls;     /* epoll_wait/read/accept or io_uring_enter */
+    unsigned long nobufs;       /* uring recvs stopped for lack of buffers */
+    unsigned long leases;       /* trip id blocks leased to generators */
+    unsigned long bad_ids;      /* events for ids never handed out */
+    unsigned long wakeups;      /* epoll_wait() returns */
+};
+
+/* the event queue between the reactors and the storage writer (evq.c) */
+struct evq_stats
+{
+    unsigned long full;             /* pushes that found the ring full */
+    unsigned long drains;           /* non empty pops by the writer */
+    unsigned long drained;          /* events popped */
+    unsigned long max_depth;        /* deepest the ring has been at a pop */
+    unsigned long latency_ns_total; /* push to pop, summed over events */
+    unsigned long latency_ns_max;
+};
+
+/* the write-ahead log (wal.c). Written by its flusher thread, and by the
+   storage writer for appends and replay. */
+struct wal_stats
+{
+    unsigned long records;          /* appended */
+    unsigned long bytes;            /* written to the file */
+    unsigned long syncs;            /* write() + fdatasync() rounds */
+    unsigned long sync_us_total;    /* time in fdatasync() */
+    unsigned long sync_us_max;
+    unsigned long max_sync_records; /* most records made durable at once */
+    unsigned long stalls;           /* appends that waited for the flusher */
+    unsigned long failed;           /* writes or syncs that failed */
+    unsigned long replayed;         /* records replayed at startup */
+    unsigned long replay_ms;
+    unsigned long torn_bytes;       /* cut off the end of the log */
+};
+
+/* snapshots (snapshot.c). Written by the snapshot thread. */
+struct snapshot_stats
+{
+    unsigned long taken;
+    unsigned long failed;
+    unsigned long last_at;          /* time the last good one is as of */
+    unsigned long last_rows;        /* events in it */
+    unsigned long last_bytes;
+    unsigned long last_ms;          /* fork to the file being in place */
+    unsigned long last_stall_us;    /* store_lock held for the fork */
+    unsigned long stall_us_total;
+    unsigned long stall_us_max;
+};
+
+/* the query workers (query.c). Written under the pool's lock. */
+struct query_stats
+{
+    unsigned long queries;          /* run by the workers */
+    unsigned long sql;              /* ad-hoc sql, on their own connections */
+    unsigned long waiting;          /* queued now */
+    unsigned long max_waiting;
+    unsigned long wait_us_total;    /* queued to picked up */
+    unsigned long wait_us_max;
+    unsigned long run_us_total;
+    unsigned long run_us_max;
+    unsigned long attached;         /* segments the workers attached */
+    unsigned long detached;
+    unsigned long pauses;           /* for snapshot forks */
+};
+
+/* report1s and report2s answered together in shared scans (scan.c).
+   Written under store_lock. */
+struct scan_stats
+{
+    unsigned long scans;            /* batches of reports */
+    unsigned long reports;          /* in them */
+    unsigned long max_reports;      /* most in one */
+    unsigned long served[4];        /* scans of 1, 2-7, 8-63 and 64 or more */
+    unsigned long passes;           /* over a segment's cells or rows */
+    unsigned long alone;            /* rects that a segment answered on its
+                                       own (sat, the R-trees) */
+};
+
+/* answers on their way out to query clients (outbuf.c). Added to
+   atomically by the event loop and the query workers. */
+struct outbuf_stats
+{
+    unsigned long writes;           /* writev()s */
+    unsigned long bytes;            /* written */
+    unsigned long blocked;          /* writes that found the socket full */
+    unsigned long waits;            /* answers held up at --out-kb */
+    unsigned long failed;           /* clients gone with answers left */
+    unsigned long timeouts;         /* of those, dropped for not
+                                       reading */
+    unsigned long buffered;         /* over all the connections, now */
+    unsigned long max_buffered;     /* most one connection had */
+};
+
+struct reply;
+
+void stats_to_fd(struct tripstore_context *ctx, struct reply *out);
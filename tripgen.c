@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/socket.h>
 #include "sockets.h"
 #include "msgs.h"
 
@@ -20,9 +23,14 @@
 #define DEFAULT_MIN_MINUTES 2.0
 #define DEFAULT_MAX_MINUTES 10.0
 #define DEFAULT_THREADS 500
+#define DEFAULT_BATCH 0
+#define DEFAULT_LEASE 64
 
 #define DOLLARS_PER_MIN 4
 
+/* --compare: the reports asked of both tripstores */
+#define COMPARE_RECTS 2000
+
 struct options
 {
     const char* host;
@@ -34,6 +42,9 @@ struct options
     float min_trip_minutes;
     float max_trip_minutes;
     int threads;
+    int batch;
+    int lease;
+    int compare[2];     /* query ports, 0 to generate trips */
 };
 
 void
@@ -49,6 +60,14 @@ syntax()
     printf("\t-m (--minmins): minimum trip minutes\n");
     printf("\t-M (--maxmins): maximum trip minutes\n");
     printf("\t-t (--threads): how many concurrent threads\n");
+    printf("\t-b (--batch): trips per thread, sent as one batched update "
+           "per tick (max %d)\n", MAX_BATCH_UPDATES);
+    printf("\t-l (--lease): trip ids to lease from tripstore at a time "
+           "(0 asks for each trip id)\n");
+    printf("\t-C (--compare): port,port: instead of generating trips, ask "
+           "the tripstores on these query ports the same %d report1s and "
+           "report2s over the area and show where they differ\n",
+           COMPARE_RECTS);
     printf("\t-h (--help): this message\n");
     printf("\n");
     printf("By default, tripgen will connect to host %s on port %d,\n",
@@ -56,8 +75,11 @@ syntax()
     printf("minlong %f, maxlong %f, minlat %f, maxlat %f,\n",
             DEFAULT_MIN_LONG, DEFAULT_MAX_LONG,
             DEFAULT_MIN_LAT, DEFAULT_MAX_LAT);
-    printf("minmins %f, maxmins %f, and threads %d.\n",
-            DEFAULT_MIN_MINUTES, DEFAULT_MAX_MINUTES, DEFAULT_THREADS);
+    printf("minmins %f, maxmins %f, threads %d, and lease %d.\n",
+            DEFAULT_MIN_MINUTES, DEFAULT_MAX_MINUTES, DEFAULT_THREADS,
+            DEFAULT_LEASE);
+    printf("Without --batch each thread runs one trip and sends one update "
+           "message per tick.\n");
     printf("You many omit or specify each any any of these arguments.\n");
 }
 
@@ -69,7 +91,7 @@ get_options(int argc, char *a[], struct options *opts)
              DEFAULT_MIN_LONG, DEFAULT_MAX_LONG,
              DEFAULT_MIN_LAT, DEFAULT_MAX_LAT,
              DEFAULT_MIN_MINUTES, DEFAULT_MAX_MINUTES,
-             DEFAULT_THREADS};
+             DEFAULT_THREADS, DEFAULT_BATCH, DEFAULT_LEASE, {0, 0}};
     static struct option long_options[] = {
         {"host", required_argument, 0, 'H'},
         {"port", required_argument, 0, 'p'},
@@ -80,6 +102,9 @@ get_options(int argc, char *a[], struct options *opts)
         {"minmins", required_argument, 0, 'm'},
         {"maxmins", required_argument, 0, 'M'},
         {"threads", required_argument, 0, 't'},
+        {"batch", required_argument, 0, 'b'},
+        {"lease", required_argument, 0, 'l'},
+        {"compare", required_argument, 0, 'C'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}};
     *opts = defaults;
@@ -87,7 +112,7 @@ get_options(int argc, char *a[], struct options *opts)
     int c;
     int option_index;
     while (1) {
-        c = getopt_long(argc, a, "H:p:x:X:y:Y:m:M:t:h", long_options,
+        c = getopt_long(argc, a, "H:p:x:X:y:Y:m:M:t:b:l:C:h", long_options,
                         &option_index);
         if (c == -1)
             break;
@@ -120,6 +145,24 @@ get_options(int argc, char *a[], struct options *opts)
             case 't':
                 opts->threads = atoi(optarg);
                 break;
+            case 'b':
+                opts->batch = atoi(optarg);
+                if (opts->batch > MAX_BATCH_UPDATES)
+                    opts->batch = MAX_BATCH_UPDATES;
+                break;
+            case 'l':
+                opts->lease = atoi(optarg);
+                if (opts->lease > MAX_LEASE_IDS)
+                    opts->lease = MAX_LEASE_IDS;
+                break;
+            case 'C':
+                if (2 != sscanf(optarg, "%d,%d", &opts->compare[0],
+                                &opts->compare[1])) {
+                    fprintf(stderr, "--compare takes two ports, "
+                            "like 8638,9638\n");
+                    return -1;
+                }
+                break;
             case 'h':
                 syntax();
                 exit(0);
@@ -155,6 +198,56 @@ generate_trip_seconds(struct options *opts)
            (float)rand() / (float)RAND_MAX;
 }
 
+/* The block of trip ids a connection holds a lease on */
+struct id_lease
+{
+    int64_t next;       /* next id to use */
+    int64_t end;        /* end of the block */
+    int requested;      /* we've asked for the next block already */
+};
+
+/* send_begin
+
+   Pick the id for a new trip and send its BEGIN. Without leases that is
+   the MSG_BEGIN / MSG_ID round trip. With them we take the next id from
+   our block, and ask for the next block once we are half way through this
+   one, so its reply is normally waiting for us by the time we need it.
+   Returns 0 if the connection is gone.
+*/
+int64_t
+send_begin(int s, struct options *opts, struct id_lease *lease,
+           float lng, float lat)
+{
+    int64_t id;
+    int count;
+
+    if (opts->lease <= 0) {
+        if (-1 == send_begin_msg(s, lng, lat))
+            return 0;
+        return recv_trip_id(s);
+    }
+
+    if (lease->next == lease->end) {
+        if (!lease->requested && -1 == send_lease_req(s, opts->lease))
+            return 0;
+        if (-1 == recv_lease(s, &lease->next, &count))
+            return 0;
+        lease->end = lease->next + count;
+        lease->requested = 0;
+    }
+
+    id = lease->next++;
+    if (-1 == send_begin_id_msg(s, id, lng, lat))
+        return 0;
+
+    if (!lease->requested && lease->end - lease->next <= opts->lease / 2) {
+        if (-1 == send_lease_req(s, opts->lease))
+            return 0;
+        lease->requested = 1;
+    }
+    return id;
+}
+
 /* run_client: this is the main client loop */
 void *
 run_client(void *arg)
@@ -162,6 +255,7 @@ run_client(void *arg)
     printf("run client starting ...\n");
     float lng, lat;
     struct options *opts = (struct options *)arg;
+    struct id_lease lease = {0, 0, 0};
     srand(time(NULL));
 
     /* connect to tripstore */
@@ -180,9 +274,12 @@ run_client(void *arg)
         /* generate our lat/long based on the command line options */
         generate_long_lat(opts, &lng, &lat);
 
-        /* Begin message goes out and then we read our assigned trip id */
-        send_begin_msg(s, lng, lat);
-        int id = recv_trip_id(s);
+        /* Begin message goes out with our next trip id */
+        int64_t id = send_begin(s, opts, &lease, lng, lat);
+        if (!id) {
+            printf("Connection closed.\n");
+            return (void*)-1;
+        }
 
         /* for each one second update ... */
         while (seconds--) {
@@ -202,6 +299,198 @@ run_client(void *arg)
     return (void*)0;
 }
 
+/* A trip being run by run_batch_client() */
+struct gen_trip
+{
+    int64_t id;
+    int seconds;
+    int fare_cents;
+};
+
+/* Start a new trip: pick its id and send the BEGIN */
+int
+begin_trip(int s, struct options *opts, struct id_lease *lease,
+           struct gen_trip *trip)
+{
+    float lng, lat;
+
+    trip->seconds = generate_trip_seconds(opts);
+    trip->fare_cents = (trip->seconds / 60.0) * (DOLLARS_PER_MIN * 100.0);
+
+    generate_long_lat(opts, &lng, &lat);
+    trip->id = send_begin(s, opts, lease, lng, lat);
+    return trip->id ? 0 : -1;
+}
+
+/* run_batch_client: client loop for --batch. The thread runs opts->batch
+   trips at once over its one connection, and each tick sends all of their
+   position updates in a single MSG_UPDATE_BATCH. */
+void *
+run_batch_client(void *arg)
+{
+    struct options *opts = (struct options *)arg;
+    struct gen_trip trips[MAX_BATCH_UPDATES];
+    struct id_lease lease = {0, 0, 0};
+    int64_t ids[MAX_BATCH_UPDATES];
+    float lngs[MAX_BATCH_UPDATES];
+    float lats[MAX_BATCH_UPDATES];
+    float lng, lat;
+    int i, n;
+
+    printf("run batch client starting ...\n");
+    srand(time(NULL));
+
+    int s = sock_connect(opts->host, opts->port);
+    if (s < 0) {
+        fprintf(stderr, "unable to connect to %s:%d\n", opts->host, opts->port);
+        return (void*)-1;
+    }
+
+    for (i = 0; i < opts->batch; i++) {
+        if (-1 == begin_trip(s, opts, &lease, &trips[i]))
+            goto closed;
+    }
+
+    while (1) { // run forever
+        n = 0;
+        for (i = 0; i < opts->batch; i++) {
+            /* finished trips send their END and are replaced right away */
+            if (trips[i].seconds-- <= 0) {
+                generate_long_lat(opts, &lng, &lat);
+                send_end_msg(s, trips[i].id, lng, lat, trips[i].fare_cents);
+                if (-1 == begin_trip(s, opts, &lease, &trips[i]))
+                    goto closed;
+                continue;
+            }
+            ids[n] = trips[i].id;
+            generate_long_lat(opts, &lngs[n], &lats[n]);
+            n++;
+        }
+        if (n && -1 == send_update_batch_msg(s, n, ids, lngs, lats))
+            goto closed;
+        sleep(1);
+    }
+
+closed:
+    printf("Connection closed.\n");
+    return (void*)-1;
+}
+
+/* The same pseudo random numbers on every run and every libc, so that
+   --compare always asks the same rects. xorshift64. */
+static double
+fixed_random(uint64_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return (*x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Send every query in qs (one per line) to the query port, and read the
+   answers, a line for each, into a malloc()ed buffer */
+char *
+ask_all(struct options *opts, int port, const char *qs, int len)
+{
+    int s = sock_connect(opts->host, port);
+    int size = 1 << 16, got = 0, x;
+    char *buf = (char *)malloc(size + 1);
+
+    if (s < 0 || !buf) {
+        fprintf(stderr, "unable to connect to %s:%d\n", opts->host, port);
+        exit(1);
+    }
+    for (x = 0; x < len; ) {
+        int w = write(s, qs + x, len - x);
+        if (w <= 0) {
+            fprintf(stderr, "%s:%d closed the connection\n", opts->host,
+                    port);
+            exit(1);
+        }
+        x += w;
+    }
+    /* the tripstore closes the connection once it has answered */
+    shutdown(s, SHUT_WR);
+    while ((x = read(s, buf + got, size - got)) > 0) {
+        got += x;
+        if (got == size) {
+            size *= 2;
+            buf = (char *)realloc(buf, size + 1);
+        }
+    }
+    close(s);
+    buf[got] = 0;
+    return buf;
+}
+
+/* compare: --compare
+
+   Ask two tripstores that hold the same trips (the same -L log replayed,
+   say) the same report1s and report2s, and show the ones whose answers
+   differ. This is how --coord-bits is checked against REAL, with -G 0
+   -S 0 so that the sql reports answer. The rects are the same on every
+   run: half are 0.002 degree squares, a quarter 0.01 to 0.03 degrees a
+   side and the rest anything up to the whole area, with their bounds to
+   1e-7 degrees so that some fall within a quantization step of a point.
+   Returns how many differ.
+*/
+int
+compare(struct options *opts)
+{
+    char *qs = (char *)malloc(COMPARE_RECTS * 2 * 80);
+    char *a, *b, *qa, *qb, *q;
+    uint64_t x = 1;
+    int i, len = 0, n = 0, differ = 0;
+
+    for (i = 0; i < COMPARE_RECTS; i++) {
+        double kind = fixed_random(&x);
+        double dlat = opts->max_lat - opts->min_lat;
+        double dlng = opts->max_long - opts->min_long;
+        double lat, lng;
+
+        if (kind < 0.5) {
+            dlat = dlng = 0.002;
+        } else if (kind < 0.75) {
+            dlat = 0.01 + 0.02 * fixed_random(&x);
+            dlng = 0.01 + 0.02 * fixed_random(&x);
+        } else {
+            dlat *= fixed_random(&x);
+            dlng *= fixed_random(&x);
+        }
+        lat = opts->min_lat + (opts->max_lat - opts->min_lat - dlat) *
+                              fixed_random(&x);
+        lng = opts->min_long + (opts->max_long - opts->min_long - dlng) *
+                               fixed_random(&x);
+        len += sprintf(qs + len, "report%d %.7f %.7f %.7f %.7f\n",
+                       1 + (i & 1), lat, lat + dlat, lng, lng + dlng);
+    }
+
+    a = ask_all(opts, opts->compare[0], qs, len);
+    b = ask_all(opts, opts->compare[1], qs, len);
+    for (q = qs, qa = a, qb = b; *q; n++) {
+        char *eq = strchr(q, '\n');
+        char *ea = strchr(qa, '\n');
+        char *eb = strchr(qb, '\n');
+        if (!ea || !eb) {
+            fprintf(stderr, "only %d answers came back\n", n);
+            return COMPARE_RECTS - n;
+        }
+        *eq = *ea = *eb = 0;
+        if (strcmp(qa, qb)) {
+            if (differ++ < 20)
+                printf("%s: %s against %s\n", q, qa, qb);
+        }
+        q = eq + 1;
+        qa = ea + 1;
+        qb = eb + 1;
+    }
+    printf("%d of %d reports differ\n", differ, n);
+    free(qs);
+    free(a);
+    free(b);
+    return differ;
+}
+
 /* main just gets the command line parameters and spins up our threads
    for us */
 int
@@ -210,12 +499,15 @@ main(int argc, char *argv[])
     struct options opts;
     if (get_options(argc, argv, &opts) < 0)
         return -1;
+    if (opts.compare[0])
+        return compare(&opts) ? 1 : 0;
 
     printf("tripgen starting with %d threads.\n", opts.threads);
     int t;
     pthread_t thr;
+    void *(*client)(void *) = opts.batch > 0 ? run_batch_client : run_client;
     for (t = 0; t < opts.threads; t++) {
-        if (0 != pthread_create(&thr, NULL, run_client, (void*)&opts))
+        if (0 != pthread_create(&thr, NULL, client, (void*)&opts))
             fprintf(stderr, "Failed to create thread %d\n", t);
     }
 
@@ -0,0 +1,727 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include "sqlite3.h"
+#include "sqls.h"
+#include "trips.h"
+#include "heatmap.h"
+#include "checkpoint.h"
+
+/*
+   Every trip has its own record, found by trip id with no search at all:
+   ids come from one allocator that counts up from 1, so the records are
+   an array indexed by id. The array is kept in pages so that retention
+   can free it from the front, and so a page is only allocated once a
+   trip in it shows up.
+
+   A record is what tripsummary used to be, and a little more: when and
+   where the trip began and ended and its fare. A BEGIN or an END just
+   fills in its half, where the tripsummary table took an INSERT or an
+   UPDATE through its two indexes. The record also says which segment the
+   trip is in, which is how segments_route() sends the rest of a trip
+   after its BEGIN, and it has the start point that sat.c wants at the
+   END. For ad-hoc sql the records are the tripsummary virtual table (see
+   the bottom of this file).
+
+   Following one trip through triplog means finding its rows through
+   type_idx and then fetching each of them from wherever it landed among
+   everybody else's. So with --trajectories a record also has the trip's
+   points in a chain of chunks. add_tripdata() appends to the last one. A
+   new chunk is twice the size of the one before it (up to TRAJ_MAX_CHUNK
+   points), so a trip of n points is in about log2(n / TRAJ_FIRST_CHUNK)
+   chunks and nothing is ever copied. "trip <id>" then reads them front
+   to back.
+
+   When a segment is dropped its trips go with it.
+
+   Each page also has the span of its points' times. Ids are handed out
+   as trips begin, so a page's trips are from about the same minutes, and
+   a heatmap with a time window passes over the pages outside of it
+   without looking at their trips.
+
+   Query workers (query.c) read the records through tripsummary without
+   store_lock. With them t->shared is set, and the writer takes t->lock
+   while it changes the pages or the summary half of a record; the
+   points are only read under store_lock.
+*/
+
+#define TRAJ_FIRST_CHUNK 16
+#define TRAJ_MAX_CHUNK 1024
+
+struct trips *
+trips_create(int keep_points)
+{
+    struct trips *t = (struct trips *)malloc(sizeof(*t));
+    memset(t, 0, sizeof(*t));
+    t->keep_points = keep_points;
+    pthread_mutex_init(&t->lock, NULL);
+    return t;
+}
+
+/* The chunk at offset off in the checkpoint, or NULL if it isn't all in
+   it. A trip's chunks were written last first, so the next one is always
+   before the one that points to it, and a chain can't go round. */
+static struct traj_chunk *
+chunk_at(const void *off, struct traj_chunk *prev)
+{
+    struct traj_chunk *c = (struct traj_chunk *)ckpt_at(off);
+
+    if (!ckpt_in(off, 1, sizeof(*c)) || (prev && c >= prev) ||
+        c->n > c->cap ||
+        !ckpt_in(off, 1, sizeof(*c) + c->cap * sizeof(c->pts[0])))
+        return NULL;
+    return c;
+}
+
+/* A record from a checkpoint has its chunks as offsets into it until it
+   is first looked at (see checkpoint.c). The records were checked at
+   loading, but their chunks would have been a pass over every point, so
+   they are checked here, and a bad one cuts the trip's points short. */
+static void
+fix_points(struct trip *r)
+{
+    struct traj_chunk *c, *prev = NULL;
+    void *off = r->head;
+
+    r->head = NULL;
+    r->tail = NULL;
+    while (off) {
+        if (!(c = chunk_at(off, prev))) {
+            fprintf(stderr, "checkpoint: bad points in a trip record, "
+                    "dropped the rest of them\n");
+            break;
+        }
+        if (prev)
+            prev->next = c;
+        else
+            r->head = c;
+        r->tail = prev = c;
+        off = c->next;
+        c->next = NULL;
+    }
+    r->unfixed = 0;
+}
+
+static void
+free_trip(struct trips *t, struct trip *r)
+{
+    struct traj_chunk *c, *next;
+
+    if (r->unfixed)
+        fix_points(r);
+    for (c = r->head; c; c = next) {
+        next = c->next;
+        t->chunks--;
+        t->chunk_bytes -= sizeof(*c) + c->cap * sizeof(c->pts[0]);
+        ckpt_free(c);
+    }
+    t->points -= r->npoints;
+    t->trips--;
+    if (r->begun && !r->ended)
+        t->open--;
+    memset(r, 0, sizeof(*r));
+}
+
+void
+trips_destroy(struct trips *t)
+{
+    unsigned long p;
+    int i;
+
+    for (p = 0; p < t->npages; p++) {
+        if (!t->pages[p])
+            continue;
+        for (i = 0; i < TRIPS_PAGE; i++) {
+            if (t->pages[p][i].seq)
+                free_trip(t, &t->pages[p][i]);
+        }
+        ckpt_free(t->pages[p]);
+    }
+    free(t->pages);
+    free(t->spans);
+    free(t);
+}
+
+/* The record for id, or NULL. With make, the page is allocated if need
+   be. Ids before the first page we still have are gone for good. */
+static struct trip *
+trip_slot(struct trips *t, int64_t id, int make)
+{
+    int64_t page = id >> TRIPS_PAGE_BITS;
+    struct trip *r;
+    struct trips_span *spans;
+    unsigned long p;
+
+    if (page < t->first_page)
+        return NULL;
+    p = page - t->first_page;
+    if (p >= t->npages) {
+        unsigned long n = t->npages ? t->npages : 16;
+        struct trip **pages;
+
+        if (!make)
+            return NULL;
+        while (n <= p)
+            n *= 2;
+        pages = (struct trip **)realloc(t->pages, n * sizeof(*pages));
+        if (!pages)
+            return NULL;
+        memset(pages + t->npages, 0, (n - t->npages) * sizeof(*pages));
+        t->pages = pages;
+        spans = (struct trips_span *)realloc(t->spans, n * sizeof(*spans));
+        if (!spans)
+            return NULL;
+        t->spans = spans;
+        t->npages = n;
+    }
+    if (!t->pages[p]) {
+        if (!make)
+            return NULL;
+        t->pages[p] = (struct trip *)calloc(TRIPS_PAGE, sizeof(struct trip));
+        if (!t->pages[p])
+            return NULL;
+        t->spans[p].lo = UINT32_MAX;
+        t->spans[p].hi = 0;
+    }
+    r = &t->pages[p][id & (TRIPS_PAGE - 1)];
+    if (r->unfixed)
+        fix_points(r);
+    return r;
+}
+
+/* Append one event to trip id, which is in segment seq (unless it is in
+   one already). rec is set to its record, or to NULL for a trip we
+   already dropped. Returns 1 if the event began or ended the trip, 0 if
+   it didn't (a point, or a BEGIN or END it already had), -1 if we ran
+   out of memory. */
+int
+trips_add(struct trips *t, int64_t id, unsigned long seq, float lng,
+          float lat, int type, int cents, time_t now, struct trip **rec)
+{
+    struct trip *r;
+    struct traj_chunk *c;
+    struct trips_span *span;
+    int changed = 0;
+
+    *rec = NULL;
+    if (id >> TRIPS_PAGE_BITS < t->first_page) {
+        t->ignored++;
+        return 0;
+    }
+    if (t->shared)
+        pthread_mutex_lock(&t->lock);
+    r = trip_slot(t, id, 1);
+    if (!r) {
+        if (t->shared)
+            pthread_mutex_unlock(&t->lock);
+        goto oom;
+    }
+    if (!r->seq) {
+        r->seq = seq;
+        t->trips++;
+    }
+    *rec = r;
+
+    if (type == BEGIN && !r->begun) {
+        changed = 1;
+        r->begun = 1;
+        r->begin = now;
+        r->start_lng = lng;
+        r->start_lat = lat;
+        if (!r->ended)
+            t->open++;
+    } else if (type == END && !r->ended) {
+        changed = 1;
+        r->ended = 1;
+        r->end = now;
+        r->end_lng = lng;
+        r->end_lat = lat;
+        r->fare = cents;
+        if (r->begun)
+            t->open--;
+    }
+    if (t->shared)
+        pthread_mutex_unlock(&t->lock);
+
+    if (!t->keep_points)
+        return changed;
+    c = r->tail;
+    if (!c || c->n == c->cap) {
+        uint32_t cap = c ? c->cap * 2 : TRAJ_FIRST_CHUNK;
+        if (cap > TRAJ_MAX_CHUNK)
+            cap = TRAJ_MAX_CHUNK;
+        struct traj_chunk *nc = (struct traj_chunk *)
+                                malloc(sizeof(*nc) + cap * sizeof(nc->pts[0]));
+        if (!nc)
+            goto oom;
+        nc->next = NULL;
+        nc->n = 0;
+        nc->cap = cap;
+        if (c)
+            c->next = nc;
+        else
+            r->head = nc;
+        r->tail = c = nc;
+        t->chunks++;
+        t->chunk_bytes += sizeof(*nc) + cap * sizeof(nc->pts[0]);
+    }
+    c->pts[c->n].lng = lng;
+    c->pts[c->n].lat = lat;
+    c->pts[c->n].t = now;
+    c->n++;
+    r->npoints++;
+    t->points++;
+    span = &t->spans[(id >> TRIPS_PAGE_BITS) - t->first_page];
+    if (span->lo > (uint32_t)now)
+        span->lo = now;
+    if (span->hi < (uint32_t)now)
+        span->hi = now;
+    return changed;
+oom:
+    fprintf(stderr, "trips: out of memory at %lu points\n", t->points);
+    return -1;
+}
+
+/* The record for trip id, or NULL if we have never seen it (or dropped
+   it) */
+struct trip *
+trips_get(struct trips *t, int64_t id)
+{
+    struct trip *r = trip_slot(t, id, 0);
+    return r && r->seq ? r : NULL;
+}
+
+/* Count every trip's points in h (heatmap.c), passing over the pages and
+   then the trips that are over before its window or not yet begun in
+   it. Points are read under store_lock, which the caller holds as lock;
+   it is let go between pages for the writer to get in, so a map of the
+   whole store doesn't hold up ingest while it goes over all of it. Pages
+   can be dropped from the front meanwhile, so we go by page number. */
+void
+trips_heatmap(struct trips *t, struct heatmap *h, pthread_mutex_t *lock)
+{
+    struct traj_chunk *c;
+    int64_t page;
+    unsigned long p;
+    int i;
+
+    for (page = t->first_page; ; page++) {
+        if (page > t->first_page) {
+            pthread_mutex_unlock(lock);
+            sched_yield();
+            pthread_mutex_lock(lock);
+        }
+        if (page < t->first_page)
+            page = t->first_page;
+        p = page - t->first_page;
+        if (p >= t->npages)
+            break;
+        if (!t->pages[p] || t->spans[p].hi < h->from ||
+            t->spans[p].lo > h->to)
+            continue;
+        for (i = 0; i < TRIPS_PAGE; i++) {
+            struct trip *r = &t->pages[p][i];
+            if (!r->seq || (r->ended && r->end < h->from) ||
+                (r->begun && r->begin > h->to))
+                continue;
+            if (r->unfixed)
+                fix_points(r);
+            for (c = r->head; c; c = c->next)
+                heatmap_add(h, (page << TRIPS_PAGE_BITS) + i, c->pts, c->n);
+        }
+    }
+}
+
+/* Free the trips of segments up to seq, which began at or before max_id.
+   The pages at the front that are left empty are freed too. */
+void
+trips_drop_segment(struct trips *t, unsigned long seq, int64_t max_id)
+{
+    unsigned long p, last, skip;
+    int i, empty;
+
+    if (max_id >> TRIPS_PAGE_BITS < t->first_page)
+        return;
+    if (t->shared)
+        pthread_mutex_lock(&t->lock);
+    last = (max_id >> TRIPS_PAGE_BITS) - t->first_page;
+    for (p = 0; p <= last && p < t->npages; p++) {
+        if (!t->pages[p])
+            continue;
+        for (i = 0; i < TRIPS_PAGE; i++) {
+            if (t->pages[p][i].seq && t->pages[p][i].seq <= seq)
+                free_trip(t, &t->pages[p][i]);
+        }
+    }
+
+    for (skip = 0; skip < last && skip < t->npages; skip++) {
+        if (t->pages[skip]) {
+            for (empty = 1, i = 0; empty && i < TRIPS_PAGE; i++)
+                empty = !t->pages[skip][i].seq;
+            if (!empty)
+                break;
+            ckpt_free(t->pages[skip]);
+        }
+    }
+    if (skip) {
+        memmove(t->pages, t->pages + skip,
+                (t->npages - skip) * sizeof(*t->pages));
+        memset(t->pages + t->npages - skip, 0, skip * sizeof(*t->pages));
+        memmove(t->spans, t->spans + skip,
+                (t->npages - skip) * sizeof(*t->spans));
+        t->first_page += skip;
+    }
+    if (t->shared)
+        pthread_mutex_unlock(&t->lock);
+}
+
+unsigned long
+trips_bytes(struct trips *t)
+{
+    unsigned long bytes = t->npages * (sizeof(*t->pages) + sizeof(*t->spans)) +
+                          t->chunk_bytes;
+    unsigned long p;
+
+    for (p = 0; p < t->npages; p++) {
+        if (t->pages[p])
+            bytes += TRIPS_PAGE * sizeof(struct trip);
+    }
+    return bytes;
+}
+
+/* The tripsummary virtual table
+
+   One row per trip that began, in id order. begin and end are unix times
+   like the table had, with end (and the end point and the fare) NULL
+   while the trip is open. It holds nothing itself, so creating it and
+   connecting to it are the same thing. Constraints on id narrow the scan
+   to that range of ids; sqlite still checks them on each row.
+*/
+
+enum
+{
+    COL_ID,
+    COL_BEGIN,
+    COL_END,
+    COL_START_LONG,
+    COL_START_LAT,
+    COL_END_LONG,
+    COL_END_LAT,
+    COL_FARE
+};
+
+/* idxNum bits from summary_best_index */
+#define ID_LOWER 1
+#define ID_LOWER_GT 2
+#define ID_UPPER 4
+#define ID_UPPER_LT 8
+
+struct summary_vtab
+{
+    sqlite3_vtab base;
+    struct trips *t;
+};
+
+struct summary_cursor
+{
+    sqlite3_vtab_cursor base;
+    struct trips *t;
+    int64_t id, last;
+    struct trip *r;             /* NULL at the end, else &rec */
+    struct trip rec;            /* copied under t->lock */
+};
+
+static int
+summary_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                sqlite3_vtab **vtab, char **err)
+{
+    struct summary_vtab *v;
+    int rc;
+
+    (void)argc;
+    (void)argv;
+    (void)err;
+    rc = sqlite3_declare_vtab(db, "CREATE TABLE x(id INTEGER, "
+                              "begin INTEGER, end INTEGER, "
+                              "start_long REAL, start_lat REAL, "
+                              "end_long REAL, end_lat REAL, "
+                              "fare_cents INTEGER)");
+    if (rc != SQLITE_OK)
+        return rc;
+    v = (struct summary_vtab *)sqlite3_malloc(sizeof(*v));
+    if (!v)
+        return SQLITE_NOMEM;
+    memset(v, 0, sizeof(*v));
+    v->t = (struct trips *)aux;
+    *vtab = &v->base;
+    return SQLITE_OK;
+}
+
+static int
+summary_disconnect(sqlite3_vtab *vtab)
+{
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int
+summary_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+    struct summary_vtab *v = (struct summary_vtab *)vtab;
+    int lower = -1, upper = -1, eq = -1;
+    int i, argv = 0;
+
+    for (i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        if (!c->usable || c->iColumn != COL_ID)
+            continue;
+        if (c->op == SQLITE_INDEX_CONSTRAINT_EQ)
+            eq = i;
+        else if (c->op == SQLITE_INDEX_CONSTRAINT_GT ||
+                 c->op == SQLITE_INDEX_CONSTRAINT_GE)
+            lower = i;
+        else if (c->op == SQLITE_INDEX_CONSTRAINT_LT ||
+                 c->op == SQLITE_INDEX_CONSTRAINT_LE)
+            upper = i;
+    }
+
+    info->idxNum = 0;
+    if (eq >= 0) {
+        /* id = x is both bounds */
+        info->idxNum = ID_LOWER | ID_UPPER;
+        info->aConstraintUsage[eq].argvIndex = ++argv;
+        info->estimatedCost = 1;
+        info->estimatedRows = 1;
+    } else {
+        if (lower >= 0) {
+            info->idxNum |= ID_LOWER;
+            if (info->aConstraint[lower].op == SQLITE_INDEX_CONSTRAINT_GT)
+                info->idxNum |= ID_LOWER_GT;
+            info->aConstraintUsage[lower].argvIndex = ++argv;
+        }
+        if (upper >= 0) {
+            info->idxNum |= ID_UPPER;
+            if (info->aConstraint[upper].op == SQLITE_INDEX_CONSTRAINT_LT)
+                info->idxNum |= ID_UPPER_LT;
+            info->aConstraintUsage[upper].argvIndex = ++argv;
+        }
+        info->estimatedRows = v->t->trips + 1;
+        if (lower >= 0)
+            info->estimatedRows /= 4;
+        if (upper >= 0)
+            info->estimatedRows /= 4;
+        info->estimatedCost = info->estimatedRows + 1;
+    }
+
+    /* we scan in id order */
+    if (info->nOrderBy == 1 && info->aOrderBy[0].iColumn == COL_ID &&
+        !info->aOrderBy[0].desc)
+        info->orderByConsumed = 1;
+    return SQLITE_OK;
+}
+
+static int
+summary_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor)
+{
+    struct summary_cursor *c;
+
+    c = (struct summary_cursor *)sqlite3_malloc(sizeof(*c));
+    if (!c)
+        return SQLITE_NOMEM;
+    memset(c, 0, sizeof(*c));
+    c->t = ((struct summary_vtab *)vtab)->t;
+    *cursor = &c->base;
+    return SQLITE_OK;
+}
+
+static int
+summary_close(sqlite3_vtab_cursor *cursor)
+{
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+/* Move to the first trip that began at or after c->id */
+static void
+summary_seek(struct summary_cursor *c)
+{
+    struct trips *t = c->t;
+    int64_t end, first;
+
+    if (t->shared)
+        pthread_mutex_lock(&t->lock);
+    end = (t->first_page + (int64_t)t->npages) << TRIPS_PAGE_BITS;
+    first = t->first_page << TRIPS_PAGE_BITS;
+    if (c->id < first)
+        c->id = first;
+    if (c->last >= end)
+        c->last = end - 1;
+    while (c->id <= c->last) {
+        struct trip *page = t->pages[(c->id >> TRIPS_PAGE_BITS) -
+                                     t->first_page];
+        if (!page) {
+            c->id = ((c->id >> TRIPS_PAGE_BITS) + 1) << TRIPS_PAGE_BITS;
+            continue;
+        }
+        c->r = &page[c->id & (TRIPS_PAGE - 1)];
+        if (c->r->seq && c->r->begun) {
+            c->rec = *c->r;
+            c->r = &c->rec;
+            goto out;
+        }
+        c->id++;
+    }
+    c->r = NULL;
+out:
+    if (t->shared)
+        pthread_mutex_unlock(&t->lock);
+}
+
+/* The bound an id constraint value gives, rounded inwards. 0 if it
+   isn't a number, and then we just don't narrow the scan on it. */
+static int
+id_bound(sqlite3_value *v, int lower, int strict, int64_t *bound)
+{
+    int type = sqlite3_value_numeric_type(v);
+    double d;
+
+    if (type == SQLITE_INTEGER) {
+        *bound = sqlite3_value_int64(v);
+        if (strict)
+            *bound += lower ? 1 : -1;
+        return 1;
+    }
+    if (type != SQLITE_FLOAT)
+        return 0;
+    d = sqlite3_value_double(v);
+    if (d > 9e18 || d < -9e18)
+        return 0;
+    if (lower)
+        *bound = strict ? (int64_t)floor(d) + 1 : (int64_t)ceil(d);
+    else
+        *bound = strict ? (int64_t)ceil(d) - 1 : (int64_t)floor(d);
+    return 1;
+}
+
+static int
+summary_filter(sqlite3_vtab_cursor *cursor, int idx, const char *idx_str,
+               int argc, sqlite3_value **argv)
+{
+    struct summary_cursor *c = (struct summary_cursor *)cursor;
+    int i = 0;
+
+    (void)idx_str;
+    c->id = 0;
+    c->last = INT64_MAX;
+    if (idx == (ID_LOWER | ID_UPPER) && argc == 1) {
+        /* id = x */
+        if (sqlite3_value_numeric_type(argv[0]) == SQLITE_INTEGER)
+            c->id = c->last = sqlite3_value_int64(argv[0]);
+    } else {
+        if ((idx & ID_LOWER) &&
+            !id_bound(argv[i++], 1, idx & ID_LOWER_GT, &c->id))
+            c->id = 0;
+        if ((idx & ID_UPPER) &&
+            !id_bound(argv[i++], 0, idx & ID_UPPER_LT, &c->last))
+            c->last = INT64_MAX;
+    }
+    summary_seek(c);
+    return SQLITE_OK;
+}
+
+static int
+summary_next(sqlite3_vtab_cursor *cursor)
+{
+    struct summary_cursor *c = (struct summary_cursor *)cursor;
+
+    c->id++;
+    summary_seek(c);
+    return SQLITE_OK;
+}
+
+static int
+summary_eof(sqlite3_vtab_cursor *cursor)
+{
+    return ((struct summary_cursor *)cursor)->r == NULL;
+}
+
+static int
+summary_column(sqlite3_vtab_cursor *cursor, sqlite3_context *sctx, int col)
+{
+    struct summary_cursor *c = (struct summary_cursor *)cursor;
+    struct trip *r = c->r;
+
+    if (col != COL_ID && col != COL_BEGIN && col != COL_START_LONG &&
+        col != COL_START_LAT && !r->ended) {
+        sqlite3_result_null(sctx);
+        return SQLITE_OK;
+    }
+    switch (col) {
+        case COL_ID:
+            sqlite3_result_int64(sctx, c->id);
+            break;
+        case COL_BEGIN:
+            sqlite3_result_int64(sctx, r->begin);
+            break;
+        case COL_END:
+            sqlite3_result_int64(sctx, r->end);
+            break;
+        case COL_START_LONG:
+            sqlite3_result_double(sctx, r->start_lng);
+            break;
+        case COL_START_LAT:
+            sqlite3_result_double(sctx, r->start_lat);
+            break;
+        case COL_END_LONG:
+            sqlite3_result_double(sctx, r->end_lng);
+            break;
+        case COL_END_LAT:
+            sqlite3_result_double(sctx, r->end_lat);
+            break;
+        case COL_FARE:
+            sqlite3_result_int(sctx, r->fare);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static int
+summary_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid)
+{
+    *rowid = ((struct summary_cursor *)cursor)->id;
+    return SQLITE_OK;
+}
+
+/* read only, so the rest of it is NULL */
+static sqlite3_module summary_module = {
+    .iVersion = 0,
+    .xCreate = summary_connect,
+    .xConnect = summary_connect,
+    .xBestIndex = summary_best_index,
+    .xDisconnect = summary_disconnect,
+    .xDestroy = summary_disconnect,
+    .xOpen = summary_open,
+    .xClose = summary_close,
+    .xFilter = summary_filter,
+    .xNext = summary_next,
+    .xEof = summary_eof,
+    .xColumn = summary_column,
+    .xRowid = summary_rowid,
+};
+
+/* Make temp.tripsummary, over t, in db */
+int
+trips_create_module(sqlite3 *db, struct trips *t)
+{
+    if (sqlite3_create_module(db, "tripsummary", &summary_module,
+                              t) != SQLITE_OK ||
+        sqlite3_exec(db, "CREATE VIRTUAL TABLE temp.tripsummary "
+                     "USING tripsummary;", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to make tripsummary: %s\n",
+                sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+/* Per trip records, indexed directly by trip id: when and where the trip
+   began and ended, its fare, which segment it is in and (with
+   --trajectories) its points in order. See trips.c. */
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+struct traj_point
+{
+    float lng, lat;
+    uint32_t t;
+};
+
+/* Chunks double in size up to TRAJ_MAX_CHUNK points */
+struct traj_chunk
+{
+    struct traj_chunk *next;
+    uint32_t n, cap;
+    struct traj_point pts[];
+};
+
+struct trip
+{
+    unsigned long seq;          /* segment the trip is in, 0 for no trip */
+    struct traj_chunk *head, *tail;
+    uint32_t npoints;
+    unsigned char begun, ended;
+    unsigned char unfixed;      /* head and tail are checkpoint offsets */
+    int fare;                   /* cents, from the END */
+    uint32_t begin, end;        /* times, when begun and ended */
+    float start_lng, start_lat;
+    float end_lng, end_lat;
+};
+
+/* Records are in pages of 2^TRIPS_PAGE_BITS trip ids, so that retention
+   can free them from the front */
+#define TRIPS_PAGE_BITS 12
+#define TRIPS_PAGE (1 << TRIPS_PAGE_BITS)
+
+/* The times of the points of a page's trips, for heatmaps to pass over
+   pages outside of their window */
+struct trips_span
+{
+    uint32_t lo, hi;
+};
+
+struct trips
+{
+    struct trip **pages;        /* NULL for pages with no trips yet */
+    struct trips_span *spans;   /* one for each of pages */
+    int64_t first_page;         /* page of pages[0] */
+    unsigned long npages;
+    int keep_points;            /* --trajectories */
+
+    unsigned long trips;        /* records in use */
+    unsigned long open;         /* begun and not ended */
+    unsigned long points;
+    unsigned long chunks;
+    unsigned long chunk_bytes;
+    unsigned long ignored;      /* events of trips we already dropped */
+    unsigned long unknown;      /* events of trips that never began */
+
+    /* Set with query workers: changes to pages and to the summary half
+       of the records are made under lock (see trips.c) */
+    int shared;
+    pthread_mutex_t lock;
+};
+
+struct trips *trips_create(int keep_points);
+void trips_destroy(struct trips *t);
+
+int trips_add(struct trips *t, int64_t id, unsigned long seq, float lng,
+              float lat, int type, int cents, time_t now, struct trip **rec);
+
+struct trip *trips_get(struct trips *t, int64_t id);
+
+void trips_drop_segment(struct trips *t, unsigned long seq, int64_t max_id);
+
+unsigned long trips_bytes(struct trips *t);
+
+struct heatmap;
+void trips_heatmap(struct trips *t, struct heatmap *h,
+                   pthread_mutex_t *lock);
+
+int trips_create_module(sqlite3 *db, struct trips *t);
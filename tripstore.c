@@ -1,24 +1,125 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
 #include "sqlite3.h"
 #include "sqls.h"
+#include "stats.h"
+#include "evq.h"
+#include "colstore.h"
+#include "grid.h"
+#include "hll.h"
+#include "active.h"
+#include "sat.h"
+#include "segment.h"
+#include "trips.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "checkpoint.h"
+#include "scan.h"
+#include "query.h"
+#include "outbuf.h"
+#include "reply.h"
+#include "quant.h"
+#include "bufpool.h"
+#include "uring.h"
 #include "ctx.h"
 #include "msgs.h"
+#include "sockets.h"
 
 #define GENPORT 8637
 #define QUERYPORT 8638
 
 #define EPOLL_EVENTS 256
 
-/* This is the global allocator for trip ids */
-static int next_trip_id = 1;
+#define BATCH_ROWS 1024
+#define BATCH_MS 0
+
+#define RECV_BUF_SIZE 65536
+
+/* --backend uring: per reactor ring size and provided recv buffers */
+#define URING_ENTRIES 4096
+#define URING_BUFS 4096
+#define URING_BUF_SIZE 4096
+
+enum BACKEND {BACKEND_EPOLL, BACKEND_URING};
+
+#define QUEUE_SIZE 65536
+#define WRITER_BATCH 1024
+
+/* --area: where we expect the trips to be, tripgen's default area */
+#define AREA_MIN_LAT 37.42445
+#define AREA_MAX_LAT 37.48479
+#define AREA_MIN_LONG -122.30817
+#define AREA_MAX_LONG -122.22542
+
+/* --grid: cells per side of the report1 grid index over the area */
+#define GRID_CELLS 64
+
+/* --sat: cells per side of the report2 summed-area tables */
+#define SAT_CELLS 64
+
+/* --hll: cells per side of the sketch grid for report1~ and report2~ */
+#define HLL_CELLS 16
+
+/* --segment: seconds of trips per segment of the trip log */
+#define SEGMENT_SECS 3600
+
+/* --wal-ms: ms between fsyncs of the write-ahead log */
+#define WAL_MS 10
+
+/* --snapshot: where snapshots go unless the query names a file */
+#define SNAPSHOT_PATH "tripstore.snap"
+
+/* --query-workers: threads that run the queries */
+#define QUERY_WORKERS 4
+
+/* --out-kb: answers buffered for a query connection before its query
+   waits for the client */
+#define OUT_KB 4096
+
+/* This is the global allocator for trip ids. It is shared by all of the
+   reactors, so it is only ever bumped atomically. Ids are 64 bit so that
+   leasing them out in blocks can't run us out. */
+static int64_t next_trip_id = 1;
 
 struct options
 {
     int port;
     int query_port;
+    int batch_rows;
+    int batch_ms;
+    int reactors;
+    int queue_size;
+    int engine;
+    int recv_buf;
+    int backend;
+    int rtree;
+    int grid;
+    int hll;
+    int sat;
+    double min_lat, max_lat, min_lng, max_lng;
+    int segment_secs;
+    int retain_secs;
+    int retain_mb;
+    int coord_bits;
+    int trajectories;
+    char *wal;
+    int wal_ms;
+    char *snapshot;
+    int snapshot_secs;
+    char *checkpoint;
+    int query_workers;
+    int out_kb;
 };
 
 void
@@ -27,19 +128,104 @@ syntax()
     printf("tripstore: store trip data in memory\n");
     printf("\t-p (--port): port to listen on for tripgen\n");
     printf("\t-q (--query-port): port to listen on for queries\n");
+    printf("\t-b (--batch-rows): max rows per ingest transaction "
+           "(1 for autocommit)\n");
+    printf("\t-w (--batch-ms): max ms to hold an ingest transaction open "
+           "(0 commits after each wakeup)\n");
+    printf("\t-r (--reactors): event loop threads for tripgen connections "
+           "(0 for one per cpu)\n");
+    printf("\t-Q (--queue-size): events buffered between the reactors "
+           "and the storage writer\n");
+    printf("\t-e (--engine): where to keep the trip log, sqlite or "
+           "columnar\n");
+    printf("\t-R (--recv-buf): receive buffer bytes per tripgen "
+           "connection\n");
+    printf("\t-B (--backend): network event loop, epoll or uring\n");
+    printf("\t-g (--rtree): R-tree index the sqlite engine keeps, none, "
+           "ends (begin/end points for report2) or all (also report1)\n");
+    printf("\t-G (--grid): cells per side of the report1 grid index "
+           "(0 for none)\n");
+    printf("\t-S (--sat): cells per side of the report2 summed-area "
+           "tables (0 for none)\n");
+    printf("\t-H (--hll): cells per side of the sketch grid for "
+           "report1~ and report2~ (0 for none)\n");
+    printf("\t-A (--area): minlat,maxlat,minlong,maxlong the grids "
+           "covers\n");
+    printf("\t-t (--segment): seconds of trips in each segment of the "
+           "trip log\n");
+    printf("\t-k (--retain): drop segments whose last event is older "
+           "than this many seconds (0 to keep them)\n");
+    printf("\t-M (--retain-mb): drop the oldest segments to stay under "
+           "this many MB (0 for no limit)\n");
+    printf("\t-c (--coord-bits): store long and lat in the sqlite tables "
+           "as %d to %d bit fixed point over the area (0 for REAL)\n",
+           QUANT_MIN_BITS, QUANT_MAX_BITS);
+    printf("\t-j (--trajectories): keep each trip's points together for "
+           "\"trip <id>\" (0 for no)\n");
+    printf("\t-L (--wal): log every event to this file, and replay it "
+           "at startup\n");
+    printf("\t-f (--wal-ms): ms between fsyncs of the log (0 for as "
+           "soon as there is anything)\n");
+    printf("\t-P (--snapshot): file the \"snapshot\" query writes to "
+           "by default\n");
+    printf("\t-s (--snapshot-secs): also take a snapshot every this many "
+           "seconds (0 for only when asked)\n");
+    printf("\t-C (--checkpoint): file the \"checkpoint\" query (and -s) "
+           "writes the store to, and startup loads it from\n");
+    printf("\t-W (--query-workers): threads that run queries, ad-hoc sql "
+           "on their own connections (0 for on the event loop)\n");
+    printf("\t-O (--out-kb): KB of answers buffered for a query "
+           "connection before its query waits for the client\n");
     printf("\t-h (--help): this message\n");
     printf("By default tripstore will listen on %d for tripgen and "
            "%d for queries.\n", GENPORT, QUERYPORT);
+    printf("Ingest is committed in batches of up to %d rows, %d ms, "
+           "through a queue of %d events.\n", BATCH_ROWS, BATCH_MS,
+           QUEUE_SIZE);
 }
 
 /* Helper functions */
 int
 get_options(int argc, char *a[], struct options *opts)
 {
-    static struct options defaults = {GENPORT, QUERYPORT};
+    static struct options defaults = {GENPORT, QUERYPORT,
+                                      BATCH_ROWS, BATCH_MS, 0,
+                                      QUEUE_SIZE, ENGINE_SQLITE,
+                                      RECV_BUF_SIZE, BACKEND_EPOLL,
+                                      RTREE_ENDS, GRID_CELLS, HLL_CELLS,
+                                      SAT_CELLS,
+                                      AREA_MIN_LAT, AREA_MAX_LAT,
+                                      AREA_MIN_LONG, AREA_MAX_LONG,
+                                      SEGMENT_SECS, 0, 0, 0, 1, NULL,
+                                      WAL_MS, SNAPSHOT_PATH, 0, NULL,
+                                      QUERY_WORKERS, OUT_KB};
     static struct option long_options[] = {
         {"port", required_argument, 0, 'p'},
         {"query-port", required_argument, 0, 'q'},
+        {"batch-rows", required_argument, 0, 'b'},
+        {"batch-ms", required_argument, 0, 'w'},
+        {"reactors", required_argument, 0, 'r'},
+        {"queue-size", required_argument, 0, 'Q'},
+        {"engine", required_argument, 0, 'e'},
+        {"recv-buf", required_argument, 0, 'R'},
+        {"backend", required_argument, 0, 'B'},
+        {"rtree", required_argument, 0, 'g'},
+        {"grid", required_argument, 0, 'G'},
+        {"hll", required_argument, 0, 'H'},
+        {"sat", required_argument, 0, 'S'},
+        {"area", required_argument, 0, 'A'},
+        {"segment", required_argument, 0, 't'},
+        {"retain", required_argument, 0, 'k'},
+        {"retain-mb", required_argument, 0, 'M'},
+        {"coord-bits", required_argument, 0, 'c'},
+        {"trajectories", required_argument, 0, 'j'},
+        {"wal", required_argument, 0, 'L'},
+        {"wal-ms", required_argument, 0, 'f'},
+        {"snapshot", required_argument, 0, 'P'},
+        {"snapshot-secs", required_argument, 0, 's'},
+        {"checkpoint", required_argument, 0, 'C'},
+        {"query-workers", required_argument, 0, 'W'},
+        {"out-kb", required_argument, 0, 'O'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}};
     *opts = defaults;
@@ -47,7 +233,7 @@ get_options(int argc, char *a[], struct options *opts)
     int c;
     int option_index;
     while (1) {
-        c = getopt_long(argc, a, "p:q:h", long_options, &option_index);
+        c = getopt_long(argc, a, "p:q:b:w:r:Q:e:R:B:g:G:H:S:A:t:k:M:c:j:L:f:P:s:C:W:O:h", long_options, &option_index);
         
         if (c == -1)
             break;
@@ -59,6 +245,121 @@ get_options(int argc, char *a[], struct options *opts)
             case 'q':
                 opts->query_port = atoi(optarg);
                 break;
+            case 'b':
+                opts->batch_rows = atoi(optarg);
+                break;
+            case 'w':
+                opts->batch_ms = atoi(optarg);
+                break;
+            case 'r':
+                opts->reactors = atoi(optarg);
+                break;
+            case 'Q':
+                opts->queue_size = atoi(optarg);
+                break;
+            case 'e':
+                if (strcasecmp(optarg, "sqlite") == 0) {
+                    opts->engine = ENGINE_SQLITE;
+                } else if (strcasecmp(optarg, "columnar") == 0) {
+                    opts->engine = ENGINE_COLUMNAR;
+                } else {
+                    fprintf(stderr, "unknown engine: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'R':
+                opts->recv_buf = atoi(optarg);
+                if (opts->recv_buf < (int)MAX_FRAME_SIZE)
+                    opts->recv_buf = MAX_FRAME_SIZE;
+                break;
+            case 'B':
+                if (strcasecmp(optarg, "epoll") == 0) {
+                    opts->backend = BACKEND_EPOLL;
+                } else if (strcasecmp(optarg, "uring") == 0) {
+                    opts->backend = BACKEND_URING;
+                } else {
+                    fprintf(stderr, "unknown backend: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'g':
+                if (strcasecmp(optarg, "none") == 0) {
+                    opts->rtree = RTREE_NONE;
+                } else if (strcasecmp(optarg, "ends") == 0) {
+                    opts->rtree = RTREE_ENDS;
+                } else if (strcasecmp(optarg, "all") == 0) {
+                    opts->rtree = RTREE_ALL;
+                } else {
+                    fprintf(stderr, "unknown rtree: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'G':
+                opts->grid = atoi(optarg);
+                break;
+            case 'H':
+                opts->hll = atoi(optarg);
+                break;
+            case 'S':
+                opts->sat = atoi(optarg);
+                break;
+            case 'A':
+                if (4 != sscanf(optarg, "%lf,%lf,%lf,%lf",
+                                &opts->min_lat, &opts->max_lat,
+                                &opts->min_lng, &opts->max_lng) ||
+                    opts->min_lat >= opts->max_lat ||
+                    opts->min_lng >= opts->max_lng) {
+                    fprintf(stderr, "bad area: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 't':
+                opts->segment_secs = atoi(optarg);
+                break;
+            case 'k':
+                opts->retain_secs = atoi(optarg);
+                break;
+            case 'M':
+                opts->retain_mb = atoi(optarg);
+                break;
+            case 'c':
+                opts->coord_bits = atoi(optarg);
+                if (opts->coord_bits &&
+                    (opts->coord_bits < QUANT_MIN_BITS ||
+                     opts->coord_bits > QUANT_MAX_BITS)) {
+                    fprintf(stderr, "coord-bits must be 0 or %d to %d\n",
+                            QUANT_MIN_BITS, QUANT_MAX_BITS);
+                    return -1;
+                }
+                break;
+            case 'j':
+                opts->trajectories = atoi(optarg);
+                break;
+            case 'L':
+                opts->wal = optarg;
+                break;
+            case 'f':
+                opts->wal_ms = atoi(optarg);
+                break;
+            case 'P':
+                opts->snapshot = optarg;
+                break;
+            case 's':
+                opts->snapshot_secs = atoi(optarg);
+                break;
+            case 'C':
+                opts->checkpoint = optarg;
+                break;
+            case 'W':
+                opts->query_workers = atoi(optarg);
+                break;
+            case 'O':
+                opts->out_kb = atoi(optarg);
+                if (opts->out_kb <= 0) {
+                    fprintf(stderr, "out-kb must be positive\n");
+                    return -1;
+                }
+                break;
             case 'h':
                 syntax();
                 exit(0);
@@ -75,14 +376,71 @@ get_options(int argc, char *a[], struct options *opts)
 }
 
 /* Allocate a new trip id and notify the requester */
-int
+int64_t
 allocate_send_id(int s)
 {
-    int id = next_trip_id++;
+    int64_t id = __sync_fetch_and_add(&next_trip_id, 1);
     send_trip_id(s, id);
     return id;
 }
 
+/* Lease a block of count trip ids to the generator on epc. It may start
+   trips with them (MSG_BEGIN_ID) without asking us first, in increasing
+   order, so that each id begins only one trip. We remember this block and
+   the one before, so the generator can ask for the next block before it
+   has used up the current one. */
+int
+lease_send_ids(struct epoll_context *epc, int count)
+{
+    int64_t first = __sync_fetch_and_add(&next_trip_id, count);
+
+    epc->lease_lo[1] = epc->lease_lo[0];
+    epc->lease_hi[1] = epc->lease_hi[0];
+    epc->lease_lo[0] = first;
+    epc->lease_hi[0] = first + count;
+    epc->reactor->stats.leases++;
+    return send_lease(epc->fd, first, count);
+}
+
+/* Has id been handed out, to any generator? Ids that haven't could be
+   anything, and the trip records and the id bitmaps are sized by them. */
+int
+id_is_allocated(int64_t id)
+{
+    return id > 0 && id < __atomic_load_n(&next_trip_id, __ATOMIC_RELAXED);
+}
+
+/* Drop an event for an id that was never handed out. The first one on a
+   connection is logged. */
+void
+bad_id(struct epoll_context *epc, int64_t id)
+{
+    if (!epc->bad_ids++)
+        fprintf(stderr, "dropping events for trip %lld, which was never "
+                "handed out\n", (long long)id);
+    epc->reactor->stats.bad_ids++;
+}
+
+/* Is id from one of the blocks leased to this generator? */
+int
+id_is_leased(struct epoll_context *epc, int64_t id)
+{
+    return (id >= epc->lease_lo[0] && id < epc->lease_hi[0]) ||
+           (id >= epc->lease_lo[1] && id < epc->lease_hi[1]);
+}
+
+/* Begin a trip with id, if it is leased to this generator and past the
+   last one it began. A later block's ids are all higher, so this also
+   holds across blocks. */
+int
+begin_leased_id(struct epoll_context *epc, int64_t id)
+{
+    if (!id_is_leased(epc, id) || id < epc->lease_next)
+        return -1;
+    epc->lease_next = id + 1;
+    return 0;
+}
+
 void
 cleanup_epc(int efd, struct epoll_context *epc)
 {
@@ -90,16 +448,82 @@ cleanup_epc(int efd, struct epoll_context *epc)
     close(epc->fd);
     if (epc->query_buf)
         free(epc->query_buf);
+    if (epc->msg_buf)
+        bufpool_put(&epc->reactor->recv_bufs, epc->msg_buf);
     free(epc);
 }
 
+/* cleanup_epc() for a generator connection */
+void
+close_gen_conn(int efd, struct epoll_context *epc)
+{
+    epc->reactor->stats.connections--;
+    cleanup_epc(efd, epc);
+}
+
+/* Hand one decoded event to the storage writer */
+void
+queue_event(struct reactor *r, int64_t id, float lng, float lat,
+            enum TRIP_EVENT_TYPE type, int cents)
+{
+    struct trip_event e;
+
+    r->stats.events++;
+    e.id = id;
+    e.lng = lng;
+    e.lat = lat;
+    e.type = type;
+    e.cents = cents;
+    evq_push_wait(r->ctx->evq, &e);
+}
+
+/* run_writer
+
+   The storage writer thread. It is the only thing on the ingest path
+   that touches the database: it drains the event queue in batches,
+   writes them through add_tripdata() and commits the group commit batch
+   when it is due. A slow sqlite step now only backs up the queue instead
+   of every socket.
+*/
+void *
+run_writer(void *arg)
+{
+    struct tripstore_context *ctx = (struct tripstore_context *)arg;
+    struct trip_event events[WRITER_BATCH];
+    int timeout = -1;
+
+    while (1) {
+        int i;
+        int n = evq_pop(ctx->evq, events, WRITER_BATCH);
+
+        if (n || timeout >= 0) {
+            pthread_mutex_lock(&ctx->store_lock);
+            for (i = 0; i < n; i++) {
+                struct trip_event *e = &events[i];
+                add_tripdata(ctx, e->id, e->lng, e->lat, e->type, e->cents);
+            }
+            if (batch_due(ctx))
+                end_batch(ctx);
+            timeout = batch_timeout_ms(ctx);
+            pthread_mutex_unlock(&ctx->store_lock);
+        }
+
+        /* Only sleep once we have emptied the queue */
+        if (n < WRITER_BATCH)
+            evq_wait(ctx->evq, timeout);
+    }
+    return NULL;
+}
+
 /* Parse incoming messages from the trip generator and to database
    actions related to the incoming data */
 int
-handle_msg(char *data, int size, int s, struct tripstore_context *ctx)
+handle_msg(char *data, int size, struct epoll_context *epc)
 {
+    struct reactor *r = epc->reactor;
     enum MSG_TYPE t;
-    int id;
+    int64_t id, tid;
+    int i;
     float lng, lat;
     int cents;
 
@@ -107,18 +531,51 @@ handle_msg(char *data, int size, int s, struct tripstore_context *ctx)
         return -1;
     }
 
+    r->stats.msgs++;
     switch (t) {
         case MSG_BEGIN:
-            id = allocate_send_id(s);
-            add_tripdata(ctx, id, lng, lat, BEGIN, 0);
+            id = allocate_send_id(epc->fd);
+            queue_event(r, id, lng, lat, BEGIN, 0);
+            break;
+
+        /* A trip id the generator leased from us, and hasn't begun a trip
+           with yet. Anything else could collide with another trip. */
+        case MSG_BEGIN_ID:
+            if (begin_leased_id(epc, id) < 0)
+                return -1;
+            queue_event(r, id, lng, lat, BEGIN, 0);
+            break;
+
+        /* id is the number of ids asked for here */
+        case MSG_LEASE_REQ:
+            lease_send_ids(epc, id);
             break;
 
+        /* The writer drops these too if the trip has no record (it never
+           began), but only ids that we handed out get that far */
         case MSG_UPDATE:
-            add_tripdata(ctx, id, lng, lat, TRANSIT, 0);
+            if (!id_is_allocated(id))
+                bad_id(epc, id);
+            else
+                queue_event(r, id, lng, lat, TRANSIT, 0);
             break;
 
         case MSG_END:
-            add_tripdata(ctx, id, lng, lat, END, cents);
+            if (!id_is_allocated(id))
+                bad_id(epc, id);
+            else
+                queue_event(r, id, lng, lat, END, cents);
+            break;
+
+        /* id is the tuple count here */
+        case MSG_UPDATE_BATCH:
+            for (i = 0; i < id; i++) {
+                batch_update_at(data, i, &tid, &lng, &lat);
+                if (!id_is_allocated(tid))
+                    bad_id(epc, tid);
+                else
+                    queue_event(r, tid, lng, lat, TRANSIT, 0);
+            }
             break;
 
         default:
@@ -127,57 +584,246 @@ handle_msg(char *data, int size, int s, struct tripstore_context *ctx)
     return 0;
 }
 
-/* handle_read: receiving data from the trip generator */
+/* consume_frames
+
+   Run every complete frame in epc->msg_buf through handle_msg(). The
+   frames are walked in place with msg_start, and only the one trailing
+   partial frame (if any) is moved back to the front of the buffer once we
+   are done. Returns -1 on a protocol error, leaving the connection for the
+   caller to close.
+*/
+int
+consume_frames(struct epoll_context *epc)
+{
+    int ret = 0;
+
+    while (epc->bytes - epc->msg_start >= (int)sizeof(uint16_t)) {
+        char *frame = epc->msg_buf + epc->msg_start;
+        uint16_t size;
+        size = *(uint16_t*)frame;
+        /* A frame we could never buffer is a protocol error */
+        if (size < sizeof(int) * 2 || size > MAX_FRAME_SIZE) {
+            ret = -1;
+            break;
+        }
+        if (epc->bytes - epc->msg_start < size)
+            break;
+
+        if (-1 == handle_msg(frame, size, epc)) {
+            ret = -1;
+            break;
+        }
+        epc->msg_start += size;
+    }
+
+    /* Keep the partial frame, if there is one, for the next read */
+    if (epc->msg_start == epc->bytes) {
+        epc->bytes = 0;
+    } else if (epc->msg_start) {
+        epc->bytes -= epc->msg_start;
+        memmove(epc->msg_buf, epc->msg_buf + epc->msg_start, epc->bytes);
+    }
+    epc->msg_start = 0;
+    return ret;
+}
+
+/* Get the connection's receive buffer from the reactor's pool */
+int
+ensure_msg_buf(struct epoll_context *epc)
+{
+    if (!epc->msg_buf)
+        epc->msg_buf = bufpool_get(&epc->reactor->recv_bufs);
+    return epc->msg_buf ? 0 : -1;
+}
+
+/* handle_read: receiving data from the trip generator
+
+   The receive buffer is large (--recv-buf), so one read() picks up every
+   frame the kernel has queued for the connection.
+*/
 int
 handle_read(struct epoll_context *epc, struct tripstore_context *ctx, int efd)
 {
-    int x = read(epc->fd, epc->msg_buf + epc->bytes, MAX_MSG_SIZE - epc->bytes);
+    struct bufpool *pool = &epc->reactor->recv_bufs;
+
+    (void)ctx;                  /* the frames go to epc->reactor's queue */
+    if (-1 == ensure_msg_buf(epc)) {
+        close_gen_conn(efd, epc);
+        return -1;
+    }
+
+    int x = read(epc->fd, epc->msg_buf + epc->bytes, pool->size - epc->bytes);
+    epc->reactor->stats.reads++;
+    epc->reactor->stats.syscalls++;
 
     if (x <= 0) {
-        cleanup_epc(efd, epc);
+        close_gen_conn(efd, epc);
         return 0;
     }
 
     epc->bytes += x;
+    if (-1 == consume_frames(epc)) {
+        close_gen_conn(efd, epc);
+        return -1;
+    }
+    return 0;
+}
 
-    /* loop through the data in the buffer until we don't have a full
-       message */
-    while (1) {
-        if (epc->bytes < sizeof(uint16_t))
-            return 0;
+/* cleanup_epc() for a query connection, once the client is done sending
+   and has all of its answers. With query workers one may still be
+   answering, and then it kicks the socket when it is done and we come
+   back here. */
+void
+close_query_conn(int efd, struct epoll_context *epc)
+{
+    if (epc->qc && query_conn_close(epc->reactor->ctx->queries, epc->qc) < 0)
+        return;
+    if (epc->reply)
+        reply_destroy(epc->reply);
+    if (epc->out)
+        outbuf_destroy(epc->out);
+    cleanup_epc(efd, epc);
+}
 
-        uint16_t size;
-        size = *(uint16_t*)epc->msg_buf;    
-        if (epc->bytes < size)
+#define QUERY_BUF_SIZE 2048
+
+/* Which protocol the connection speaks, from its first bytes: REPLY_MAGIC
+   for the binary one (see reply.c), anything else for text. Returns 0 if
+   it needs more of them, -1 if the connection can't be set up. */
+static int
+start_reply(struct epoll_context *epc, struct tripstore_context *ctx)
+{
+    int proto = REPLY_TEXT;
+
+    if (epc->query_buf[0] == REPLY_MAGIC[0]) {
+        if (epc->bytes < REPLY_MAGIC_SIZE)
             return 0;
+        if (memcmp(epc->query_buf, REPLY_MAGIC, REPLY_MAGIC_SIZE) == 0) {
+            proto = REPLY_BINARY;
+            epc->bytes -= REPLY_MAGIC_SIZE;
+            memmove(epc->query_buf, epc->query_buf + REPLY_MAGIC_SIZE,
+                    epc->bytes);
+        }
+    }
+    epc->reply = reply_create(epc->out, proto);
+    if (epc->reply && ctx->queries)
+        epc->qc = query_conn_create(epc->reply);
+    return epc->reply && (!ctx->queries || epc->qc) ? 1 : -1;
+}
 
-        if (-1 == handle_msg(epc->msg_buf, size, epc->fd, ctx))
-            return -1;
-               
-        memmove(epc->msg_buf, epc->msg_buf + size, epc->bytes - size);
-        epc->bytes -= size;
+/* Without query workers, a report waiting for the end of the tick */
+struct tick_report
+{
+    struct epoll_context *epc;
+    uint32_t id;
+    struct scan_rect rect;
+};
+
+/* Answer the reports of the tick so far, from one scan */
+static void
+answer_tick_reports(struct reactor *r)
+{
+    struct tripstore_context *ctx = r->ctx;
+    int i;
+
+    if (!r->nreports)
+        return;
+    scan_reset(r->scan);
+    for (i = 0; i < r->nreports; i++)
+        scan_add(r->scan, &r->reports[i].rect);
+    pthread_mutex_lock(&ctx->store_lock);
+    run_scan(ctx, r->scan);
+    pthread_mutex_unlock(&ctx->store_lock);
+    for (i = 0; i < r->nreports; i++) {
+        struct tick_report *t = &r->reports[i];
+        reply_begin(t->epc->reply, t->id);
+        scan_rect_reply(&t->rect, t->epc->reply);
+        reply_end(t->epc->reply);
+        t->epc->reports = 0;
     }
+    r->nreports = 0;
 }
 
-/* handle_query: receiving data from the query interface */
-#define QUERY_BUF_SIZE 2048
-int
-handle_query(struct epoll_context *epc, struct tripstore_context *ctx, int efd)
+/* Keep a report for the end of the tick. Returns -1 if it has to be
+   answered now. */
+static int
+tick_report(struct epoll_context *epc, uint32_t id, struct scan_rect *rect)
 {
-    /* The epoll_context for the query interface needs it's own special
-       bigger buffer */
-    if (!epc->query_buf) {
-        epc->query_buf = (char *)malloc(QUERY_BUF_SIZE);
-    } 
-    int x = read(epc->fd, epc->query_buf + epc->bytes,
-                 QUERY_BUF_SIZE - epc->bytes);
-    if (x <= 0) {
-        cleanup_epc(efd, epc);
-        return 0;
+    struct reactor *r = epc->reactor;
+    struct tick_report *t;
+
+    if (!r->scan || (!epc->ticked && r->nconns == EPOLL_EVENTS))
+        return -1;
+    if (r->nreports == SCAN_MAX_RECTS)
+        answer_tick_reports(r);
+    if (!epc->ticked) {
+        epc->ticked = 1;
+        r->tick_conns[r->nconns++] = epc;
+    }
+    t = &r->reports[r->nreports++];
+    t->epc = epc;
+    t->id = id;
+    t->rect = *rect;
+    epc->reports++;
+    return 0;
+}
+
+/* The events of a tick are handled. Wake the workers for the queries
+   they were given, or answer the reports kept for now and let go of the
+   connections that were waiting for them. */
+static void
+end_tick(struct reactor *r)
+{
+    int i;
+
+    if (r->submitted) {
+        query_pool_wake(r->ctx->queries);
+        r->submitted = 0;
     }
+    answer_tick_reports(r);
+    for (i = 0; i < r->nconns; i++) {
+        struct epoll_context *epc = r->tick_conns[i];
+        epc->ticked = 0;
+        if (outbuf_drain(epc->out) && epc->closing)
+            close_query_conn(r->efd, epc);
+    }
+    r->nconns = 0;
+}
 
+/* Run one query (which we free), or queue it for the workers. Reports
+   wait for the end of the tick, to share a scan with the others that
+   came in with them. */
+static void
+submit_query(struct epoll_context *epc, struct tripstore_context *ctx,
+             char *query, uint32_t id)
+{
+    struct scan_rect rect;
+
+    if (epc->qc) {
+        query_submit(ctx->queries, epc->qc, query, id);
+        epc->reactor->submitted = 1;
+        return;
+    }
+    if (report_rect(query, &rect) && tick_report(epc, id, &rect) == 0) {
+        free(query);
+        return;
+    }
+    /* its answer goes after theirs */
+    if (epc->reports)
+        answer_tick_reports(epc->reactor);
+    reply_begin(epc->reply, id);
+    pthread_mutex_lock(&ctx->store_lock);
+    exec_query_tofd(query, ctx, epc->reply);
+    pthread_mutex_unlock(&ctx->store_lock);
+    reply_end(epc->reply);
+    free(query);
+}
+
+/* The complete lines in the query buffer */
+static void
+run_text_queries(struct epoll_context *epc, struct tripstore_context *ctx)
+{
     int ran_one = 1;
-    epc->bytes += x;
 
     /* Loop through the data in the query buffer until we don't have a
        full null terminated line */
@@ -191,9 +837,7 @@ handle_query(struct epoll_context *epc, struct tripstore_context *ctx, int efd)
                 query = (char *)malloc(i + 1);
                 memcpy(query, epc->query_buf, i);
                 query[i] = 0;
-                /* Run ad-hoc query to the output fd */
-                exec_query_tofd(query, ctx, epc->fd);
-                free(query);
+                submit_query(epc, ctx, query, 0);
 
                 /* Copy back the rest of the bytes that were in the input
                    buffer and run again */
@@ -205,24 +849,122 @@ handle_query(struct epoll_context *epc, struct tripstore_context *ctx, int efd)
             }
         }
     }
+}
+
+/* The complete request frames in the query buffer. One that couldn't fit
+   in it isn't ours, and the connection goes once its answers so far are
+   out. */
+static void
+run_binary_queries(struct epoll_context *epc, struct tripstore_context *ctx)
+{
+    char *p = epc->query_buf;
+    int left = epc->bytes;
+
+    while (left >= REPLY_REQ_HDR_SIZE) {
+        uint32_t size, id;
+        char *query;
+
+        memcpy(&size, p, sizeof(size));
+        if (size < sizeof(id) || size > QUERY_BUF_SIZE - sizeof(size)) {
+            epc->closing = 1;
+            left = 0;
+            break;
+        }
+        if (left < (int)(sizeof(size) + size))
+            break;
+        memcpy(&id, p + sizeof(size), sizeof(id));
+        size -= sizeof(id);
+        query = (char *)malloc(size + 1);
+        memcpy(query, p + REPLY_REQ_HDR_SIZE, size);
+        query[size] = 0;
+        submit_query(epc, ctx, query, id);
+        p += REPLY_REQ_HDR_SIZE + size;
+        left -= REPLY_REQ_HDR_SIZE + size;
+    }
+    memmove(epc->query_buf, p, left);
+    epc->bytes = left;
+}
+
+/* Run the queries in the query buffer, or queue them for the workers */
+static void
+run_queries(struct epoll_context *epc, struct tripstore_context *ctx)
+{
+    if (!epc->reply) {
+        int ready = start_reply(epc, ctx);
+        if (ready < 0) {
+            epc->closing = 1;
+            epc->bytes = 0;
+        }
+        if (ready <= 0)
+            return;
+    }
+    if (epc->reply->proto == REPLY_BINARY)
+        run_binary_queries(epc, ctx);
+    else
+        run_text_queries(epc, ctx);
+}
+
+/* handle_query: the query interface. The socket is edge triggered, so
+   we read until it would block, and we also get here when it has room
+   for more of the answers (see outbuf.c). With query workers the
+   queries are only queued for them here. */
+int
+handle_query(struct epoll_context *epc, struct tripstore_context *ctx, int efd)
+{
+    /* The epoll_context for the query interface needs it's own special
+       bigger buffer, and somewhere to put the answers */
+    if (!epc->query_buf) {
+        epc->query_buf = (char *)malloc(QUERY_BUF_SIZE);
+        epc->out = outbuf_create(epc->fd, efd, epc, ctx->out_cap,
+                                 !ctx->queries, &ctx->out_stats);
+        if (!epc->query_buf || !epc->out) {
+            close_query_conn(efd, epc);
+            return -1;
+        }
+    }
+
+    while (!epc->closing) {
+        int x = read(epc->fd, epc->query_buf + epc->bytes,
+                     QUERY_BUF_SIZE - epc->bytes);
+        if (x < 0 && errno == EINTR)
+            continue;
+        if (x < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (x <= 0) {
+            epc->closing = 1;
+            break;
+        }
+        epc->bytes += x;
+        run_queries(epc, ctx);
+    }
+
+    if (!epc->ticked && outbuf_drain(epc->out) && epc->closing)
+        close_query_conn(efd, epc);
     return 0;
 }
 
-/* handle_accept: genereic acceptor closure for sockets */
+/* handle_accept: genereic acceptor closure for sockets. Edge triggered
+   sockets are made non-blocking, for their callback to read them dry. */
 int
-handle_accept(struct epoll_context *epc, struct tripstore_context *ctx, int efd,
+handle_accept(struct epoll_context *epc, int efd,
               int (*cb)(struct epoll_context *,
                         struct tripstore_context *,
-                        int))
+                        int),
+              uint32_t events)
 {
     int s = accept(epc->fd, NULL, 0);
     if (s > 0) {
         struct epoll_event evt;
-        evt.events = EPOLLIN;
-        evt.data.ptr = make_epoll_ctx(s, cb);
+        struct epoll_context *new_epc = make_epoll_ctx(s, cb);
+        new_epc->reactor = epc->reactor;
+        if (events & EPOLLET)
+            fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+        evt.events = events;
+        evt.data.ptr = new_epc;
         if (-1 == epoll_ctl(efd, EPOLL_CTL_ADD, s, &evt)) {
             fprintf(stderr, "acceptor could not register reads\n");
             close(s);
+            free(new_epc);
             return -1;
         }
     } else {
@@ -236,7 +978,13 @@ int
 handle_gen_accept(struct epoll_context *epc, struct tripstore_context *ctx,
                   int efd)
 {
-    return handle_accept(epc, ctx, efd, handle_read);
+    (void)ctx;
+    epc->reactor->stats.syscalls++;
+    if (-1 == handle_accept(epc, efd, handle_read, EPOLLIN))
+        return -1;
+    epc->reactor->stats.accepted++;
+    epc->reactor->stats.connections++;
+    return 0;
 }
 
 /* handle_query_accept: accept callback on the query socket */
@@ -244,20 +992,258 @@ int
 handle_query_accept(struct epoll_context *epc, struct tripstore_context *ctx,
                     int efd)
 {
-    return handle_accept(epc, ctx, efd, handle_query);
+    (void)ctx;
+    return handle_accept(epc, efd, handle_query, OUTBUF_EVENTS);
+}
+
+
+/* Register a listening socket with the reactor's epoll */
+int
+add_listener(struct reactor *r, int s,
+             int (*cb)(struct epoll_context *, struct tripstore_context *, int))
+{
+    struct epoll_event evt;
+    struct epoll_context *epc = make_epoll_ctx(s, cb);
+    epc->reactor = r;
+    evt.events = EPOLLIN;
+    evt.data.ptr = epc;
+    return epoll_ctl(r->efd, EPOLL_CTL_ADD, s, &evt);
+}
+
+/* run_reactor: the event loop for one reactor thread. We epoll on our
+   sockets and run the associated callbacks for read events. */
+void *
+run_reactor(void *arg)
+{
+    struct reactor *r = (struct reactor *)arg;
+    struct epoll_event events[EPOLL_EVENTS];
+    while (1) { 
+        int x = epoll_wait(r->efd, events, EPOLL_EVENTS, -1);
+        r->stats.wakeups++;
+        r->stats.syscalls++;
+        if (x > 0) {
+            int i;
+            for (i = 0; i < x; i++) {
+                struct epoll_context *epc = (struct epoll_context *)
+                                            events[i].data.ptr;
+                epc->cb(epc, r->ctx, r->efd);
+            }
+            end_tick(r);
+        }
+    }
+    return NULL;
+}
+
+/* --backend uring
+
+   The generator side runs entirely on the reactor's io_uring: a multishot
+   accept on the listening socket, and a multishot recv per connection
+   that fills buffers from the provided buffer ring. Each recv completion
+   is copied into the connection's receive buffer and goes through the
+   same consume_frames() / handle_msg() path as the epoll backend. The
+   reactor's epoll set (the query socket lives there) is kept as a
+   multishot poll on the ring, so its callbacks run unchanged too.
+
+   The user_data of each sqe is the epoll_context (or NULL) tagged with
+   what the request was in the low bits.
+*/
+enum {URING_ACCEPT = 1, URING_RECV = 2, URING_EPOLL = 3};
+#define URING_TAG_MASK 3UL
+
+static void
+uring_arm(struct reactor *r, int op, int fd, struct epoll_context *epc)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r->uring);
+    unsigned long data = (unsigned long)epc | op;
+
+    if (!sqe) {
+        fprintf(stderr, "io_uring submission queue full\n");
+        return;
+    }
+    if (op == URING_ACCEPT)
+        uring_prep_accept_multishot(sqe, fd, data);
+    else if (op == URING_RECV)
+        uring_prep_recv_multishot(sqe, fd, data);
+    else
+        uring_prep_poll_multishot(sqe, fd, data);
+}
+
+/* The recv request for this connection has finished for good, so it is
+   now safe to free it */
+static void
+uring_close_conn(struct reactor *r, struct epoll_context *epc)
+{
+    r->stats.connections--;
+    close(epc->fd);
+    if (epc->msg_buf)
+        bufpool_put(&r->recv_bufs, epc->msg_buf);
+    free(epc);
+}
+
+/* Copy one completed recv into the connection's buffer and parse it */
+static int
+uring_feed(struct epoll_context *epc, const char *data, int len)
+{
+    int room, n;
+
+    if (-1 == ensure_msg_buf(epc))
+        return -1;
+    while (len) {
+        room = epc->reactor->recv_bufs.size - epc->bytes;
+        n = len < room ? len : room;
+        memcpy(epc->msg_buf + epc->bytes, data, n);
+        epc->bytes += n;
+        data += n;
+        len -= n;
+        if (-1 == consume_frames(epc))
+            return -1;
+    }
+    return 0;
+}
+
+static void
+uring_handle_cqe(struct reactor *r, struct io_uring_cqe *cqe)
+{
+    int op = cqe->user_data & URING_TAG_MASK;
+    struct epoll_context *epc = (struct epoll_context *)
+                                (cqe->user_data & ~URING_TAG_MASK);
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (op) {
+        case URING_ACCEPT:
+            if (cqe->res >= 0) {
+                epc = make_epoll_ctx(cqe->res, NULL);
+                epc->reactor = r;
+                r->stats.accepted++;
+                r->stats.connections++;
+                uring_arm(r, URING_RECV, epc->fd, epc);
+            }
+            if (!more)
+                uring_arm(r, URING_ACCEPT, r->listen_fd, NULL);
+            break;
+
+        case URING_RECV:
+            if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                r->stats.reads++;
+                if (!epc->closing &&
+                        -1 == uring_feed(epc, uring_buf(r->uring, bid),
+                                         cqe->res)) {
+                    /* the recv finishes with 0 once the socket is shut */
+                    epc->closing = 1;
+                    shutdown(epc->fd, SHUT_RDWR);
+                }
+                uring_recycle_buf(r->uring, bid);
+            }
+            if (more)
+                break;
+            if (cqe->res == -ENOBUFS)
+                r->stats.nobufs++;
+            if (!epc->closing && (cqe->res > 0 || cqe->res == -ENOBUFS))
+                uring_arm(r, URING_RECV, epc->fd, epc);
+            else
+                uring_close_conn(r, epc);
+            break;
+
+        case URING_EPOLL:
+            {
+                struct epoll_event events[EPOLL_EVENTS];
+                int i, x = epoll_wait(r->efd, events, EPOLL_EVENTS, 0);
+                r->stats.syscalls++;
+                for (i = 0; i < x; i++) {
+                    struct epoll_context *e = (struct epoll_context *)
+                                              events[i].data.ptr;
+                    e->cb(e, r->ctx, r->efd);
+                }
+                end_tick(r);
+            }
+            if (!more)
+                uring_arm(r, URING_EPOLL, r->efd, NULL);
+            break;
+    }
 }
 
+/* run_uring_reactor: the event loop for one reactor thread with
+   --backend uring. io_uring_enter() is the only syscall on the generator
+   path. */
+void *
+run_uring_reactor(void *arg)
+{
+    struct reactor *r = (struct reactor *)arg;
+    struct io_uring_cqe *cqe;
+
+    uring_arm(r, URING_ACCEPT, r->listen_fd, NULL);
+    uring_arm(r, URING_EPOLL, r->efd, NULL);
+    while (1) {
+        if (uring_submit_wait(r->uring, 1) < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            break;
+        }
+        r->stats.wakeups++;
+        r->stats.syscalls++;
+        while ((cqe = uring_peek_cqe(r->uring))) {
+            uring_handle_cqe(r, cqe);
+            uring_cqe_seen(r->uring);
+        }
+    }
+    return NULL;
+}
 
 int
 main(int argc, char *argv[])
 {
     struct options opts;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
     if (get_options(argc, argv, &opts) < 0)
             return -1;
 
-    printf("listening on port %d for gen, %d for queries.\n",
-            opts.port, opts.query_port);
+    /* A query client that hangs up before its answer is all written
+       gets EPIPE, rather than taking the whole server down */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (opts.reactors <= 0)
+        opts.reactors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opts.reactors <= 0)
+        opts.reactors = 1;
+
+    printf("listening on port %d for gen, %d for queries, %d reactors.\n",
+            opts.port, opts.query_port, opts.reactors);
     struct tripstore_context * ctx = make_ctx();
+    ctx->batch_max_rows = opts.batch_rows;
+    ctx->batch_max_ms = opts.batch_ms;
+    ctx->engine = opts.engine;
+    ctx->active = active_create();
+    ctx->out_cap = opts.out_kb * 1024UL;
+    if (ctx->engine == ENGINE_SQLITE) {
+        ctx->rtree = opts.rtree;
+        ctx->ends_rtree = opts.rtree >= RTREE_ENDS && !opts.sat;
+    }
+    if (ctx->engine == ENGINE_SQLITE && opts.coord_bits) {
+        ctx->quant = (struct quant *)malloc(sizeof(*ctx->quant));
+        quant_init(ctx->quant, opts.coord_bits, opts.min_lat, opts.max_lat,
+                   opts.min_lng, opts.max_lng);
+    }
+    ctx->trips = trips_create(opts.trajectories);
+    if (ctx->engine == ENGINE_SQLITE && opts.query_workers > 0) {
+        ctx->shared_segments = 1;
+        ctx->trips->shared = 1;
+    }
+    ctx->segments = segments_create();
+    if (!ctx->segments) {
+        fprintf(stderr, "segments_create failed.\n");
+        return -1;
+    }
+    ctx->segments->grid_cells = opts.grid;
+    ctx->segments->hll_cells = opts.hll;
+    ctx->segments->sat_cells = opts.sat;
+    ctx->segments->min_lat = opts.min_lat;
+    ctx->segments->max_lat = opts.max_lat;
+    ctx->segments->min_lng = opts.min_lng;
+    ctx->segments->max_lng = opts.max_lng;
+    ctx->segments->seal_secs = opts.segment_secs;
+    ctx->segments->retain_secs = opts.retain_secs;
+    ctx->segments->retain_bytes = opts.retain_mb * 1024UL * 1024;
 
     /* Make our initial database from the ddl and connect */
     if (open_create_db(ctx) < 0) {
@@ -271,48 +1257,190 @@ main(int argc, char *argv[])
         return -1;
     }
 
-    /* Open up our ports and create the epoll */
-    int s = listen_on_port(opts.port);
-    int q = listen_on_port(opts.query_port);
-    int efd = epoll_create1(0);
+    /* Bring the store back from the checkpoint, if there is one yet. One
+       we can't use is passed over for the whole log, if we have it. */
+    struct checkpoint_loaded ld;
+    memset(&ld, 0, sizeof(ld));
+    if (opts.checkpoint && access(opts.checkpoint, F_OK) == 0) {
+        int rc = checkpoint_load(ctx, opts.checkpoint, &ld);
+        if (rc == -1 && opts.wal) {
+            fprintf(stderr, "checkpoint %s not used, replaying all of %s.\n",
+                    opts.checkpoint, opts.wal);
+            memset(&ld, 0, sizeof(ld));
+        } else if (rc < 0) {
+            fprintf(stderr, "checkpoint_load failed.\n");
+            return -1;
+        }
+    }
+    if (ld.bytes) {
+        if (ld.max_id >= next_trip_id)
+            next_trip_id = ld.max_id + 1;
+        printf("checkpoint %s: %lu events in %lu segments, %lu MB. "
+               "map %lu ms, trips %lu ms, segments %lu ms, sqlite %lu ms.\n",
+               opts.checkpoint, ld.rows, ld.segments, ld.bytes >> 20,
+               ld.map_us / 1000, ld.trips_us / 1000, ld.segments_us / 1000,
+               ld.sql_us / 1000);
+    }
 
-    if (s < 0 || q < 0 || efd < 0) {
-        fprintf(stderr, "error in socketing\n");
+    /* And the first segment of the trip log */
+    if (segments_start(ctx) < 0) {
+        fprintf(stderr, "segments_start failed.\n");
         return -1;
     }
 
-    /* Add the generator socket and the query socket to the epoll */
-    struct epoll_event evt;
-    evt.events = EPOLLIN;
-    evt.data.ptr = make_epoll_ctx(s, handle_gen_accept);
-    if (-1 == epoll_ctl(efd, EPOLL_CTL_ADD, s, &evt)) {
-        fprintf(stderr, "Failed to epoll_ctl\n");
+    /* Bring back what the log has past the checkpoint, then log from here
+       on. Trip ids go on from the highest one in either. */
+    if (opts.wal) {
+        struct wal *w = wal_open(opts.wal, opts.wal_ms);
+        int64_t max_id;
+        if (!w || wal_replay(w, ctx, ld.wal_records, &max_id) < 0) {
+            fprintf(stderr, "wal replay failed.\n");
+            return -1;
+        }
+        if (max_id >= next_trip_id)
+            next_trip_id = max_id + 1;
+        printf("replayed %lu events from %s in %lu ms.\n",
+               w->stats.replayed, opts.wal, w->stats.replay_ms);
+        if (wal_start(w) < 0) {
+            fprintf(stderr, "wal_start failed.\n");
+            return -1;
+        }
+        ctx->wal = w;
+    }
+    if (opts.checkpoint || opts.wal) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        printf("store ready %ld ms after startup.\n",
+               (now.tv_sec - started.tv_sec) * 1000 +
+               (now.tv_nsec - started.tv_nsec) / 1000000);
+        fflush(stdout);
+    }
+
+    /* The query workers. Their connections are made before anything can
+       fork. */
+    if (opts.query_workers > 0) {
+        ctx->queries = query_pool_create(ctx, opts.query_workers);
+        if (!ctx->queries || query_pool_start(ctx->queries) < 0) {
+            fprintf(stderr, "query workers failed.\n");
+            return -1;
+        }
+    }
+
+    /* Snapshots fork from their own thread, so they only stop ingest for
+       the fork */
+    ctx->snapshot = snapshot_create(ctx, opts.snapshot, opts.checkpoint,
+                                    opts.snapshot_secs);
+    if (!ctx->snapshot || snapshot_start(ctx->snapshot) < 0) {
+        fprintf(stderr, "snapshot thread failed.\n");
         return -1;
     }
-    evt.events = EPOLLIN;
-    evt.data.ptr = make_epoll_ctx(q, handle_query_accept);
-    if (-1 == epoll_ctl(efd, EPOLL_CTL_ADD, q, &evt)) {
-        fprintf(stderr, "Failed to epoll_ctl for queries\n");
+
+    /* The queue and the writer thread that drains it into storage */
+    struct evq evq;
+    pthread_t writer;
+    if (evq_init(&evq, opts.queue_size) < 0) {
+        fprintf(stderr, "evq_init failed.\n");
+        return -1;
+    }
+    ctx->evq = &evq;
+    if (0 != pthread_create(&writer, NULL, run_writer, ctx)) {
+        fprintf(stderr, "Failed to create writer\n");
+        return -1;
     }
 
-    /* This is the main event loop. We epoll on our sockets and
-       run the associated callbacks for read events */
-    struct epoll_event events[EPOLL_EVENTS];
-    while (1) { 
-        int x = epoll_wait(efd, events, EPOLL_EVENTS, -1);
-        if (x > 0) {
-            int i;
-            for (i = 0; i < x; i++) {
-                struct epoll_context *epc = (struct epoll_context *)
-                                            events[i].data.ptr;
-                epc->cb(epc, ctx, efd);
+    /* Each reactor gets its own generator socket on the shared port and
+       its own epoll. The query socket only goes to the first one. */
+    struct reactor *reactors = (struct reactor *)
+                               calloc(opts.reactors, sizeof(*reactors));
+    ctx->reactors = reactors;
+    ctx->nreactors = opts.reactors;
+
+    int i;
+    for (i = 0; i < opts.reactors; i++) {
+        struct reactor *r = &reactors[i];
+        r->id = i;
+        r->ctx = ctx;
+        bufpool_init(&r->recv_bufs, opts.recv_buf);
+        r->listen_fd = listen_on_port_reuse(opts.port);
+        r->efd = epoll_create1(0);
+        if (r->listen_fd < 0 || r->efd < 0) {
+            fprintf(stderr, "error in socketing\n");
+            return -1;
+        }
+        if (opts.backend == BACKEND_URING) {
+            r->uring = (struct uring *)malloc(sizeof(*r->uring));
+            if (uring_init(r->uring, URING_ENTRIES) < 0 ||
+                uring_init_bufs(r->uring, URING_BUFS, URING_BUF_SIZE) < 0) {
+                fprintf(stderr, "io_uring setup failed\n");
+                return -1;
             }
+        } else if (-1 == add_listener(r, r->listen_fd, handle_gen_accept)) {
+            fprintf(stderr, "Failed to epoll_ctl\n");
+            return -1;
+        }
+    }
+
+    int q = listen_on_port(opts.query_port);
+    if (q < 0) {
+        fprintf(stderr, "error in socketing\n");
+        return -1;
+    }
+    if (-1 == add_listener(&reactors[0], q, handle_query_accept)) {
+        fprintf(stderr, "Failed to epoll_ctl for queries\n");
+    }
+    if (!ctx->queries) {
+        struct reactor *r = &reactors[0];
+        r->reports = (struct tick_report *)
+                     malloc(SCAN_MAX_RECTS * sizeof(*r->reports));
+        r->tick_conns = (struct epoll_context **)
+                        malloc(EPOLL_EVENTS * sizeof(*r->tick_conns));
+        r->scan = scan_create();
+        if (!r->reports || !r->tick_conns || !r->scan) {
+            fprintf(stderr, "Out of memory for shared scans\n");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < opts.reactors; i++) {
+        if (0 != pthread_create(&reactors[i].thread, NULL,
+                                opts.backend == BACKEND_URING ?
+                                    run_uring_reactor : run_reactor,
+                                &reactors[i])) {
+            fprintf(stderr, "Failed to create reactor %d\n", i);
+            return -1;
         }
     }
+    for (i = 0; i < opts.reactors; i++)
+        pthread_join(reactors[i].thread, NULL);
 
-    close(efd);
-    close(s);
+    for (i = 0; i < opts.reactors; i++) {
+        close(reactors[i].efd);
+        close(reactors[i].listen_fd);
+        bufpool_destroy(&reactors[i].recv_bufs);
+        if (reactors[i].uring) {
+            uring_destroy(reactors[i].uring);
+            free(reactors[i].uring);
+        }
+        free(reactors[i].reports);
+        free(reactors[i].tick_conns);
+        if (reactors[i].scan)
+            scan_destroy(reactors[i].scan);
+    }
+    close(q);
+    evq_destroy(&evq);
+    if (ctx->queries) {
+        query_pool_destroy(ctx->queries);
+        ctx->queries = NULL;
+    }
+    snapshot_destroy(ctx->snapshot);
+    if (ctx->wal)
+        wal_close(ctx->wal);
+    segments_destroy(ctx);
     close_db(ctx);
+    active_destroy(ctx->active);
+    trips_destroy(ctx->trips);
+    free(ctx->quant);
+    free(reactors);
     free(ctx);
     return 0;
 }
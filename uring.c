@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+/*
+   Just enough io_uring for the network side of tripstore:
+
+     - one ring per reactor, set up with io_uring_setup() and mmap()'d
+     - multishot accept, so one sqe keeps accepting connections
+     - multishot recv into a provided buffer ring, so one sqe per
+       connection keeps delivering data into buffers the kernel picks
+     - multishot poll, which the reactor uses to keep its (query side)
+       epoll set going inside the ring
+
+   The kernel only stops a multishot request when it has to (the buffer
+   ring ran dry, the peer closed, an error). It tells us by leaving
+   IORING_CQE_F_MORE off the last cqe, and the caller re-arms.
+*/
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned op, void *arg, unsigned nr)
+{
+    return syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+int
+uring_init(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *ring;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+
+    /* multishot requests can post many cqes per sqe, so give the
+       completion side plenty of room */
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    u->fd = sys_io_uring_setup(entries, &p);
+    if (u->fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        fprintf(stderr, "io_uring: kernel too old\n");
+        close(u->fd);
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        perror("io_uring mmap");
+        close(u->fd);
+        return -1;
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, u->fd,
+                                          IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        perror("io_uring mmap");
+        munmap(u->ring, u->ring_size);
+        close(u->fd);
+        return -1;
+    }
+
+    ring = (char *)u->ring;
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(ring + p.sq_off.array);
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    return 0;
+}
+
+/* Register nbufs buffers of size bytes as buffer group URING_BGID.
+   nbufs must be a power of two. */
+int
+uring_init_bufs(struct uring *u, int nbufs, int size)
+{
+    struct io_uring_buf_reg reg;
+    int i;
+
+    u->br_size = nbufs * sizeof(struct io_uring_buf);
+    u->br = (struct io_uring_buf_ring *)mmap(NULL, u->br_size,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS,
+                                             -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        return -1;
+    }
+    u->bufs = (char *)malloc((size_t)nbufs * size);
+    if (!u->bufs)
+        return -1;
+    u->nbufs = nbufs;
+    u->buf_size = size;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)u->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring register buffer ring");
+        return -1;
+    }
+
+    for (i = 0; i < nbufs; i++)
+        uring_recycle_buf(u, i);
+    return 0;
+}
+
+void
+uring_destroy(struct uring *u)
+{
+    if (u->br)
+        munmap(u->br, u->br_size);
+    free(u->bufs);
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->ring, u->ring_size);
+    close(u->fd);
+}
+
+/* Next free sqe. If the submission queue is full we push what we have
+   to the kernel first. */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *u)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *u->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if (tail - head > u->sq_mask) {
+        uring_submit_wait(u, 0);
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head > u->sq_mask)
+            return NULL;
+    }
+
+    sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+    return sqe;
+}
+
+/* Submit everything queued and wait for at least wait_nr completions.
+   This is the only syscall the uring event loop makes. */
+int
+uring_submit_wait(struct uring *u, unsigned wait_nr)
+{
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret = sys_io_uring_enter(u->fd, u->to_submit, wait_nr, flags);
+    if (ret >= 0)
+        u->to_submit -= ret;
+    return ret;
+}
+
+/* The oldest unseen completion, or NULL */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *u)
+{
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring *u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char *
+uring_buf(struct uring *u, int bid)
+{
+    return u->bufs + (size_t)bid * u->buf_size;
+}
+
+/* Hand buffer bid back to the kernel */
+void
+uring_recycle_buf(struct uring *u, int bid)
+{
+    struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (u->nbufs - 1)];
+    buf->addr = (unsigned long)uring_buf(u, bid);
+    buf->len = u->buf_size;
+    buf->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+void
+uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+                            unsigned long data)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = data;
+}
+
+void
+uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd,
+                          unsigned long data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = data;
+}
+
+void
+uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+                          unsigned long data)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = data;
+}
@@ -0,0 +1,55 @@
+/* Minimal io_uring wrapper for the tripstore --backend uring event loop.
+   We drive the rings with the raw syscalls rather than pulling in
+   liburing. Needs <linux/io_uring.h> included first. */
+
+struct uring
+{
+    int fd;
+
+    /* submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned to_submit;
+
+    /* completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+
+    /* provided buffer ring, for multishot recv */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    char *bufs;
+    int buf_size;
+    int nbufs;
+    unsigned short br_tail;
+};
+
+#define URING_BGID 0
+
+int uring_init(struct uring *u, unsigned entries);
+int uring_init_bufs(struct uring *u, int nbufs, int size);
+void uring_destroy(struct uring *u);
+
+struct io_uring_sqe *uring_get_sqe(struct uring *u);
+int uring_submit_wait(struct uring *u, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *u);
+void uring_cqe_seen(struct uring *u);
+
+char *uring_buf(struct uring *u, int bid);
+void uring_recycle_buf(struct uring *u, int bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+                                 unsigned long data);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd,
+                               unsigned long data);
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+                               unsigned long data);
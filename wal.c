@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "sqls.h"
+#include "stats.h"
+#include "wal.h"
+
+/*
+   Everything tripstore has lives in memory, so a restart used to start
+   from nothing. With --wal every event that add_tripdata() takes is also
+   appended to a log file, and at startup the log is replayed through
+   add_tripdata_at() (with the times the events first came in) before the
+   ports open.
+
+   The storage writer must not wait on the disk, so it only copies the
+   event into one of two buffers. The flusher thread takes the full one
+   in exchange for the empty one, and writes it out and fdatasync()s it
+   while the writer fills the other. That happens every sync_ms (the
+   group commit interval, --wal-ms), or sooner once the buffer is half
+   full. So a crash loses at most about sync_ms of events, and a disk
+   that keeps up with the bytes (32 per event) costs ingest one memcpy
+   and an uncontended lock per event. If the disk falls behind and both
+   buffers fill up, the writer waits (wal.stalls), and the event queue in
+   front of it takes up the slack.
+
+   The file is a header and then the records back to back. Each record
+   has a check over its bytes, and replay stops at the first one that is
+   cut short or doesn't check out: that is where we crashed in the middle
+   of a write. The tail from there is cut off before we append again.
+   For the same reason a write (or sync) that fails while we run is cut
+   back off the file and tried again, every WAL_RETRY_MS, until it goes
+   through. The records after it would only be lost behind it, so until
+   then the writer stalls once the other buffer is full.
+
+   Replayed events go through the same retention as live ones, but the
+   log itself is never trimmed.
+*/
+
+#define WAL_MAGIC "TRIPWAL1"
+#define WAL_VERSION 1
+
+/* records per buffer, 2MB */
+#define WAL_BUF_RECS 65536
+
+/* records per read() on replay, 1MB */
+#define REPLAY_RECS 32768
+
+/* ms between tries of a write that failed, and the tries before we give
+   up on it when shutting down */
+#define WAL_RETRY_MS 100
+#define WAL_STOP_TRIES 10
+
+struct wal_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+    char pad[16];
+};
+
+static unsigned long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* FNV-1a over the record up to check */
+static uint32_t
+rec_check(const struct wal_rec *r)
+{
+    const unsigned char *p = (const unsigned char *)r;
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < offsetof(struct wal_rec, check); i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+struct wal *
+wal_open(const char *path, int sync_ms)
+{
+    struct wal *w = (struct wal *)calloc(1, sizeof(*w));
+
+    if (!w)
+        return NULL;
+    w->sync_ms = sync_ms;
+    w->cap = WAL_BUF_RECS;
+    w->bufs[0] = (struct wal_rec *)malloc(w->cap * sizeof(struct wal_rec));
+    w->bufs[1] = (struct wal_rec *)malloc(w->cap * sizeof(struct wal_rec));
+    w->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (w->fd < 0 || !w->bufs[0] || !w->bufs[1]) {
+        fprintf(stderr, "wal: can't open %s: %s\n", path, strerror(errno));
+        if (w->fd >= 0)
+            close(w->fd);
+        free(w->bufs[0]);
+        free(w->bufs[1]);
+        free(w);
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    pthread_cond_init(&w->room, NULL);
+    return w;
+}
+
+/* pwrite() all of len at off, or fail */
+static int
+write_all(int fd, const void *buf, size_t len, off_t off)
+{
+    const char *p = (const char *)buf;
+
+    while (len) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* wal_replay
+
+   Feed every good record in the log after the first skip (which a
+   checkpoint already has) to add_tripdata_at(), cut off a torn tail and
+   leave the file ready for appends. max_id is set to the highest trip id
+   replayed (0 for none), so the caller can keep the id allocator past
+   it. Call it before wal_start(), and without ctx->wal set, so that the
+   events aren't logged again.
+*/
+int
+wal_replay(struct wal *w, struct tripstore_context *ctx, unsigned long skip,
+           int64_t *max_id)
+{
+    struct wal_header h;
+    struct wal_rec *recs;
+    struct stat st;
+    off_t good = sizeof(h);
+    unsigned long start = now_us();
+    ssize_t n;
+    int i, torn = 0;
+
+    *max_id = 0;
+    if (fstat(w->fd, &st) < 0)
+        return -1;
+    if (st.st_size < (off_t)sizeof(h)) {
+        /* new (or never got its header out) */
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, WAL_MAGIC, sizeof(h.magic));
+        h.version = WAL_VERSION;
+        h.rec_size = sizeof(struct wal_rec);
+        if (ftruncate(w->fd, 0) < 0 ||
+            write_all(w->fd, &h, sizeof(h), 0) < 0 || fdatasync(w->fd) < 0) {
+            fprintf(stderr, "wal: can't write header: %s\n", strerror(errno));
+            return -1;
+        }
+        w->end = sizeof(h);
+        return 0;
+    }
+
+    if (pread(w->fd, &h, sizeof(h), 0) != sizeof(h) ||
+        memcmp(h.magic, WAL_MAGIC, sizeof(h.magic)) ||
+        h.version != WAL_VERSION || h.rec_size != sizeof(struct wal_rec)) {
+        fprintf(stderr, "wal: not a trip log we can read\n");
+        return -1;
+    }
+
+    /* Records are only ever appended, so the checkpoint's are the first
+       skip of them */
+    if (good + (off_t)(skip * sizeof(struct wal_rec)) > st.st_size) {
+        fprintf(stderr, "wal: the log is behind the checkpoint, not "
+                "replaying it\n");
+        skip = (st.st_size - good) / sizeof(struct wal_rec);
+    }
+    good += skip * sizeof(struct wal_rec);
+    w->logged = skip;
+
+    recs = (struct wal_rec *)malloc(REPLAY_RECS * sizeof(*recs));
+    if (!recs)
+        return -1;
+    while (!torn &&
+           (n = pread(w->fd, recs, REPLAY_RECS * sizeof(*recs), good)) > 0) {
+        int nrecs = n / sizeof(*recs);
+        for (i = 0; i < nrecs; i++) {
+            struct wal_rec *r = &recs[i];
+            if (r->check != rec_check(r) || r->type > END) {
+                torn = 1;
+                break;
+            }
+            if (add_tripdata_at(ctx, r->id, r->lng, r->lat, r->type,
+                                r->cents, r->t) < 0) {
+                free(recs);
+                return -1;
+            }
+            if (r->id > *max_id)
+                *max_id = r->id;
+            good += sizeof(*r);
+            w->logged++;
+            w->stats.replayed++;
+        }
+        if ((ssize_t)(nrecs * sizeof(*recs)) < n)
+            torn = 1;
+    }
+    free(recs);
+    end_batch(ctx);
+
+    if (good < st.st_size) {
+        w->stats.torn_bytes = st.st_size - good;
+        fprintf(stderr, "wal: cutting %lu torn bytes off the end\n",
+                w->stats.torn_bytes);
+        if (ftruncate(w->fd, good) < 0)
+            return -1;
+    }
+    w->end = good;
+    w->stats.replay_ms = (now_us() - start) / 1000;
+    return 0;
+}
+
+/* Append one event. Called by the storage writer, from add_tripdata(). */
+void
+wal_append(struct wal *w, int64_t id, float lng, float lat, int type,
+           int cents, time_t t)
+{
+    struct wal_rec *r;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->fill == w->cap) {
+        w->stats.stalls++;
+        pthread_cond_signal(&w->wake);
+        pthread_cond_wait(&w->room, &w->lock);
+    }
+    r = &w->bufs[w->cur][w->fill++];
+    r->id = id;
+    r->lng = lng;
+    r->lat = lat;
+    r->cents = cents;
+    r->t = t;
+    r->type = type;
+    r->pad = 0;
+    r->check = rec_check(r);
+    w->stats.records++;
+    w->logged++;
+    if (w->fill == w->cap / 2)
+        pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Write out n records from recs at the end of the file and sync them.
+   Returns the us the sync took, or -1 with what there was of them cut
+   back off. */
+static long
+write_recs(struct wal *w, struct wal_rec *recs, unsigned long n)
+{
+    unsigned long t;
+
+    if (write_all(w->fd, recs, n * sizeof(*recs), w->end) == 0) {
+        t = now_us();
+        if (fdatasync(w->fd) == 0)
+            return now_us() - t;
+    }
+    if (ftruncate(w->fd, w->end) < 0)
+        fprintf(stderr, "wal: can't cut a failed write back off: %s\n",
+                strerror(errno));
+    return -1;
+}
+
+/* Write out and sync n records from recs, trying again until they go
+   through. Not under the lock. */
+static void
+flush_recs(struct wal *w, struct wal_rec *recs, unsigned long n)
+{
+    long t;
+    int tries = 0;
+
+    while ((t = write_recs(w, recs, n)) < 0) {
+        w->stats.failed++;
+        if (!tries++)
+            fprintf(stderr, "wal: writing %lu records failed, trying again "
+                    "until it works (ingest stalls meanwhile): %s\n", n,
+                    strerror(errno));
+        /* w->stop is only ever set, a stale 0 just means one more try */
+        if (w->stop && tries >= WAL_STOP_TRIES) {
+            fprintf(stderr, "wal: shutting down, %lu records are lost from "
+                    "the log\n", n);
+            return;
+        }
+        usleep(WAL_RETRY_MS * 1000);
+    }
+    if (tries)
+        fprintf(stderr, "wal: %lu records written after %d tries\n", n,
+                tries + 1);
+    w->end += n * sizeof(*recs);
+    w->stats.bytes += n * sizeof(*recs);
+    w->stats.syncs++;
+    w->stats.sync_us_total += t;
+    if ((unsigned long)t > w->stats.sync_us_max)
+        w->stats.sync_us_max = t;
+    if (n > w->stats.max_sync_records)
+        w->stats.max_sync_records = n;
+}
+
+/* The flusher thread */
+static void *
+run_flusher(void *arg)
+{
+    struct wal *w = (struct wal *)arg;
+    struct timespec due;
+    int stop;
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        clock_gettime(CLOCK_REALTIME, &due);
+        due.tv_nsec += w->sync_ms * 1000000L;
+        due.tv_sec += due.tv_nsec / 1000000000L;
+        due.tv_nsec %= 1000000000L;
+        while (!w->stop && w->fill < w->cap / 2 &&
+               (w->sync_ms > 0 || !w->fill)) {
+            if (pthread_cond_timedwait(&w->wake, &w->lock, &due) ==
+                ETIMEDOUT)
+                break;
+        }
+        stop = w->stop;
+        if (w->fill) {
+            struct wal_rec *recs = w->bufs[w->cur];
+            unsigned long n = w->fill;
+            w->cur ^= 1;
+            w->fill = 0;
+            pthread_cond_broadcast(&w->room);
+            pthread_mutex_unlock(&w->lock);
+            flush_recs(w, recs, n);
+            pthread_mutex_lock(&w->lock);
+        }
+        /* on the way out, until the writer's last records are out too */
+        if (stop && !w->fill)
+            break;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+int
+wal_start(struct wal *w)
+{
+    if (pthread_create(&w->thread, NULL, run_flusher, w) != 0)
+        return -1;
+    w->started = 1;
+    return 0;
+}
+
+/* Flush what is left and close the log */
+void
+wal_close(struct wal *w)
+{
+    if (w->started) {
+        pthread_mutex_lock(&w->lock);
+        w->stop = 1;
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+    }
+    close(w->fd);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->wake);
+    pthread_cond_destroy(&w->room);
+    free(w->bufs[0]);
+    free(w->bufs[1]);
+    free(w);
+}
@@ -0,0 +1,53 @@
+/* Write-ahead log of the decoded trip events (tripstore --wal), replayed
+   into the store at startup. See wal.c. Needs stats.h (struct wal_stats)
+   included first. */
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+struct tripstore_context;
+
+/* One event on disk. check is over the bytes before it, so a record that
+   only partly made it to the disk is caught on replay. */
+struct wal_rec
+{
+    int64_t id;
+    float lng, lat;
+    int32_t cents;
+    uint32_t t;
+    uint16_t type;
+    uint16_t pad;
+    uint32_t check;
+};
+
+struct wal
+{
+    int fd;
+    int sync_ms;
+
+    /* The storage writer appends to bufs[cur] while the flusher writes
+       out the other one. lock covers cur, fill, stop and the swap. */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        /* for the flusher: half full, or stop */
+    pthread_cond_t room;        /* for the writer: the buffers swapped */
+    struct wal_rec *bufs[2];
+    int cur;
+    unsigned long fill, cap;
+    unsigned long logged;       /* records in the file, good ones */
+    off_t end;                  /* the end of the ones written out */
+    int stop;
+    pthread_t thread;
+    int started;
+
+    struct wal_stats stats;
+};
+
+struct wal *wal_open(const char *path, int sync_ms);
+int wal_replay(struct wal *w, struct tripstore_context *ctx,
+               unsigned long skip, int64_t *max_id);
+int wal_start(struct wal *w);
+void wal_close(struct wal *w);
+
+void wal_append(struct wal *w, int64_t id, float lng, float lat, int type,
+                int cents, time_t t);